@@ -1,3 +1,9 @@
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/overflow.h>
+#include <linux/slab.h>
+
 #include "cache.h"
 
 /*
@@ -14,7 +20,10 @@
  *
  * Full refactor TBD (TM).
  */
-uint64_t init_cache(struct cache* c, uint64_t tt_pgs, uint64_t dram_bytes) 
+static const struct cache_policy_ops cache_policies[NR_CACHE_POLICIES];
+
+uint64_t init_cache(struct cache* c, uint64_t tt_pgs, uint64_t dram_bytes,
+                    unsigned int policy) 
 {
     struct ht_section **ht, *ht_mem;
     uint64_t total = 0;
@@ -26,9 +35,37 @@ uint64_t init_cache(struct cache* c, uint64_t tt_pgs, uint64_t dram_bytes)
 #ifndef ORIGINAL
     c->nr_valid_tpages++;
     c->nr_valid_tentries += GRAIN_PER_PAGE;
+
+    /*
+     * Original caches whole mapping pages, which include the room EPP
+     * leaves for fingerprints. Plus only caches the leaves a section
+     * uses, so charge FP_SIZE bytes of cache for every ENTRY_SIZE bytes
+     * of section.
+     */
+    c->max_cached_tentries = (dram_bytes * ENTRY_SIZE) / 
+                             ((ENTRY_SIZE + FP_SIZE) * GRAINED_UNIT);
 #endif
 
-    fifo_init(&c->fifo);
+    c->lh_max = (c->nr_valid_tentries / EPP) - 1;
+    c->lh_base = max_t(uint32_t, rounddown_pow_of_two(c->lh_max) >> LH_LEVELS, 1);
+    c->lh_level = 0;
+    c->lh_split = 0;
+    atomic64_set(&c->lh_used, 0);
+
+    NVMEV_ASSERT(policy < NR_CACHE_POLICIES);
+    c->ops = &cache_policies[policy];
+    spin_lock_init(&c->policy_lock);
+    fifo_init(&c->main_q);
+    fifo_init(&c->small_q);
+    fifo_init(&c->ghost_q);
+    memset(&c->pstat, 0x0, sizeof(c->pstat));
+
+    c->vb = (struct victim_buffer*) vmalloc_node(sizeof(struct victim_buffer),
+                                                 numa_node_id());
+    NVMEV_ASSERT(c->vb);
+    c->vb->head = 0;
+    c->vb->tail = 0;
+    total += sizeof(struct victim_buffer);
 
     /*
      * This is a constantly available list of pointers to every hash table
@@ -79,24 +116,26 @@ uint64_t init_cache(struct cache* c, uint64_t tt_pgs, uint64_t dram_bytes)
          *
          * If we were using virt's internal memory, we would use the grain
          * and take GRAINED_UNIT * grain to find the pair. However,
-         * since we are allocating pairs by kzalloc, we can't do that.
+         * since we are allocating pairs with pair_alloc, we can't do that.
          *
-         * pair_mem contains the locations of KV pairs in memory.
+         * entries contains the locations of KV pairs in memory.
          * When we look for a hash index to grain mapping,
-         * we get its KV pair data from here.
+         * we get its KV pair data from here. It's allocated on the
+         * section's first store, and sized by how many pairs it holds.
          */
+        ht[i]->entries = NULL;
+        ht[i]->spills = 0;
         ht[i]->len_on_disk = 0;
-
-        NVMEV_ASSERT(ht[i]->pair_mem);
-        for(int j = 0; j < EPP; j++) {
-            ht[i]->pair_mem[j] = NULL;
-            ht[i]->keys[j] = NULL;
-        }
+        INIT_LIST_HEAD(&ht[i]->fifo_node);
+        ht[i]->queue = CQ_NONE;
+        ht[i]->freq = 0;
     }
     
     c->ht = ht;
     c->ht_mem = ht_mem;
     c->nr_cached_tentries = 0;
+    atomic_set(&c->nr_entries, 0);
+    atomic64_set(&c->entries_bytes, 0);
 
     return total;
 }
@@ -105,11 +144,18 @@ void destroy_cache(struct cache* c)
 {
     for (int i = 0; i < c->nr_valid_tpages; i++) {
         struct ht_section *ht = c->ht[i];
-        for(int i = 0; i < EPP; i++) {
-            if(ht->pair_mem[i]) {
-                kfree(ht->pair_mem[i]);
-                ht->pair_mem[i] = NULL;
+        struct ht_entries *e = ht->entries;
+
+        if(e) {
+            for(uint32_t i = 0; i < (1U << e->bits); i++) {
+                if(e->slots[i].off != HT_SLOT_FREE) {
+                    pair_free(e->slots[i].pair_mem);
+                    kfree(e->slots[i].key);
+                }
             }
+
+            kvfree(e);
+            ht->entries = NULL;
         }
 
         if(ht->mem) {
@@ -117,9 +163,157 @@ void destroy_cache(struct cache* c)
         }
     }
 
+    fifo_destroy(&c->main_q);
+    fifo_destroy(&c->small_q);
+    fifo_destroy(&c->ghost_q);
     vfree(c->ht);
     vfree(c->ht_mem);
-    fifo_destroy(c->fifo);
+    vfree(c->vb);
+}
+
+/*
+ * Section entry tables. See struct ht_entries.
+ */
+static struct ht_entries *__ht_entries_alloc(struct cache *c, uint32_t bits)
+{
+    struct ht_entries *e;
+    size_t sz = struct_size(e, slots, 1U << bits);
+
+    e = kvzalloc_node(sz, GFP_KERNEL, numa_node_id());
+    NVMEV_ASSERT(e);
+
+    e->bits = bits;
+    for(uint32_t i = 0; i < (1U << bits); i++) {
+        e->slots[i].off = HT_SLOT_FREE;
+    }
+
+    atomic_inc(&c->nr_entries);
+    atomic64_add(sz, &c->entries_bytes);
+    return e;
+}
+
+static void __ht_entries_free(struct cache *c, struct ht_entries *e)
+{
+    atomic_dec(&c->nr_entries);
+    atomic64_sub(struct_size(e, slots, 1U << e->bits), &c->entries_bytes);
+    kvfree(e);
+}
+
+static struct ht_slot *__ht_slot_insert(struct ht_entries *e, uint32_t off)
+{
+    uint32_t mask = (1U << e->bits) - 1;
+    uint32_t i = hash_32(off, e->bits);
+
+    while(e->slots[i].off != HT_SLOT_FREE) {
+        i = (i + 1) & mask;
+    }
+
+    e->slots[i].off = off;
+    e->used++;
+    return &e->slots[i];
+}
+
+static void __ht_entries_resize(struct cache *c, struct ht_section *ht, 
+                                uint32_t bits)
+{
+    struct ht_entries *old = ht->entries;
+    struct ht_entries *e = __ht_entries_alloc(c, bits);
+
+    for(uint32_t i = 0; i < (1U << old->bits); i++) {
+        if(old->slots[i].off != HT_SLOT_FREE) {
+            *__ht_slot_insert(e, old->slots[i].off) = old->slots[i];
+        }
+    }
+
+    ht->entries = e;
+    __ht_entries_free(c, old);
+}
+
+/*
+ * The slot for entry off, added empty if the entry had none.
+ */
+struct ht_slot *ht_slot_get(struct cache *c, struct ht_section *ht, uint32_t off)
+{
+    struct ht_slot *s = ht_slot_find(ht, off);
+    struct ht_entries *e;
+
+    if(s) {
+        return s;
+    }
+
+    NVMEV_ASSERT(off < EPP);
+
+    e = ht->entries;
+    if(!e) {
+        e = ht->entries = __ht_entries_alloc(c, ilog2(HT_ENTRIES_MIN));
+    } else if((e->used + 1) * 4 > (3U << e->bits)) {
+        __ht_entries_resize(c, ht, e->bits + 1);
+        e = ht->entries;
+    }
+
+    return __ht_slot_insert(e, off);
+}
+
+/*
+ * Empties entry off, freeing its key but not its pair. The slots after
+ * it in the probe run are shifted back over it, so lookups never need
+ * tombstones.
+ */
+void ht_slot_drop(struct cache *c, struct ht_section *ht, uint32_t off)
+{
+    struct ht_slot *s = ht_slot_find(ht, off);
+    struct ht_entries *e = ht->entries;
+    uint32_t mask, i, j;
+
+    if(!s) {
+        return;
+    }
+
+    kfree(s->key);
+
+    mask = (1U << e->bits) - 1;
+    i = s - e->slots;
+    for(j = (i + 1) & mask; e->slots[j].off != HT_SLOT_FREE; j = (j + 1) & mask) {
+        uint32_t home = hash_32(e->slots[j].off, e->bits);
+
+        /* j may only move back to i if i is on its probe path */
+        if(((i - home) & mask) < ((j - home) & mask)) {
+            e->slots[i] = e->slots[j];
+            i = j;
+        }
+    }
+
+    memset(&e->slots[i], 0x0, sizeof(e->slots[i]));
+    e->slots[i].off = HT_SLOT_FREE;
+    e->used--;
+
+    if(!e->used) {
+        ht->entries = NULL;
+        __ht_entries_free(c, e);
+    } else if(e->bits > ilog2(HT_ENTRIES_MIN) && e->used * 8 < (1U << e->bits)) {
+        __ht_entries_resize(c, ht, e->bits - 1);
+    }
+}
+
+/*
+ * Forgets every entry of a section, freeing keys but not pairs.
+ */
+void ht_entries_reset(struct cache *c, struct ht_section *ht)
+{
+    struct ht_entries *e = ht->entries;
+
+    if(!e) {
+        return;
+    }
+
+    for(uint32_t i = 0; i < (1U << e->bits); i++) {
+        if(e->slots[i].off != HT_SLOT_FREE) {
+            kfree(e->slots[i].key);
+        }
+    }
+
+    ht->entries = NULL;
+    __ht_entries_free(c, e);
 }
 
 bool cache_full(struct cache *c) {
@@ -175,6 +369,262 @@ struct h_to_g_mapping cache_hidx_to_grain(struct ht_section *ht, uint32_t hidx,
 #endif
 }
 
+/*
+ * Eviction policies.
+ *
+ * Sections enter the policy when they are loaded into DRAM (insert), are
+ * reported on every foreground hit (access), and leave when the eviction
+ * thread picks them (victim). The queue links are embedded in the
+ * sections, so none of this allocates. All three run under
+ * c->policy_lock. CLOCK and S3-FIFO only bump ht->freq on access, and
+ * do it without the lock.
+ */
+static inline struct ht_section *__cq_pop(struct fifo *q)
+{
+    struct list_head *node = fifo_dequeue(q);
+
+    return node ? list_entry(node, struct ht_section, fifo_node) : NULL;
+}
+
+static inline void __cq_push(struct fifo *q, struct ht_section *ht, uint8_t queue)
+{
+    fifo_enqueue(q, &ht->fifo_node);
+    ht->queue = queue;
+}
+
+/* FIFO: evict in load order, ignore hits. */
+static void fifo_insert(struct cache *c, struct ht_section *ht)
+{
+    __cq_push(&c->main_q, ht, CQ_MAIN);
+}
+
+static void fifo_access(struct cache *c, struct ht_section *ht)
+{
+}
+
+static struct ht_section *fifo_victim(struct cache *c)
+{
+    struct ht_section *ht = __cq_pop(&c->main_q);
+
+    if(ht) {
+        ht->queue = CQ_NONE;
+    }
+    return ht;
+}
+
+/* CLOCK: FIFO, but a section hit since it last came around gets another lap. */
+static void clock_insert(struct cache *c, struct ht_section *ht)
+{
+    ht->freq = 0;
+    __cq_push(&c->main_q, ht, CQ_MAIN);
+}
+
+static void clock_access(struct cache *c, struct ht_section *ht)
+{
+    if(!READ_ONCE(ht->freq)) {
+        WRITE_ONCE(ht->freq, 1);
+    }
+}
+
+static struct ht_section *clock_victim(struct cache *c)
+{
+    struct ht_section *ht;
+    uint32_t laps = 2 * c->main_q.len;
+
+    while((ht = __cq_pop(&c->main_q))) {
+        if(READ_ONCE(ht->freq) && laps--) {
+            WRITE_ONCE(ht->freq, 0);
+            __cq_push(&c->main_q, ht, CQ_MAIN);
+            c->pstat.second_chances++;
+            continue;
+        }
+
+        ht->queue = CQ_NONE;
+        return ht;
+    }
+
+    return NULL;
+}
+
+/*
+ * S3-FIFO (Yang et al., SOSP '23): new sections go to a small probation
+ * queue. Ones hit while there move to the main queue, and the rest are
+ * evicted and remembered in a ghost queue. A section reloaded while still
+ * in the ghost queue goes straight to main. Main is a CLOCK with a 2-bit
+ * counter.
+ */
+#define S3FIFO_SMALL_PCT 10
+#define S3FIFO_MAX_FREQ 3
+
+static void s3fifo_insert(struct cache *c, struct ht_section *ht)
+{
+    if(ht->queue == CQ_GHOST) {
+        fifo_remove(&c->ghost_q, &ht->fifo_node);
+        ht->freq = 0;
+        __cq_push(&c->main_q, ht, CQ_MAIN);
+        c->pstat.ghost_hits++;
+        return;
+    }
+
+    ht->freq = 0;
+    __cq_push(&c->small_q, ht, CQ_SMALL);
+}
+
+static void s3fifo_access(struct cache *c, struct ht_section *ht)
+{
+    uint8_t freq = READ_ONCE(ht->freq);
+
+    if(freq < S3FIFO_MAX_FREQ) {
+        WRITE_ONCE(ht->freq, freq + 1);
+    }
+}
+
+static void __s3fifo_ghost(struct cache *c, struct ht_section *ht)
+{
+    struct ht_section *old;
+
+    __cq_push(&c->ghost_q, ht, CQ_GHOST);
+
+    /* Remember about as many evictions as main holds sections */
+    while(c->ghost_q.len > max_t(uint32_t, c->main_q.len, 1)) {
+        old = __cq_pop(&c->ghost_q);
+        old->queue = CQ_NONE;
+    }
+}
+
+static struct ht_section *s3fifo_victim(struct cache *c)
+{
+    struct ht_section *ht;
+
+    while(c->small_q.len || c->main_q.len) {
+        uint32_t total = c->small_q.len + c->main_q.len;
+
+        if(c->small_q.len && 
+           (c->main_q.len == 0 || c->small_q.len * 100 >= total * S3FIFO_SMALL_PCT)) {
+            ht = __cq_pop(&c->small_q);
+            if(READ_ONCE(ht->freq)) {
+                WRITE_ONCE(ht->freq, 0);
+                __cq_push(&c->main_q, ht, CQ_MAIN);
+                c->pstat.promotions++;
+                continue;
+            }
+
+            __s3fifo_ghost(c, ht);
+            return ht;
+        }
+
+        ht = __cq_pop(&c->main_q);
+        if(READ_ONCE(ht->freq)) {
+            WRITE_ONCE(ht->freq, READ_ONCE(ht->freq) - 1);
+            __cq_push(&c->main_q, ht, CQ_MAIN);
+            c->pstat.second_chances++;
+            continue;
+        }
+
+        ht->queue = CQ_NONE;
+        return ht;
+    }
+
+    return NULL;
+}
+
+/*
+ * LRU-2, approximated with two LRU lists: sections referenced once since
+ * they were loaded (small_q) and those referenced at least twice (main_q).
+ * Sections with a single reference have an infinite backward 2-distance,
+ * so they are evicted first, oldest first.
+ */
+static void lru2_insert(struct cache *c, struct ht_section *ht)
+{
+    __cq_push(&c->small_q, ht, CQ_SMALL);
+}
+
+static void lru2_access(struct cache *c, struct ht_section *ht)
+{
+    spin_lock(&c->policy_lock);
+    if(ht->queue == CQ_SMALL) {
+        fifo_remove(&c->small_q, &ht->fifo_node);
+        __cq_push(&c->main_q, ht, CQ_MAIN);
+        c->pstat.promotions++;
+    } else if(ht->queue == CQ_MAIN) {
+        list_move_tail(&ht->fifo_node, &c->main_q.head);
+    }
+    spin_unlock(&c->policy_lock);
+}
+
+static struct ht_section *lru2_victim(struct cache *c)
+{
+    struct ht_section *ht = __cq_pop(&c->small_q);
+
+    if(!ht) {
+        ht = __cq_pop(&c->main_q);
+    }
+    if(ht) {
+        ht->queue = CQ_NONE;
+    }
+    return ht;
+}
+
+static const struct cache_policy_ops cache_policies[NR_CACHE_POLICIES] = {
+    [CACHE_POLICY_FIFO] = { "fifo", fifo_insert, fifo_access, fifo_victim },
+    [CACHE_POLICY_CLOCK] = { "clock", clock_insert, clock_access, clock_victim },
+    [CACHE_POLICY_S3FIFO] = { "s3fifo", s3fifo_insert, s3fifo_access, s3fifo_victim },
+    [CACHE_POLICY_LRU2] = { "lru2", lru2_insert, lru2_access, lru2_victim },
+};
+
+int cache_policy_parse(const char *name)
+{
+    for(int i = 0; i < NR_CACHE_POLICIES; i++) {
+        if(sysfs_streq(name, cache_policies[i].name)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+const char *cache_policy_name(unsigned int policy)
+{
+    return policy < NR_CACHE_POLICIES ? cache_policies[policy].name : "unknown";
+}
+
+void cache_enqueue(struct cache *c, struct ht_section *ht)
+{
+    spin_lock(&c->policy_lock);
+    if(ht->queue == CQ_MAIN || ht->queue == CQ_SMALL) {
+        /* Already tracked, e.g. a GC shadow read of a cached section */
+        spin_unlock(&c->policy_lock);
+        return;
+    }
+
+    c->ops->insert(c, ht);
+    c->pstat.inserts++;
+    spin_unlock(&c->policy_lock);
+}
+
+struct ht_section *cache_dequeue(struct cache *c)
+{
+    struct ht_section *ht;
+
+    spin_lock(&c->policy_lock);
+    ht = c->ops->victim(c);
+    if(ht) {
+        c->pstat.victims++;
+    }
+    spin_unlock(&c->policy_lock);
+
+    return ht;
+}
+
+/*
+ * Called on foreground hits, with the section's outgoing flag held.
+ */
+void cache_access(struct cache *c, struct ht_section *ht)
+{
+    c->ops->access(c, ht);
+    WRITE_ONCE(c->pstat.hits, c->pstat.hits + 1);
+}
+
 struct ht_section* cache_get_ht(struct cache* c, uint32_t hidx) 
 {
     struct ht_section *ht;
@@ -193,3 +643,173 @@ struct ht_section* cache_get_ht(struct cache* c, uint32_t hidx)
     return ht;
 }
 
+
+/*
+ * Pair allocator.
+ *
+ * Filling a device means one allocation per pair, so going through
+ * kzalloc meant 100M+ trips to the general purpose kmalloc caches, each
+ * rounded up to the next power of two. Here each grain count has its own
+ * cache of exactly (header + glen * GRAINED_UNIT) bytes. Class 0 is the
+ * kmalloc fallback for pairs bigger than PAIR_NR_CLASSES grains.
+ */
+struct pair_hdr {
+    uint32_t cls;
+    uint32_t glen;
+};
+
+struct pair_class {
+    struct kmem_cache *cache;
+    char name[24];
+    atomic64_t live;
+    atomic64_t allocs;
+    atomic64_t payload; /* glen * GRAINED_UNIT of the live pairs */
+    atomic64_t held; /* bytes actually held, including header and slack */
+};
+
+static struct pair_class pair_classes[PAIR_NR_CLASSES + 1];
+static int pair_mem_users;
+
+int pair_mem_init(void)
+{
+    if(pair_mem_users++) {
+        return 0;
+    }
+
+    for(int i = 0; i <= PAIR_NR_CLASSES; i++) {
+        atomic64_set(&pair_classes[i].live, 0);
+        atomic64_set(&pair_classes[i].allocs, 0);
+        atomic64_set(&pair_classes[i].payload, 0);
+        atomic64_set(&pair_classes[i].held, 0);
+    }
+
+    for(int i = 1; i <= PAIR_NR_CLASSES; i++) {
+        struct pair_class *pc = &pair_classes[i];
+
+        snprintf(pc->name, sizeof(pc->name), "nvmev_pair_%d", i);
+        pc->cache = kmem_cache_create(pc->name, 
+                                      sizeof(struct pair_hdr) + (i * GRAINED_UNIT),
+                                      sizeof(uint64_t), 0, NULL);
+        if(!pc->cache) {
+            NVMEV_ERROR("Failed to create pair cache for %d grains.\n", i);
+            pair_mem_users = 1;
+            pair_mem_exit();
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+void pair_mem_exit(void)
+{
+    if(--pair_mem_users) {
+        return;
+    }
+
+    for(int i = 1; i <= PAIR_NR_CLASSES; i++) {
+        if(pair_classes[i].cache) {
+            kmem_cache_destroy(pair_classes[i].cache);
+            pair_classes[i].cache = NULL;
+        }
+    }
+}
+
+/*
+ * gfp is passed through, so callers that relied on kzalloc pass
+ * __GFP_ZERO. Returns the start of the pair, just past the header.
+ */
+void *pair_alloc(uint32_t glen, gfp_t gfp)
+{
+    uint32_t cls = (glen <= PAIR_NR_CLASSES) ? glen : 0;
+    struct pair_class *pc = &pair_classes[cls];
+    struct pair_hdr *hdr;
+
+    NVMEV_ASSERT(glen > 0);
+
+    if(cls) {
+        hdr = kmem_cache_alloc_node(pc->cache, gfp, numa_node_id());
+    } else {
+        hdr = kmalloc_node(sizeof(*hdr) + (glen * GRAINED_UNIT), gfp, numa_node_id());
+    }
+
+    if(!hdr) {
+        return NULL;
+    }
+
+    hdr->cls = cls;
+    hdr->glen = glen;
+
+    atomic64_inc(&pc->live);
+    atomic64_inc(&pc->allocs);
+    atomic64_add(glen * GRAINED_UNIT, &pc->payload);
+    atomic64_add(cls ? kmem_cache_size(pc->cache) : ksize(hdr), &pc->held);
+
+    return hdr + 1;
+}
+
+void pair_free(void *mem)
+{
+    struct pair_hdr *hdr;
+    struct pair_class *pc;
+
+    if(!mem) {
+        return;
+    }
+
+    hdr = ((struct pair_hdr*) mem) - 1;
+    NVMEV_ASSERT(hdr->cls <= PAIR_NR_CLASSES);
+    pc = &pair_classes[hdr->cls];
+
+    atomic64_dec(&pc->live);
+    atomic64_sub(hdr->glen * GRAINED_UNIT, &pc->payload);
+
+    if(hdr->cls) {
+        atomic64_sub(kmem_cache_size(pc->cache), &pc->held);
+        kmem_cache_free(pc->cache, hdr);
+    } else {
+        atomic64_sub(ksize(hdr), &pc->held);
+        kfree(hdr);
+    }
+}
+
+/*
+ * Per-class usage for kvstat. Only classes that have been used are shown.
+ * The difference between payload and held is header and rounding overhead.
+ */
+uint32_t pair_mem_stat(char *buf, uint32_t buf_size)
+{
+    uint32_t length = 0;
+    uint64_t payload = 0, held = 0;
+
+    length += scnprintf(buf + length, buf_size - length, 
+                        "Grains\tLive\tAllocs\tPayload KB\tHeld KB\n");
+
+    for(int i = 0; i <= PAIR_NR_CLASSES; i++) {
+        struct pair_class *pc = &pair_classes[i];
+        uint64_t allocs = atomic64_read(&pc->allocs);
+        uint64_t p = atomic64_read(&pc->payload);
+        uint64_t h = atomic64_read(&pc->held);
+
+        if(!allocs) {
+            continue;
+        }
+
+        if(i) {
+            length += scnprintf(buf + length, buf_size - length, "%d\t", i);
+        } else {
+            length += scnprintf(buf + length, buf_size - length, ">%d\t", PAIR_NR_CLASSES);
+        }
+        length += scnprintf(buf + length, buf_size - length, "%lld\t%llu\t%llu\t\t%llu\n", 
+                            (long long) atomic64_read(&pc->live), allocs, p >> 10, h >> 10);
+
+        payload += p;
+        held += h;
+    }
+
+    length += scnprintf(buf + length, buf_size - length, 
+                        "Payload:\t%llu MB\nHeld:\t\t%llu MB\n", 
+                        payload >> 20, held >> 20);
+
+    return length;
+}
@@ -5,6 +5,7 @@
  * See cache.c for more comments.
  */
 
+#include <linux/hash.h>
 #include <linux/types.h>
 
 #include "fifo.h"
@@ -12,15 +13,29 @@
 #include "ssd.h"
 #include "ssd_config.h"
 
-#ifdef ORIGINAL
-#define OFFSET(x) ((x) & (EPP - 1))
+#if FP_BITS > 16
+typedef uint32_t fp_t;
+#elif FP_BITS > 8
+typedef uint16_t fp_t;
+#else
+typedef uint8_t fp_t;
+#endif
+
+/*
+ * Key fingerprints are kept host-side with the rest of an entry's
+ * state (struct ht_slot), but each one takes FP_SIZE bytes of the
+ * mapping page, so fewer entries fit in a section.
+ */
+#define FP_SIZE (FP_BITS ? sizeof(fp_t) : 0)
+
+#define OFFSET(x) ((x) % EPP)
 
+#ifdef ORIGINAL
 #define ENTRY_SIZE sizeof(ppa_t)
 
-#define EPP (PAGESIZE / ENTRY_SIZE)
+#define EPP (PAGESIZE / (ENTRY_SIZE + FP_SIZE))
 
 #else
-#define OFFSET(x) ((x) % EPP)
 #define ENTRY_SIZE (sizeof(ppa_t) + sizeof(lpa_t))
 
 #define ROOT_G 4
@@ -29,7 +44,9 @@
 #define ORIG_GLEN (ROOT_G + 2)
 #define ORIG_GLEN_BYTES (ORIG_GLEN * GRAINED_UNIT)
 
-#define EPP (((GRAIN_PER_PAGE - ROOT_G) * GRAINED_UNIT) / ENTRY_SIZE)
+/* Whole leaves only */
+#define EPP ((((GRAIN_PER_PAGE - ROOT_G) * GRAINED_UNIT) / \
+             (ENTRY_SIZE + FP_SIZE)) / IN_LEAF * IN_LEAF)
 
 #define IN_LEAF ((GRAINED_UNIT) / ENTRY_SIZE)
 #define IN_ROOT (EPP / ENTRY_SIZE)
@@ -39,13 +56,19 @@
 #define IDX2LPA(x) ((x) * EPP)
 #define IDX(x) ((x) / EPP)
 
+/*
+ * The hash index starts at 1/(2^LH_LEVELS) of its full size and grows by
+ * splitting sections once LH_LOAD_PCT of the slots in use are taken.
+ */
+#define LH_LEVELS 3
+#define LH_LOAD_PCT 70
+
 #define VICTIM_RB_SZ 131072
 struct victim_buffer {
     struct ht_section* hts[VICTIM_RB_SZ];
     int head, tail;
     spinlock_t lock;
 };
-static struct victim_buffer vb;
 
 struct h_to_g_mapping {
 #ifndef ORIGINAL
@@ -58,6 +81,83 @@ typedef enum {
 	CLEAN, DIRTY, C_CANDIDATE, D_CANDIDATE
 } mapping_state;
 
+/*
+ * Mapping cache eviction policies, picked with the cache_policy= module
+ * parameter. See the policy section of cache.c.
+ */
+enum cache_policy {
+    CACHE_POLICY_FIFO,
+    CACHE_POLICY_CLOCK,
+    CACHE_POLICY_S3FIFO,
+    CACHE_POLICY_LRU2,
+    NR_CACHE_POLICIES,
+};
+
+/* Which of its cache's queues a section is on */
+enum {
+    CQ_NONE,
+    CQ_MAIN,
+    CQ_SMALL, /* S3-FIFO probation queue, LRU-2 seen-once list */
+    CQ_GHOST, /* S3-FIFO recently evicted from the small queue */
+};
+
+
+/*
+ * Per-entry state of a hash table section. Sections only hold a fraction
+ * of EPP pairs, so this isn't an EPP-sized array but a small
+ * open-addressed table keyed by entry offset. It is allocated on the
+ * section's first store with HT_ENTRIES_MIN slots, doubles once it is 3/4
+ * full, halves below 1/8, and is freed when the last pair leaves. A
+ * section that was never stored to has no table, and its entries read
+ * as empty.
+ *
+ * Callers hold the section's outgoing flag, which keeps the table from
+ * being resized under them.
+ */
+#define HT_ENTRIES_MIN 8
+#define HT_SLOT_FREE U16_MAX
+static_assert(EPP < HT_SLOT_FREE);
+
+struct ht_slot {
+    /*
+     * Mem is where this pair is located in-memory, which is not
+     * necessarily the same as its ppa. Consider that we don't need to
+     * re-write pairs to a new memory location if they're the same length,
+     * we can just overwrite, saving some work. We will still get
+     * flash timings based on the PPA on the SSD and use those for the
+     * completion times.
+     */
+    void *pair_mem;
+
+    /*
+     * For avoiding reads of the first page of an append buffer.
+     */
+    char *key;
+
+#ifndef ORIGINAL
+    /*
+     * Somewhere to store LPA -> grain mappings for use in fast filling.
+     * Only works with Plus for now.
+     */
+    uint32_t fm_grain;
+#endif
+
+    uint16_t off; /* entry offset in the section, HT_SLOT_FREE if unused */
+
+#if FP_BITS
+    /*
+     * Fingerprint of the key in this entry, see ht_fp().
+     */
+    fp_t fp;
+#endif
+};
+
+struct ht_entries {
+    uint32_t bits; /* log2 of the slot count */
+    uint32_t used;
+    struct ht_slot slots[];
+};
+
 struct ht_section {
     uint32_t idx;
     atomic_t t_ppa;
@@ -81,31 +181,45 @@ struct ht_section {
 #endif
 
     atomic_t outgoing;
-    /*
-     * Mem is where this pair is located in-memory, which is not
-     * necessarily the same as its ppa. Consider that we don't need to
-     * re-write pairs to a new memory location if they're the same length,
-     * we can just overwrite, saving some work. We will still get
-     * flash timings based on the PPA on the SSD and use those for the
-     * completion times.
-     */
-    void *pair_mem[EPP];
 
-#ifndef ORIGINAL
+    struct ht_entries *entries; /* NULL while the section holds no pairs */
+
     /*
-     * Somewhere to store LPA -> grain mappings for use in fast filling.
-     * Only works with Plus for now.
+     * Keys that wanted a slot in this section but found their window
+     * full and went to their second choice. Only ever goes up, and a
+     * split copies it to the new section.
      */
-    uint32_t fm_grains[EPP];
-#endif
+    uint32_t spills;
 
     /*
-     * For avoiding reads of the first page of an append buffer.
+     * Link in one of the owning cache's eviction queues, and policy
+     * state. The link is empty when the section isn't queued. freq is the
+     * CLOCK reference bit, or the S3-FIFO access count.
      */
-    char* keys[EPP];
+    struct list_head fifo_node;
+    uint8_t queue;
+    uint8_t freq;
 };
 extern struct ht_section *ht_mem;
 
+struct cache_policy_stats {
+    uint64_t inserts;
+    uint64_t hits;
+    uint64_t victims;
+    uint64_t promotions; /* S3-FIFO small -> main, LRU-2 once -> twice */
+    uint64_t second_chances; /* CLOCK / S3-FIFO re-queued instead of evicted */
+    uint64_t ghost_hits; /* S3-FIFO reloads of recently evicted sections */
+};
+
+struct cache;
+
+struct cache_policy_ops {
+    const char *name;
+    void (*insert)(struct cache *c, struct ht_section *ht);
+    void (*access)(struct cache *c, struct ht_section *ht);
+    struct ht_section *(*victim)(struct cache *c);
+};
+
 struct cache {
     int nr_valid_tpages;
     int nr_valid_tentries;
@@ -114,10 +228,46 @@ struct cache {
 
     struct ht_section **ht;
     struct ht_section *ht_mem;
-    struct fifo *fifo;
+    struct fifo fifo;
+
+    atomic_t nr_entries; /* sections that have their ht_entries */
+    atomic64_t entries_bytes; /* and the memory those take */
+
+    /*
+     * Linear hashing over sections. Keys start out spread over lh_base
+     * sections. Once more than LH_LOAD_PCT of the slots in use are taken,
+     * section lh_split is split into itself and lh_split + (lh_base <<
+     * lh_level), one at a time, until all lh_max sections are in use.
+     * The keys that belong to the new half are moved there as part of
+     * the split. Section numbers here start after the unused section 0.
+     */
+    uint32_t lh_base;
+    uint32_t lh_level;
+    uint32_t lh_split;
+    uint32_t lh_max;
+    atomic64_t lh_used; /* live keys, GC drops pairs it finds deleted */
+
+    /*
+     * Sections picked for eviction by the background eviction thread,
+     * waiting for the foreground to write them out. One per cache, so
+     * that each shard evicts independently.
+     */
+    struct victim_buffer *vb;
+
+    /*
+     * Eviction policy. Sections are queued on load and dequeued when
+     * they are picked as victims. policy_lock covers the queues.
+     */
+    const struct cache_policy_ops *ops;
+    spinlock_t policy_lock;
+    struct fifo main_q;
+    struct fifo small_q;
+    struct fifo ghost_q;
+    struct cache_policy_stats pstat;
 };
 
-uint64_t init_cache(struct cache*, uint64_t tt_pgs, uint64_t dram_bytes);
+uint64_t init_cache(struct cache*, uint64_t tt_pgs, uint64_t dram_bytes,
+                    unsigned int policy);
 
 void destroy_cache(struct cache*);
 
@@ -132,5 +282,131 @@ struct h_to_g_mapping cache_hidx_to_grain(struct ht_section *ht, uint32_t hidx,
 
 struct ht_section *cache_get_ht(struct cache*, uint32_t);
 
+struct ht_slot *ht_slot_get(struct cache*, struct ht_section *ht, uint32_t off);
+
+void ht_slot_drop(struct cache*, struct ht_section *ht, uint32_t off);
+
+void ht_entries_reset(struct cache*, struct ht_section *ht);
+
+/*
+ * The slot holding entry off, or NULL if the entry is empty.
+ */
+static inline struct ht_slot *ht_slot_find(struct ht_section *ht, uint32_t off)
+{
+    struct ht_entries *e = ht->entries;
+    uint32_t mask, i;
+
+    if(!e) {
+        return NULL;
+    }
+
+    mask = (1U << e->bits) - 1;
+    for(i = hash_32(off, e->bits); e->slots[i].off != HT_SLOT_FREE; i = (i + 1) & mask) {
+        if(e->slots[i].off == off) {
+            return &e->slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+static inline void *ht_pair_mem(struct ht_section *ht, uint32_t off)
+{
+    struct ht_slot *s = ht_slot_find(ht, off);
+    return s ? s->pair_mem : NULL;
+}
+
+static inline char *ht_key(struct ht_section *ht, uint32_t off)
+{
+    struct ht_slot *s = ht_slot_find(ht, off);
+    return s ? s->key : NULL;
+}
+
+#ifndef ORIGINAL
+static inline uint32_t ht_fm_grain(struct ht_section *ht, uint32_t off)
+{
+    struct ht_slot *s = ht_slot_find(ht, off);
+    return s ? s->fm_grain : UINT_MAX;
+}
+#endif
+
+/*
+ * Key fingerprints are the top FP_BITS bits of the key's 64-bit hash.
+ * Slots are picked from the low 32 bits and shards from the bottom of
+ * the upper 32, so the fingerprint is independent of both.
+ * 0 means no fingerprint was recorded for an entry, and matches any key.
+ */
+static inline fp_t ht_fp(uint64_t hash)
+{
+#if FP_BITS
+    fp_t fp = hash >> (64 - FP_BITS);
+    return fp ? fp : 1;
+#else
+    return 0;
+#endif
+}
+
+static inline bool ht_fp_match(struct ht_section *ht, uint32_t off, fp_t fp)
+{
+#if FP_BITS
+    struct ht_slot *s = ht_slot_find(ht, off);
+    fp_t stored = s ? s->fp : 0;
+
+    return !stored || stored == fp;
+#else
+    return true;
+#endif
+}
+
+static inline void ht_set_fp(struct ht_slot *s, fp_t fp)
+{
+#if FP_BITS
+    s->fp = fp;
+#endif
+}
+
+/*
+ * Clearing an entry drops its slot, along with its key and fingerprint.
+ */
+static inline void ht_set_pair_mem(struct cache *c, struct ht_section *ht, 
+                                   uint32_t off, void *mem)
+{
+    if(!mem) {
+        ht_slot_drop(c, ht, off);
+        return;
+    }
+
+    ht_slot_get(c, ht, off)->pair_mem = mem;
+}
+
+void cache_enqueue(struct cache*, struct ht_section *ht);
+
+struct ht_section *cache_dequeue(struct cache*);
+
+void cache_access(struct cache*, struct ht_section *ht);
+
+int cache_policy_parse(const char *name);
+
+const char *cache_policy_name(unsigned int policy);
+
+/*
+ * KV pair memory. Pairs of up to PAIR_NR_CLASSES grains come from a
+ * kmem_cache sized exactly for that grain count, bigger ones from kmalloc.
+ * Every object starts with a small header recording its class, so
+ * pair_free() works no matter how the pair's length changed since it was
+ * allocated (GC shrinking it, an overwrite reusing a longer buffer, etc).
+ */
+#define PAIR_NR_CLASSES (WB_SIZE_G)
+
+int pair_mem_init(void);
+
+void pair_mem_exit(void);
+
+void *pair_alloc(uint32_t glen, gfp_t gfp);
+
+void pair_free(void *mem);
+
+uint32_t pair_mem_stat(char *buf, uint32_t buf_size);
+
 #include "twolevel.h"
 #endif
@@ -5,10 +5,13 @@
 #include <linux/ktime.h>
 #include <linux/highmem.h>
 #include <linux/sched/clock.h>
+#include <linux/vmalloc.h>
 
 #include "nvmev.h"
 #include "channel_model.h"
 
+#define RUN_END(r) ((r)->start + (r)->len)
+
 static inline unsigned long long __get_wallclock(void)
 {
 	return cpu_clock(nvmev_vdev->config.cpu_nr_dispatcher);
@@ -16,22 +19,318 @@ static inline unsigned long long __get_wallclock(void)
 
 void chmodel_init(struct channel_model *ch, uint64_t bandwidth /*MB/s*/)
 {
-	ch->head = 0;
-	ch->valid_len = 0;
 	ch->cur_time = 0;
+	ch->nr_runs = 0;
+	ch->max_runs = 0;
+	ch->merged_runs = 0;
 	ch->max_credits = BANDWIDTH_TO_MAX_CREDITS(bandwidth);
 	ch->command_credits = 0;
 	ch->xfer_lat = BANDWIDTH_TO_TX_TIME(bandwidth);
-	MEMSET(&(ch->avail_credits[0]), ch->max_credits, NR_CREDIT_ENTRIES);
+	spin_lock_init(&ch->lock);
 
 	NVMEV_DEBUG("[%s] CH %p bandwidth %llu max_credits %u tx_time %u\n", __func__, ch, bandwidth,
 		         ch->max_credits, ch->xfer_lat);
 }
 
-uint32_t last = 0;
+/* Index of the first run that ends after 'slot', or nr_runs if there is none. */
+static uint32_t __chmodel_find(struct channel_model *ch, uint64_t slot)
+{
+	const struct credit_run *base = ch->runs;
+	uint32_t n = ch->nr_runs;
+
+	if (n == 0)
+		return 0;
+
+	/* Branch-free lower bound; the comparison result is hard to predict */
+	while (n > 1) {
+		uint32_t half = n / 2;
+
+		base = (RUN_END(&base[half - 1]) <= slot) ? base + half : base;
+		n -= half;
+	}
+
+	return (base - ch->runs) + (RUN_END(base) <= slot);
+}
+
+/* Merge adjacent runs with the same credit count in runs[lo..hi]. */
+static void __chmodel_coalesce(struct channel_model *ch, uint32_t lo, uint32_t hi)
+{
+	uint32_t w = lo, r;
+
+	if (ch->nr_runs == 0)
+		return;
+	if (hi >= ch->nr_runs)
+		hi = ch->nr_runs - 1;
+
+	for (r = lo + 1; r <= hi; r++) {
+		struct credit_run *prev = &ch->runs[w];
+
+		if (RUN_END(prev) == ch->runs[r].start && prev->avail == ch->runs[r].avail)
+			prev->len += ch->runs[r].len;
+		else
+			ch->runs[++w] = ch->runs[r];
+	}
+
+	if (w != hi) {
+		memmove(&ch->runs[w + 1], &ch->runs[hi + 1],
+			(ch->nr_runs - hi - 1) * sizeof(struct credit_run));
+		ch->nr_runs -= hi - w;
+	}
+}
+
+/*
+ * Record a reservation that drained every slot in [from, final) and left
+ * 'left' credits in slot 'final'. 'i' is __chmodel_find(ch, from). The
+ * overlapped runs are spliced out and replaced in one pass. Returns false if
+ * the run table has no room, in which case nothing is changed.
+ */
+static bool __chmodel_reserve(struct channel_model *ch, uint32_t i, uint64_t from,
+			      uint64_t final, credit_t left)
+{
+	struct credit_run repl[4];
+	uint64_t to = final + 1;
+	uint32_t j, m = 0;
+
+	for (j = i; j < ch->nr_runs && ch->runs[j].start < to; j++)
+		;
+
+	if (i < j && ch->runs[i].start < from) {
+		repl[m].start = ch->runs[i].start;
+		repl[m].len = from - ch->runs[i].start;
+		repl[m++].avail = ch->runs[i].avail;
+	}
+	if (final > from) {
+		repl[m].start = from;
+		repl[m].len = final - from;
+		repl[m++].avail = 0;
+	}
+	if (left != ch->max_credits) {
+		repl[m].start = final;
+		repl[m].len = 1;
+		repl[m++].avail = left;
+	}
+	if (i < j && RUN_END(&ch->runs[j - 1]) > to) {
+		repl[m].start = to;
+		repl[m].len = RUN_END(&ch->runs[j - 1]) - to;
+		repl[m++].avail = ch->runs[j - 1].avail;
+	}
+
+	if (ch->nr_runs - (j - i) + m > NR_CREDIT_RUNS)
+		return false;
+
+	if (j != i + m)
+		memmove(&ch->runs[i + m], &ch->runs[j],
+			(ch->nr_runs - j) * sizeof(struct credit_run));
+	memcpy(&ch->runs[i], repl, m * sizeof(struct credit_run));
+	ch->nr_runs = ch->nr_runs - (j - i) + m;
+
+	__chmodel_coalesce(ch, i ? i - 1 : 0, i + m);
+
+	if (ch->nr_runs > ch->max_runs)
+		ch->max_runs = ch->nr_runs;
+
+	return true;
+}
+
+/*
+ * Credits a merge of runs[k] and runs[k + 1] would take away. The merged
+ * run covers both and the gap between them at the lower of the two
+ * credit counts.
+ */
+static uint64_t __chmodel_merge_cost(struct channel_model *ch, uint32_t k)
+{
+	struct credit_run *a = &ch->runs[k], *b = &ch->runs[k + 1];
+	credit_t low = min(a->avail, b->avail);
+
+	return (uint64_t)a->len * (a->avail - low) + (uint64_t)b->len * (b->avail - low) +
+	       (b->start - RUN_END(a)) * (ch->max_credits - low);
+}
+
+/*
+ * Make sure a reservation, which adds at most CHMODEL_RESERVE_RUNS runs,
+ * fits in the table. Neighbouring runs that lose the fewest credits are
+ * merged at the lower credit count. That only ever makes the channel look
+ * busier than it is, never idler, so no reservation is dropped.
+ */
+#define CHMODEL_RESERVE_RUNS (3)
+static void __chmodel_make_room(struct channel_model *ch)
+{
+	while (ch->nr_runs > NR_CREDIT_RUNS - CHMODEL_RESERVE_RUNS) {
+		uint64_t cost, best_cost = U64_MAX;
+		uint32_t k, best = 0;
+
+		/* Ties go to the later pair, the one furthest in the future */
+		for (k = 0; k + 1 < ch->nr_runs; k++) {
+			cost = __chmodel_merge_cost(ch, k);
+			if (cost <= best_cost) {
+				best_cost = cost;
+				best = k;
+			}
+		}
+
+		ch->runs[best].avail = min(ch->runs[best].avail, ch->runs[best + 1].avail);
+		ch->runs[best].len = RUN_END(&ch->runs[best + 1]) - ch->runs[best].start;
+		memmove(&ch->runs[best + 1], &ch->runs[best + 2],
+			(ch->nr_runs - best - 2) * sizeof(struct credit_run));
+		ch->nr_runs--;
+		ch->merged_runs++;
+	}
+}
+
+/* Forget every slot before 'cur_slot'. They are back to max_credits. */
+static void __chmodel_expire(struct channel_model *ch, uint64_t cur_slot)
+{
+	uint32_t k = 0;
+
+	/* Expired runs are all at the front, and there are rarely many */
+	while (k < ch->nr_runs && RUN_END(&ch->runs[k]) <= cur_slot)
+		k++;
+
+	if (k) {
+		memmove(&ch->runs[0], &ch->runs[k], (ch->nr_runs - k) * sizeof(struct credit_run));
+		ch->nr_runs -= k;
+	}
+
+	if (ch->nr_runs && ch->runs[0].start < cur_slot) {
+		ch->runs[0].len -= cur_slot - ch->runs[0].start;
+		ch->runs[0].start = cur_slot;
+	}
+}
+
+/*
+ * Reserve the credits for 'length' bytes starting at the slot of
+ * request_time, spilling into later slots as they fill up, and return when
+ * the transfer completes. Same semantics as the old per-slot credit array,
+ * but the cost is in the number of runs touched rather than in the number
+ * of slots time has moved by.
+ */
+static uint64_t __chmodel_request(struct channel_model *ch, uint64_t cur_time,
+				  uint64_t request_time, uint64_t length)
+{
+	uint64_t cur_slot = cur_time / UNIT_TIME_INTERVAL;
+	uint64_t req_slot, horizon, pos, final;
+	uint32_t units_to_xfer = DIV_ROUND_UP(length, UNIT_XFER_SIZE);
+	uint32_t remaining_credits, default_delay, left;
+	uint64_t delay, total_latency;
+	uint32_t first, i;
+
+	__chmodel_expire(ch, cur_slot);
+	__chmodel_make_room(ch);
+	ch->cur_time = cur_time;
+
+	if (request_time < cur_time) {
+		NVMEV_DEBUG("[%s] Reqeust time is before the current time %llu %llu (%llu)\n",
+			    __func__, request_time, cur_time, cur_time - request_time);
+		return request_time; // return minimum delay
+	}
+
+	req_slot = request_time / UNIT_TIME_INTERVAL;
+	horizon = cur_slot + NR_CREDIT_ENTRIES;
+
+	if (req_slot >= horizon) {
+		NVMEV_ERROR("[%s] CH %p need to increase array size %llu %llu %llu\n", __func__,
+			    ch, request_time, cur_time, req_slot - cur_slot);
+		return request_time; // return minimum delay
+	}
+
+	remaining_credits = units_to_xfer * UNIT_XFER_CREDITS;
+	remaining_credits += ch->command_credits;
+	if (remaining_credits == 0)
+		return request_time;
+
+	default_delay = remaining_credits / ch->max_credits;
+
+	first = i = __chmodel_find(ch, req_slot);
+	pos = req_slot;
+
+	while (1) {
+		struct credit_run *r = (i < ch->nr_runs) ? &ch->runs[i] : NULL;
+		bool in_run = r && r->start <= pos;
+		uint64_t span_end;
+		uint32_t avail;
+
+		/* Every slot in [pos, span_end) has the same number of credits left */
+		if (in_run) {
+			avail = r->avail;
+			span_end = RUN_END(r);
+		} else {
+			avail = ch->max_credits;
+			span_end = r ? r->start : horizon;
+		}
+		if (span_end > horizon)
+			span_end = horizon;
+
+		if (avail) {
+			uint64_t need = DIV_ROUND_UP(remaining_credits, avail);
+
+			if (pos + need <= span_end) {
+				final = pos + need - 1;
+				left = avail * need - remaining_credits;
+				break;
+			}
+			remaining_credits -= avail * (span_end - pos);
+		}
+
+		pos = span_end;
+		if (in_run)
+			i++;
+
+		if (pos >= horizon) {
+			NVMEV_ERROR("[%s] No free entry 0x%llx 0x%llx 0x%llx\n", __func__,
+				    request_time, cur_time, req_slot - cur_slot);
+			final = horizon - 1;
+			left = 0;
+			break;
+		}
+	}
+
+	/* __chmodel_make_room() left space for this */
+	if (!__chmodel_reserve(ch, first, req_slot, final, left)) {
+		NVMEV_ERROR("[%s] CH %p out of credit runs (%u)\n", __func__, ch, ch->nr_runs);
+		NVMEV_ASSERT(false);
+	}
+
+	delay = final - req_slot;
+	delay = (delay > default_delay) ? (delay - default_delay) : 0;
+
+	total_latency = (ch->xfer_lat * units_to_xfer) + (delay * UNIT_TIME_INTERVAL);
+
+	return request_time + total_latency;
+}
+
+/*
+ * Each channel model carries its own lock, so requests to different NAND
+ * channels (and to the PCIe link) no longer serialize behind one another.
+ */
 uint64_t chmodel_request(struct channel_model *ch, uint64_t request_time, uint64_t length)
 {
-	uint64_t cur_time = __get_wallclock();
+	uint64_t ret;
+
+	spin_lock(&ch->lock);
+	ret = __chmodel_request(ch, __get_wallclock(), request_time, length);
+	spin_unlock(&ch->lock);
+
+	return ret;
+}
+
+/*
+ * The previous model, kept only as a baseline for chmodel_bench(). It keeps
+ * one credit counter per UNIT_TIME_INTERVAL slot in a ring and memsets the
+ * slots that time has passed.
+ */
+struct chmodel_array {
+	uint64_t cur_time;
+	uint32_t head;
+	uint32_t valid_len;
+	uint32_t max_credits;
+	uint32_t command_credits;
+	uint32_t xfer_lat;
+	credit_t avail_credits[NR_CREDIT_ENTRIES];
+};
+
+static uint64_t __chmodel_array_request(struct chmodel_array *ch, uint64_t cur_time,
+					uint64_t request_time, uint64_t length)
+{
 	uint32_t pos, next_pos;
 	uint32_t remaining_credits, consumed_credits;
 	uint32_t default_delay, delay = 0;
@@ -40,7 +339,6 @@ uint64_t chmodel_request(struct channel_model *ch, uint64_t request_time, uint64
 	uint32_t units_to_xfer = DIV_ROUND_UP(length, UNIT_XFER_SIZE);
 	uint32_t cur_time_offs, request_time_offs;
 
-	// Search current time index and move head to it
 	cur_time_offs = (cur_time / UNIT_TIME_INTERVAL) - (ch->cur_time / UNIT_TIME_INTERVAL);
 	cur_time_offs = (cur_time_offs < ch->valid_len) ? cur_time_offs : ch->valid_len;
 
@@ -57,38 +355,18 @@ uint64_t chmodel_request(struct channel_model *ch, uint64_t request_time, uint64
 	ch->cur_time = cur_time;
 	ch->valid_len = ch->valid_len - cur_time_offs;
 
-	if (ch->valid_len > NR_CREDIT_ENTRIES) {
-        NVMEV_ERROR("[%s] ch %p Invalid valid_len 0x%x cur_time %llu request_time %llu length %llu. "
-                    "Last was %u cur_time_offs %u.\n", 
-                    __func__, ch, ch->valid_len, cur_time, request_time, length, last, cur_time_offs);
-        NVMEV_INFO("Caller is %pS\n", __builtin_return_address(0));
-        NVMEV_INFO("Caller is %pS\n", __builtin_return_address(1));
-        NVMEV_INFO("Caller is %pS\n", __builtin_return_address(2));
-        return request_time;
-        NVMEV_ASSERT(0);
-    }
-
-    if (request_time < cur_time) {
-        NVMEV_DEBUG("[%s] Reqeust time is before the current time %llu %llu (%llu)\n",
-                     __func__, request_time, cur_time, cur_time - request_time);
-        return request_time; // return minimum delay
-	}
+	if (request_time < cur_time)
+		return request_time;
 
-	//Search request time index
 	request_time_offs = (request_time / UNIT_TIME_INTERVAL) - (cur_time / UNIT_TIME_INTERVAL);
-
-	if (request_time_offs >= NR_CREDIT_ENTRIES) {
-        NVMEV_ERROR("[%s] CH %p need to increase array size %llu %llu %u\n", __func__,
-                ch, request_time, cur_time, request_time_offs);
-        return request_time; // return minimum delay
-	}
+	if (request_time_offs >= NR_CREDIT_ENTRIES)
+		return request_time;
 
 	pos = (ch->head + request_time_offs) % NR_CREDIT_ENTRIES;
 	remaining_credits = units_to_xfer * UNIT_XFER_CREDITS;
 	remaining_credits += ch->command_credits;
 
 	default_delay = remaining_credits / ch->max_credits;
-	delay = 0;
 
 	while (1) {
 		consumed_credits = (remaining_credits <= ch->avail_credits[pos]) ?
@@ -97,33 +375,128 @@ uint64_t chmodel_request(struct channel_model *ch, uint64_t request_time, uint64
 		ch->avail_credits[pos] -= consumed_credits;
 		remaining_credits -= consumed_credits;
 
-		if (remaining_credits) {
-			next_pos = (pos + 1) % NR_CREDIT_ENTRIES;
-			// If array is full
-			if (next_pos != ch->head) {
-				delay++;
-				pos = next_pos;
-			} else {
-				NVMEV_ERROR("[%s] No free entry 0x%llx 0x%llx 0x%x\n", __func__,
-					    request_time, cur_time, request_time_offs);
-                break;
-			}
-		} else
+		if (!remaining_credits)
 			break;
+
+		next_pos = (pos + 1) % NR_CREDIT_ENTRIES;
+		if (next_pos == ch->head)
+			break;
+		delay++;
+		pos = next_pos;
 	}
 
 	valid_length = (pos >= ch->head) ? (pos - ch->head + 1) :
 			       (NR_CREDIT_ENTRIES - (ch->head - pos - 1));
-
-	if (valid_length > ch->valid_len) {
+	if (valid_length > ch->valid_len)
 		ch->valid_len = valid_length;
-    }
-    last = ch->valid_len;
 
-	// check if array is small..
 	delay = (delay > default_delay) ? (delay - default_delay) : 0;
-
 	total_latency = (ch->xfer_lat * units_to_xfer) + (delay * UNIT_TIME_INTERVAL);
 
 	return request_time + total_latency;
 }
+
+/*
+ * Replays the same synthetic request stream against the old credit array
+ * and the run-based model, and reports the time spent in each. The stream
+ * is spread round-robin over CHMODEL_BENCH_MODELS models, like the NAND
+ * channels and the PCIe link of one device. Each model sees 4KB-16KB
+ * transfers that target up to 200us into the future, and arrive on a
+ * virtual clock at 'load' percent of its bandwidth on average. Past 100%
+ * the backlog grows, which is where the array model has to walk slot by
+ * slot. Both variants are fed the same clock, so their completion times
+ * must match exactly. Any difference is counted in res->mismatches.
+ */
+#define CHMODEL_BENCH_MODELS (9)
+int chmodel_bench(uint32_t nr_reqs, uint32_t load, struct chmodel_bench_result *res)
+{
+	struct chmodel_array *array[CHMODEL_BENCH_MODELS] = { NULL };
+	struct channel_model *sparse[CHMODEL_BENCH_MODELS] = { NULL };
+	uint64_t clock = NS_PER_SEC(1), t0, t1;
+	uint64_t *req_time, *req_len, *clocks, *done;
+	uint64_t avg_xfer_ns, max_step;
+	uint32_t seed = 0x9e3779b9;
+	uint32_t i, m;
+	int ret = -ENOMEM;
+
+	if (nr_reqs == 0 || load == 0)
+		return -EINVAL;
+
+	req_time = vmalloc(sizeof(uint64_t) * nr_reqs);
+	req_len = vmalloc(sizeof(uint64_t) * nr_reqs);
+	clocks = vmalloc(sizeof(uint64_t) * nr_reqs);
+	done = vmalloc(sizeof(uint64_t) * nr_reqs);
+	if (!req_time || !req_len || !clocks || !done)
+		goto out;
+
+	for (m = 0; m < CHMODEL_BENCH_MODELS; m++) {
+		array[m] = vmalloc(sizeof(struct chmodel_array));
+		sparse[m] = vmalloc(sizeof(struct channel_model));
+		if (!array[m] || !sparse[m])
+			goto out;
+
+		chmodel_init(sparse[m], 800);
+		array[m]->cur_time = 0;
+		array[m]->head = 0;
+		array[m]->valid_len = 0;
+		array[m]->max_credits = sparse[m]->max_credits;
+		array[m]->command_credits = sparse[m]->command_credits;
+		array[m]->xfer_lat = sparse[m]->xfer_lat;
+		MEMSET(&(array[m]->avail_credits[0]), array[m]->max_credits, NR_CREDIT_ENTRIES);
+	}
+
+	/* Mean of 4KB, 8KB and 16KB transfers, and the arrival gap that gives 'load' */
+	avg_xfer_ns = (uint64_t)sparse[0]->xfer_lat * (KB(4) + KB(8) + KB(16)) / 3 / UNIT_XFER_SIZE;
+	max_step = 2 * avg_xfer_ns * 100 / load / CHMODEL_BENCH_MODELS;
+	if (max_step == 0)
+		max_step = 1;
+
+	for (i = 0; i < nr_reqs; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+
+		clock += seed % max_step;
+		clocks[i] = clock;
+		req_time[i] = clock + (seed >> 8) % 200000;
+		req_len[i] = KB(4) << ((seed >> 4) % 3);
+	}
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < nr_reqs; i++) {
+		done[i] = __chmodel_array_request(array[i % CHMODEL_BENCH_MODELS], clocks[i],
+						  req_time[i], req_len[i]);
+	}
+	t1 = ktime_get_ns();
+	res->array_ns = t1 - t0;
+
+	res->mismatches = 0;
+	t0 = ktime_get_ns();
+	for (i = 0; i < nr_reqs; i++) {
+		if (__chmodel_request(sparse[i % CHMODEL_BENCH_MODELS], clocks[i], req_time[i],
+				      req_len[i]) != done[i])
+			res->mismatches++;
+	}
+	t1 = ktime_get_ns();
+	res->sparse_ns = t1 - t0;
+
+	res->nr_reqs = nr_reqs;
+	res->load = load;
+	res->max_runs = 0;
+	res->merged_runs = 0;
+	for (m = 0; m < CHMODEL_BENCH_MODELS; m++) {
+		res->max_runs = max(res->max_runs, sparse[m]->max_runs);
+		res->merged_runs += sparse[m]->merged_runs;
+	}
+	ret = 0;
+out:
+	for (m = 0; m < CHMODEL_BENCH_MODELS; m++) {
+		vfree(sparse[m]);
+		vfree(array[m]);
+	}
+	vfree(done);
+	vfree(clocks);
+	vfree(req_len);
+	vfree(req_time);
+	return ret;
+}
@@ -3,8 +3,11 @@
 #ifndef _CHANNEL_MODEL_H
 #define _CHANNEL_MODEL_H
 
+#include <linux/spinlock.h>
+
 /* Macros for channel model */
-#define NR_CREDIT_ENTRIES (1024 * 96 * 8)
+#define NR_CREDIT_ENTRIES (1024 * 96 * 8) //reservation horizon, in UNIT_TIME_INTERVALs
+#define NR_CREDIT_RUNS (1024)
 #define UNIT_TIME_INTERVAL (4000ULL) //ns
 #define UNIT_XFER_SIZE (128ULL) //bytes
 #define UNIT_XFER_CREDITS (1) //credits needed to transfer data(UNIT_XFER_SIZE)
@@ -26,16 +29,28 @@ typedef uint32_t credit_t;
 #error "Invalid credit size"
 #endif
 
+/*
+ * A run of consecutive time slots that all have 'avail' credits left. Slots
+ * not covered by any run are implicitly at max_credits, so only the parts of
+ * the timeline that were actually reserved take up memory.
+ */
+struct credit_run {
+	uint64_t start; /* absolute slot, i.e. time / UNIT_TIME_INTERVAL */
+	uint32_t len;
+	credit_t avail;
+};
+
 struct channel_model {
 	uint64_t cur_time;
-	uint32_t head;
-	uint32_t valid_len;
+	uint32_t nr_runs;
+	uint32_t max_runs; /* high-water mark of nr_runs */
+	uint32_t merged_runs; /* merges done because the table was full */
 	uint32_t max_credits;
 	uint32_t command_credits;
 	uint32_t xfer_lat; /*XKB NAND CH transfer time in nanoseconds*/
 
-    uint64_t last;
-	credit_t avail_credits[NR_CREDIT_ENTRIES];
+	spinlock_t lock; /* protects the fields above and runs */
+	struct credit_run runs[NR_CREDIT_RUNS]; /* sorted by start, non-overlapping */
 };
 
 #define BANDWIDTH_TO_TX_TIME(MB_S) (((UNIT_XFER_SIZE)*NS_PER_SEC(1)) / (MB(MB_S)))
@@ -44,4 +59,15 @@ struct channel_model {
 
 uint64_t chmodel_request(struct channel_model *ch, uint64_t request_time, uint64_t length);
 void chmodel_init(struct channel_model *ch, uint64_t bandwidth /*MB/s*/);
+
+struct chmodel_bench_result {
+	uint32_t nr_reqs;
+	uint32_t load; /* offered load in percent of each model's bandwidth */
+	uint64_t array_ns; /* total time spent in the old credit array model */
+	uint64_t sparse_ns; /* total time spent in the run-based model */
+	uint32_t max_runs;
+	uint32_t merged_runs; /* merges forced by a full run table, can cause mismatches */
+	uint32_t mismatches; /* requests where the two models disagreed */
+};
+int chmodel_bench(uint32_t nr_reqs, uint32_t load, struct chmodel_bench_result *res);
 #endif
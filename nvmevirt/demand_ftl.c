@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0-only
 
+#include <linux/bitmap.h>
 #include <linux/delay.h>
+#include <linux/hash.h>
 #include <linux/highmem.h>
 #include <linux/ktime.h>
 #include <linux/kthread.h>
@@ -23,16 +25,13 @@
 #include "twolevel.h"
 #endif
 
-spinlock_t entry_spin;
-spinlock_t ev_spin;
-spinlock_t wfc_spin;
-spinlock_t v_spin;
-spinlock_t inv_spin;
-spinlock_t lm_spin;
-spinlock_t inv_m_spin;
-atomic_t gcing;
-
-struct lru_cache buf_lru;
+/*
+ * Locks that protect FTL state live in each demand_shard. GC scratch
+ * state lives in the gc_worker that owns the shard, so shards owned by
+ * different workers are collected in parallel.
+ */
+static struct gc_worker **gc_workers;
+static unsigned int nr_gc_workers;
 
 static int __proc_file_read(struct seq_file *m, void *data)
 {
@@ -41,12 +40,12 @@ static int __proc_file_read(struct seq_file *m, void *data)
 
     if(strcmp(filename, "kvstat") == 0) {
         NVMEV_ERROR("Stats!\n");
-        char* dstat = get_demand_stat();
+        char* dstat = get_demand_stat(&nvmev_vdev->ns[0]);
         seq_printf(m, "%s", dstat);
         kfree(dstat);
     } else if(strcmp(filename, "clearkvstat") == 0) {
         NVMEV_ERROR("Clear stats!\n");
-        clear_demand_stat();
+        clear_demand_stat(&nvmev_vdev->ns[0]);
 	} else if(strcmp(filename, "fastfill") == 0) {
         char input[128];
         uint32_t vlen, pairs;
@@ -55,7 +54,7 @@ static int __proc_file_read(struct seq_file *m, void *data)
         fast_fill(&nvmev_vdev->ns[0], nvmev_vdev->ns[0].size, vlen, pairs);
     } else if(strcmp(filename, "gc") == 0) {
         NVMEV_ERROR("GC called!\n");
-        gc();
+        gc(&nvmev_vdev->ns[0]);
     }
 
     return 0;
@@ -84,33 +83,8 @@ static const struct file_operations proc_file_fops = {
 };
 #endif
 
-struct demand_shard* __g_shard;
-
-/*
- * fastmode parameters -> for filling the device quickly.
- */
-struct demand_shard* __fast_fill_shard;
-
-/*
- * This isn't stricly necessary, but is here to try to avoid
- * a situation where the exact same page is read repeatedly
- * and the channel runs out of space for requests.
- *
- */
-#define NUM_APPEND_BUFS 4
-struct item append_lrus[NUM_APPEND_BUFS];
-char *cur_append_key = NULL;
-uint8_t cur_append_klen = 0;
-uint8_t append_klens[NUM_APPEND_BUFS];
-char* append_keys[NUM_APPEND_BUFS];
-char* append_bufs[NUM_APPEND_BUFS];
-uint32_t wb_idxs[NUM_APPEND_BUFS];
-uint32_t inv_cnts[NUM_APPEND_BUFS];
-uint32_t wb_idx = 0;
-char* cur_append_buf = NULL;
-
-void schedule_internal_operation(int sqid, unsigned long long nsecs_target,
-        struct buffer *write_buffer, unsigned int buffs_to_release);
+bool schedule_internal_operation(int sqid, unsigned long long nsecs_target,
+        struct buffer *write_buffer, size_t buffs_to_release);
 
 void __warn_not_found(char* key, uint8_t klen) {
     char k[255];
@@ -121,9 +95,7 @@ void __warn_not_found(char* key, uint8_t klen) {
     NVMEV_DEBUG("Key %s (%llu) not found.\n", k, *(uint64_t*) k);
 }
 
-void clear_demand_stat(void) {
-    struct stats *_stat = &__g_shard->stats;
-
+static void __clear_shard_stat(struct stats *_stat) {
     _stat->data_r = 0;
     _stat->data_w = 0;
     _stat->trans_r = 0;
@@ -159,18 +131,120 @@ void clear_demand_stat(void) {
     _stat->fp_match_w = 0;
     _stat->fp_collision_r = 0;
     _stat->fp_collision_w = 0;
+    _stat->fp_skip_r = 0;
+    _stat->fp_skip_w = 0;
+    _stat->hash_full = 0;
+    _stat->hash_moved = 0;
+    memset(_stat->w_hash_collision_cnt, 0x0, sizeof(_stat->w_hash_collision_cnt));
+    memset(_stat->r_hash_collision_cnt, 0x0, sizeof(_stat->r_hash_collision_cnt));
     _stat->cache_hit = 0;
     _stat->cache_miss = 0;
     _stat->clean_evict = 0;
     _stat->dirty_evict = 0;
 }
 
-char* get_demand_stat(void) {
-    const struct stats *_stat = &__g_shard->stats;
+void clear_demand_stat(struct nvmev_ns *ns) {
+    struct demand_shard *shards = (struct demand_shard*) ns->ftls;
+
+    for(int i = 0; i < ns->nr_parts; i++) {
+        __clear_shard_stat(&shards[i].stats);
+        memset(&shards[i].cache.pstat, 0x0, sizeof(shards[i].cache.pstat));
+    }
+}
+
+/*
+ * Sums the per-shard stats into a freshly allocated struct stats.
+ * Every field is a uint64_t counter, so we can add them word by word.
+ */
+static struct stats* __sum_shard_stats(struct nvmev_ns *ns) {
+    struct demand_shard *shards = (struct demand_shard*) ns->ftls;
+    struct stats *sum;
+    uint64_t *dst, *src;
+
+    sum = (struct stats*) kzalloc(sizeof(*sum), GFP_KERNEL);
+    NVMEV_ASSERT(sum);
+
+    dst = (uint64_t*) sum;
+    for(int i = 0; i < ns->nr_parts; i++) {
+        src = (uint64_t*) &shards[i].stats;
+        for(int j = 0; j < sizeof(*sum) / sizeof(uint64_t); j++) {
+            dst[j] += src[j];
+        }
+    }
+
+    return sum;
+}
+
+/*
+ * Eviction policy counters, summed over the shards' caches.
+ */
+static uint32_t __policy_stat(struct nvmev_ns *ns, char *buf, uint32_t buf_size) {
+    struct demand_shard *shards = (struct demand_shard*) ns->ftls;
+    struct cache_policy_stats sum;
+    uint32_t length = 0;
+
+    memset(&sum, 0x0, sizeof(sum));
+    for(int i = 0; i < ns->nr_parts; i++) {
+        struct cache_policy_stats *p = &shards[i].cache.pstat;
+
+        sum.inserts += p->inserts;
+        sum.hits += p->hits;
+        sum.victims += p->victims;
+        sum.promotions += p->promotions;
+        sum.second_chances += p->second_chances;
+        sum.ghost_hits += p->ghost_hits;
+    }
+
+    length += snprintf(buf + length, buf_size - length, "[Policy: %s]\n",
+                       cache_policy_name(nvmev_vdev->config.cache_policy));
+    length += snprintf(buf + length, buf_size - length, "Hits:\t\t%lld\n", sum.hits);
+    length += snprintf(buf + length, buf_size - length, "Loads:\t\t%lld\n", sum.inserts);
+    length += snprintf(buf + length, buf_size - length, "Victims:\t%lld\n", sum.victims);
+    length += snprintf(buf + length, buf_size - length, "Promotions:\t%lld\n", sum.promotions);
+    length += snprintf(buf + length, buf_size - length, "Second chances:\t%lld\n", 
+                       sum.second_chances);
+    length += snprintf(buf + length, buf_size - length, "Ghost hits:\t%lld\n", sum.ghost_hits);
+    length += snprintf(buf + length, buf_size - length, "\n");
+
+    return length;
+}
+
+/*
+ * One line per probe count that was seen: the count, how many requests
+ * needed that many extra probes, and the cumulative share of requests.
+ */
+static uint32_t __probe_hist_stat(uint64_t *hist, char *buf, uint32_t buf_size) {
+    uint64_t total = 0, sum = 0;
+    uint32_t length = 0;
+
+    for(int i = 0; i < HASH_MAX_PROBES; i++) {
+        total += hist[i];
+    }
+
+    if(!total) {
+        return snprintf(buf, buf_size, "No requests.\n");
+    }
+
+    for(int i = 0; i < HASH_MAX_PROBES; i++) {
+        if(!hist[i]) {
+            continue;
+        }
+
+        sum += hist[i];
+        length += snprintf(buf + length, buf_size - length, "%d:\t%lld\t(%lld%%)\n", 
+                           i, hist[i], (sum * 100) / total);
+    }
+
+    return length;
+}
+
+char* get_demand_stat(struct nvmev_ns *ns) {
+    struct stats *_stat = __sum_shard_stats(ns);
     uint32_t buf_size = 16384;
     uint32_t length = 0;
     char *ret = kzalloc(buf_size, GFP_KERNEL);
     char tmp_buf[4096];
+    uint64_t nr_suspends = 0;
     memset(ret, 0x0, buf_size);
 
     /* device traffic */
@@ -199,6 +273,30 @@ char* get_demand_stat(void) {
     length += snprintf(ret + length, buf_size - length, "DataGC_TW:\t%lld MB\n", 
             _stat->trans_w_dgc >> 20);
     length += snprintf(ret + length, buf_size - length, "\n");
+    length += snprintf(ret + length, buf_size - length, "GC policy:\t%s\n", 
+            gc_policy_name(nvmev_vdev->config.gc_policy));
+    if(_stat->dgc_cnt + _stat->tgc_cnt > 0) {
+        length += snprintf(ret + length, buf_size - length, "Victim VGC:\t%lld (avg)\n", 
+                _stat->gc_victim_vgc / (_stat->dgc_cnt + _stat->tgc_cnt));
+        length += snprintf(ret + length, buf_size - length, "Victim age:\t%lld lines (avg)\n", 
+                _stat->gc_victim_age / (_stat->dgc_cnt + _stat->tgc_cnt));
+    }
+    length += snprintf(ret + length, buf_size - length, "GC slice:\t%u flash pages\n", 
+            nvmev_vdev->config.gc_slice);
+    length += snprintf(ret + length, buf_size - length, "FG GC stalls:\t%lld (%lld us)\n", 
+            _stat->fg_gc_stalls, _stat->fg_gc_stall_us);
+    length += snprintf(ret + length, buf_size - length, "WB stalls:\t%lld (%lld us)\n", 
+            _stat->wbuf_stalls, _stat->wbuf_stall_us);
+    for(int i = 0; i < ns->nr_parts; i++) {
+        nr_suspends += ssd_nr_suspends(((struct demand_shard*) ns->ftls)[i].ssd);
+    }
+    length += snprintf(ret + length, buf_size - length, "P/E suspends:\t%lld\n", 
+            nr_suspends);
+    for(int i = 0; i < NR_STREAMS; i++) {
+        length += snprintf(ret + length, buf_size - length, "Stream %d_W:\t%lld MB\n", 
+                i, _stat->stream_w[i] >> 20);
+    }
+    length += snprintf(ret + length, buf_size - length, "\n");
     length += snprintf(ret + length, buf_size - length, "TransGC cnt:\t%lld\n", _stat->tgc_cnt);
     length += snprintf(ret + length, buf_size - length, "TransGC_TR: \t%lld MB\n", 
             _stat->trans_r_tgc >> 20);
@@ -257,19 +355,41 @@ char* get_demand_stat(void) {
     length += snprintf(ret + length, buf_size - length, "\n");
 
     length += snprintf(ret + length, buf_size - length, "[Overall Hash-table Load Factor]\n");
-    int filled_entry_cnt = 0 ; //count_filled_entry(NULL);
-    int total_entry_cnt = 0; //d_cache->env.nr_valid_tentries;
-    length += snprintf(ret + length, buf_size - length, "Total entry:  %d\n", total_entry_cnt);
-    length += snprintf(ret + length, buf_size - length, "Filled entry: %d\n", filled_entry_cnt);
-    //length += snprintf(ret + length, buf_size - length, "Load factor: %d%%\n", 100 * (filled_entry_cnt/total_entry_cnt*100));
+    struct demand_shard *shards = (struct demand_shard*) ns->ftls;
+    uint64_t filled_entry_cnt = 0, total_entry_cnt = 0;
+    uint64_t sections = 0, max_sections = 0;
+
+    for(int i = 0; i < ns->nr_parts; i++) {
+        struct cache *c = &shards[i].cache;
+        uint32_t size = (c->lh_base << c->lh_level) + c->lh_split;
+
+        filled_entry_cnt += atomic64_read(&c->lh_used);
+        total_entry_cnt += (uint64_t) size * (EPP - 1);
+        sections += size;
+        max_sections += c->lh_max;
+    }
+
+    length += snprintf(ret + length, buf_size - length, "Sections:     %lld of %lld\n", 
+                       sections, max_sections);
+    length += snprintf(ret + length, buf_size - length, "Total entry:  %lld\n", total_entry_cnt);
+    length += snprintf(ret + length, buf_size - length, "Filled entry: %lld\n", filled_entry_cnt);
+    if(total_entry_cnt) {
+        length += snprintf(ret + length, buf_size - length, "Load factor:  %lld%%\n", 
+                           (filled_entry_cnt * 100) / total_entry_cnt);
+    }
+    length += snprintf(ret + length, buf_size - length, "Moved on split: %lld\n", 
+                       _stat->hash_moved);
     length += snprintf(ret + length, buf_size - length, "\n");
 
     length += snprintf(ret + length, buf_size - length, "[write(insertion)]\n");
-    length += 0 ; //get_hash_collision_cdf(_stat->w_hash_collision_cnt, ret + length);
+    length += __probe_hist_stat(_stat->w_hash_collision_cnt, ret + length, 
+                                buf_size - length);
+    length += snprintf(ret + length, buf_size - length, "Table full:\t%lld\n", 
+                       _stat->hash_full);
 
     length += snprintf(ret + length, buf_size - length, "[read]\n");
-    length += 0 ; // get_hash_collision_cdf(_stat->r_hash_collision_cnt, ret + length);
-    //length += snprintf(ret + length, buf_size - length, print_hash_collision_cdf(_stat->r_hash_collision_cnt));
+    length += __probe_hist_stat(_stat->r_hash_collision_cnt, ret + length, 
+                                buf_size - length);
     length += snprintf(ret + length, buf_size - length, "\n");
 
     length += snprintf(ret + length, buf_size - length, "=======================\n");
@@ -280,6 +400,7 @@ char* get_demand_stat(void) {
     length += snprintf(ret + length, buf_size - length, "[Read]\n");
     length += snprintf(ret + length, buf_size - length, "fp_match:     %lld\n", _stat->fp_match_r);
     length += snprintf(ret + length, buf_size - length, "fp_collision: %lld\n", _stat->fp_collision_r);
+    length += snprintf(ret + length, buf_size - length, "fp_skipped:   %lld\n", _stat->fp_skip_r);
 
     if(_stat->fp_match_r + _stat->fp_collision_r > 0) {
         length += snprintf(ret+length, buf_size - length, "rate: %llu\n", 
@@ -289,6 +410,7 @@ char* get_demand_stat(void) {
     length += snprintf(ret + length, buf_size - length, "[Write]\n");
     length += snprintf(ret + length, buf_size - length, "fp_match:     %lld\n", _stat->fp_match_w);
     length += snprintf(ret + length, buf_size - length, "fp_collision: %lld\n", _stat->fp_collision_w);
+    length += snprintf(ret + length, buf_size - length, "fp_skipped:   %lld\n", _stat->fp_skip_w);
 
     if(_stat->fp_match_w + _stat->fp_collision_w > 0) {
         length += snprintf(ret + length, buf_size - length, "rate: %lld\n", 
@@ -314,13 +436,36 @@ char* get_demand_stat(void) {
     length += snprintf(ret + length, buf_size - length, "Cache_Hit:\t%lld\n", _stat->cache_hit);
     length += snprintf(ret + length, buf_size - length, "Cache_Miss:\t%lld\n", _stat->cache_miss);
 
-    length += snprintf(ret + length, buf_size - length, "Hit ratio:FIXME\n");
+    if(_stat->cache_hit + _stat->cache_miss > 0) {
+        length += snprintf(ret + length, buf_size - length, "Hit ratio:\t%lld%%\n", 
+                (100 * _stat->cache_hit) / (_stat->cache_hit + _stat->cache_miss));
+    }
     length += snprintf(ret + length, buf_size - length, "\n");
 
+    length += __policy_stat(ns, ret + length, buf_size - length);
+
     length += snprintf(ret + length, buf_size - length, "Clean evict:\t%lld\n", _stat->clean_evict);
     length += snprintf(ret + length, buf_size - length, "Dirty evict:\t%lld\n", _stat->dirty_evict);
     length += snprintf(ret + length, buf_size - length, "\n");
 
+    length += snprintf(ret + length, buf_size - length, "=============\n");
+    length += snprintf(ret + length, buf_size - length, " Pair Memory \n");
+    length += snprintf(ret + length, buf_size - length, "=============\n");
+    length += pair_mem_stat(ret + length, buf_size - length);
+
+    uint64_t nr_entries = 0, nr_sections = 0, entries_bytes = 0;
+    for(int i = 0; i < ns->nr_parts; i++) {
+        struct cache *c = &((struct demand_shard*) ns->ftls)[i].cache;
+        nr_entries += atomic_read(&c->nr_entries);
+        entries_bytes += atomic64_read(&c->entries_bytes);
+        nr_sections += c->nr_valid_tpages;
+    }
+    length += snprintf(ret + length, buf_size - length, 
+            "Entry tables:\t%lld of %lld sections (%lld KB)\n", 
+            nr_entries, nr_sections, entries_bytes >> 10);
+    length += snprintf(ret + length, buf_size - length, "\n");
+
+    kfree(_stat);
     return ret;
 }
 
@@ -347,6 +492,33 @@ static unsigned int cmd_key_length(struct nvme_kv_command *cmd)
     }
 }
 
+/*
+ * The shard a KV command will touch, so the IO path can hand it to the FTL
+ * worker that owns that shard. Batches carry many keys and can touch any
+ * shard, so they return -1 and get run with the FTL workers quiesced.
+ */
+int kv_io_cmd_part(struct nvmev_ns *ns, struct nvme_command *b_cmd)
+{
+    struct nvme_kv_command *cmd = (struct nvme_kv_command*) b_cmd;
+    uint8_t klen = cmd_key_length(cmd);
+    char *key;
+
+    switch (cmd->common.opcode) {
+        case nvme_cmd_kv_store:
+        case nvme_cmd_kv_append:
+            key = cmd->kv_store.key;
+            break;
+        case nvme_cmd_kv_retrieve:
+        case nvme_cmd_kv_delete:
+            key = cmd->kv_retrieve.key;
+            break;
+        default:
+            return -1;
+    }
+
+    return SHARD_OF(CityHash64(key, klen));
+}
+
 static unsigned int cmd_value_length(struct nvme_kv_command *cmd)
 {
     if (cmd->common.opcode == nvme_cmd_kv_store) {
@@ -364,10 +536,16 @@ static unsigned int cmd_value_length(struct nvme_kv_command *cmd)
     }
 }
 
+/*
+ * The write pointer fills a wordline on every plane of a LUN before moving
+ * on, so the last page of the last plane's wordline is where we issue the
+ * multi-plane program for all of them.
+ */
 inline bool last_pg_in_wordline(struct demand_shard *demand_shard, struct ppa *ppa)
 {
     struct ssdparams *spp = &demand_shard->ssd->sp;
-    return (ppa->g.pg % spp->pgs_per_oneshotpg) == (spp->pgs_per_oneshotpg - 1);
+    return (ppa->g.pg % spp->pgs_per_oneshotpg) == (spp->pgs_per_oneshotpg - 1) &&
+           ppa->g.pl == (spp->pls_per_lun - 1);
 }
 
 inline bool last_pg_in_ch(struct demand_shard *demand_shard, struct ppa *ppa) 
@@ -404,6 +582,58 @@ static inline bool should_gc_high(struct demand_shard *demand_shard)
     return demand_shard->lm.free_line_cnt <= demand_shard->cp.gc_thres_lines_high;
 }
 
+static inline bool __fg_can_write(struct demand_shard *demand_shard)
+{
+    return !should_gc_high(demand_shard) ||
+           ((int32_t) demand_shard->wfc.write_credits > 0 &&
+            demand_shard->lm.free_line_cnt > GC_RESERVE_LINES);
+}
+
+static inline void __kick_gc(struct demand_shard *demand_shard)
+{
+    if(should_gc(demand_shard) && wq_has_sleeper(&demand_shard->gcw->wq)) {
+        wake_up(&demand_shard->gcw->wq);
+    }
+}
+
+/*
+ * bg_ev_t only pre-collects victims once the cache is past its
+ * watermark. Below that, nobody is going to evict any time soon.
+ */
+static inline bool __should_collect(struct demand_shard *shard)
+{
+    return atomic_read(&shard->have_victims) == 0 &&
+           shard->cache.nr_cached_tentries >= shard->ev_wmark;
+}
+
+static inline void __kick_ev(struct demand_shard *shard)
+{
+    if(__should_collect(shard) && wq_has_sleeper(&shard->ev_wq)) {
+        wake_up(&shard->ev_wq);
+    }
+}
+
+/*
+ * Wait for cond, which is checked (and may have side effects) until it
+ * is true exactly once. Spin for BG_SPIN_NS first so short waits don't
+ * pay for a wakeup, then sleep on wq.
+ */
+#define __spin_then_sleep(wq, cond)                                     \
+    do {                                                                \
+        uint64_t __until = ktime_get_ns() + BG_SPIN_NS;                 \
+        while(!(cond)) {                                                \
+            if(ktime_get_ns() < __until) {                              \
+                cpu_relax();                                            \
+                continue;                                               \
+            }                                                           \
+                                                                        \
+            if(wait_event_interruptible_timeout(wq, cond,               \
+                    msecs_to_jiffies(BG_POLL_MS)) > 0) {                \
+                break;                                                  \
+            }                                                           \
+        }                                                               \
+    } while(0)
+
 static inline struct ppa get_maptbl_ent(struct demand_shard *demand_shard, uint64_t lpn)
 {
     return demand_shard->maptbl[lpn];
@@ -497,6 +727,8 @@ static void init_lines(struct demand_shard *demand_shard)
     lm->victim_line_pq = pqueue_init(spp->tt_lines, victim_line_cmp_pri, victim_line_get_pri,
             victim_line_set_pri, victim_line_get_pos,
             victim_line_set_pos);
+    lm->seal_seq = 0;
+    lm->policy = nvmev_vdev->config.gc_policy;
 
     lm->free_line_cnt = 0;
     for (i = 0; i < lm->tt_lines; i++) {
@@ -507,6 +739,7 @@ static void init_lines(struct demand_shard *demand_shard)
                 .vgc = 0,
                 .igc = 0,
                 .pos = 0,
+                .age = 0,
                 .map = false,
                 .entry = LIST_HEAD_INIT(lm->lines[i].entry),
         };
@@ -542,6 +775,7 @@ static void alloc_gc_mem(struct demand_shard *demand_shard) {
 
     gcd->offset = GRAIN_PER_PAGE;
     gcd->last = false;
+    gcd->victim = NULL;
 
     xa_init(&gcd->inv_mapping_xa);
 }
@@ -574,13 +808,16 @@ static struct line *get_next_free_line(struct demand_shard *demand_shard)
     list_del_init(&curline->entry);
     lm->free_line_cnt--;
     NVMEV_DEBUG("%s: free_line_cnt %d\n", __func__, lm->free_line_cnt);
+    __kick_gc(demand_shard);
     return curline;
 }
 
 static struct write_pointer *__get_wp(struct demand_shard *ftl, uint32_t io_type)
 {
     if (io_type == USER_IO) {
-        return &ftl->wp;
+        return &ftl->streams[0].wp;
+    } else if (io_type > GC_MAP_IO && io_type < GC_MAP_IO + NR_STREAMS) {
+        return &ftl->streams[io_type - GC_MAP_IO].wp;
     } else if (io_type == MAP_IO) {
         return &ftl->map_wp;
     } else if (io_type == GC_IO) {
@@ -627,6 +864,12 @@ struct ppa peek_next_page(struct demand_shard *demand_shard, struct ppa p)
         goto out;
 
     p.g.pg -= spp->pgs_per_oneshotpg;
+    check_addr(p.g.pl, spp->pls_per_lun);
+    p.g.pl++;
+    if (p.g.pl != spp->pls_per_lun)
+        goto out;
+
+    p.g.pl = 0;
     check_addr(p.g.ch, spp->nchs);
     p.g.ch++;
     if (p.g.ch != spp->nchs)
@@ -714,26 +957,26 @@ bool enough_space_in_line(struct demand_shard *shard, struct ppa p,
     }
 }
 
-spinlock_t map_spin;
 bool advance_write_pointer(struct demand_shard *demand_shard, uint32_t io_type)
 {
     struct ssdparams *spp = &demand_shard->ssd->sp;
     struct line_mgmt *lm = &demand_shard->lm;
     struct write_pointer *wpp = __get_wp(demand_shard, io_type);
+    struct gc_worker *w = demand_shard->gcw;
 
     NVMEV_DEBUG_VERBOSE("current wpp: ch:%d, lun:%d, pl:%d, blk:%d, pg:%d\n",
             wpp->ch, wpp->lun, wpp->pl, wpp->blk, wpp->pg);
 
     if(io_type == GC_IO) {
-        gc_pgs_this_gc++;
+        w->gc_pgs_this_gc++;
     } else if(io_type == GC_MAP_IO) {
-        map_gc_pgs_this_gc++;
+        w->map_gc_pgs_this_gc++;
     } else {
-        map_pgs_this_gc++;
+        w->map_pgs_this_gc++;
     }
 
     if(io_type == MAP_IO) {
-        spin_lock(&map_spin);
+        spin_lock(&demand_shard->map_spin);
     }
 
     struct ppa p;
@@ -749,6 +992,13 @@ bool advance_write_pointer(struct demand_shard *demand_shard, uint32_t io_type)
         goto out;
 
     wpp->pg -= spp->pgs_per_oneshotpg;
+    /* stripe across planes so they can be programmed together */
+    check_addr(wpp->pl, spp->pls_per_lun);
+    wpp->pl++;
+    if (wpp->pl != spp->pls_per_lun)
+        goto out;
+
+    wpp->pl = 0;
     check_addr(wpp->ch, spp->nchs);
     wpp->ch++;
     if (wpp->ch != spp->nchs)
@@ -773,7 +1023,8 @@ bool advance_write_pointer(struct demand_shard *demand_shard, uint32_t io_type)
             wpp->curline->vgc, 
             spp->pgs_per_line * GRAIN_PER_PAGE);
 
-    spin_lock(&lm_spin);
+    spin_lock(&demand_shard->lm_spin);
+    wpp->curline->age = lm->seal_seq++;
     /* move current line to {victim,full} line list */
     if (wpp->curline->igc == 0) {
         /* all pgs are still valid, move to full line list */
@@ -793,7 +1044,7 @@ bool advance_write_pointer(struct demand_shard *demand_shard, uint32_t io_type)
     /* current line is used up, pick another empty line */
     check_addr(wpp->blk, spp->blks_per_pl);
     wpp->curline = get_next_free_line(demand_shard);
-    spin_unlock(&lm_spin);
+    spin_unlock(&demand_shard->lm_spin);
 
     if(io_type == MAP_IO || io_type == GC_MAP_IO) {
         wpp->curline->map = true;
@@ -815,19 +1066,93 @@ bool advance_write_pointer(struct demand_shard *demand_shard, uint32_t io_type)
     NVMEV_ASSERT(wpp->pg == 0);
     NVMEV_ASSERT(wpp->lun == 0);
     NVMEV_ASSERT(wpp->ch == 0);
-    /* TODO: assume # of pl_per_lun is 1, fix later */
     NVMEV_ASSERT(wpp->pl == 0);
 out:
     if(io_type == MAP_IO) {
-        spin_unlock(&map_spin);
+        spin_unlock(&demand_shard->map_spin);
     }
 
     return true;
 }
 
+/*
+ * The OOB area of every grain. shard->oob holds the LPA of the pair
+ * starting at a grain, or one of the UINT_MAX - n markers, whose
+ * arguments go in the grains right after it. shard->oob_glen holds the
+ * pair's length in grains and only means something where a pair starts.
+ * Both are flat arrays indexed by grain.
+ */
+static inline uint32_t __oob(struct demand_shard *shard, uint64_t pgidx, uint32_t off)
+{
+    return shard->oob[PPA_TO_PGA(pgidx, off)];
+}
+
+static inline uint32_t __oob_glen(struct demand_shard *shard, uint64_t pgidx, uint32_t off)
+{
+    return shard->oob_glen[PPA_TO_PGA(pgidx, off)];
+}
+
+static inline void __oob_set(struct demand_shard *shard, uint64_t pgidx, uint32_t off,
+                             uint32_t val)
+{
+    shard->oob[PPA_TO_PGA(pgidx, off)] = val;
+}
+
+static inline void __oob_set_pair(struct demand_shard *shard, uint64_t pgidx, uint32_t off,
+                                  uint32_t lpa, uint32_t glen)
+{
+    NVMEV_ASSERT(glen <= U16_MAX);
+    shard->oob[PPA_TO_PGA(pgidx, off)] = lpa;
+    shard->oob_glen[PPA_TO_PGA(pgidx, off)] = glen;
+}
+
+/*
+ * The hash index of the pair at grain, whose OOB says lpa. A split moves
+ * pairs to another hash index without rewriting them, and the OOB keeps
+ * the one the pair was written with, so look up where it went. Invalid
+ * mapping records stay keyed by the OOB's hash index.
+ */
+static inline uint32_t __lh_hidx(struct demand_shard *shard, uint64_t grain, uint32_t lpa)
+{
+    void *e = xa_load(&shard->lh_moved, grain);
+    return e ? xa_to_value(e) : lpa;
+}
+
+/*
+ * The pairs of this flash page are gone, forget where splits moved them.
+ */
+static void __lh_forget(struct demand_shard *shard, struct ppa *ppa)
+{
+    struct ssdparams *spp = &shard->ssd->sp;
+    struct ppa p = *ppa;
+    unsigned long g;
+    uint64_t pgidx;
+    void *e;
+
+    if(xa_empty(&shard->lh_moved)) {
+        return;
+    }
+
+    for(int i = 0; i < spp->pgs_per_flashpg; i++, p.g.pg++) {
+        pgidx = ppa2pgidx(shard, &p);
+        xa_for_each_range(&shard->lh_moved, g, e, PPA_TO_PGA(pgidx, 0),
+                          PPA_TO_PGA(pgidx, GRAIN_PER_PAGE - 1)) {
+            xa_erase(&shard->lh_moved, g);
+        }
+    }
+}
+
+static inline void __oob_fill(struct demand_shard *shard, uint64_t pgidx, uint32_t from,
+                              uint32_t val)
+{
+    for(uint32_t i = from; i < GRAIN_PER_PAGE; i++) {
+        shard->oob[PPA_TO_PGA(pgidx, i)] = val;
+    }
+}
+
 void clear_rest_of_line(struct demand_shard *shard, struct ppa p,
         uint64_t g_off, uint32_t len, uint64_t *credits,
-        bool gc)
+        uint32_t io_type)
 {
     uint64_t pgidx;
     uint64_t grain;
@@ -851,9 +1176,7 @@ void clear_rest_of_line(struct demand_shard *shard, struct ppa p,
         mark_grain_valid(shard, grain, len);
         mark_grain_invalid(shard, grain, len);
 
-        for(int i = g_off; i < GRAIN_PER_PAGE; i++) {
-            shard->oob[pgidx][i] = UINT_MAX;
-        }
+        __oob_fill(shard, pgidx, g_off, UINT_MAX);
 
         if(credits) {
             (*credits) += len;
@@ -867,7 +1190,7 @@ void clear_rest_of_line(struct demand_shard *shard, struct ppa p,
         g_off = 0;
 
         if(p.g.lun == lun) {
-            advance_write_pointer(shard, gc ? GC_IO : USER_IO);
+            advance_write_pointer(shard, io_type);
             mark_page_valid(shard, &p);
         }
     }
@@ -887,31 +1210,9 @@ struct ppa get_new_page(struct demand_shard *shard, uint32_t io_type)
     ppa.g.blk = wp->blk;
     ppa.g.pl = wp->pl;
 
-    NVMEV_ASSERT(ppa.g.pl == 0);
     return ppa;
 }
 
-#ifndef ORIGINAL
-/*
- * Plus's in-memory per-superblock invalid mapping buffers.
- */
-char **inv_mapping_bufs;
-
-/*
- * The current offset for each invalid mapping buffer.
- */
-uint64_t *inv_mapping_offs;
-
-/*
- * Plus's per-page invalid count.
- */
-uint8_t *pg_inv_cnt;
-#endif
-
-#define IN_TXN 32
-atomic_t *multi_ht[IN_TXN];
-uint32_t multi_idx = 0;
-
 void demand_init(struct demand_shard *shard, uint64_t size, 
         struct ssd* ssd) 
 {
@@ -919,34 +1220,35 @@ void demand_init(struct demand_shard *shard, uint64_t size,
     uint64_t total = 0, from_cache = 0;
 
     for(int i = 0; i < IN_TXN; i++) {
-        multi_ht[i] = NULL;
+        shard->multi_ht[i] = NULL;
     }
+    shard->multi_idx = 0;
 
     memset(&shard->stats, 0x0, sizeof(shard->stats));
 
 #ifndef ORIGINAL
-    pg_inv_cnt = (uint8_t*) vmalloc_node(spp->tt_pgs * sizeof(uint8_t),
+    shard->pg_inv_cnt = (uint8_t*) vmalloc_node(spp->tt_pgs * sizeof(uint8_t),
             numa_node_id());
-    NVMEV_ASSERT(pg_inv_cnt);
-    memset(pg_inv_cnt, 0x0, spp->tt_pgs * sizeof(uint8_t));
+    NVMEV_ASSERT(shard->pg_inv_cnt);
+    memset(shard->pg_inv_cnt, 0x0, spp->tt_pgs * sizeof(uint8_t));
     total += spp->tt_pgs * sizeof(uint8_t);
 
-    inv_mapping_bufs = 
+    shard->inv_mapping_bufs = 
         (char**) kzalloc_node(spp->tt_lines * sizeof(char*), GFP_KERNEL, 
                 numa_node_id());
     total += spp->tt_lines * sizeof(char*);
 
-    inv_mapping_offs = 
+    shard->inv_mapping_offs = 
         (uint64_t*) kzalloc_node(spp->tt_lines * sizeof(uint64_t), GFP_KERNEL,
                 numa_node_id());
     total += spp->tt_lines * sizeof(uint64_t);
 
     for(int i = 0; i < spp->tt_lines; i++) {
-        inv_mapping_bufs[i] =
+        shard->inv_mapping_bufs[i] =
             (char*) vmalloc(INV_PAGE_SZ);
-        memset(inv_mapping_bufs[i], 0x0, INV_PAGE_SZ);
-        inv_mapping_offs[i] = 0;
-        NVMEV_ASSERT(inv_mapping_bufs[i]);
+        memset(shard->inv_mapping_bufs[i], 0x0, INV_PAGE_SZ);
+        shard->inv_mapping_offs[i] = 0;
+        NVMEV_ASSERT(shard->inv_mapping_bufs[i]);
         total += INV_PAGE_SZ;
     }
 #endif
@@ -955,66 +1257,72 @@ void demand_init(struct demand_shard *shard, uint64_t size,
      * OOB stores LPA to grain information.
      */
 
-    uint64_t req = spp->tt_pgs * sizeof(uint64_t*);
-    shard->oob = (uint64_t**)vmalloc_node(req, numa_node_id());
-    total += spp->tt_pgs * sizeof(uint64_t*);
+    uint64_t req = spp->tt_pgs * GRAIN_PER_PAGE * sizeof(uint32_t);
+    shard->oob = (uint32_t*) vmalloc_node(req, numa_node_id());
+    total += req;
 
-    req = spp->tt_pgs * GRAIN_PER_PAGE * sizeof(uint64_t);
-    shard->oob_mem = (uint64_t*) vmalloc_node(req, numa_node_id());
-    total += spp->tt_pgs * GRAIN_PER_PAGE * sizeof(uint64_t);
+    req = spp->tt_pgs * GRAIN_PER_PAGE * sizeof(uint16_t);
+    shard->oob_glen = (uint16_t*) vmalloc_node(req, numa_node_id());
+    total += req;
 
     NVMEV_ASSERT(shard->oob);
-    NVMEV_ASSERT(shard->oob_mem);
+    NVMEV_ASSERT(shard->oob_glen);
+    xa_init(&shard->lh_moved);
 
     for(int i = 0; i < spp->tt_pgs; i++) {
-        shard->oob[i] = shard->oob_mem + i * GRAIN_PER_PAGE;
         ////NVMEV_INFO("Trying OOB for page %d out of %lu\n", i, spp->tt_pgs);
-        for(int j = 0; j < GRAIN_PER_PAGE; j++) {
-            shard->oob[i][j] = 2;
-        }
+        __oob_fill(shard, i, 0, 2);
     }
 
 #ifdef ORIGINAL
     uint64_t tt_grains = spp->tt_pgs * GRAIN_PER_PAGE; 
-    shard->grain_bitmap = (bool*) vmalloc_node(tt_grains * sizeof(bool), numa_node_id());
-    memset(shard->grain_bitmap, 0x0, tt_grains * sizeof(bool));
-    total += tt_grains * sizeof(bool);
+    shard->grain_bitmap = (unsigned long*) 
+                          vmalloc_node(BITS_TO_LONGS(tt_grains) * sizeof(unsigned long), 
+                                       numa_node_id());
+    NVMEV_ASSERT(shard->grain_bitmap);
+    bitmap_zero(shard->grain_bitmap, tt_grains);
+    total += BITS_TO_LONGS(tt_grains) * sizeof(unsigned long);
 #endif
     shard->dram  = ((uint64_t) nvmev_vdev->config.cache_dram_mb) << 20;
 
-    from_cache = init_cache(&shard->cache, spp->tt_pgs, shard->dram);
+    from_cache = init_cache(&shard->cache, spp->tt_pgs, shard->dram,
+                            nvmev_vdev->config.cache_policy);
     total += from_cache;
 
-    /*
-     * Since fast mode is called from main.c with no knowledge of the
-     * underlying FTL structures, not sure if there's a better way to do
-     * this than setting a global here.
-     */
-
-    __fast_fill_shard = shard;
     shard->fastmode = false;
 
-    shard->offset = 0;
+    for(int i = 0; i < NR_STREAMS; i++) {
+        shard->streams[i].offset = 0;
+        shard->streams[i].wbuf_pending = 0;
+    }
+    memset(&shard->heat, 0x0, sizeof(shard->heat));
     shard->max_try = 0;
 
     atomic_set(&shard->candidates, 0);
     atomic_set(&shard->have_victims, 0);
+    shard->ev_wmark = shard->cache.max_cached_tentries -
+                      (shard->cache.max_cached_tentries >> 2);
 
+    memset(shard->append_lrus, 0x0, sizeof(shard->append_lrus));
     for(int i = 0; i < NUM_APPEND_BUFS; i++) {
-        append_keys[i] = kzalloc_node(MAX_KLEN, GFP_KERNEL, numa_node_id());
-        append_bufs[i] = kzalloc_node(WB_SIZE + sizeof(uint8_t) + MAX_KLEN + sizeof(uint32_t), 
+        shard->append_keys[i] = kzalloc_node(MAX_KLEN, GFP_KERNEL, numa_node_id());
+        shard->append_bufs[i] = kzalloc_node(WB_SIZE + sizeof(uint8_t) + MAX_KLEN + sizeof(uint32_t), 
                 GFP_KERNEL, numa_node_id());
-        wb_idxs[i] = 0;
-        inv_cnts[i] = 0;
-        append_klens[i] = 0;
+        shard->wb_idxs[i] = 0;
+        shard->inv_cnts[i] = 0;
+        shard->append_klens[i] = 0;
+        shard->append_hidx[i] = UINT_MAX;
+        atomic_set(&shard->buf_lock[i], 0);
     }
 
-    cur_append_klen = 0;
-    cur_append_buf = NULL;
+    shard->cur_append_key = NULL;
+    shard->cur_append_klen = 0;
+    shard->cur_append_buf = NULL;
+    shard->wb_idx = 0;
 
-    lru_cache_init(&buf_lru, 32);
+    lru_cache_init(&shard->buf_lru, 32);
 
-    total += WB_SIZE + sizeof(uint8_t) + MAX_KLEN + sizeof(uint32_t);
+    total += NUM_APPEND_BUFS * (WB_SIZE + sizeof(uint8_t) + MAX_KLEN + sizeof(uint32_t));
 
     NVMEV_INFO("Allocated %llu total bytes (%lluMB) in init. %lluMB from cache.\n",
             total, total >> 20, from_cache >> 20);
@@ -1025,20 +1333,26 @@ void demand_free(struct demand_shard *shard) {
 
     destroy_cache(&shard->cache);
 
+    for(int i = 0; i < NUM_APPEND_BUFS; i++) {
+        kfree(shard->append_keys[i]);
+        kfree(shard->append_bufs[i]);
+    }
+
 #ifndef ORIGINAL
-    vfree(pg_inv_cnt);
+    vfree(shard->pg_inv_cnt);
 
     for(int i = 0; i < spp->tt_lines; i++) {
-        vfree(inv_mapping_bufs[i]);
+        vfree(shard->inv_mapping_bufs[i]);
     }
 
-    kfree(inv_mapping_bufs);
-    kfree(inv_mapping_offs);
+    kfree(shard->inv_mapping_bufs);
+    kfree(shard->inv_mapping_offs);
 #else
     vfree(shard->grain_bitmap);
 #endif
 
-    vfree(shard->oob_mem);
+    xa_destroy(&shard->lh_moved);
+    vfree(shard->oob_glen);
     vfree(shard->oob);
 }
 
@@ -1053,11 +1367,29 @@ static void conv_init_ftl(uint64_t id, struct demand_shard *demand_shard,
     demand_shard->ssd = ssd;
     demand_shard->id = id;
 
+    spin_lock_init(&demand_shard->entry_spin);
+    spin_lock_init(&demand_shard->ev_spin);
+    spin_lock_init(&demand_shard->wfc_spin);
+    spin_lock_init(&demand_shard->v_spin);
+    spin_lock_init(&demand_shard->inv_spin);
+    spin_lock_init(&demand_shard->lm_spin);
+    spin_lock_init(&demand_shard->inv_m_spin);
+    spin_lock_init(&demand_shard->map_spin);
+
+    init_waitqueue_head(&demand_shard->gc_done_wq);
+    init_waitqueue_head(&demand_shard->ev_wq);
+    init_waitqueue_head(&demand_shard->ev_done_wq);
+
+    demand_shard->leftover_credits = 0;
+    memset(demand_shard->streams, 0x0, sizeof(demand_shard->streams));
+
     /* initialize all the lines */
     init_lines(demand_shard);
 
     /* initialize write pointer, this is how we allocate new pages for writes */
-    prepare_write_pointer(demand_shard, USER_IO);
+    for(int i = 0; i < NR_STREAMS; i++) {
+        prepare_write_pointer(demand_shard, STREAM_IO(i));
+    }
     prepare_write_pointer(demand_shard, MAP_IO);
     prepare_write_pointer(demand_shard, GC_MAP_IO);
     prepare_write_pointer(demand_shard, GC_IO);
@@ -1065,11 +1397,15 @@ static void conv_init_ftl(uint64_t id, struct demand_shard *demand_shard,
     init_write_flow_control(demand_shard);
 
     demand_init(demand_shard, ssd->sp.tt_pgs * ssd->sp.pgsz, ssd);
-    __g_shard = demand_shard;
 
-    demand_shard->proc_stats = proc_create("kvstat", 0444, nvmev_vdev->proc_root, &proc_file_fops);
-    demand_shard->proc_stats = proc_create("clearkvstat", 0444, nvmev_vdev->proc_root, &proc_file_fops);
-    demand_shard->proc_gc = proc_create("gc", 0444, nvmev_vdev->proc_root, &proc_file_fops);
+    /*
+     * The proc files report on the whole namespace, so only create them once.
+     */
+    if(id == 0) {
+        demand_shard->proc_stats = proc_create("kvstat", 0444, nvmev_vdev->proc_root, &proc_file_fops);
+        demand_shard->proc_stats = proc_create("clearkvstat", 0444, nvmev_vdev->proc_root, &proc_file_fops);
+        demand_shard->proc_gc = proc_create("gc", 0444, nvmev_vdev->proc_root, &proc_file_fops);
+    }
 
     /* for storing invalid mappings during GC */
     alloc_gc_mem(demand_shard);
@@ -1096,9 +1432,12 @@ static void conv_init_ftl(uint64_t id, struct demand_shard *demand_shard,
 static void conv_remove_ftl(struct demand_shard *demand_shard)
 {
     remove_lines(demand_shard);
-    remove_proc_entry("kvstat", nvmev_vdev->proc_root);
-    remove_proc_entry("clearkvstat", nvmev_vdev->proc_root);
-    remove_proc_entry("gc", nvmev_vdev->proc_root);
+
+    if(demand_shard->id == 0) {
+        remove_proc_entry("kvstat", nvmev_vdev->proc_root);
+        remove_proc_entry("clearkvstat", nvmev_vdev->proc_root);
+        remove_proc_entry("gc", nvmev_vdev->proc_root);
+    }
 }
 
 static void conv_init_params(struct convparams *cpp)
@@ -1121,39 +1460,80 @@ int bg_ev_t(void*);
 uint64_t dsize = 0;
 uint8_t* wb;
 uint64_t wb_offs;
-void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr,
-                         uint32_t cpu_nr_dispatcher)
+int conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr,
+                        uint32_t cpu_nr_dispatcher)
 {
     struct ssdparams spp;
     struct convparams cpp;
     struct demand_shard *demand_shards;
     struct ssd *ssd;
     uint32_t i;
+    int ret;
     const uint32_t nr_parts = SSD_PARTITIONS;
 
     ssd_init_params(&spp, size, nr_parts);
     conv_init_params(&cpp);
 
+    ret = pair_mem_init();
+    NVMEV_ASSERT(ret == 0);
+
     demand_shards = kmalloc_node(sizeof(struct demand_shard) * nr_parts, GFP_KERNEL, 
                                  numa_node_id());
+    if (!demand_shards)
+        goto err_shards;
+
+    /*
+     * More workers than shards would leave some of them idle, since a
+     * shard is only ever collected by one worker.
+     */
+    nr_gc_workers = clamp(nvmev_vdev->config.nr_gc_workers, 1U, nr_parts);
+    gc_workers = kcalloc(nr_gc_workers, sizeof(struct gc_worker*), GFP_KERNEL);
+    if (!gc_workers)
+        goto err_workers;
+
+    for (i = 0; i < nr_gc_workers; i++) {
+        struct gc_worker *w = vzalloc_node(sizeof(struct gc_worker), numa_node_id());
+
+        if (!w)
+            goto err_worker;
+
+        w->id = i;
+        w->next = i;
+        w->shards = demand_shards;
+        w->nr_parts = nr_parts;
+        init_waitqueue_head(&w->wq);
+        mutex_init(&w->lock);
+        hash_init(w->inv_m_hash);
+        hash_init(w->off_del_hash);
+        gc_workers[i] = w;
+    }
+
     for (i = 0; i < nr_parts; i++) {
         ssd = kmalloc_node(sizeof(struct ssd), GFP_KERNEL, numa_node_id());
         ssd_init(ssd, &spp, cpu_nr_dispatcher);
+        /* advance_write_pointer counts into gcw, so set it first */
+        demand_shards[i].gcw = gc_workers[i % nr_gc_workers];
         conv_init_ftl(i, &demand_shards[i], &cpp, ssd);
     }
 
-    //spin_lock_init(&inv_m_spin);
-    spin_lock_init(&lm_spin);
+    for (i = 0; i < nr_gc_workers; i++) {
+        gc_workers[i]->task = kthread_create(bg_gc_t, gc_workers[i], "bg_gc_%u", i);
+        kthread_bind(gc_workers[i]->task, nvmev_vdev->config.cpu_nr_gc_workers[i]);
+        wake_up_process(gc_workers[i]->task);
+    }
 
-    demand_shards[0].bg_gc_t = kthread_create(bg_gc_t, &demand_shards[0], "bg_gc");
-    if (nvmev_vdev->config.cpu_nr_bg_gc != -1)
-        kthread_bind(demand_shards[0].bg_gc_t, nvmev_vdev->config.cpu_nr_bg_gc);
-    wake_up_process(demand_shards[0].bg_gc_t);
+    NVMEV_INFO("%u GC workers for %u shards\n", nr_gc_workers, nr_parts);
 
-    demand_shards[0].bg_ev_t = kthread_create(bg_ev_t, &demand_shards[0], "bg_ev");
-    if (nvmev_vdev->config.cpu_nr_ev_t != -1)
-        kthread_bind(demand_shards[0].bg_ev_t, nvmev_vdev->config.cpu_nr_ev_t);
-    wake_up_process(demand_shards[0].bg_ev_t);
+    /*
+     * Each shard has its own lines and cache, so each gets its own
+     * background eviction thread.
+     */
+    for (i = 0; i < nr_parts; i++) {
+        demand_shards[i].bg_ev_t = kthread_create(bg_ev_t, &demand_shards[i], "bg_ev_%u", i);
+        if (nvmev_vdev->config.cpu_nr_ev_t != -1)
+            kthread_bind(demand_shards[i].bg_ev_t, nvmev_vdev->config.cpu_nr_ev_t);
+        wake_up_process(demand_shards[i].bg_ev_t);
+    }
     
     nvmev_vdev->space_used = 0;
 
@@ -1167,8 +1547,15 @@ void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *
         demand_shards[i].ssd->write_buffer = demand_shards[0].ssd->write_buffer;
     }
 
-    vb.head = 0;
-    vb.tail = 0;
+    /*
+     * Every stream can hold back up to one program unit it hasn't filled
+     * yet. A store waiting for buffer space needs at least one more page
+     * on top of that, or it would wait forever.
+     */
+    NVMEV_ASSERT(demand_shards[0].ssd->write_buffer->size >=
+                 (uint64_t) nr_parts * NR_STREAMS * 
+                 demand_shards[0].ssd->sp.pgs_per_prog * demand_shards[0].ssd->sp.pgsz +
+                 demand_shards[0].ssd->sp.pgsz);
 
     ns->id = id;
     ns->csi = NVME_CSI_NVM;
@@ -1179,6 +1566,7 @@ void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *
     /*register io command handler*/
     ns->proc_io_cmd = kv_proc_nvme_io_cmd;
     ns->identify_io_cmd = kv_identify_nvme_io_cmd;
+    ns->io_cmd_part = kv_io_cmd_part;
 
     wb = ns->mapped + size;
     wb_offs = 0;
@@ -1187,7 +1575,23 @@ void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *
                 size, ns->size, cpp.pba_pcent);
     NVMEV_INFO("Pages per line %lu\n", spp.pgs_per_line);
 
-    return;
+    return 0;
+
+err_worker:
+    /* gc_workers came from kcalloc, so the ones not allocated are NULL */
+    for (i = 0; i < nr_gc_workers; i++) {
+        vfree(gc_workers[i]);
+    }
+    kfree(gc_workers);
+    gc_workers = NULL;
+err_workers:
+    nr_gc_workers = 0;
+    kfree(demand_shards);
+err_shards:
+    pair_mem_exit();
+    ns->ftls = NULL;
+    NVMEV_ERROR("Failed to allocate the FTL for namespace %u\n", id);
+    return -ENOMEM;
 }
 
 void conv_remove_namespace(struct nvmev_ns *ns)
@@ -1208,18 +1612,24 @@ void conv_remove_namespace(struct nvmev_ns *ns)
 
     NVMEV_INFO("Removing namespace.\n");
 
-    if (!IS_ERR_OR_NULL(demand_shards[0].bg_gc_t)) {
-        kthread_stop(demand_shards[0].bg_gc_t);
-        demand_shards[0].bg_gc_t = NULL;
+    for (i = 0; i < nr_gc_workers; i++) {
+        if (!IS_ERR_OR_NULL(gc_workers[i]->task)) {
+            kthread_stop(gc_workers[i]->task);
+            gc_workers[i]->task = NULL;
+        }
     }
 
-    if (!IS_ERR_OR_NULL(demand_shards[0].bg_ev_t)) {
-        kthread_stop(demand_shards[0].bg_ev_t);
-        demand_shards[0].bg_ev_t = NULL;
+    for (i = 0; i < nr_parts; i++) {
+        if (!IS_ERR_OR_NULL(demand_shards[i].bg_ev_t)) {
+            kthread_stop(demand_shards[i].bg_ev_t);
+            demand_shards[i].bg_ev_t = NULL;
+        }
     }
 
-    free_gc_mem(&demand_shards[0]);
-    demand_free(&demand_shards[0]);
+    for (i = 0; i < nr_parts; i++) {
+        free_gc_mem(&demand_shards[i]);
+        demand_free(&demand_shards[i]);
+    }
 
     for (i = 0; i < nr_parts; i++) {
         conv_remove_ftl(&demand_shards[i]);
@@ -1227,8 +1637,16 @@ void conv_remove_namespace(struct nvmev_ns *ns)
         kfree(demand_shards[i].ssd);
     }
 
+    for (i = 0; i < nr_gc_workers; i++) {
+        vfree(gc_workers[i]);
+    }
+    kfree(gc_workers);
+    gc_workers = NULL;
+
     kfree(demand_shards);
     ns->ftls = NULL;
+
+    pair_mem_exit();
 }
 
 static inline bool valid_ppa(struct demand_shard *demand_shard, struct ppa *ppa)
@@ -1284,7 +1702,7 @@ void mark_page_invalid(struct demand_shard *demand_shard, struct ppa *ppa)
     pg->status = PG_INVALID;
 
 #ifndef ORIGINAL
-    NVMEV_ASSERT(pg_inv_cnt[ppa2pgidx(demand_shard, ppa)] == GRAIN_PER_PAGE);
+    NVMEV_ASSERT(demand_shard->pg_inv_cnt[ppa2pgidx(demand_shard, ppa)] == GRAIN_PER_PAGE);
 #endif
 }
 
@@ -1295,8 +1713,8 @@ static struct ppa ppa_to_struct(const struct ssdparams *spp, uint64_t ppa_)
     ppa.ppa = 0;
     ppa.g.ch = (ppa_ / spp->pgs_per_ch) % spp->pgs_per_ch;
     ppa.g.lun = (ppa_ % spp->pgs_per_ch) / spp->pgs_per_lun;
-    ppa.g.pl = 0 ; //ppa_ % spp->tt_pls; // (ppa_ / spp->pgs_per_pl) % spp->pls_per_lun;
-    ppa.g.blk = (ppa_ % spp->pgs_per_lun) / spp->pgs_per_blk;
+    ppa.g.pl = (ppa_ % spp->pgs_per_lun) / spp->pgs_per_pl;
+    ppa.g.blk = (ppa_ % spp->pgs_per_pl) / spp->pgs_per_blk;
     ppa.g.pg = ppa_ % spp->pgs_per_blk;
 
     //NVMEV_INFO("%s: For PPA %u we got ch:%d, lun:%d, pl:%d, blk:%d, pg:%d\n", 
@@ -1316,6 +1734,34 @@ static int __grain2lineid(struct demand_shard *shard, uint64_t grain) {
     return get_line(shard, &p)->id;
 }
 
+#ifdef ORIGINAL
+/*
+ * grain_bitmap has one bit per grain, set on the first grain of every
+ * live pair. Bits are set and cleared atomically, as GC and store can
+ * touch grains of neighbouring pages that share a word. Scans go a word
+ * at a time through the kernel's find_*_bit helpers.
+ */
+static inline bool __grain_valid(struct demand_shard *shard, uint64_t grain)
+{
+    return test_bit(grain, shard->grain_bitmap);
+}
+
+/*
+ * The first valid grain in [grain, end), or end if there isn't one.
+ */
+static inline uint64_t __next_valid_grain(struct demand_shard *shard,
+                                          uint64_t grain, uint64_t end)
+{
+    return find_next_bit(shard->grain_bitmap, end, grain);
+}
+
+static inline bool __grains_any_valid(struct demand_shard *shard,
+                                      uint64_t grain, uint32_t len)
+{
+    return __next_valid_grain(shard, grain, grain + len) < grain + len;
+}
+#endif
+
 /*
  * Only to be called after mark_page_valid.
  */
@@ -1325,7 +1771,7 @@ void mark_grain_valid(struct demand_shard *shard, uint64_t grain, uint32_t len)
     struct nand_page *pg = NULL;
     struct line *line;
 
-    spin_lock(&v_spin);
+    spin_lock(&shard->v_spin);
 
     uint64_t page = G_IDX(grain);
     NVMEV_DEBUG("Marking grain %llu valid length %u in PPA %llu\n", 
@@ -1353,7 +1799,7 @@ void mark_grain_valid(struct demand_shard *shard, uint64_t grain, uint32_t len)
     NVMEV_ASSERT(blk->vgc >= 0 && blk->vgc <= spp->pgs_per_blk * GRAIN_PER_PAGE);
     blk->vgc += len;
 
-    spin_lock(&lm_spin);
+    spin_lock(&shard->lm_spin);
     /* update corresponding line status */
     line = get_line(shard, &ppa);
     //NVMEV_ASSERT(line->vpc > 0 && line->vpc <= spp->pgs_per_line);
@@ -1364,7 +1810,7 @@ void mark_grain_valid(struct demand_shard *shard, uint64_t grain, uint32_t len)
     
     NVMEV_ASSERT(line->vgc >= 0 && line->vgc <= spp->pgs_per_line * GRAIN_PER_PAGE);
     line->vgc += len;
-    spin_unlock(&lm_spin);
+    spin_unlock(&shard->lm_spin);
 
     //NVMEV_ERROR("Marking grain %llu length %u in PPA %llu line %d valid shard %llu vgc %u\n", 
     //            grain, len, page, line->id, shard->id, line->vgc);
@@ -1381,15 +1827,15 @@ void mark_grain_valid(struct demand_shard *shard, uint64_t grain, uint32_t len)
     //NVMEV_INFO("Marking grain %llu valid shard %llu (%p)\n", 
     //        grain, shard->id, shard->grain_bitmap);
     
-    if(shard->grain_bitmap[grain] == 1) {
+    if(__grain_valid(shard, grain)) {
         NVMEV_INFO("!!!! grain %llu page %llu len %u\n", grain, G_IDX(grain), len);
     }
 
-    NVMEV_ASSERT(shard->grain_bitmap[grain] != 1);
-    shard->grain_bitmap[grain] = 1;
+    NVMEV_ASSERT(!__grain_valid(shard, grain));
+    set_bit(grain, shard->grain_bitmap);
 #endif
 
-    spin_unlock(&v_spin);
+    spin_unlock(&shard->v_spin);
 }
 
 #ifdef ORIGINAL
@@ -1397,12 +1843,10 @@ bool page_grains_invalid(struct demand_shard *shard, uint64_t ppa) {
     uint64_t page = ppa;
     uint64_t offset = page * GRAIN_PER_PAGE;
 
-    for(int i = 0; i < GRAIN_PER_PAGE; i++) {
-        if(shard->grain_bitmap[offset + i] == 1) {
-            NVMEV_DEBUG("Grain %llu PPA %llu was valid\n",
-                         offset + i, page);
-            return false;
-        }
+    if(__grains_any_valid(shard, offset, GRAIN_PER_PAGE)) {
+        NVMEV_DEBUG("Grain %llu PPA %llu was valid\n",
+                     __next_valid_grain(shard, offset, offset + GRAIN_PER_PAGE), page);
+        return false;
     }
 
     NVMEV_DEBUG("All grains invalid PPA %llu (%llu)\n", page, offset);
@@ -1428,7 +1872,7 @@ void mark_grain_invalid(struct demand_shard *shard, uint64_t grain, uint32_t len
     }
 
 again:
-    spin_lock(&inv_spin);
+    spin_lock(&shard->inv_spin);
     len = min_t(uint32_t, rem, GRAIN_PER_PAGE - (grain % GRAIN_PER_PAGE));
     NVMEV_DEBUG("Marking grain %llu length %u in PPA %llu invalid shard %llu\n", 
                  grain, len, page, shard->id);
@@ -1439,7 +1883,7 @@ again:
     pg = get_pg(shard->ssd, &ppa);
 
     if(pg->status != PG_VALID) {
-        //spin_unlock(&inv_spin);
+        //spin_unlock(&shard->inv_spin);
         //return;
         NVMEV_ERROR("PPA %u %lld! Grain %llu len %u\n", pg->status, page, grain, len);
         NVMEV_INFO("Caller is %pS\n", __builtin_return_address(0));
@@ -1456,7 +1900,7 @@ again:
     
     if(blk->igc < 0 || blk->igc >= spp->pgs_per_blk * GRAIN_PER_PAGE) {
         NVMEV_DEBUG("IGC PPA %u was %d\n", ppa2pgidx(shard, &ppa), blk->igc);
-        //spin_unlock(&inv_spin);
+        //spin_unlock(&shard->inv_spin);
         //return;
     }
 
@@ -1475,7 +1919,7 @@ again:
     //             grain, len, ppa2pgidx(shard, &ppa), line->id, shard->id);
 
     //if(line->igc > spp->pgs_per_line * GRAIN_PER_PAGE) {
-    //    spin_unlock(&inv_spin);
+    //    spin_unlock(&shard->inv_spin);
     //    return;
     //}
 
@@ -1488,7 +1932,7 @@ again:
     NVMEV_ASSERT(line->igc < spp->pgs_per_line * GRAIN_PER_PAGE);
     line->igc += len;
 
-    spin_lock(&lm_spin);
+    spin_lock(&shard->lm_spin);
     /* Adjust the position of the victime line in the pq under over-writes */
     if (line->pos) {
         /* Note that line->vgc will be updated by this call */
@@ -1509,12 +1953,12 @@ again:
     //NVMEV_ASSERT(line->vpc > 0 && line->vpc <= spp->pgs_per_line);
     if(line->vgc < 0 || line->vgc > spp->pgs_per_line * GRAIN_PER_PAGE) {
         NVMEV_INFO("Line %d's VGC was %u\n", line->id, line->vgc);
-        //spin_unlock(&lm_spin);
-        //spin_unlock(&inv_spin);
+        //spin_unlock(&shard->lm_spin);
+        //spin_unlock(&shard->inv_spin);
         //return;
     }
     NVMEV_ASSERT(line->vgc >= 0 && line->vgc <= spp->pgs_per_line * GRAIN_PER_PAGE);
-    spin_unlock(&lm_spin);
+    spin_unlock(&shard->lm_spin);
 
     //if(grain_bitmap[grain] == 0) {
     //    NVMEV_INFO("Caller is %pS\n", __builtin_return_address(0));
@@ -1523,27 +1967,27 @@ again:
     //}
 
 #ifdef ORIGINAL
-    NVMEV_ASSERT(shard->grain_bitmap[grain] != 0);
-    shard->grain_bitmap[grain] = 0;
+    NVMEV_ASSERT(__grain_valid(shard, grain));
+    clear_bit(grain, shard->grain_bitmap);
 #else
-    if(pg_inv_cnt[page] + len > GRAIN_PER_PAGE) {
+    if(shard->pg_inv_cnt[page] + len > GRAIN_PER_PAGE) {
         NVMEV_INFO("inv_cnt was %u PPA %llu (tried to add %u)\n", 
-                    pg_inv_cnt[page], page, len * GRAINED_UNIT);
+                    shard->pg_inv_cnt[page], page, len * GRAINED_UNIT);
         NVMEV_INFO("Caller is %pS\n", __builtin_return_address(0));
         NVMEV_INFO("Caller is %pS\n", __builtin_return_address(1));
         NVMEV_INFO("Caller is %pS\n", __builtin_return_address(2));
         BUG_ON(true);
     }
 
-    NVMEV_ASSERT(pg_inv_cnt[page] + len <= GRAIN_PER_PAGE);
-    pg_inv_cnt[page] += len;
+    NVMEV_ASSERT(shard->pg_inv_cnt[page] + len <= GRAIN_PER_PAGE);
+    shard->pg_inv_cnt[page] += len;
 
-    if(pg_inv_cnt[page] == GRAIN_PER_PAGE) {
+    if(shard->pg_inv_cnt[page] == GRAIN_PER_PAGE) {
         mark_page_invalid(shard, &ppa);
     }
 #endif
 
-    spin_unlock(&inv_spin);
+    spin_unlock(&shard->inv_spin);
 
     rem -= len;
     if(rem) {
@@ -1584,17 +2028,17 @@ uint64_t __maybe_advance(struct demand_shard *shard, struct ppa *ppa, int type,
             .type = type,
             .cmd = NAND_WRITE,
             .interleave_pci_dma = false,
-            .xfer_size = spp->pgsz * spp->pgs_per_oneshotpg,
+            .xfer_size = spp->pgsz * spp->pgs_per_prog,
         };
 
         swr.stime = stime;
         swr.ppa = ppa;
 
         nsecs = ssd_advance_nand(shard->ssd, &swr);
-        shard->stats.inv_m_w += spp->pgsz * spp->pgs_per_oneshotpg;
+        shard->stats.inv_m_w += spp->pgsz * spp->pgs_per_prog;
 
         //schedule_internal_operation(req->sq_id, nsecs_completed, wbuf,
-        //        spp->pgs_per_oneshotpg * spp->pgsz);
+        //        spp->pgs_per_prog * spp->pgsz);
     }
 
     return nsecs;
@@ -1605,6 +2049,8 @@ uint64_t __maybe_advance(struct demand_shard *shard, struct ppa *ppa, int type,
 /*
  * This is where Plus records invalid hash index to grain mappings
  * in invalid mappings buffers. It is called on each overwrite of a pair.
+ * lpa is the hash index in the grain's OOB, which is what GC looks them
+ * up by, even if a split has since moved the pair (see __lh_hidx).
  */
 static uint64_t __record_inv_mapping(struct demand_shard *shard, lpa_t lpa, 
                                      ppa_t ppa, uint32_t off, uint32_t len, 
@@ -1616,7 +2062,6 @@ static uint64_t __record_inv_mapping(struct demand_shard *shard, lpa_t lpa,
     struct line* l = get_line(shard, &p); 
     uint64_t line = (uint64_t) l->id;
     uint64_t nsecs_completed = 0;
-    uint64_t **oob = shard->oob;
     uint32_t extra = 0;
 
     if(off != UINT_MAX) {
@@ -1628,15 +2073,15 @@ static uint64_t __record_inv_mapping(struct demand_shard *shard, lpa_t lpa,
         extra += sizeof(uint64_t);
         NVMEV_DEBUG("Got an offset delete mapping LPA %u PPA %u offset %u " 
                     "mapping line %llu (%llu)\n", 
-                     lpa, ppa, off, line, inv_mapping_offs[line]);
+                     lpa, ppa, off, line, shard->inv_mapping_offs[line]);
     } else {
         NVMEV_DEBUG("Got an invalid LPA %u PPA %u mapping line %llu (%llu)\n", 
-                     lpa, ppa, line, inv_mapping_offs[line]);
+                     lpa, ppa, line, shard->inv_mapping_offs[line]);
     }
 
-    spin_lock(&inv_m_spin);
+    spin_lock(&shard->inv_m_spin);
 
-    if((inv_mapping_offs[line] + sizeof(lpa) + sizeof(ppa) + extra) > INV_PAGE_SZ) {
+    if((shard->inv_mapping_offs[line] + sizeof(lpa) + sizeof(ppa) + extra) > INV_PAGE_SZ) {
         /*
          * This buffer is full, flush it to an invalid mapping page.
          * Anything bigger complicates implementation. Keep to pgsz for now.
@@ -1644,14 +2089,14 @@ static uint64_t __record_inv_mapping(struct demand_shard *shard, lpa_t lpa,
         NVMEV_ASSERT(INV_PAGE_SZ == spp->pgsz);
 
 skip:
-        spin_lock(&ev_spin);
+        spin_lock(&shard->ev_spin);
         struct ppa n_p = get_new_page(shard, MAP_IO);
         uint64_t pgidx = ppa2pgidx(shard, &n_p);
 
-        NVMEV_ASSERT(pg_inv_cnt[pgidx] == 0);
+        NVMEV_ASSERT(shard->pg_inv_cnt[pgidx] == 0);
         advance_write_pointer(shard, MAP_IO);
         mark_page_valid(shard, &n_p);
-        spin_unlock(&ev_spin);
+        spin_unlock(&shard->ev_spin);
         mark_grain_valid(shard, PPA_TO_PGA(ppa2pgidx(shard, &n_p), 0), GRAIN_PER_PAGE);
 
         if(pgidx == 0) {
@@ -1662,22 +2107,20 @@ skip:
         /*
          * GC will see UINT_MAX at grain 0 and know it's an invalid mapping page.
          */
-        oob[pgidx][0] = UINT_MAX - 5;
+        __oob_set(shard, pgidx, 0, UINT_MAX - 5);
         /*
          * The superblock this invalid mapping page is targeting.
          */
-        oob[pgidx][1] = line;
-        oob[pgidx][2] = pgidx;
+        __oob_set(shard, pgidx, 1, line);
+        __oob_set(shard, pgidx, 2, pgidx);
 
-        for(int i = 3; i < GRAIN_PER_PAGE; i++) {
-            oob[pgidx][i] = UINT_MAX;
-        }
+        __oob_fill(shard, pgidx, 3, UINT_MAX);
 
         uint64_t shard_off = shard->id * spp->tt_pgs * spp->pgsz;
         void *ptr = kzalloc_node(spp->pgsz, GFP_KERNEL, numa_node_id());
         NVMEV_ASSERT(ptr);
 
-        memcpy(ptr, inv_mapping_bufs[line], spp->pgsz);
+        memcpy(ptr, shard->inv_mapping_bufs[line], spp->pgsz);
         nsecs_completed = __maybe_advance(shard, &n_p, MAP_IO, 0);
 
         /*
@@ -1707,8 +2150,8 @@ skip:
 
         //NVMEV_ASSERT(found);
 
-        memset(inv_mapping_bufs[line], 0x0, INV_PAGE_SZ);
-        inv_mapping_offs[line] = 0;
+        memset(shard->inv_mapping_bufs[line], 0x0, INV_PAGE_SZ);
+        shard->inv_mapping_offs[line] = 0;
 
         if(credits) {
             /*
@@ -1720,36 +2163,35 @@ skip:
         }
     }
 
-    memcpy(inv_mapping_bufs[line] + inv_mapping_offs[line], &lpa, sizeof(lpa));
-    inv_mapping_offs[line] += sizeof(lpa);
-    memcpy(inv_mapping_bufs[line] + inv_mapping_offs[line], &ppa, sizeof(ppa));
-    inv_mapping_offs[line] += sizeof(ppa);
+    memcpy(shard->inv_mapping_bufs[line] + shard->inv_mapping_offs[line], &lpa, sizeof(lpa));
+    shard->inv_mapping_offs[line] += sizeof(lpa);
+    memcpy(shard->inv_mapping_bufs[line] + shard->inv_mapping_offs[line], &ppa, sizeof(ppa));
+    shard->inv_mapping_offs[line] += sizeof(ppa);
 
     if(off != UINT_MAX) {
         uint64_t marker = (((uint64_t) off) << 32) | len;
         marker = marker | (1ULL << 63);
-        memcpy(inv_mapping_bufs[line] + inv_mapping_offs[line], &marker, sizeof(marker));
+        memcpy(shard->inv_mapping_bufs[line] + shard->inv_mapping_offs[line], &marker, sizeof(marker));
         NVMEV_DEBUG("Copied marker %llu to pos %llu\n", 
-                     marker, inv_mapping_offs[line]);
-        inv_mapping_offs[line] += sizeof(marker);
+                     marker, shard->inv_mapping_offs[line]);
+        shard->inv_mapping_offs[line] += sizeof(marker);
     }
 
-    spin_unlock(&inv_m_spin);
+    spin_unlock(&shard->inv_m_spin);
 
     return nsecs_completed;
 }
 #endif
 
+void clear_oob(struct demand_shard *shard, uint64_t pgidx) {
+    __oob_fill(shard, pgidx, 0, 2);
+}
+
 void clear_oob_block(struct demand_shard *shard, uint64_t start_pgidx) {
     struct ssdparams *spp = &shard->ssd->sp;
-    uint64_t *start_address = shard->oob[start_pgidx];
-    size_t total_size = sizeof(uint64_t) * GRAIN_PER_PAGE * spp->pgs_per_blk;
-    memset(start_address, 2, total_size);
-}
 
-void clear_oob(struct demand_shard *shard, uint64_t pgidx) {
-    for(int i = 0; i < GRAIN_PER_PAGE; i++) {
-        shard->oob[pgidx][i] = 2;
+    for(int i = 0; i < spp->pgs_per_blk; i++) {
+        clear_oob(shard, start_pgidx + i);
     }
 }
 
@@ -1775,16 +2217,17 @@ static void mark_block_free(struct demand_shard *shard, struct ppa *ppa)
         pg->status = PG_FREE;
 
 #ifndef ORIGINAL
-        //if(pg_inv_cnt[ppa2pgidx(shard, &ppa_copy) + i] == 0) {
+        //if(shard->pg_inv_cnt[ppa2pgidx(shard, &ppa_copy) + i] == 0) {
         //    NVMEV_INFO("FAIL PPA %u\n", ppa2pgidx(shard, &ppa_copy) + i);
         //}
-        //NVMEV_ASSERT(pg_inv_cnt[ppa2pgidx(shard, &ppa_copy) + i] > 0);
-        pg_inv_cnt[ppa2pgidx(shard, &ppa_copy) + i] = 0;
+        //NVMEV_ASSERT(shard->pg_inv_cnt[ppa2pgidx(shard, &ppa_copy) + i] > 0);
+        shard->pg_inv_cnt[ppa2pgidx(shard, &ppa_copy) + i] = 0;
 #else
         uint64_t pg = ppa2pgidx(shard, &ppa_copy) + i;
-        for(int i = 0; i < GRAIN_PER_PAGE; i++) {
-            uint64_t grain = (pg * GRAIN_PER_PAGE) + i;
-            shard->grain_bitmap[grain] = 0;
+        uint64_t grain = pg * GRAIN_PER_PAGE;
+
+        for_each_set_bit_from(grain, shard->grain_bitmap, (pg + 1) * GRAIN_PER_PAGE) {
+            clear_bit(grain, shard->grain_bitmap);
         }
 #endif
         clear_oob(shard, ppa2pgidx(shard, &ppa_copy) + i);
@@ -1799,54 +2242,170 @@ static void mark_block_free(struct demand_shard *shard, struct ppa *ppa)
     blk->erase_cnt++;
 }
 
-static struct line *select_victim_line(struct demand_shard *demand_shard, bool bg)
+static const char *gc_policy_names[NR_GC_POLICIES] = {
+    [GC_GREEDY] = "greedy",
+    [GC_COST_BENEFIT] = "cb",
+    [GC_WINDOWED] = "window",
+};
+
+int gc_policy_parse(const char *name)
 {
-    struct ssdparams *spp = &demand_shard->ssd->sp;
-    struct line_mgmt *lm = &demand_shard->lm;
-    struct line *victim_line = NULL, *dummy = NULL;
+    for(int i = 0; i < NR_GC_POLICIES; i++) {
+        if(sysfs_streq(name, gc_policy_names[i])) {
+            return i;
+        }
+    }
 
-    spin_lock(&lm_spin);
+    return -1;
+}
 
-again:
-    victim_line = pqueue_peek(lm->victim_line_pq);
+const char *gc_policy_name(unsigned int policy)
+{
+    return policy < NR_GC_POLICIES ? gc_policy_names[policy] : "unknown";
+}
 
-    if (!victim_line) {
-        if(dummy) {
-            NVMEV_DEBUG("Whoops! Had a dummy here.\n");
-            pqueue_insert(lm->victim_line_pq, dummy);
+/*
+ * Whether a user stream may still be filling line id. See
+ * select_victim_line.
+ */
+static bool __line_in_use(struct demand_shard *shard, int id)
+{
+    for(int s = 0; s < NR_STREAMS; s++) {
+        if(__grain2lineid(shard, shard->streams[s].offset / GRAINED_UNIT) == id) {
+            return true;
         }
-
-        spin_unlock(&lm_spin);
-        return NULL;
     }
 
-    if(victim_line->id == 
-       __grain2lineid(demand_shard, demand_shard->offset / GRAINED_UNIT)) {
-        /*
-         * In a rare case, the victim line chosen here can actually
-         * be the same line as the current line that stores will
-         * be directed to.
-         *
-         * This happens when we call get_new_page, then
-         * advance_write_pointer in store, and then GC starts.
-         * advance_write_pointer placed the line on the victim line
-         * PQ if it was called on the last page in the line. Depending
-         * on its priority, GC can select it as the victim.
-         *
-         * We don't want GC and stores to happen on the same line,
-         * because we generally assume a lot of the structures like the
-         * grain bitmap and OOB don't receive modifications to the same
-         * entries at the same time.
-         *
-         * Just pop the line, get another line, then place it back on the
-         * queue.
-         */
-        dummy = victim_line;
-        pqueue_pop(lm->victim_line_pq); 
+    return false;
+}
+
+/*
+ * Pick a victim for the age-aware policies by walking every line on
+ * victim_line_pq. Called with lm_spin held.
+ */
+static struct line *__scan_victim_line(struct demand_shard *shard)
+{
+    struct line_mgmt *lm = &shard->lm;
+    pqueue_t *q = lm->victim_line_pq;
+    uint64_t total = shard->ssd->sp.pgs_per_line * GRAIN_PER_PAGE;
+    struct line *best = NULL, *window[GC_WINDOW];
+    uint64_t score, best_score = 0;
+    int nr_window = 0, youngest = 0;
+
+    for(size_t i = 1; i < q->size; i++) {
+        struct line *line = q->d[i];
+
+        if(__line_in_use(shard, line->id)) {
+            continue;
+        }
+
+        if(lm->policy == GC_COST_BENEFIT) {
+            /*
+             * benefit / cost = (1 - u) * age / (1 + u), u being the
+             * valid fraction of the line. A cold line that's half valid
+             * can beat a hot line that's mostly invalid, because the
+             * hot line's remaining data is likely to die on its own.
+             */
+            score = (((total - line->vgc) << 16) / (total + line->vgc)) *
+                    (lm->seal_seq - line->age + 1);
+            if(!best || score > best_score) {
+                best = line;
+                best_score = score;
+            }
+            continue;
+        }
+
+        /*
+         * GC_WINDOWED. Keep the GC_WINDOW oldest lines seen so far,
+         * replacing the youngest one when an older line turns up.
+         */
+        if(nr_window < GC_WINDOW) {
+            window[nr_window++] = line;
+        } else if(line->age < window[youngest]->age) {
+            window[youngest] = line;
+        } else {
+            continue;
+        }
+
+        for(int j = 0; j < nr_window; j++) {
+            if(window[j]->age > window[youngest]->age) {
+                youngest = j;
+            }
+        }
+    }
+
+    if(lm->policy == GC_WINDOWED) {
+        for(int j = 0; j < nr_window; j++) {
+            if(!best || window[j]->vgc < best->vgc) {
+                best = window[j];
+            }
+        }
+    }
+
+    return best;
+}
+
+static struct line *select_victim_line(struct demand_shard *demand_shard, bool bg)
+{
+    struct ssdparams *spp = &demand_shard->ssd->sp;
+    struct line_mgmt *lm = &demand_shard->lm;
+    struct line *victim_line = NULL, *dummy[NR_STREAMS];
+    int nr_dummy = 0;
+
+    spin_lock(&demand_shard->lm_spin);
+
+    if(lm->policy != GC_GREEDY) {
+        victim_line = __scan_victim_line(demand_shard);
+        if(!victim_line) {
+            spin_unlock(&demand_shard->lm_spin);
+            return NULL;
+        }
+
+        pqueue_remove(lm->victim_line_pq, victim_line);
+        goto out;
+    }
+
+again:
+    victim_line = pqueue_peek(lm->victim_line_pq);
+
+    if (!victim_line) {
+        for(int i = 0; i < nr_dummy; i++) {
+            NVMEV_DEBUG("Whoops! Had a dummy here.\n");
+            pqueue_insert(lm->victim_line_pq, dummy[i]);
+        }
+
+        spin_unlock(&demand_shard->lm_spin);
+        return NULL;
+    }
+
+    if(__line_in_use(demand_shard, victim_line->id)) {
+        /*
+         * In a rare case, the victim line chosen here can actually
+         * be the same line as the current line that stores to one of
+         * the streams will be directed to.
+         *
+         * This happens when we call get_new_page, then
+         * advance_write_pointer in store, and then GC starts.
+         * advance_write_pointer placed the line on the victim line
+         * PQ if it was called on the last page in the line. Depending
+         * on its priority, GC can select it as the victim.
+         *
+         * We don't want GC and stores to happen on the same line,
+         * because we generally assume a lot of the structures like the
+         * grain bitmap and OOB don't receive modifications to the same
+         * entries at the same time.
+         *
+         * Just pop the line, get another line, then place it back on the
+         * queue. At most one line per stream can be in this state.
+         */
+        NVMEV_ASSERT(nr_dummy < NR_STREAMS);
+        dummy[nr_dummy++] = victim_line;
+        pqueue_pop(lm->victim_line_pq); 
         goto again;
     }    
 
     pqueue_pop(lm->victim_line_pq);
+out:
     victim_line->pos = 0;
     lm->victim_line_cnt--;
 
@@ -1856,20 +2415,15 @@ again:
             demand_shard->lm.victim_line_cnt, demand_shard->lm.full_line_cnt, 
             demand_shard->lm.free_line_cnt);
 
-    if(dummy) {
-        pqueue_insert(lm->victim_line_pq, dummy);
+    for(int i = 0; i < nr_dummy; i++) {
+        pqueue_insert(lm->victim_line_pq, dummy[i]);
     }
 
-    spin_unlock(&lm_spin);
+    spin_unlock(&demand_shard->lm_spin);
     /* victim_line is a danggling node now */
     return victim_line;
 }
 
-uint64_t clean_first_half = 0;
-uint64_t clean_second_half = 0;
-uint64_t clean_third_half = 0;
-uint64_t mapping_searches = 0;
-
 /*
  * Plus's transient GC hash table, containing invalid
  * hash index to grain mappings.
@@ -1878,14 +2432,12 @@ struct inv_entry {
     uint64_t key; // This will be used as the key in the hash table
     struct hlist_node node; // Hash table uses hlist_node to chain items
 };
-DEFINE_HASHTABLE(inv_m_hash, 17);
 
 struct off_del {
     uint64_t key; // This will be used as the key in the hash table
     uint64_t offset;
     struct hlist_node node; // Hash table uses hlist_node to chain items
 };
-DEFINE_HASHTABLE(off_del_hash, 17);
 
 uint64_t __get_inv_mappings(struct demand_shard *shard, uint64_t line) {
 #ifdef ORIGINAL
@@ -1898,6 +2450,7 @@ uint64_t __get_inv_mappings(struct demand_shard *shard, uint64_t line) {
     struct ssd *ssd = shard->ssd;
     struct ssdparams *spp = &shard->ssd->sp;
     struct gc_data *gcd = &shard->gcd;
+    struct gc_worker *w = shard->gcw;
     struct ppa p;
     uint64_t nsecs_completed = 0, nsecs_latest = 0;
     uint64_t shard_off = shard->id * spp->tt_pgs * spp->pgsz;
@@ -1919,14 +2472,14 @@ uint64_t __get_inv_mappings(struct demand_shard *shard, uint64_t line) {
     void* xa_entry = NULL;
 
     struct nand_cmd swr = {
-        .type = USER_IO,
+        .type = GC_MAP_IO,
         .cmd = NAND_READ,
         .interleave_pci_dma = false,
         .xfer_size = spp->pgsz,
         .stime = 0, /* TODO fix */
     };
 
-    spin_lock(&inv_m_spin);
+    spin_lock(&shard->inv_m_spin);
 
     NVMEV_DEBUG("Starting an XA scan %lu %lu\n", start, end);
     xa_for_each_range(&gcd->inv_mapping_xa, index, xa_entry, start, end) {
@@ -1983,7 +2536,7 @@ uint64_t __get_inv_mappings(struct demand_shard *shard, uint64_t line) {
                 struct hlist_node *next;
                 bool deleted = false;
 
-                hash_for_each_possible_safe(inv_m_hash, item, next, node, entry->key) {
+                hash_for_each_possible_safe(w->inv_m_hash, item, next, node, entry->key) {
                     if (item->key == entry->key) {
                         hash_del(&item->node);
                         deleted = true;
@@ -1998,7 +2551,7 @@ uint64_t __get_inv_mappings(struct demand_shard *shard, uint64_t line) {
                 /*
                  * Add it to the hash table.
                  */
-                hash_add(inv_m_hash, &entry->node, entry->key);
+                hash_add(w->inv_m_hash, &entry->node, entry->key);
             } else {
                 struct off_del *entry;
                 entry = kmalloc_node(sizeof(*entry), GFP_KERNEL, numa_node_id());
@@ -2011,7 +2564,7 @@ uint64_t __get_inv_mappings(struct demand_shard *shard, uint64_t line) {
                 /*
                  * Add it to the hash table.
                  */
-                hash_add(off_del_hash, &entry->node, entry->key);
+                hash_add(w->off_del_hash, &entry->node, entry->key);
             }
             hsize++;
         }
@@ -2027,20 +2580,20 @@ uint64_t __get_inv_mappings(struct demand_shard *shard, uint64_t line) {
     }
 
     NVMEV_DEBUG("Copying %lld (%lld %lu) inv mapping pairs from mem.\n",
-            inv_mapping_offs[line] / INV_ENTRY_SZ, 
-            inv_mapping_offs[line], INV_ENTRY_SZ);
+            shard->inv_mapping_offs[line] / INV_ENTRY_SZ, 
+            shard->inv_mapping_offs[line], INV_ENTRY_SZ);
 
     /*
      * The current in-memory invalid mapping buffer.
      */
 
-    uint32_t cnt = inv_mapping_offs[line] / (uint32_t) INV_ENTRY_SZ;
+    uint32_t cnt = shard->inv_mapping_offs[line] / (uint32_t) INV_ENTRY_SZ;
     uint64_t marker;
     uint64_t off;
 
-    for(int j = 0; j < inv_mapping_offs[line] / (uint32_t) INV_ENTRY_SZ; j++) {
+    for(int j = 0; j < shard->inv_mapping_offs[line] / (uint32_t) INV_ENTRY_SZ; j++) {
         if(j < cnt - 1) {
-            marker = *(uint64_t*) (inv_mapping_bufs[line] + ((j + 1) * INV_ENTRY_SZ));
+            marker = *(uint64_t*) (shard->inv_mapping_bufs[line] + ((j + 1) * INV_ENTRY_SZ));
             if(marker & (1ULL << 63)) {
                 off = marker;
                 off &= ~(1ULL << 63);
@@ -2054,8 +2607,8 @@ uint64_t __get_inv_mappings(struct demand_shard *shard, uint64_t line) {
             offset_del = false;
         }
 
-        lpa_t lpa = *(lpa_t*) (inv_mapping_bufs[line] + (j * INV_ENTRY_SZ));
-        ppa_t ppa = *(ppa_t*) (inv_mapping_bufs[line] + (j * INV_ENTRY_SZ) + 
+        lpa_t lpa = *(lpa_t*) (shard->inv_mapping_bufs[line] + (j * INV_ENTRY_SZ));
+        ppa_t ppa = *(ppa_t*) (shard->inv_mapping_bufs[line] + (j * INV_ENTRY_SZ) + 
                 sizeof(lpa_t));
 
         if(lpa == UINT_MAX) {
@@ -2066,7 +2619,7 @@ uint64_t __get_inv_mappings(struct demand_shard *shard, uint64_t line) {
             struct inv_entry *entry;
             entry = kmalloc_node(sizeof(*entry), GFP_KERNEL, numa_node_id());
             entry->key = ((uint64_t) ppa << 32) | lpa;
-            hash_add(inv_m_hash, &entry->node, entry->key);
+            hash_add(w->inv_m_hash, &entry->node, entry->key);
             hsize++;
         } else {
             struct off_del *entry;
@@ -2077,7 +2630,7 @@ uint64_t __get_inv_mappings(struct demand_shard *shard, uint64_t line) {
             NVMEV_DEBUG("Adding offset delete %llu off %llu len %llu from pos %lu.\n",
                          marker, off >> 32, off & 0xFFFFFFFF, (j + 1) * INV_ENTRY_SZ);
 
-            hash_add(off_del_hash, &entry->node, entry->key);
+            hash_add(w->off_del_hash, &entry->node, entry->key);
             hsize++;
             j++;
         }
@@ -2085,8 +2638,8 @@ uint64_t __get_inv_mappings(struct demand_shard *shard, uint64_t line) {
 
     NVMEV_DEBUG("Hsize was %d\n", hsize);
 
-    inv_mapping_offs[line] = 0;
-    spin_unlock(&inv_m_spin);
+    shard->inv_mapping_offs[line] = 0;
+    spin_unlock(&shard->inv_m_spin);
 
     return nsecs_completed;
 #endif
@@ -2114,11 +2667,12 @@ bool __valid_mapping(struct demand_shard *demand_shard, uint64_t lpa, uint64_t p
      * Where Plus determines if the KV pair at a grain is valid or not.
      * If we find it in inv_m_hash, that means it was previously invalidated.
      */
+    struct gc_worker *w = demand_shard->gcw;
     uint64_t key = (ppa << 32) | lpa;
     bool valid = true;
     struct inv_entry *item;
     // Iterate over the hash table to find the item
-    hash_for_each_possible(inv_m_hash, item, node, key) {
+    hash_for_each_possible(w->inv_m_hash, item, node, key) {
         if (item->key == key) {
             valid = false;
             break;
@@ -2135,6 +2689,7 @@ uint64_t __off_del(struct demand_shard *demand_shard, uint64_t lpa, uint64_t ppa
     /*
      * This mapping is valid, but do we have a delete for an offset inside it?
      */
+    struct gc_worker *w = demand_shard->gcw;
     uint64_t key = (ppa << 32) | lpa;
     bool have = false;
     uint64_t ret = ULLONG_MAX;
@@ -2149,7 +2704,7 @@ uint64_t __off_del(struct demand_shard *demand_shard, uint64_t lpa, uint64_t ppa
     //    }
     //} 
 
-    hash_for_each_possible_safe(off_del_hash, item, next, node, key) {
+    hash_for_each_possible_safe(w->off_del_hash, item, next, node, key) {
         if (item->key == key) {
             hash_del(&item->node);
             have = true;
@@ -2181,13 +2736,14 @@ void __update_mapping_ppa(struct demand_shard *demand_shard, uint64_t new_ppa,
 void __clear_gc_data(struct demand_shard* demand_shard) {
     struct ssdparams *spp = &demand_shard->ssd->sp;
     struct gc_data *gcd = &demand_shard->gcd;
+    struct gc_worker *w = demand_shard->gcw;
 
     struct inv_entry *item;
     struct hlist_node *tmp;
     int bkt;
 
     // Iterate over each bucket
-    hash_for_each_safe(inv_m_hash, bkt, tmp, item, node) {
+    hash_for_each_safe(w->inv_m_hash, bkt, tmp, item, node) {
         // Remove the item from the hash table
         hash_del(&item->node);
         // Free the memory allocated for the item
@@ -2196,7 +2752,7 @@ void __clear_gc_data(struct demand_shard* demand_shard) {
 
     struct off_del *off_item;
 
-    hash_for_each_safe(off_del_hash, bkt, tmp, off_item, node) {
+    hash_for_each_safe(w->off_del_hash, bkt, tmp, off_item, node) {
         // Remove the item from the hash table
         hash_del(&off_item->node);
         // Free the memory allocated for the item
@@ -2204,19 +2760,6 @@ void __clear_gc_data(struct demand_shard* demand_shard) {
     }
 }
 
-uint64_t user_pgs_this_gc = 0;
-uint64_t gc_pgs_this_gc = 0;
-uint64_t map_pgs_this_gc = 0;
-uint64_t map_gc_pgs_this_gc = 0;
-
-static inline uint32_t __lpa_from_oob(uint64_t oob) {
-    return oob & 0xFFFFFFFF;
-}
-
-static inline uint32_t __glen_from_oob(uint64_t oob) {
-    return oob >> 32;
-}
-
 uint64_t __maybe_write(struct demand_shard *shard, struct ppa *ppa, bool map) {
     struct ssdparams *spp;
     struct convparams *cpp;
@@ -2236,14 +2779,14 @@ uint64_t __maybe_write(struct demand_shard *shard, struct ppa *ppa, bool map) {
 
         if (last_pg_in_wordline(shard, ppa)) {
             gcw.cmd = NAND_WRITE;
-            gcw.xfer_size = spp->pgsz * spp->pgs_per_oneshotpg;
+            gcw.xfer_size = spp->pgsz * spp->pgs_per_prog;
 
             //nsecs_completed = ssd_advance_nand(shard->ssd, &gcw);
         }
 
         //if (last_pg_in_wordline(shard, &new_ppa)) {
         //    schedule_internal_operation(UINT_MAX, nsecs_completed, NULL,
-        //                                spp->pgs_per_oneshotpg * spp->pgsz);
+        //                                spp->pgs_per_prog * spp->pgsz);
         //}
     }
 
@@ -2292,19 +2835,17 @@ void __copy_inv_map(struct demand_shard *shard, uint64_t old_grain,
     struct ppa ppa;
     uint32_t offset;
     uint64_t pgidx;
-    uint64_t **oob;
     uint32_t len;
     uint32_t grain;
 
     spp = &shard->ssd->sp;
     cache = &shard->cache;
     gcd = &shard->gcd;
-    oob = shard->oob;
     len = GRAIN_PER_PAGE;
 
     if(gcd->offset >= GRAIN_PER_PAGE) {
         if(__new_gc_ppa(shard, true)) {
-            shard->stats.trans_w_tgc += spp->pgsz * spp->pgs_per_oneshotpg;
+            shard->stats.trans_w_tgc += spp->pgsz * spp->pgs_per_prog;
         }
     }
 
@@ -2328,12 +2869,10 @@ again:
         mark_grain_invalid(shard, PPA_TO_PGA(pgidx, offset), 
                 GRAIN_PER_PAGE - offset);
 
-        for(int i = offset; i < GRAIN_PER_PAGE; i++) {
-            oob[pgidx][i] = UINT_MAX;
-        }
+        __oob_fill(shard, pgidx, offset, UINT_MAX);
 
         if(__new_gc_ppa(shard, true)) {
-            shard->stats.trans_w_tgc += spp->pgsz * spp->pgs_per_oneshotpg;
+            shard->stats.trans_w_tgc += spp->pgsz * spp->pgs_per_prog;
         }
 
         goto again;
@@ -2350,13 +2889,11 @@ again:
 
     NVMEV_ASSERT(offset == 0);
 
-    oob[pgidx][0] = UINT_MAX - 5;
-    oob[pgidx][1] = target_line;
-    oob[pgidx][2] = pgidx;
+    __oob_set(shard, pgidx, 0, UINT_MAX - 5);
+    __oob_set(shard, pgidx, 1, target_line);
+    __oob_set(shard, pgidx, 2, pgidx);
 
-    for(int i = 3; i < GRAIN_PER_PAGE; i++) {
-        oob[pgidx][i] = UINT_MAX;
-    }
+    __oob_fill(shard, pgidx, 3, UINT_MAX);
 
     __update_mapping_ppa(shard, pgidx, target_line, ptr);
     gcd->offset += GRAIN_PER_PAGE;
@@ -2370,17 +2907,15 @@ void __copy_map(struct demand_shard *shard, lpa_t idx, uint32_t len) {
     struct ppa ppa;
     uint32_t offset;
     uint64_t pgidx;
-    uint64_t **oob;
     uint64_t grain;
 
     spp = &shard->ssd->sp;
     cache = &shard->cache;
     gcd = &shard->gcd;
-    oob = shard->oob;
 
     if(gcd->offset >= GRAIN_PER_PAGE) {
         if(__new_gc_ppa(shard, true)) {
-            shard->stats.trans_w_tgc += spp->pgsz * spp->pgs_per_oneshotpg;
+            shard->stats.trans_w_tgc += spp->pgsz * spp->pgs_per_prog;
         }
     }
 
@@ -2401,12 +2936,10 @@ again:
         mark_grain_invalid(shard, PPA_TO_PGA(pgidx, offset), 
                 GRAIN_PER_PAGE - offset);
 
-        for(int i = offset; i < GRAIN_PER_PAGE; i++) {
-            oob[pgidx][i] = UINT_MAX;
-        }
+        __oob_fill(shard, pgidx, offset, UINT_MAX);
 
         if(__new_gc_ppa(shard, true)) {
-            shard->stats.trans_w_tgc += spp->pgsz * spp->pgs_per_oneshotpg;
+            shard->stats.trans_w_tgc += spp->pgsz * spp->pgs_per_prog;
         }
 
         goto again;
@@ -2418,7 +2951,7 @@ again:
     atomic_set(&ht->t_ppa, pgidx);
     ht->g_off = gcd->offset;
 
-    oob[pgidx][offset] = ((uint64_t) len << 32) | IDX2LPA(idx);
+    __oob_set_pair(shard, pgidx, offset, IDX2LPA(idx), len);
 
     gcd->offset += len;
 }
@@ -2431,20 +2964,18 @@ void __copy_valid_pair(struct demand_shard *shard, lpa_t lpa, uint32_t len,
     struct ppa ppa;
     uint32_t offset;
     uint64_t pgidx;
-    uint64_t **oob;
     uint64_t grain;
     uint32_t rem, rem_in_page, sz, gsz;
     uint64_t start_pgidx, start_offset;
 
     spp = &shard->ssd->sp;
     gcd = &shard->gcd;
-    oob = shard->oob;
     rem = len;
     rem_in_page = GRAIN_PER_PAGE - (gcd->offset % GRAIN_PER_PAGE);
 
     if(gcd->offset >= GRAIN_PER_PAGE) {
         if(__new_gc_ppa(shard, false)) {
-            shard->stats.data_w_dgc += spp->pgsz * spp->pgs_per_oneshotpg;
+            shard->stats.data_w_dgc += spp->pgsz * spp->pgs_per_prog;
         }
     }
 
@@ -2464,11 +2995,11 @@ void __copy_valid_pair(struct demand_shard *shard, lpa_t lpa, uint32_t len,
         NVMEV_DEBUG("DIDN'T HAVE SPACE FOR THIS COPY HAD %u NEEDED %u\n", 
                     rem_in_line, len * GRAINED_UNIT);
         clear_rest_of_line(shard, ppa, offset, len,
-                           NULL, true);
+                           NULL, GC_IO);
 
         uint32_t line_before = ppa.g.blk;
         if(__new_gc_ppa(shard, false)) {
-            shard->stats.data_w_dgc += spp->pgsz * spp->pgs_per_oneshotpg;
+            shard->stats.data_w_dgc += spp->pgsz * spp->pgs_per_prog;
         }
 
         ppa = gcd->gc_ppa;
@@ -2504,10 +3035,10 @@ void __copy_valid_pair(struct demand_shard *shard, lpa_t lpa, uint32_t len,
 
         if (last_pg_in_wordline(shard, &ppa)) {
             struct nand_cmd swr = {
-                .type = USER_IO,
+                .type = GC_IO,
                 .cmd = NAND_WRITE,
                 .interleave_pci_dma = false,
-                .xfer_size = spp->pgsz * spp->pgs_per_oneshotpg,
+                .xfer_size = spp->pgsz * spp->pgs_per_prog,
             };
 
             swr.stime = 0;
@@ -2526,7 +3057,7 @@ void __copy_valid_pair(struct demand_shard *shard, lpa_t lpa, uint32_t len,
                      lpa, ppa2pgidx(shard, &ppa), PPA_TO_PGA(pgidx, offset));
     }
 
-    oob[start_pgidx][start_offset] = ((uint64_t) len << 32) | lpa;
+    __oob_set_pair(shard, start_pgidx, start_offset, lpa, len);
     NVMEV_ASSERT(lpa != UINT_MAX);
     if(start_offset + len > GRAIN_PER_PAGE) {
         struct ppa next;
@@ -2549,10 +3080,10 @@ void __copy_valid_pair(struct demand_shard *shard, lpa_t lpa, uint32_t len,
                          rem, pgidx, sz);
 
             if(sz == 1) {
-                oob[pgidx][0] = UINT_MAX - 11;
+                __oob_set(shard, pgidx, 0, UINT_MAX - 11);
             } else {
-                oob[pgidx][0] = UINT_MAX - 10;
-                oob[pgidx][1] = sz;
+                __oob_set(shard, pgidx, 0, UINT_MAX - 10);
+                __oob_set(shard, pgidx, 1, sz);
             }
 
             rem -= sz;
@@ -2600,28 +3131,18 @@ void __copy_valid_pair(struct demand_shard *shard, lpa_t lpa, uint32_t len,
     }
 }
 
-uint32_t shadow_idx[GRAIN_PER_PAGE * FLASH_PAGE_SIZE];
-uint32_t shadow_idx_idx = 0;
-bool __shadow_read(struct cache *cache, uint32_t ppa) {
-    for(int i = 0; i < shadow_idx_idx; i++) {
-        if(atomic_read(&cache->ht[shadow_idx[i]]->t_ppa) == ppa) {
+bool __shadow_read(struct demand_shard *shard, uint32_t ppa) {
+    struct cache *cache = &shard->cache;
+    struct gc_worker *w = shard->gcw;
+
+    for(int i = 0; i < w->shadow_idx_idx; i++) {
+        if(atomic_read(&cache->ht[w->shadow_idx[i]]->t_ppa) == ppa) {
             return true;
         }
     }
     return false;
 }
 
-uint64_t existing_shifts[1024];
-uint64_t shifts_pre[1024];
-uint64_t shifts_post[1024];
-uint64_t combined[1024];
-uint64_t holes[1024];
-uint32_t existing_idx = 0;
-uint32_t shift_pre_idx = 0;
-uint32_t shift_post_idx = 0;
-uint32_t combined_idx = 0;
-uint32_t holes_idx = 0;
-
 static int comp(const void *lhs, const void *rhs) {
     uint64_t lhs_integer = *(const uint64_t*)(lhs);
     uint64_t rhs_integer = *(const uint64_t*)(rhs);
@@ -2641,17 +3162,19 @@ bool __has_marker(void* mem, uint64_t glen)
              == marker;
 }
 
-void __merge_shifts(uint32_t pair_len) 
+void __merge_shifts(struct demand_shard *shard, uint32_t pair_len) 
 {
-    for(int i = 0; i < existing_idx; i++) {
-        combined[combined_idx++] = existing_shifts[i];
+    struct gc_worker *w = shard->gcw;
+
+    for(int i = 0; i < w->existing_idx; i++) {
+        w->combined[w->combined_idx++] = w->existing_shifts[i];
     }
 
-    for(int i = 0; i < shift_post_idx; i++) {
-        combined[combined_idx++] = shifts_post[i];
+    for(int i = 0; i < w->shift_post_idx; i++) {
+        w->combined[w->combined_idx++] = w->shifts_post[i];
     }
 
-    sort(combined, combined_idx, sizeof(uint64_t), &comp, NULL);
+    sort(w->combined, w->combined_idx, sizeof(uint64_t), &comp, NULL);
 
     //uint64_t off;
     //uint64_t len;
@@ -2688,6 +3211,7 @@ void __merge_shifts(uint32_t pair_len)
 void __get_existing_shifts(struct demand_shard *shard, uint32_t lpa, uint64_t grain, 
         void *mem, uint64_t glen)
 {
+    struct gc_worker *w = shard->gcw;
     uint32_t start_marker, end_marker;
     uint32_t total;
     uint64_t start, end;
@@ -2720,10 +3244,10 @@ void __get_existing_shifts(struct demand_shard *shard, uint32_t lpa, uint64_t gr
 
     idx += sizeof(uint32_t);
     for(int i = 0; i < total; i++) {
-        existing_shifts[existing_idx++] = *(uint64_t*) (mem + idx);
+        w->existing_shifts[w->existing_idx++] = *(uint64_t*) (mem + idx);
         NVMEV_DEBUG("Added existing shift %llu %llu\n", 
-                     existing_shifts[existing_idx - 1] >> 32, 
-                     existing_shifts[existing_idx - 1] & 0xFFFFFFFF);
+                     w->existing_shifts[w->existing_idx - 1] >> 32, 
+                     w->existing_shifts[w->existing_idx - 1] & 0xFFFFFFFF);
 
         if(*(uint32_t*) (mem + idx + sizeof(uint32_t)) == end_marker) {
             break;
@@ -2737,10 +3261,11 @@ void __get_existing_shifts(struct demand_shard *shard, uint32_t lpa, uint64_t gr
 void __collect_shifts(struct demand_shard *shard, uint32_t lpa, uint64_t grain, 
                       void *mem, uint64_t glen)
 {
+    struct gc_worker *w = shard->gcw;
     uint64_t ret;
 
     while((ret = __off_del(shard, lpa, grain)) != ULLONG_MAX) {
-        shifts_pre[shift_pre_idx++] = ret;
+        w->shifts_pre[w->shift_pre_idx++] = ret;
         NVMEV_DEBUG("Collected shift offset %llu len %llu.\n", 
                      ret >> 32, ret & 0xFFFFFFFF);
     }
@@ -2748,6 +3273,7 @@ void __collect_shifts(struct demand_shard *shard, uint32_t lpa, uint64_t grain,
 }
 
 void __combine_shifts(struct demand_shard *shard) {
+    struct gc_worker *w = shard->gcw;
     uint64_t shift;
     uint64_t prev_off;
     uint64_t prev_len;
@@ -2757,24 +3283,24 @@ void __combine_shifts(struct demand_shard *shard) {
     uint64_t comp_range;
     uint64_t len;
 
-    if(shift_pre_idx == 0) {
+    if(w->shift_pre_idx == 0) {
         return;
     }
 
-    sort(shifts_pre, shift_pre_idx, sizeof(uint64_t), &comp, NULL);
+    sort(w->shifts_pre, w->shift_pre_idx, sizeof(uint64_t), &comp, NULL);
 
-    NVMEV_INFO("Sorted %u shifts.\n", shift_pre_idx);
-    NVMEV_ASSERT(shift_pre_idx <= 1024);
+    NVMEV_INFO("Sorted %u shifts.\n", w->shift_pre_idx);
+    NVMEV_ASSERT(w->shift_pre_idx <= GC_SHIFTS);
 
-    prev_off = shifts_pre[0] >> 32;
-    prev_len = len = shifts_pre[0] & 0xFFFFFFFF;
+    prev_off = w->shifts_pre[0] >> 32;
+    prev_len = len = w->shifts_pre[0] & 0xFFFFFFFF;
     prev_range = prev_off + prev_len; 
 
     NVMEV_DEBUG("Starting with shift offset %llu len %llu range %llu.\n",
                  prev_off, prev_len, prev_range);
 
-    for(int i = 1; i < shift_pre_idx; i++) {
-        shift = shifts_pre[i];
+    for(int i = 1; i < w->shift_pre_idx; i++) {
+        shift = w->shifts_pre[i];
 
         comp_off = shift >> 32;
         comp_len = shift & 0xFFFFFFFF;
@@ -2805,28 +3331,27 @@ void __combine_shifts(struct demand_shard *shard) {
             NVMEV_DEBUG("Ranges overlap! Set prev off to %llu len %llu range %llu\n",
                          prev_off, len, prev_range);
         } else {
-            shifts_post[shift_post_idx++] = (prev_off << 32) | len;
+            w->shifts_post[w->shift_post_idx++] = (prev_off << 32) | len;
             NVMEV_DEBUG("Ranges didn't overlap! Added off %llu len %llu range %llu at %u.\n",
-                         prev_off, len, prev_range, shift_post_idx - 1);
+                         prev_off, len, prev_range, w->shift_post_idx - 1);
             prev_off = comp_off;
             prev_len = len = comp_len;
             prev_range = comp_range;
         }
     }
 
-    shifts_post[shift_post_idx++] = (prev_off << 32) | len;
+    w->shifts_post[w->shift_post_idx++] = (prev_off << 32) | len;
     NVMEV_DEBUG("Finally added off %llu len %llu range %llu at %u.\n",
-                 prev_off, len, prev_range, shift_post_idx - 1);
+                 prev_off, len, prev_range, w->shift_post_idx - 1);
 }
 
 static void __update_map(struct demand_shard *shard, 
         struct ht_section *ht,
         lpa_t lpa, void* mem, 
         struct h_to_g_mapping pte, 
-        uint32_t pos, char* key,
-        uint32_t klen, uint64_t *credits, bool record);
+        uint32_t pos, char* key, uint32_t klen,
+        uint64_t hash, uint64_t *credits, bool record);
 
-uint64_t clearing = 0, clear_count = 0, copying = 0;
 uint64_t skip_until = UINT_MAX;
 /* here ppa identifies the block we want to clean */
 void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
@@ -2835,12 +3360,12 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
     struct convparams *cpp = &shard->cp;
     struct cache *cache = &shard->cache;
     struct gc_data *gcd = &shard->gcd;
+    struct gc_worker *w = shard->gcw;
     struct nand_page *pg_iter = NULL;
     int page_cnt = 0, i = 0, len = 0;
     uint64_t reads_done = 0, pgidx = 0;
     struct ppa ppa_copy = *ppa;
     struct line* l = get_line(shard, ppa); 
-    uint64_t **oob = shard->oob;
 
     uint64_t tt_rewrite = 0;
     bool mapping_line = gcd->map;
@@ -2873,14 +3398,14 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
             page_cnt++;
         } else if(pg_iter->status == PG_INVALID) {
 #ifndef ORIGINAL
-            NVMEV_ASSERT(pg_inv_cnt[pgidx] == GRAIN_PER_PAGE);
+            NVMEV_ASSERT(shard->pg_inv_cnt[pgidx] == GRAIN_PER_PAGE);
 #endif
             ppa_copy.g.pg++;
             continue;
 #ifdef ORIGINAL
         }
 #else
-        } else if(pg_inv_cnt[pgidx] == GRAIN_PER_PAGE) {
+        } else if(shard->pg_inv_cnt[pgidx] == GRAIN_PER_PAGE) {
             NVMEV_DEBUG("Skipping PPA %llu because all invalid.\n", pgidx);
             skipped++;
             NVMEV_ASSERT(pg_iter->status == PG_INVALID);
@@ -2892,15 +3417,15 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
         for(int i = 0; i < GRAIN_PER_PAGE; i++) {
             uint64_t grain = PPA_TO_PGA(pgidx, i);
 #ifdef ORIGINAL
-            bool valid_g = shard->grain_bitmap[grain];
+            bool valid_g = __grain_valid(shard, grain);
 #else
             bool valid_g = true;
 #endif
-            if(oob[pgidx][i] == (UINT_MAX - 11)) {
+            if(__oob(shard, pgidx, i) == (UINT_MAX - 11)) {
                 NVMEV_ASSERT(i == 0);
                 NVMEV_DEBUG("MULTI-PAGE SINGLE GRAIN SKIP PPA %llu\n", pgidx);
                 continue;
-            } else if(oob[pgidx][i] == (UINT_MAX - 10)) {
+            } else if(__oob(shard, pgidx, i) == (UINT_MAX - 10)) {
                 NVMEV_ASSERT(i == 0);
                 /*
                  * This page was the result of a multi-page write, but
@@ -2908,11 +3433,11 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
                  *
                  * Skip the rest of the grains.
                  */
-                NVMEV_DEBUG("MULTI-PAGE SKIP PPA %llu LEN %llu\n", pgidx, oob[pgidx][1]);
-                NVMEV_ASSERT(oob[pgidx][1] <= GRAIN_PER_PAGE);
-                i += oob[pgidx][1] - 1;
+                NVMEV_DEBUG("MULTI-PAGE SKIP PPA %llu LEN %u\n", pgidx, __oob(shard, pgidx, 1));
+                NVMEV_ASSERT(__oob(shard, pgidx, 1) <= GRAIN_PER_PAGE);
+                i += __oob(shard, pgidx, 1) - 1;
                 continue;
-            } else if(oob[pgidx][i] == UINT_MAX) {
+            } else if(__oob(shard, pgidx, i) == UINT_MAX) {
                 /*
                  * This section of the OOB was marked as invalid,
                  * because we didn't have enough space in the page
@@ -2923,18 +3448,40 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
                 continue;
             }
 
-            if(shard->offset / GRAINED_UNIT == grain) {
-                /*
-                 * Edge case where in store we got the last
-                 * page of a line for the offset, and GC thinks the
-                 * line is available to garbage collect because all
-                 * of the pages have been used.
-                 */
-                shard->offset = 0;
+#ifdef ORIGINAL
+            /*
+             * Nothing to copy until the next live pair, so step over
+             * the whole dead run instead of one grain at a time.
+             */
+            uint64_t run_end = valid_g ? grain + 1 :
+                               __next_valid_grain(shard, grain, 
+                                                  PPA_TO_PGA(pgidx, GRAIN_PER_PAGE));
+#else
+            uint64_t run_end = grain + 1;
+#endif
+
+            for(int s = 0; s < NR_STREAMS; s++) {
+                uint64_t s_grain = shard->streams[s].offset / GRAINED_UNIT;
+                if(s_grain >= grain && s_grain < run_end) {
+                    /*
+                     * Edge case where in store we got the last
+                     * page of a line for the offset, and GC thinks the
+                     * line is available to garbage collect because all
+                     * of the pages have been used.
+                     */
+                    shard->streams[s].offset = 0;
+                }
+            }
+
+#ifdef ORIGINAL
+            if(!valid_g) {
+                i += run_end - grain - 1;
+                continue;
             }
+#endif
 
             NVMEV_DEBUG("Cleaning grain %llu (%d)\n", grain, i);
-            if(i == 0 && mapping_line && oob[pgidx][i] == UINT_MAX - 5) {
+            if(i == 0 && mapping_line && __oob(shard, pgidx, i) == UINT_MAX - 5) {
 #ifdef ORIGINAL
                 /*
                  * Original scheme doesn't have invalid mapping pages!
@@ -2946,8 +3493,8 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
                  * This is a page that contains invalid LPA -> PPA mappings.
                  * We need to copy the whole page to somewhere else.
                  */
-                uint32_t target_line = oob[pgidx][1];
-                uint32_t page = oob[pgidx][2];
+                uint32_t target_line = __oob(shard, pgidx, 1);
+                uint32_t page = __oob(shard, pgidx, 2);
                 unsigned long key = 
                 ((unsigned long) target_line << 32) | page;
                 uint8_t *ptr;
@@ -2963,7 +3510,7 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
 
                 copy_start = ktime_get();
                 __copy_inv_map(shard, grain, target_line, ptr);
-                copying += ktime_to_us(ktime_get()) - ktime_to_us(copy_start);
+                w->copying += ktime_to_us(ktime_get()) - ktime_to_us(copy_start);
 
                 shard->stats.inv_m_w += spp->pgsz;
                 shard->stats.inv_m_r += spp->pgsz;
@@ -2973,17 +3520,17 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
 #endif
             } else if(mapping_line && valid_g) {
                 clear_start = ktime_get();
-                clear_count++;
+                w->clear_count++;
 
                 /*
                  * A grain containing live hash index to grain mapping 
                  * information.
                  */
 
-                uint32_t lpa = __lpa_from_oob(oob[pgidx][i]);
+                uint32_t lpa = __oob(shard, pgidx, i);
                 uint32_t idx = IDX(lpa);
 
-                NVMEV_ASSERT(oob[pgidx][i] != UINT_MAX);
+                NVMEV_ASSERT(__oob(shard, pgidx, i) != UINT_MAX);
                 NVMEV_ASSERT(idx > 0);
 
                 struct ht_section *ht;
@@ -2992,7 +3539,7 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
 #ifdef ORIGINAL
                 len = GRAIN_PER_PAGE;
 #else
-                len = __glen_from_oob(oob[pgidx][i]);
+                len = __oob_glen(shard, pgidx, i);
 #endif
 
 #ifdef ORIGINAL
@@ -3017,23 +3564,35 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
                 i += len - 1;
 
                 atomic_set(&ht->outgoing, 0);
-                clearing += ktime_to_us(ktime_get()) - ktime_to_us(clear_start);
+                w->clearing += ktime_to_us(ktime_get()) - ktime_to_us(clear_start);
             } else if(!mapping_line && valid_g) {
 #ifndef ORIGINAL
-                NVMEV_ASSERT(pg_inv_cnt[pgidx] <= GRAIN_PER_PAGE);
+                NVMEV_ASSERT(shard->pg_inv_cnt[pgidx] <= GRAIN_PER_PAGE);
 #endif
                 NVMEV_ASSERT(!mapping_line);
                 
-                uint64_t lpa = __lpa_from_oob(oob[pgidx][i]);
-                len = __glen_from_oob(oob[pgidx][i]);
+                uint64_t lpa = __oob(shard, pgidx, i);
+                uint32_t hidx;
+                len = __oob_glen(shard, pgidx, i);
 
-                NVMEV_DEBUG("Going for LPA %llu oob %llu grain %llu\n", 
-                             lpa, oob[pgidx][i], grain);
+                NVMEV_DEBUG("Going for LPA %llu oob %u grain %llu\n", 
+                             lpa, __oob(shard, pgidx, i), grain);
                 NVMEV_ASSERT(lpa != UINT_MAX);
                 NVMEV_ASSERT(lpa <= cache->nr_valid_tentries);
 
                 struct ht_section *ht;
-                ht = cache_get_ht(cache, lpa);
+moved:
+                hidx = __lh_hidx(shard, grain, lpa);
+                ht = cache_get_ht(cache, hidx);
+
+                if(__lh_hidx(shard, grain, lpa) != hidx) {
+                    /*
+                     * A split moved the pair while we waited for its
+                     * section.
+                     */
+                    atomic_set(&ht->outgoing, 0);
+                    goto moved;
+                }
 
                 if(__valid_mapping(shard, lpa, grain)) {
                     NVMEV_DEBUG("LPA %llu PPA %llu mapping is valid.\n", lpa, grain);
@@ -3055,7 +3614,7 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
                          * have a KV pair from a different CMT. With a 32K
                          * flash and 64B grains, that's 512 pages, which is 4MB.
                          */
-                        if(!__shadow_read(cache, atomic_read(&ht->t_ppa))) {
+                        if(!__shadow_read(shard, atomic_read(&ht->t_ppa))) {
                             //NVMEV_ERROR("Added IDX %u LPA %llu grain %d PPA %u pgidx %llu to shadow.\n", 
                             //             ht->idx, lpa, i, atomic_read(&ht->t_ppa), pgidx);
                             struct ppa p = ppa_to_struct(spp, atomic_read(&ht->t_ppa));
@@ -3071,11 +3630,11 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
                             ssd_advance_nand(shard->ssd, &gcr);
                         }
                         ht->mappings = (struct h_to_g_mapping*) ht->mem;
-                        shadow_idx[shadow_idx_idx++] = ht->idx;
+                        w->shadow_idx[w->shadow_idx_idx++] = ht->idx;
                     }
 
                     uint32_t pos = UINT_MAX;
-                    struct h_to_g_mapping pte = cache_hidx_to_grain(ht, lpa, &pos);
+                    struct h_to_g_mapping pte = cache_hidx_to_grain(ht, hidx, &pos);
 
                     //NVMEV_ERROR("Got valid mapping from IDX %u\n", ht->idx);
 
@@ -3118,7 +3677,7 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
 
                         //mark_grain_invalid(shard, grain, len);
 
-                        mem = ht->pair_mem[OFFSET(lpa)];
+                        mem = ht_pair_mem(ht, OFFSET(hidx));
                         real_vlen = __vlen_from_value(mem);
                         klen = __klen_from_value(mem);
                         total_del = 0;
@@ -3141,17 +3700,17 @@ void clean_one_flashpg(struct demand_shard *shard, struct ppa *ppa)
                         uint32_t cnt = 0;
                         int j;
 
-                        for(int i = 0; i < shift_post_idx; i++) {
+                        for(int i = 0; i < w->shift_post_idx; i++) {
 next:
-                            ret = shifts_post[i];
+                            ret = w->shifts_post[i];
 
                             uint64_t off = ret >> 32;
                             uint64_t del_len = ret & 0xFFFFFFFF; 
                             uint32_t g_len;
 
-                            for(j = seen_until; j < existing_idx; j++) {
-                                e_off = existing_shifts[j] >> 32;
-                                e_len = existing_shifts[j] & 0xFFFFFFFF;
+                            for(j = seen_until; j < w->existing_idx; j++) {
+                                e_off = w->existing_shifts[j] >> 32;
+                                e_len = w->existing_shifts[j] & 0xFFFFFFFF;
 
                                 bool one = (e_off < off) && (e_off + e_len > off);
                                 bool two = (off < e_off) && (off + del_len > e_off);
@@ -3162,7 +3721,7 @@ next:
                                                 "when there's already a delete marker for offset "
                                                 "%llu len %llu.\n", off, del_len, e_off, e_len);
                                     i++;
-                                    if(i < shift_post_idx) {
+                                    if(i < w->shift_post_idx) {
                                         goto next;
                                     } else {
                                         done = true;
@@ -3245,10 +3804,11 @@ next:
                              */
                             NVMEV_INFO("LPA %llu was fully deleted in GC!\n", lpa);
                             atomic_set(&pte.ppa, UINT_MAX);
-                            __update_map(shard, ht, lpa, (void*) 0xDE1E7ED, pte, 
-                                         pos, NULL, 0, NULL, false);
-                            kfree(mem);
-                            ht->pair_mem[OFFSET(lpa)] = NULL;
+                            __update_map(shard, ht, hidx, (void*) 0xDE1E7ED, pte, 
+                                         pos, NULL, 0, 0, NULL, false);
+                            pair_free(mem);
+                            atomic64_dec(&cache->lh_used);
+                            ht_set_pair_mem(cache, ht, OFFSET(hidx), NULL);
                         } else {
                             uint32_t space_needed;
                             uint32_t meta_sz;
@@ -3257,9 +3817,9 @@ next:
                             uint32_t end_marker = 0xABABABAB;
 
                             if(changed) {
-                                __merge_shifts(len * GRAINED_UNIT);
+                                __merge_shifts(shard, len * GRAINED_UNIT);
 
-                                space_needed = ((existing_idx + shift_post_idx) * sizeof(uint64_t)) + 
+                                space_needed = ((w->existing_idx + w->shift_post_idx) * sizeof(uint64_t)) + 
                                                sizeof(start_marker) + sizeof(end_marker) +
                                                (sizeof(uint32_t) - (klen % sizeof(uint32_t)));
                                 meta_sz = sizeof(klen) + klen + sizeof(uint32_t) + real_vlen;
@@ -3285,13 +3845,13 @@ next:
                                 memset(mem + meta_sz + sizeof(start_marker), 0x0,
                                        (new_len * GRAINED_UNIT) - (meta_sz + sizeof(start_marker)));
 
-                                for(int i = 0; i < combined_idx; i++) {
-                                    NVMEV_DEBUG("Copying %llu to pos %lu\n", combined[i],
+                                for(int i = 0; i < w->combined_idx; i++) {
+                                    NVMEV_DEBUG("Copying %llu to pos %lu\n", w->combined[i],
                                                  meta_sz + sizeof(start_marker) + 
                                                  (i * sizeof(uint64_t))); 
                                     memcpy(mem + meta_sz + sizeof(start_marker) + 
                                            (i * sizeof(uint64_t)),
-                                           &combined[i], sizeof(uint64_t));
+                                           &w->combined[i], sizeof(uint64_t));
                                 }
 
                                 memcpy(mem + ((new_len * GRAINED_UNIT) - sizeof(uint32_t)),
@@ -3302,14 +3862,13 @@ next:
                                              (new_len * GRAINED_UNIT) - sizeof(0xDEADBEEF));
                             }
 
-                            __copy_valid_pair(shard, lpa, new_len, ht, pos, l->id);
+                            __copy_valid_pair(shard, hidx, new_len, ht, pos, l->id);
                         }
 
-                        shift_pre_idx = 0;
-                        shift_post_idx = 0;
-                        existing_idx = 0;
-                        combined_idx = 0;
-                        holes_idx = 0;
+                        w->shift_pre_idx = 0;
+                        w->shift_post_idx = 0;
+                        w->existing_idx = 0;
+                        w->combined_idx = 0;
                     }
                 }
 
@@ -3326,7 +3885,7 @@ next:
     ppa_copy = *ppa;
 
     end = ktime_get();
-    clean_first_half += ktime_to_us(end) - ktime_to_us(start);
+    w->clean_first_half += ktime_to_us(end) - ktime_to_us(start);
 
     NVMEV_DEBUG("Skipped %u pages out of %lu in %s GC.\n",
                  skipped, spp->pgs_per_line, mapping_line ? "mapping" :
@@ -3345,20 +3904,21 @@ next:
      * later eviction.
      */
     struct ht_section *ht;
-    for(int i = 0; i < shadow_idx_idx; i++) {
-        ht = cache_get_ht(cache, shadow_idx[i] * EPP);
-        fifo_enqueue(cache->fifo, ht);
+    for(int i = 0; i < w->shadow_idx_idx; i++) {
+        ht = cache_get_ht(cache, w->shadow_idx[i] * EPP);
+        cache_enqueue(cache, ht);
 
-        spin_lock(&entry_spin);
+        spin_lock(&shard->entry_spin);
         cache->nr_cached_tentries += ht->len_on_disk;
-        spin_unlock(&entry_spin);
+        spin_unlock(&shard->entry_spin);
+        __kick_ev(shard);
 
         //NVMEV_ERROR("Removed IDX %u from shadow.\n", ht->idx);
         atomic_set(&ht->outgoing, 0);
     }
 
-    shadow_idx_idx = 0;
-    clean_third_half += ktime_to_us(end) - ktime_to_us(start);
+    w->shadow_idx_idx = 0;
+    w->clean_third_half += ktime_to_us(end) - ktime_to_us(start);
 
     return;
 }
@@ -3370,7 +3930,7 @@ static void mark_line_free(struct demand_shard *demand_shard, struct ppa *ppa)
 
     NVMEV_DEBUG("Marking line %d free\n", line->id);
 
-    spin_lock(&lm_spin);
+    spin_lock(&demand_shard->lm_spin);
 
     line->ipc = 0;
     line->vpc = 0;
@@ -3380,43 +3940,46 @@ static void mark_line_free(struct demand_shard *demand_shard, struct ppa *ppa)
     list_add_tail(&line->entry, &lm->free_line_list);
     lm->free_line_cnt++;
 
-    spin_unlock(&lm_spin);
+    spin_unlock(&demand_shard->lm_spin);
 }
 
-static uint64_t do_gc(struct demand_shard *shard, bool bg)
+/*
+ * Starts collecting a victim line. The copying is done by __gc_step,
+ * and __gc_finish frees the line once every flash page is clean.
+ */
+static bool __gc_begin(struct demand_shard *shard, bool bg)
 {
     struct line *victim_line = NULL;
-    struct ssdparams *spp = &shard->ssd->sp;
-    struct convparams *cpp = &shard->cp;
-    struct ppa ppa;
     struct gc_data *gcd = &shard->gcd;
-    struct cache *cache;
-    int flashpg;
-    uint64_t pgidx;
-    uint64_t nsecs_completed = 0, nsecs_latest = 0;
-
-    uint64_t map = 0, total = 0, cleaning = 0, freeing = 0;
+    struct gc_worker *w = shard->gcw;
+    uint64_t nsecs_completed = 0;
+    ktime_t start, end;
 
-    ktime_t gc_start, start, gc_end, end;
+    NVMEV_ASSERT(!gcd->victim);
 
     victim_line = select_victim_line(shard, bg);
     if (!victim_line) {
         NVMEV_INFO("No victim line!\n");
-        return UINT_MAX;
+        return false;
     }
 
-    gc_start = ktime_get();
+    gcd->start = ktime_get();
+    gcd->victim = victim_line;
+    gcd->cursor = 0;
+    shard->wfc.credits_to_refill = victim_line->igc;
+    gcd->refilled = 0;
+    gcd->bg = bg;
+    gcd->map_us = gcd->clean_us = 0;
+    gcd->nsecs_latest = 0;
 
-    shift_pre_idx = shift_post_idx = 0;
+    w->shift_pre_idx = w->shift_post_idx = 0;
 
     gcd->map = victim_line->map;
-    cache = &shard->cache;
 
-    user_pgs_this_gc = gc_pgs_this_gc = map_gc_pgs_this_gc = map_pgs_this_gc = 0;
+    w->user_pgs_this_gc = w->gc_pgs_this_gc = w->map_gc_pgs_this_gc = w->map_pgs_this_gc = 0;
 
-    ppa.g.blk = victim_line->id;
     NVMEV_INFO("%s GC-ing %s line:%d,ipc=%d(%d),igc=%d(%d),victim=%d,full=%d,free=%d\n", 
-            bg ? "BACKGROUND" : "FOREGROUND", gcd->map? "MAP" : "USER", ppa.g.blk,
+            bg ? "BACKGROUND" : "FOREGROUND", gcd->map? "MAP" : "USER", victim_line->id,
             victim_line->ipc, victim_line->vpc, victim_line->igc, victim_line->vgc,
             shard->lm.victim_line_cnt, shard->lm.full_line_cnt, 
             shard->lm.free_line_cnt);
@@ -3427,63 +3990,128 @@ static uint64_t do_gc(struct demand_shard *shard, bool bg)
         shard->stats.dgc_cnt++;
     }
 
-    shard->wfc.credits_to_refill = victim_line->igc;
+    shard->stats.gc_victim_vgc += victim_line->vgc;
+    shard->stats.gc_victim_age += shard->lm.seal_seq - victim_line->age;
+
 #ifndef ORIGINAL
     start = ktime_get();
     if(victim_line->vgc > 0 && !gcd->map) {
         nsecs_completed = __get_inv_mappings(shard, victim_line->id);
     }
     end = ktime_get();
-    map = ktime_to_us(end) - ktime_to_us(start);
+    gcd->map_us = ktime_to_us(end) - ktime_to_us(start);
 #endif
-    nsecs_latest = max(nsecs_latest, nsecs_completed);
+    gcd->nsecs_latest = max(gcd->nsecs_latest, nsecs_completed);
+
+    return true;
+}
+
+/*
+ * Hands back write credits in proportion to how much of the victim
+ * we've cleaned, instead of all at once when the line is freed.
+ */
+static void __gc_refill(struct demand_shard *shard, uint32_t total)
+{
+    struct gc_data *gcd = &shard->gcd;
+    struct write_flow_control *wfc = &shard->wfc;
+    uint32_t due = div_u64((uint64_t) wfc->credits_to_refill * gcd->cursor, total);
+
+    if(due > gcd->refilled) {
+        spin_lock(&shard->wfc_spin);
+        wfc->write_credits += due - gcd->refilled;
+        spin_unlock(&shard->wfc_spin);
+        gcd->refilled = due;
+    }
+}
+
+/*
+ * Copies valid data out of, and erases, up to nr_flashpgs flash pages
+ * of the victim. Returns true once the whole line has been cleaned.
+ */
+static bool __gc_step(struct demand_shard *shard, uint32_t nr_flashpgs)
+{
+    struct ssdparams *spp = &shard->ssd->sp;
+    struct convparams *cpp = &shard->cp;
+    struct gc_data *gcd = &shard->gcd;
+    struct line *victim_line = gcd->victim;
+    const uint32_t per_flashpg = spp->nchs * spp->luns_per_ch * spp->pls_per_lun;
+    const uint32_t total = spp->flashpgs_per_blk * per_flashpg;
+    uint32_t end_cursor;
+    uint64_t nsecs_completed;
+    ktime_t start, end;
+    struct ppa ppa;
+
+    if(nr_flashpgs == 0 || nr_flashpgs > total - gcd->cursor) {
+        end_cursor = total;
+    } else {
+        end_cursor = gcd->cursor + nr_flashpgs;
+    }
+
+    ppa.ppa = 0;
+    ppa.g.blk = victim_line->id;
 
     /* copy back valid data */
-    for (flashpg = 0; flashpg < spp->flashpgs_per_blk; flashpg++) {
-        int ch, lun;
+    for (; gcd->cursor < end_cursor; gcd->cursor++) {
+        int flashpg = gcd->cursor / per_flashpg;
+        int ch = (gcd->cursor % per_flashpg) / (spp->luns_per_ch * spp->pls_per_lun);
+        int lun = (gcd->cursor / spp->pls_per_lun) % spp->luns_per_ch;
+        int pl = gcd->cursor % spp->pls_per_lun;
+        struct nand_lun *lunp;
 
         ppa.g.pg = flashpg * spp->pgs_per_flashpg;
-        for (ch = 0; ch < spp->nchs; ch++) {
-            for (lun = 0; lun < spp->luns_per_ch; lun++) {
-                struct nand_lun *lunp;
-
-                ppa.g.ch = ch;
-                ppa.g.lun = lun;
-                ppa.g.pl = 0;
-                lunp = get_lun(shard->ssd, &ppa);
-
-                start = ktime_get();
-                if(victim_line->vgc > 0) {
-                    clean_one_flashpg(shard, &ppa);
-                }
-                end = ktime_get();
-                cleaning += ktime_to_us(end) - ktime_to_us(start);
-
-                if (flashpg == (spp->flashpgs_per_blk - 1)) {
-                    struct convparams *cpp = &shard->cp;
-
-                    mark_block_free(shard, &ppa);
-
-                    if (cpp->enable_gc_delay) {
-                        struct nand_cmd gce = {
-                            .type = GC_IO,
-                            .cmd = NAND_ERASE,
-                            .stime = 0,
-                            .interleave_pci_dma = false,
-                            .ppa = &ppa,
-                        };
-                        nsecs_completed = ssd_advance_nand(shard->ssd, &gce);
-                        nsecs_latest = max(nsecs_latest, nsecs_completed);
-                    }
-                    //end = ktime_get();
-                    //freeing += ktime_to_us(end) - ktime_to_us(start);
+        ppa.g.ch = ch;
+        ppa.g.lun = lun;
+        ppa.g.pl = pl;
+        lunp = get_lun(shard->ssd, &ppa);
+
+        start = ktime_get();
+        if(victim_line->vgc > 0) {
+            clean_one_flashpg(shard, &ppa);
+        }
 
-                    lunp->gc_endtime = lunp->next_lun_avail_time;
-                }
+        if(!gcd->map) {
+            __lh_forget(shard, &ppa);
+        }
+        end = ktime_get();
+        gcd->clean_us += ktime_to_us(end) - ktime_to_us(start);
+
+        if (flashpg == (spp->flashpgs_per_blk - 1)) {
+            mark_block_free(shard, &ppa);
+
+            /* one multi-plane erase once the LUN's last plane is clean */
+            if (cpp->enable_gc_delay && pl == spp->pls_per_lun - 1) {
+                struct nand_cmd gce = {
+                    .type = GC_IO,
+                    .cmd = NAND_ERASE,
+                    .stime = 0,
+                    .interleave_pci_dma = false,
+                    .ppa = &ppa,
+                };
+                nsecs_completed = ssd_advance_nand(shard->ssd, &gce);
+                gcd->nsecs_latest = max(gcd->nsecs_latest, nsecs_completed);
             }
+
+            lunp->gc_endtime = lunp->next_lun_avail_time;
         }
     }
 
+    __gc_refill(shard, total);
+
+    return gcd->cursor == total;
+}
+
+static uint64_t __gc_finish(struct demand_shard *shard)
+{
+    struct ssdparams *spp = &shard->ssd->sp;
+    struct convparams *cpp = &shard->cp;
+    struct gc_data *gcd = &shard->gcd;
+    struct gc_worker *w = shard->gcw;
+    struct line *victim_line = gcd->victim;
+    uint64_t nsecs_completed = 0, nsecs_latest = gcd->nsecs_latest;
+    uint64_t total = 0, freeing = 0;
+    ktime_t start, gc_end, end;
+    struct ppa line_ppa;
+
     //NVMEV_ASSERT(gcd->offset > 0);
 
     if(gcd->offset < GRAIN_PER_PAGE) {
@@ -3495,12 +4123,12 @@ static uint64_t do_gc(struct demand_shard *shard, bool bg)
         uint64_t shard_off = shard->id * spp->tt_pgs * spp->pgsz;
         uint64_t to = shard_off + (pgidx * spp->pgsz) + (offset * GRAINED_UNIT);
 
-        for(int i = offset; i < GRAIN_PER_PAGE; i++) {
-            shard->oob[pgidx][i] = UINT_MAX;
+        __oob_fill(shard, pgidx, offset, UINT_MAX);
 #ifdef ORIGINAL
-            shard->grain_bitmap[PPA_TO_PGA(pgidx, i)] = 0;
-#endif
+        for(int i = offset; i < GRAIN_PER_PAGE; i++) {
+            clear_bit(PPA_TO_PGA(pgidx, i), shard->grain_bitmap);
         }
+#endif
 
         mark_grain_valid(shard, PPA_TO_PGA(pgidx, offset), 
                          GRAIN_PER_PAGE - offset);
@@ -3518,19 +4146,19 @@ static uint64_t do_gc(struct demand_shard *shard, bool bg)
 
             if (last_pg_in_wordline(shard, &ppa)) {
                 gcw.cmd = NAND_WRITE;
-                gcw.xfer_size = spp->pgsz * spp->pgs_per_oneshotpg;
+                gcw.xfer_size = spp->pgsz * spp->pgs_per_prog;
 
                 if(gcd->map) {
-                    shard->stats.trans_w_tgc += spp->pgsz * spp->pgs_per_oneshotpg;
+                    shard->stats.trans_w_tgc += spp->pgsz * spp->pgs_per_prog;
                 } else {
-                    shard->stats.data_w_dgc += spp->pgsz * spp->pgs_per_oneshotpg;
+                    shard->stats.data_w_dgc += spp->pgsz * spp->pgs_per_prog;
                 }
             }
 
             nsecs_completed = ssd_advance_nand(shard->ssd, &gcw);
             //if (last_pg_in_wordline(shard, &ppa)) {
             //    schedule_internal_operation(UINT_MAX, nsecs_completed, NULL,
-            //            spp->pgs_per_oneshotpg * spp->pgsz);
+            //            spp->pgs_per_prog * spp->pgsz);
             //}
         }
 
@@ -3541,7 +4169,9 @@ static uint64_t do_gc(struct demand_shard *shard, bool bg)
     }
 
     /* update line status */
-    mark_line_free(shard, &ppa);
+    line_ppa.ppa = 0;
+    line_ppa.g.blk = victim_line->id;
+    mark_line_free(shard, &line_ppa);
 #ifndef ORIGINAL
     start = ktime_get();
     if(!gcd->map) {
@@ -3552,26 +4182,50 @@ static uint64_t do_gc(struct demand_shard *shard, bool bg)
 #endif
 
     gc_end = ktime_get();
-    total = ktime_to_us(gc_end) - ktime_to_us(gc_start);
+    total = ktime_to_us(gc_end) - ktime_to_us(gcd->start);
 
-    NVMEV_ASSERT(user_pgs_this_gc == 0);
+    NVMEV_ASSERT(w->user_pgs_this_gc == 0);
     NVMEV_INFO("%llu user %llu GC %llu map GC this round. %lu pgs_per_line."
                " Took %llu microseconds (%llu map %llu clean %llu free).\n"
                " Clean breakdown %llu first half %llu second half %llu third half"
                " %llu time spent searching %llu clearing %llu copying %llu clear_count.", 
-                user_pgs_this_gc, gc_pgs_this_gc, map_gc_pgs_this_gc, 
-                spp->pgs_per_line, total, map, cleaning, freeing,
-                clean_first_half, clean_second_half, clean_third_half, 
-                mapping_searches, clearing, copying, clear_count);
+                w->user_pgs_this_gc, w->gc_pgs_this_gc, w->map_gc_pgs_this_gc, 
+                spp->pgs_per_line, total, gcd->map_us, gcd->clean_us, freeing,
+                w->clean_first_half, w->clean_second_half, w->clean_third_half, 
+                w->mapping_searches, w->clearing, w->copying, w->clear_count);
 
-    clean_first_half = clean_second_half = clean_third_half = mapping_searches = 0;
-    clearing = copying = clear_count = 0;
+    w->clean_first_half = w->clean_second_half = w->clean_third_half = w->mapping_searches = 0;
+    w->clearing = w->copying = w->clear_count = 0;
 
     NVMEV_DEBUG("Leaving GC-ing for line %d \n", victim_line->id);
 
+    gcd->victim = NULL;
     return nsecs_latest;
 }
 
+/*
+ * Collects a whole line in one go. Callers hold shard->gcw->lock. If the
+ * worker is part way through a line, possibly on another shard, that
+ * line is finished first since they share the worker's scratch space.
+ */
+static uint64_t do_gc(struct demand_shard *shard, bool bg)
+{
+    struct gc_worker *w = shard->gcw;
+
+    if(w->active) {
+        __gc_step(w->active, 0);
+        __gc_finish(w->active);
+        wake_up_all(&w->active->gc_done_wq);
+        w->active = NULL;
+    }
+
+    if(!__gc_begin(shard, bg)) {
+        return UINT_MAX;
+    }
+
+    __gc_step(shard, 0);
+    return __gc_finish(shard);
+}
 #define VICTIM_RB_SZ 131072
 #define MAX_SEARCH 131072
 
@@ -3620,18 +4274,19 @@ static void __collect_victims(struct demand_shard *shard, uint32_t target_g) {
     candidates = &shard->candidates;
     have_victims = &shard->have_victims;
 
-    dist = vb.head - vb.tail;
+    dist = cache->vb->head - cache->vb->tail;
     if(dist < 0) {
         dist += VICTIM_RB_SZ;
     }
 
     if(dist > (GRAIN_PER_PAGE * 10)) {
         atomic_set(have_victims, 1);
+        wake_up(&shard->ev_done_wq);
         return;
     }
 
 again:
-    victim = fifo_dequeue(cache->fifo);
+    victim = cache_dequeue(cache);
 
     for(int i = 0; i < MAX_SEARCH; i++) {
         if(!victim) {
@@ -3672,8 +4327,8 @@ again:
 
         NVMEV_ASSERT(victim);
 
-        vb.hts[vb.head] = victim;
-        vb.head = (vb.head + 1) % VICTIM_RB_SZ;
+        cache->vb->hts[cache->vb->head] = victim;
+        cache->vb->head = (cache->vb->head + 1) % VICTIM_RB_SZ;
 
         atomic_add(g_len, candidates);
 
@@ -3683,7 +4338,7 @@ again:
         }
     
         atomic_set(&victim->outgoing, 0);
-        victim = fifo_dequeue(cache->fifo);
+        victim = cache_dequeue(cache);
     }
 
     if(atomic_read(candidates) < target_g) {
@@ -3691,11 +4346,22 @@ again:
             return;
         }
 
-        cond_resched();
+        /*
+         * Nothing else to pick yet. Unless the cache is full, no writer
+         * is blocked on us, so sleep until it fills instead of spinning.
+         */
+        if(cache_full(cache)) {
+            cond_resched();
+        } else {
+            wait_event_interruptible_timeout(shard->ev_wq,
+                    cache_full(cache) || kthread_should_stop(),
+                    msecs_to_jiffies(1));
+        }
         goto again;
     }
 
     atomic_set(have_victims, 1);
+    wake_up(&shard->ev_done_wq);
     return;
 }
 
@@ -3703,7 +4369,6 @@ int bg_ev_t(void *data) {
     struct demand_shard *shard;
     struct cache *cache;
     struct write_flow_control *wfc;
-    uint32_t threshold;
     atomic_t *have_victims;
 
     NVMEV_INFO("Started background eviction thread.\n");
@@ -3711,15 +4376,25 @@ int bg_ev_t(void *data) {
     shard = (struct demand_shard*) data;
     cache = &shard->cache;
     wfc = &(shard->wfc);
-    threshold = cache->max_cached_tentries >> 2;
     have_victims = &shard->have_victims;
 
     while(!kthread_should_stop()) {
-        if(atomic_read(have_victims) == 0) {
+        /*
+         * Woken when the cache crosses ev_wmark, when an eviction
+         * consumes our victims, or directly by __evict_one.
+         */
+        wait_event_interruptible_timeout(shard->ev_wq,
+                __should_collect(shard) || kthread_should_stop(),
+                msecs_to_jiffies(BG_POLL_MS));
+
+        if(kthread_should_stop()) {
+            break;
+        }
+
+        if(__should_collect(shard)) {
             atomic_set(&shard->candidates, 0);
             __collect_victims(shard, GRAIN_PER_PAGE);
         }
-        cond_resched();
     }
 
     NVMEV_INFO("Evict thread returning!\n");
@@ -3727,40 +4402,87 @@ int bg_ev_t(void *data) {
     return 0;
 }
 
-void gc(void)
+void gc(struct nvmev_ns *ns)
+{
+    struct demand_shard *shards = (struct demand_shard*) ns->ftls;
+
+    for(int i = 0; i < ns->nr_parts; i++) {
+        mutex_lock(&shards[i].gcw->lock);
+        do_gc(&shards[i], true);
+        mutex_unlock(&shards[i].gcw->lock);
+        wake_up_all(&shards[i].gc_done_wq);
+    }
+}
+
+static bool __worker_should_gc(struct gc_worker *w)
 {
-    do_gc(__g_shard, true);
+    for(uint32_t i = w->id; i < w->nr_parts; i += nr_gc_workers) {
+        if(should_gc(&w->shards[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * The next of our shards that needs GC, starting after the one we
+ * collected last so one busy shard can't starve the others.
+ */
+static struct demand_shard *__worker_next_shard(struct gc_worker *w)
+{
+    for(uint32_t n = 0; n < w->nr_parts; n += nr_gc_workers) {
+        uint32_t i = w->next;
+
+        w->next += nr_gc_workers;
+        if(w->next >= w->nr_parts) {
+            w->next = w->id;
+        }
+
+        if(should_gc(&w->shards[i])) {
+            return &w->shards[i];
+        }
+    }
+    return NULL;
 }
 
 int bg_gc_t(void *data) {
+    struct gc_worker *w = (struct gc_worker*) data;
     struct demand_shard *shard;
-    struct cache *cache;
-    struct write_flow_control *wfc;
-
-    NVMEV_INFO("Started background GC thread.\n");
+    uint32_t slice = nvmev_vdev->config.gc_slice;
 
-    shard = (struct demand_shard*) data;
-    cache = &shard->cache;
-    wfc = &(shard->wfc);
+    NVMEV_INFO("Started background GC worker %u.\n", w->id);
 
     while(!kthread_should_stop()) {
-        if(!should_gc(shard)) {
-            cond_resched();
-            continue;
+        wait_event_interruptible_timeout(w->wq,
+                w->active || __worker_should_gc(w) || kthread_should_stop(),
+                msecs_to_jiffies(BG_POLL_MS));
+
+        if(kthread_should_stop()) {
+            break;
         }
 
-        if(atomic_cmpxchg(&gcing, 0, 1) != 0) {
-            cond_resched();
-            continue;
+        /*
+         * Copy one slice of the current victim, then drop the lock and
+         * yield so stores waiting on credits can run before the next.
+         */
+        mutex_lock(&w->lock);
+        if(!w->active) {
+            shard = __worker_next_shard(w);
+            if(shard && __gc_begin(shard, true)) {
+                w->active = shard;
+            }
         }
 
-        if(do_gc(shard, true) != UINT_MAX) {
-            spin_lock(&wfc_spin);
-            wfc->write_credits += wfc->credits_to_refill;
-            spin_unlock(&wfc_spin);
+        shard = w->active;
+        if(shard && __gc_step(shard, slice)) {
+            __gc_finish(shard);
+            w->active = NULL;
         }
+        mutex_unlock(&w->lock);
 
-        atomic_set(&gcing, 0);
+        if(shard) {
+            wake_up_all(&shard->gc_done_wq);
+        }
         cond_resched();
     }
 
@@ -3782,20 +4504,38 @@ static uint64_t forground_gc(struct demand_shard *demand_shard)
     //    do_gc(demand_shard, false);
     //}
 
-    while(should_gc_high(demand_shard)) {
-        cpu_relax();
+    /*
+     * Stall the writer until our GC worker has handed back some credits
+     * or freed enough lines. Credits come back a slice at a time, so the
+     * stall is bounded by one slice rather than a whole line, as long as
+     * GC keeps GC_RESERVE_LINES free lines to copy into.
+     */
+    if(!__fg_can_write(demand_shard)) {
+        start = ktime_get();
+        wake_up(&demand_shard->gcw->wq);
+        __spin_then_sleep(demand_shard->gc_done_wq,
+                          __fg_can_write(demand_shard));
+        end = ktime_get();
+
+        demand_shard->stats.fg_gc_stalls++;
+        demand_shard->stats.fg_gc_stall_us += ktime_to_us(end) - ktime_to_us(start);
     }
    
     return nsecs_latest;
 }
 
+/*
+ * Whether ppa2 can be read in the same (multi-plane) read as ppa1: the
+ * same flash page of the same block on any plane of the same LUN.
+ */
 static bool is_same_flash_page(struct demand_shard *demand_shard, struct ppa ppa1, struct ppa ppa2)
 {
     struct ssdparams *spp = &demand_shard->ssd->sp;
     uint64_t ppa1_page = ppa1.g.pg / spp->pgs_per_flashpg;
     uint64_t ppa2_page = ppa2.g.pg / spp->pgs_per_flashpg;
 
-    return (ppa1.h.blk_in_ssd == ppa2.h.blk_in_ssd) && (ppa1_page == ppa2_page);
+    return ppa1.g.ch == ppa2.g.ch && ppa1.g.lun == ppa2.g.lun && 
+           ppa1.g.blk == ppa2.g.blk && (ppa1_page == ppa2_page);
 }
 
 struct pte_e_args {
@@ -3839,12 +4579,10 @@ static void __expand_map_entry(struct demand_shard *shard,
     struct ssdparams *spp;
     struct ppa p;
     uint64_t ppa;
-    uint64_t **oob;
     uint32_t t_ppa;
 
     cache = &shard->cache;
     spp = &shard->ssd->sp;
-    oob = shard->oob;
     t_ppa = atomic_read(&ht->t_ppa);
 
     NVMEV_DEBUG("Invalidating IDX %u PPA %u grain %llu len %u before expand.\n", 
@@ -3858,13 +4596,13 @@ static void __expand_map_entry(struct demand_shard *shard,
     NVMEV_ASSERT(ht->len_on_disk < GRAIN_PER_PAGE);
 
 skip:
-    spin_lock(&ev_spin);
+    spin_lock(&shard->ev_spin);
     p = get_new_page(shard, MAP_IO);
     ppa = ppa2pgidx(shard, &p);
 
     advance_write_pointer(shard, MAP_IO);
     mark_page_valid(shard, &p);
-    spin_unlock(&ev_spin);
+    spin_unlock(&shard->ev_spin);
     mark_grain_valid(shard, PPA_TO_PGA(ppa, 0), GRAIN_PER_PAGE);
 
     if(ppa == 0) {
@@ -3875,9 +4613,10 @@ skip:
     atomic_set(&ht->t_ppa, ppa);
     ht->g_off = 0;
     ht->len_on_disk++;
-    spin_lock(&entry_spin);
+    spin_lock(&shard->entry_spin);
     cache->nr_cached_tentries++;
-    spin_unlock(&entry_spin);
+    spin_unlock(&shard->entry_spin);
+    __kick_ev(shard);
 
     if(ht->state == C_CANDIDATE) {
         atomic_inc(&shard->candidates);
@@ -3888,10 +4627,8 @@ skip:
         ht->state = DIRTY;
     }
 
-    oob[ppa][0] = ((uint64_t) ht->len_on_disk << 32) | (ht->idx * EPP);
-    for(int i = ht->len_on_disk; i < GRAIN_PER_PAGE; i++) {
-        oob[ppa][i] = UINT_MAX;
-    }
+    __oob_set_pair(shard, ppa, 0, (ht->idx * EPP), ht->len_on_disk);
+    __oob_fill(shard, ppa, ht->len_on_disk, UINT_MAX);
 
     if(GRAIN_PER_PAGE - ht->len_on_disk > 0) {
         mark_grain_invalid(shard, PPA_TO_PGA(ppa, ht->len_on_disk), 
@@ -3904,8 +4641,8 @@ static void __update_map(struct demand_shard *shard,
                          struct ht_section *ht,
                          lpa_t lpa, void* mem, 
                          struct h_to_g_mapping pte, 
-                         uint32_t pos, char* key,
-                         uint32_t klen, uint64_t *credits, 
+                         uint32_t pos, char* key, uint32_t klen,
+                         uint64_t hash, uint64_t *credits, 
                          bool record) {
     struct cache *cache = &shard->cache;
 
@@ -3913,19 +4650,15 @@ static void __update_map(struct demand_shard *shard,
     __mark_dirty(ht);
 #ifdef ORIGINAL
     ht->mappings[OFFSET(lpa)] = pte;
-    ht->pair_mem[OFFSET(lpa)] = mem;
+    ht_set_pair_mem(cache, ht, OFFSET(lpa), mem);
+
+    if(key && mem) {
+        ht_set_fp(ht_slot_get(cache, ht, OFFSET(lpa)), ht_fp(hash));
+    }
 #else
     struct root *root;
-    uint32_t max;
 
     root = (struct root*) ht->mappings;
-    max = root->cnt * IN_LEAF;
-
-    if(ht->cached_cnt == max && pos == UINT_MAX) {
-        __expand_map_entry(shard, ht, pte, mem);
-        twolevel_expand(root);
-        twolevel_reload(ht, root, UINT_MAX, UINT_MAX);
-    }
 
     if(pos != UINT_MAX) {
         ppa_t old_ppa;
@@ -3935,24 +4668,35 @@ static void __update_map(struct demand_shard *shard,
             /*
              * == UINT_MAX means this pair had been deleted before. 
              */
-            __record_inv_mapping(shard, lpa, old_ppa, UINT_MAX, 0, credits);
+            __record_inv_mapping(shard, __oob(shard, G_IDX(old_ppa), G_OFFSET(old_ppa)),
+                                 old_ppa, UINT_MAX, 0, credits);
         }
     }
 
-    twolevel_insert(ht, root, lpa, atomic_read(&pte.ppa), pos);
+    if(!twolevel_insert(ht, root, lpa, atomic_read(&pte.ppa), pos)) {
+        /*
+         * The leaf, and every leaf close enough to shift into, is full.
+         * Grow the section by a grain and split the leaf into it.
+         */
+        __expand_map_entry(shard, ht, pte, mem);
+        twolevel_split(ht, root, lpa, atomic_read(&pte.ppa));
+    }
     //NVMEV_INFO("Set LPA %u to PPA %u line %u in %s\n", 
     //             lpa, atomic_read(&pte.ppa), 
     //             __grain2lineid(shard, atomic_read(&pte.ppa)),
     //             __func__);
 
-    ht->pair_mem[OFFSET(lpa)] = mem;
+    ht_set_pair_mem(cache, ht, OFFSET(lpa), mem);
 
-    if(key) {
-        if(!ht->keys[OFFSET(lpa)]) {
-            ht->keys[OFFSET(lpa)] = (char*) kzalloc(16, GFP_KERNEL);
+    if(key && mem) {
+        struct ht_slot *s = ht_slot_get(cache, ht, OFFSET(lpa));
+
+        if(!s->key) {
+            s->key = (char*) kzalloc(16, GFP_KERNEL);
         }
 
-        memcpy(ht->keys[OFFSET(lpa)], key, klen);
+        memcpy(s->key, key, klen);
+        ht_set_fp(s, ht_fp(hash));
     }
     return;
 #endif
@@ -3966,12 +4710,62 @@ static uint64_t __stime_or_clock(uint64_t stime) {
     return clock > stime ? clock : stime;
 }
 
+static inline bool __stopping(void)
+{
+    return (current->flags & PF_KTHREAD) && kthread_should_stop();
+}
+
+/*
+ * Admit bytes of a store into the write buffer shared by all shards.
+ * When it's full we wait for earlier programs to finish, as io.c hands
+ * their space back when they retire and buffer_release wakes us.
+ * Returns when the bytes are in, or unadmitted if our thread is told to
+ * stop while waiting.
+ */
+static uint64_t __wbuf_admit(struct demand_shard *shard, struct user_stream *stream,
+                             uint32_t bytes, uint64_t nsecs_latest)
+{
+    struct buffer *wbuf = shard->ssd->write_buffer;
+    bool admitted = false;
+    ktime_t start, end;
+
+    if(buffer_allocate(wbuf, bytes) < bytes) {
+        start = ktime_get();
+        __spin_then_sleep(wbuf->wq,
+                          (admitted = buffer_allocate(wbuf, bytes) >= bytes) ||
+                          __stopping());
+        end = ktime_get();
+
+        shard->stats.wbuf_stalls++;
+        shard->stats.wbuf_stall_us += ktime_to_us(end) - ktime_to_us(start);
+        nsecs_latest = __stime_or_clock(nsecs_latest);
+
+        if(!admitted) {
+            return nsecs_latest;
+        }
+    }
+
+    stream->wbuf_pending += bytes;
+    return nsecs_latest;
+}
+
+/*
+ * The stream skipped ahead without programming what it had buffered,
+ * so nothing will retire that space later.
+ */
+static void __wbuf_drop(struct demand_shard *shard, struct user_stream *stream)
+{
+    if(stream->wbuf_pending) {
+        buffer_release(shard->ssd->write_buffer, stream->wbuf_pending);
+        stream->wbuf_pending = 0;
+    }
+}
+
 static uint64_t __evict_one(struct demand_shard *shard, struct nvmev_request *req,
                             uint64_t stime, uint64_t *credits) {
     struct cache *cache;
     struct ssdparams *spp;
     struct ht_section* victim;
-    uint64_t **oob;
     bool got_ppa, got_lock;
     uint32_t grain, g_len, cnt;
     uint32_t t_ppa;
@@ -3984,7 +4778,6 @@ static uint64_t __evict_one(struct demand_shard *shard, struct nvmev_request *re
 
     cache = &shard->cache;
     spp = &shard->ssd->sp;
-    oob = shard->oob;
     got_ppa = got_lock = false;
     grain = g_len = cnt = 0;
     ppa = UINT_MAX;
@@ -3993,10 +4786,13 @@ static uint64_t __evict_one(struct demand_shard *shard, struct nvmev_request *re
     evicted = 0;
     have_victims = &shard->have_victims;
 
-    while(atomic_cmpxchg(have_victims, 1, 2) != 1) {
-        cpu_relax();
+    if(atomic_read(have_victims) != 1) {
+        wake_up(&shard->ev_wq);
     }
 
+    __spin_then_sleep(shard->ev_done_wq,
+                      atomic_cmpxchg(have_victims, 1, 2) == 1);
+
     while(cache->nr_cached_tentries > 
           cache->max_cached_tentries - GRAIN_PER_PAGE) {
         if(grain == GRAIN_PER_PAGE) {
@@ -4007,13 +4803,13 @@ new_page:
                 .type = USER_IO,
                 .cmd = NAND_WRITE,
                 .interleave_pci_dma = false,
-                .xfer_size = spp->pgsz * spp->pgs_per_oneshotpg,
+                .xfer_size = spp->pgsz * spp->pgs_per_prog,
             };
 
             if (!shard->fastmode && last_pg_in_wordline(shard, &p)) {
                 swr.stime = __stime_or_clock(stime);
                 swr.ppa = &p;
-                shard->stats.trans_w += spp->pgsz * spp->pgs_per_oneshotpg;
+                shard->stats.trans_w += spp->pgsz * spp->pgs_per_prog;
                 nsecs_completed = ssd_advance_nand(shard->ssd, &swr);
             }
 
@@ -4021,7 +4817,7 @@ new_page:
             got_ppa = false;
         }
 
-        victim = vb.hts[vb.tail]; 
+        victim = cache->vb->hts[cache->vb->tail]; 
 
         NVMEV_ASSERT(victim);
         NVMEV_ASSERT(victim->mem);
@@ -4045,14 +4841,12 @@ new_page:
             mark_grain_valid(shard, PPA_TO_PGA(ppa, grain), GRAIN_PER_PAGE - grain);
             mark_grain_invalid(shard, PPA_TO_PGA(ppa, grain), GRAIN_PER_PAGE - grain);
 
-            for(int i = grain; i < GRAIN_PER_PAGE; i++) {
-                oob[ppa][i] = UINT_MAX;
-            }
+            __oob_fill(shard, ppa, grain, UINT_MAX);
 
             goto new_page;
         }
 
-        vb.tail = (vb.tail + 1) % VICTIM_RB_SZ;
+        cache->vb->tail = (cache->vb->tail + 1) % VICTIM_RB_SZ;
         t_ppa = atomic_read(&victim->t_ppa);
 
         if (victim->state == D_CANDIDATE) {
@@ -4078,13 +4872,13 @@ new_page:
 skip:;
             uint64_t prev_ppa = t_ppa;
             if(!got_ppa) {
-                spin_lock(&ev_spin);
+                spin_lock(&shard->ev_spin);
                 p = get_new_page(shard, MAP_IO);
                 ppa = ppa2pgidx(shard, &p);
 
                 advance_write_pointer(shard, MAP_IO);
                 mark_page_valid(shard, &p);
-                spin_unlock(&ev_spin);
+                spin_unlock(&shard->ev_spin);
 
                 if(ppa == 0) {
                     mark_grain_valid(shard, PPA_TO_PGA(ppa, 0), GRAIN_PER_PAGE);
@@ -4120,7 +4914,7 @@ skip:;
              * section to update.
              */
 
-            oob[ppa][grain] = ((uint64_t) g_len << 32) | (victim->idx * EPP);
+            __oob_set_pair(shard, ppa, grain, (victim->idx * EPP), g_len);
 
             mark_grain_valid(shard, PPA_TO_PGA(ppa, grain), g_len);
 
@@ -4137,9 +4931,9 @@ skip:;
 
         evicted += g_len;
 
-        spin_lock(&entry_spin);
+        spin_lock(&shard->entry_spin);
         cache->nr_cached_tentries -= g_len;
-        spin_unlock(&entry_spin);
+        spin_unlock(&shard->entry_spin);
 
         victim->mappings = NULL;
         victim->state = CLEAN;
@@ -4162,9 +4956,7 @@ skip:;
         mark_grain_valid(shard, PPA_TO_PGA(ppa, grain), GRAIN_PER_PAGE - grain);
         mark_grain_invalid(shard, PPA_TO_PGA(ppa, grain), GRAIN_PER_PAGE - grain);
 
-        for(int i = grain; i < GRAIN_PER_PAGE; i++) {
-            oob[ppa][i] = UINT_MAX;
-        }
+        __oob_fill(shard, ppa, grain, UINT_MAX);
     }
 
     if(got_ppa) {
@@ -4173,18 +4965,19 @@ skip:;
             .type = USER_IO,
             .cmd = NAND_WRITE,
             .interleave_pci_dma = false,
-            .xfer_size = spp->pgsz * spp->pgs_per_oneshotpg,
+            .xfer_size = spp->pgsz * spp->pgs_per_prog,
         };
 
         if (!shard->fastmode && last_pg_in_wordline(shard, &p)) {
             swr.stime = __stime_or_clock(stime);
             swr.ppa = &p;
-            shard->stats.trans_w += spp->pgsz * spp->pgs_per_oneshotpg;
+            shard->stats.trans_w += spp->pgsz * spp->pgs_per_prog;
             nsecs_completed = ssd_advance_nand(shard->ssd, &swr);
         }
     }
 
     atomic_set(have_victims, 0);
+    __kick_ev(shard);
     return nsecs_completed;
 }
 
@@ -4195,12 +4988,10 @@ uint64_t __get_one(struct demand_shard *shard, struct ht_section *ht,
     struct ht_section* victim;
     uint64_t nsecs_completed = 0;
     uint32_t grain, t_ppa;
-    uint64_t **oob;
 
     cache = &shard->cache;
     spp = &shard->ssd->sp;
     grain = ht->g_off;
-    oob = shard->oob;
     t_ppa = atomic_read(&ht->t_ppa);
 
     if(!first) {
@@ -4237,24 +5028,24 @@ uint64_t __get_one(struct demand_shard *shard, struct ht_section *ht,
         
         for(int i = 0; i < spp->pgsz / ENTRY_SIZE; i++) {
             atomic_set(&ht->mappings[i].ppa, UINT_MAX);
-            ht->pair_mem[i] = NULL;
         }
+
+        ht_entries_reset(cache, ht);
 #else
         twolevel_init((struct root*) ht->mappings);
 
         ht->len_on_disk = ORIG_GLEN;
         ht->g_off = 0;
 
-        for(int i = 0; i < EPP; i++) {
-            ht->pair_mem[i] = NULL;
-        }
+        ht_entries_reset(cache, ht);
 #endif
     }
 
-    fifo_enqueue(cache->fifo, (void*) ht);
-    spin_lock(&entry_spin);
+    cache_enqueue(cache, ht);
+    spin_lock(&shard->entry_spin);
     cache->nr_cached_tentries += ht->len_on_disk;
-    spin_unlock(&entry_spin);
+    spin_unlock(&shard->entry_spin);
+    __kick_ev(shard);
 
     *missed = true;
     shard->stats.cache_miss++;
@@ -4276,6 +5067,13 @@ struct ppa __skip_ppas(struct ssdparams *spp, struct ppa p,
         }
 
         p.g.pg -= spp->pgs_per_oneshotpg;
+        check_addr(p.g.pl, spp->pls_per_lun);
+        p.g.pl++;
+        if (p.g.pl != spp->pls_per_lun) {
+            continue;
+        }
+
+        p.g.pl = 0;
         check_addr(p.g.ch, spp->nchs);
         p.g.ch++;
         if (p.g.ch != spp->nchs) {
@@ -4453,6 +5251,10 @@ static uint64_t __retrieve_and_compare(struct demand_shard *shard, ppa_t grain,
     xfer_size = spp->pgsz;
     rem = read_len;
 
+    /*
+     * Issue the rest of the reads together once the key has been checked,
+     * so reads that land on the same die stream through its cache register.
+     */
     swr.stime = nsecs_latest;
 
     //NVMEV_INFO("Starting read of length %u from PPA %u offset %llu\n", 
@@ -4485,7 +5287,6 @@ static uint64_t __retrieve_and_compare(struct demand_shard *shard, ppa_t grain,
         } else if(xfer_size > 0) {
             swr.xfer_size = xfer_size;
             swr.ppa = &to_read;
-            swr.stime = 0;
             rds += (xfer_size / spp->pgsz);
             nsecs_completed = ssd_advance_nand(ssd, &swr);
             nsecs_latest = max(nsecs_latest, nsecs_completed);
@@ -4500,7 +5301,6 @@ static uint64_t __retrieve_and_compare(struct demand_shard *shard, ppa_t grain,
     if (xfer_size > 0) {
         swr.xfer_size = xfer_size;
         swr.ppa = &to_read;
-        swr.stime = 0;
         nsecs_completed = ssd_advance_nand(ssd, &swr);
         nsecs_latest = max(nsecs_completed, nsecs_latest);
         rds += (xfer_size / spp->pgsz);
@@ -4516,34 +5316,173 @@ static uint64_t __retrieve_and_compare(struct demand_shard *shard, ppa_t grain,
     return 0;
 }
 
+static_assert(HASH_PROBE_WIN < EPP);
+static_assert(HASH_MAX_PROBES <= MAX_HASH_COLLISION);
+
+/*
+ * The hash each of a key's two choices comes from.
+ */
+static inline uint32_t __probe_hash(struct hash_params *h, uint32_t choice)
+{
+    if(!choice) {
+        return (uint32_t) h->hash;
+    }
+
+    return (uint32_t) ((h->hash * GOLDEN_RATIO_64) >> 32);
+}
+
+/*
+ * Section that hash h maps to, counting from the first section after
+ * section 0. Sections below lh_split were already split at this level,
+ * so they take one more bit of the hash.
+ */
+static uint32_t __lh_section(struct cache *c, uint32_t h)
+{
+    uint32_t n = c->lh_base << c->lh_level;
+
+    if((h & (n - 1)) < c->lh_split) {
+        return h & ((n << 1) - 1);
+    }
+
+    return h & (n - 1);
+}
+
+/*
+ * Whether more than LH_LOAD_PCT of the slots in use are taken, and
+ * there's still a section left to split into.
+ */
+static bool __lh_split_due(struct cache *c)
+{
+    uint32_t size = (c->lh_base << c->lh_level) + c->lh_split;
+
+    return size < c->lh_max && 
+           (uint64_t) atomic64_read(&c->lh_used) * 100 >
+           (uint64_t) LH_LOAD_PCT * size * (EPP - 1);
+}
+
+/*
+ * Returns the hash index probe h->cnt lands on, or UINT_MAX once there's
+ * nothing left to probe, which is after the first window unless the key
+ * may have spilled.
+ * Window starts are mapped with reciprocal_scale() (a multiply and shift)
+ * from the top bits of the hash, as the section comes from the low ones.
+ */
+static uint32_t __probe_resolve(struct cache *c, struct hash_params *h)
+{
+    uint32_t choice, hash, section, start;
+
+    if(h->cnt < HASH_MAX_PROBES) {
+        choice = PROBE_CHOICE(h->cnt);
+
+        /*
+         * A key only goes to its second choice when the first was full.
+         */
+        if(!choice || h->spill) {
+            hash = __probe_hash(h, choice);
+            section = __lh_section(c, hash);
+
+            /*
+             * Skip anything in mapping table entry 0 for now, as it
+             * complicates things like OOB checking where 0 can be
+             * meaningful or not. Slot 0 of every other section is skipped
+             * too, which keeps a window from running off the end of its
+             * section.
+             */
+            start = 1 + reciprocal_scale(hash, EPP - HASH_PROBE_WIN);
+            return IDX2LPA(section + 1) + start + (h->cnt % HASH_PROBE_WIN);
+        }
+    }
+
+    h->cnt = HASH_MAX_PROBES;
+    return UINT_MAX;
+}
+
+/*
+ * Returns the hash index for probe h_params->cnt, or UINT_MAX once every
+ * window has been tried.
+ */
 uint32_t get_hash_idx(struct cache *cache, void *_h_params) {
     struct hash_params *h_params = (struct hash_params *)_h_params;
-again:
-    h_params->lpa = PROBING_FUNC(h_params->hash, h_params->cnt) % 
-                    (cache->nr_valid_tentries - 1) + 1;
 
     /*
-     * Skip anything in mapping table entry 0 for now, as it complicates
-     * things like OOB checking where 0 can be meaningful or not.
+     * Ran off the end of the first window without passing a free slot.
      */
-    if(h_params->lpa <= EPP) {
-        h_params->cnt++;
-        goto again;
+    if(h_params->cnt == HASH_PROBE_WIN && !h_params->gap) {
+        h_params->spill = true;
     }
-    
+
+    h_params->lpa = __probe_resolve(cache, h_params);
+
+    if(h_params->lpa != UINT_MAX) {
+        h_params->probes++;
+    }
+
     return h_params->lpa;
 }
 
+/*
+ * Probing section ht for the key's first choice. If keys were ever pushed
+ * out of it, the key could be in its second choice too.
+ */
+static inline void __probe_note(struct hash_params *h, struct ht_section *ht)
+{
+    if(PROBE_CHOICE(h->cnt) == 0 && ht->spills) {
+        h->spill = true;
+    }
+}
+
+/*
+ * The probe at h->cnt found a free slot (or a whole section that was never
+ * written, if whole). Deletes and splits leave holes behind, so the key can
+ * still be further along the window, unless the whole section is empty.
+ * Returns false if there's nothing left to probe.
+ */
+static bool __probe_next_window(struct cache *c, struct hash_params *h, bool whole)
+{
+    h->gap = true;
+
+    if(whole) {
+        h->cnt = ((h->cnt / HASH_PROBE_WIN) + 1) * HASH_PROBE_WIN;
+    } else {
+        h->cnt++;
+    }
+
+    return __probe_resolve(c, h) != UINT_MAX;
+}
+
+/*
+ * A store found a free slot at h->cnt. Keeps the first one seen as the
+ * place for a new key, then goes on to make sure the key isn't already
+ * further along. Returns true if there is more to look at, otherwise
+ * points h->cnt at the slot to take.
+ */
+static bool __store_free_slot(struct cache *c, struct hash_params *h, 
+                              int *ins_cnt, bool whole)
+{
+    if(*ins_cnt < 0) {
+        *ins_cnt = h->cnt;
+    }
+
+    if(__probe_next_window(c, h, whole)) {
+        return true;
+    }
+
+    h->cnt = *ins_cnt;
+    return false;
+}
+
 uint64_t __release_map_multi(void *voidargs, uint64_t* a, uint64_t* b) {
+    struct demand_shard *shard = (struct demand_shard*) voidargs;
+
     for(int i = 0; i < IN_TXN; i++) {
-        if(multi_ht[i]) {
-            NVMEV_INFO("Dec %p in multi_ht.\n", multi_ht[i]);
-            atomic_dec(multi_ht[i]);
-            multi_ht[i] = NULL;
+        if(shard->multi_ht[i]) {
+            NVMEV_INFO("Dec %p in multi_ht.\n", shard->multi_ht[i]);
+            atomic_dec(shard->multi_ht[i]);
+            shard->multi_ht[i] = NULL;
         }
     }
 
-    multi_idx = 0;
+    shard->multi_idx = 0;
     return 0;
 }
 
@@ -4559,9 +5498,8 @@ uint64_t __release_buf(void *voidargs, uint64_t* a, uint64_t* b) {
     return 0;
 }
 
-atomic_t buf_lock[NUM_APPEND_BUFS];
-void __wait_buf(uint32_t num) {
-    while(atomic_read(&buf_lock[num]) > 0) {
+void __wait_buf(struct demand_shard *shard, uint32_t num) {
+    while(atomic_read(&shard->buf_lock[num]) > 0) {
         cpu_relax();
     }
 }
@@ -4576,8 +5514,8 @@ bool __key_match(char* key1, char *key2, uint32_t len) {
     return !(memcmp(key1, key2, len));
 }
 
-uint32_t leftover_credits = 0;
-static uint32_t __get_append_buf(char* key, uint8_t klen, bool* need_new);
+static uint32_t __get_append_buf(struct demand_shard *shard, char* key, uint8_t klen, 
+                                 bool* need_new);
 static bool __retrieve(struct nvmev_ns *ns, struct nvmev_request *req, 
                    struct nvmev_result *ret, bool for_del) {
     struct demand_shard *demand_shards = (struct demand_shard *)ns->ftls;
@@ -4606,7 +5544,7 @@ static bool __retrieve(struct nvmev_ns *ns, struct nvmev_request *req,
 
     char* key = cmd->kv_retrieve.key;
     uint64_t hash = CityHash64(key, klen);
-    struct demand_shard *shard = &demand_shards[hash % SSD_PARTITIONS];
+    struct demand_shard *shard = &demand_shards[SHARD_OF(hash)];
     struct ssd *ssd = shard->ssd;
     struct ssdparams *spp = &ssd->sp;
 
@@ -4635,32 +5573,34 @@ static bool __retrieve(struct nvmev_ns *ns, struct nvmev_request *req,
     h.hash = hash;
     h.cnt = 0;
     h.lpa = 0;
+    h.probes = 0;
+    h.gap = false;
+    h.spill = false;
 
-    uint64_t **oob = shard->oob;
 
     bool need_new;
-    uint32_t buf = __get_append_buf(cmd->kv_retrieve.key, klen, &need_new);
+    uint32_t buf = __get_append_buf(shard, cmd->kv_retrieve.key, klen, &need_new);
 
     //if(need_new) {
     //    NVMEV_DEBUG("We need a new buffer!\n");
     //}
 
     if(buf != UINT_MAX) {
-        cur_append_key = append_keys[buf];
-        cur_append_klen = append_klens[buf];
-        cur_append_buf = append_bufs[buf];
-        wb_idx = wb_idxs[buf];
-        lru_cache_get(&buf_lru, buf);
+        shard->cur_append_key = shard->append_keys[buf];
+        shard->cur_append_klen = shard->append_klens[buf];
+        shard->cur_append_buf = shard->append_bufs[buf];
+        shard->wb_idx = shard->wb_idxs[buf];
+        lru_cache_get(&shard->buf_lru, buf);
     } else {
-        cur_append_klen = 0;
-        cur_append_key = NULL;
-        cur_append_buf = NULL;
+        shard->cur_append_klen = 0;
+        shard->cur_append_key = NULL;
+        shard->cur_append_buf = NULL;
     }
 
-    //if(cur_append_klen == klen && 
-    //   !memcmp(cur_append_key, key, cur_append_klen)) {
+    //if(shard->cur_append_klen == klen && 
+    //   !memcmp(shard->cur_append_key, key, shard->cur_append_klen)) {
     if(buf != UINT_MAX) {    
-        r_offset += sizeof(cur_append_klen) + cur_append_klen + sizeof(uint32_t);
+        r_offset += sizeof(shard->cur_append_klen) + shard->cur_append_klen + sizeof(uint32_t);
 
         if(!for_del) {
             NVMEV_DEBUG("Got a read for something append buffer %u. "
@@ -4670,58 +5610,58 @@ static bool __retrieve(struct nvmev_ns *ns, struct nvmev_request *req,
                         "Offset %u\n", r_offset);
         }
 
-        if(r_offset < sizeof(cur_append_klen) + cur_append_klen + sizeof(uint32_t)) {
+        if(r_offset < sizeof(shard->cur_append_klen) + shard->cur_append_klen + sizeof(uint32_t)) {
             cmd->kv_retrieve.value_len = 0;
             cmd->kv_retrieve.rsvd = U64_MAX;
             status = KV_ERR_KEY_NOT_EXIST;
             goto out;
-        //} else if((r_offset >= wb_idx) || (r_offset + vlen > wb_idx)) {
-        } else if(r_offset >= wb_idx) {
+        //} else if((r_offset >= shard->wb_idx) || (r_offset + vlen > shard->wb_idx)) {
+        } else if(r_offset >= shard->wb_idx) {
             NVMEV_ERROR("Tried to read or delete past the current append buffer!"
                         "Current buffer size is %u, offset was "
                         "%u. Read size was %u.\n",
-                        wb_idx, r_offset, for_del ? 0 : vlen);
+                        shard->wb_idx, r_offset, for_del ? 0 : vlen);
             cmd->kv_retrieve.value_len = 0;
             cmd->kv_retrieve.rsvd = U64_MAX;
             status = KV_ERR_KEY_NOT_EXIST;
             goto out;
-        } else if(r_offset + vlen > wb_idx) {
+        } else if(r_offset + vlen > shard->wb_idx) {
             NVMEV_ERROR("Tried to %s an offset too large for the current "
                         "append buffer! Current buffer size is %u, offset was "
                         "%u. %s size was %u. Changing vlen to %u. Offset %u\n",
-                        for_del ? "delete" : "read", wb_idx, r_offset, 
+                        for_del ? "delete" : "read", shard->wb_idx, r_offset, 
                         for_del ? "Delete" : "read", vlen, 
-                        wb_idx - r_offset, r_offset);
+                        shard->wb_idx - r_offset, r_offset);
             //cmd->kv_retrieve.value_len = 0;
             //cmd->kv_retrieve.rsvd = U64_MAX;
             //status = KV_ERR_KEY_NOT_EXIST;
            
-            vlen = wb_idx - r_offset;
+            vlen = shard->wb_idx - r_offset;
             cmd->kv_retrieve.value_len = vlen;
-            cmd->kv_retrieve.rsvd = ((uint64_t) cur_append_buf) + (uint64_t) r_offset;
+            cmd->kv_retrieve.rsvd = ((uint64_t) shard->cur_append_buf) + (uint64_t) r_offset;
             status = 0;
 
-            __wait_buf(buf);
+            __wait_buf(shard, buf);
             goto out;
         } else if(!for_del) {
             cmd->kv_retrieve.offset = r_offset;
             cmd->kv_retrieve.value_len = vlen;
-            cmd->kv_retrieve.rsvd = (uint64_t) (cur_append_buf + r_offset);
+            cmd->kv_retrieve.rsvd = (uint64_t) (shard->cur_append_buf + r_offset);
             status = 0;
 
-            __wait_buf(buf);
+            __wait_buf(shard, buf);
             goto out;
         } else {
             /*
              * Slooooooooooow.
              * Maybe replace this with __record_inv_mapping later.
              */
-            __wait_buf(buf);
-            memmove(cur_append_buf + r_offset, cur_append_buf + r_offset + vlen, vlen);
-            inv_cnts[buf] += vlen;
+            __wait_buf(shard, buf);
+            memmove(shard->cur_append_buf + r_offset, shard->cur_append_buf + r_offset + vlen, vlen);
+            shard->inv_cnts[buf] += vlen;
             NVMEV_DEBUG("Deleting %u bytes from offset %u in append buffer %u. inv_cnt %u\n",
-                         vlen, r_offset, buf, inv_cnts[buf]);
-            NVMEV_ASSERT(inv_cnts[buf] <= WB_SIZE);
+                         vlen, r_offset, buf, shard->inv_cnts[buf]);
+            NVMEV_ASSERT(shard->inv_cnts[buf] <= WB_SIZE);
             cmd->kv_retrieve.rsvd = U64_MAX;
             goto out;
         }
@@ -4730,8 +5670,8 @@ static bool __retrieve(struct nvmev_ns *ns, struct nvmev_request *req,
     NVMEV_DEBUG("%s of size %u for key %llu offset %u\n", 
                  for_del ? "Delete" : "Read", vlen, *(uint64_t*) key, r_offset);
 
-    credits += leftover_credits;
-    leftover_credits = 0;
+    credits += shard->leftover_credits;
+    shard->leftover_credits = 0;
 
     struct cache *cache = &shard->cache;
     while(cache_full(cache)) {
@@ -4750,15 +5690,11 @@ lpa:;
     lpa_t lpa = get_hash_idx(&shard->cache, &h);
     h.lpa = lpa;
 
-    //NVMEV_DEBUG("Trying to get HT for LPA %u\n", lpa);
-    ht = cache_get_ht(cache, lpa);
-    //NVMEV_DEBUG("Got HT for LPA %u\n", lpa);
-    uint32_t t_ppa = atomic_read(&ht->t_ppa);
-
-    if (h.cnt > shard->max_try) {
+    if (lpa == UINT_MAX) {
         /*
-         * max_try is the most we've collided so far.
+         * Looked through every window the key could be in.
          */
+        ht = NULL;
         cmd->kv_retrieve.value_len = 0;
         cmd->kv_retrieve.rsvd = U64_MAX;
 
@@ -4768,39 +5704,71 @@ lpa:;
 
         __warn_not_found(key, klen);
 
-        NVMEV_INFO("Failing key %s %llu in max_try cnt %u.\n", 
+        NVMEV_INFO("Failing key %s %llu after cnt %u.\n", 
                      (char*) cmd->kv_store.key, *(uint64_t*) cmd->kv_store.key, 
                      h.cnt);
         status = KV_ERR_KEY_NOT_EXIST;
         goto out;
     }
 
+    //NVMEV_DEBUG("Trying to get HT for LPA %u\n", lpa);
+    ht = cache_get_ht(cache, lpa);
+    //NVMEV_DEBUG("Got HT for LPA %u\n", lpa);
+    uint32_t t_ppa = atomic_read(&ht->t_ppa);
+    __probe_note(&h, ht);
+
     if(t_ppa == UINT_MAX) {
         NVMEV_INFO("Key %s (%llu) tried to read missing CMT entry LPA %u IDX %u. max_try %u\n", 
                      (char*) cmd->kv_store.key, *(uint64_t*) cmd->kv_store.key, 
                      lpa, ht->idx, shard->max_try);
-        h.cnt++;
+        __probe_next_window(cache, &h, true);
         atomic_set(&ht->outgoing, 0);
         goto lpa;
     }
 
 cache:
     if(cache_hit(ht)) { 
+        if(!missed) {
+            cache_access(cache, ht);
+        }
+
         struct h_to_g_mapping pte = cache_hidx_to_grain(ht, lpa, &pos);
         uint32_t g_from_pte = atomic_read(&pte.ppa);
         uint64_t g_to_del = UINT_MAX;
         void* old_mem;
 
+        if (!IS_INITIAL_PPA(pte.ppa) && !ht_fp_match(ht, OFFSET(lpa), ht_fp(hash))) {
+            /*
+             * Another key is in this slot, and its fingerprint says so
+             * without reading the pair. Go straight to the next probe.
+             */
+            shard->stats.fp_skip_r++;
+            h.cnt++;
+            pos = UINT_MAX;
+            atomic_set(&ht->outgoing, 0);
+            goto lpa;
+        }
+
+        if (IS_INITIAL_PPA(pte.ppa) && __probe_next_window(cache, &h, false)) {
+            /*
+             * A hole left by a delete or a split. The key may still be
+             * further along.
+             */
+            pos = UINT_MAX;
+            atomic_set(&ht->outgoing, 0);
+            goto lpa;
+        }
+
         if (!IS_INITIAL_PPA(pte.ppa)) {
             shard->stats.d_read_on_read += spp->pgsz;
-            old_mem = ht->pair_mem[OFFSET(lpa)];
+            old_mem = ht_pair_mem(ht, OFFSET(lpa));
 
-            uint32_t glen = __glen_from_oob(oob[G_IDX(g_from_pte)][G_OFFSET(g_from_pte)]);
+            uint32_t glen = __oob_glen(shard, G_IDX(g_from_pte), G_OFFSET(g_from_pte));
             NVMEV_DEBUG("LPA %u has grain %u PPA %u length %u.\n", lpa, g_from_pte,
                          g_from_pte / GRAIN_PER_PAGE, glen);
 
             uint32_t real_vlen = __vlen_from_value(old_mem);
-            bool key_match = __key_match(key, ht->keys[OFFSET(lpa)], klen);
+            bool key_match = __key_match(key, ht_key(ht, OFFSET(lpa)), klen);
 
             //if(key_match) {
             //    NVMEV_DEBUG("Matched %llu %llu\n", 
@@ -4851,11 +5819,12 @@ cache:
                     NVMEV_DEBUG("Deleting LPA %u PPA %u grain %u\n",
                                 lpa, g_from_pte / GRAIN_PER_PAGE, g_from_pte);
 
-                    kfree(old_mem);
+                    pair_free(old_mem);
                     mark_grain_invalid(shard, g_from_pte, glen);
                     atomic_set(&pte.ppa, UINT_MAX);
                     __update_map(shard, ht, lpa, NULL, pte, pos, 
-                                 key, klen, &credits, true);
+                                 key, klen, hash, &credits, true);
+                    atomic64_dec(&cache->lh_used);
                 } else {
                     /*
                      * Delete part of a pair.
@@ -4912,7 +5881,9 @@ cache:
                     NVMEV_DEBUG("Invalid mapping for offset %u LPA %u\n",
                                  r_offset, lpa);
 #ifndef ORIGINAL
-                    __record_inv_mapping(shard, lpa, g_from_pte, r_offset, vlen, &credits);
+                    __record_inv_mapping(shard, 
+                                         __oob(shard, G_IDX(g_from_pte), G_OFFSET(g_from_pte)),
+                                         g_from_pte, r_offset, vlen, &credits);
 #endif
                 }
             }
@@ -4963,6 +5934,10 @@ cache:
 out:
     shard->stats.read_req_cnt++;
 
+    if(status == NVME_SC_SUCCESS) {
+        shard->stats.r_hash_collision_cnt[min(h.probes - 1, MAX_HASH_COLLISION - 1)]++;
+    }
+
     nsecs_completed = __get_wallclock();
     nsecs_latest = max(nsecs_latest, nsecs_completed);
 
@@ -4977,7 +5952,7 @@ out:
                 (nsecs_latest - orig) / 1000);
 
     if(credits) {
-        leftover_credits += credits;
+        shard->leftover_credits += credits;
     }
 
     if(ht) {
@@ -5008,7 +5983,6 @@ static bool conv_delete(struct nvmev_ns *ns, struct nvmev_request *req,
     return __retrieve(ns, req, ret, true);
 }
 
-struct ppa cur_page;
 inline bool __crossing_page(struct ssdparams *spp, uint64_t offset, uint32_t vlen) {
     if(offset % spp->pgsz == 0) {
         return true;
@@ -5016,18 +5990,62 @@ inline bool __crossing_page(struct ssdparams *spp, uint64_t offset, uint32_t vle
     return !((offset % spp->pgsz) + vlen <= spp->pgsz);
 }
 
-static struct ppa __new_page(struct demand_shard *shard) 
+/*
+ * Bump the sketch for hash and return its estimated store count. Each
+ * row uses a different odd multiplier, so keys that collide in one row
+ * are unlikely to collide in the others.
+ */
+static uint32_t __heat_update(struct heat_sketch *hs, uint64_t hash)
+{
+    static const uint64_t mult[HEAT_ROWS] = {
+        0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+        0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL,
+    };
+    uint32_t est = U8_MAX;
+
+    for(int r = 0; r < HEAT_ROWS; r++) {
+        uint8_t *c = &hs->cnt[r][(hash * mult[r]) >> (64 - HEAT_BITS)];
+
+        if(*c < U8_MAX) {
+            (*c)++;
+        }
+        est = min_t(uint32_t, est, *c);
+    }
+
+    if(++hs->updates >= HEAT_DECAY) {
+        for(int r = 0; r < HEAT_ROWS; r++) {
+            for(int i = 0; i < HEAT_WIDTH; i++) {
+                hs->cnt[r][i] >>= 1;
+            }
+        }
+        hs->updates = 0;
+    }
+
+    return est;
+}
+
+/*
+ * A key stored once goes to stream 0, 2-3 times to stream 1, 4-7 times
+ * to stream 2 and so on, within the sketch's decay window.
+ */
+static inline uint32_t __pick_stream(struct demand_shard *shard, uint64_t hash)
+{
+    uint32_t est = __heat_update(&shard->heat, hash);
+    return min_t(uint32_t, ilog2(max_t(uint32_t, est, 1)), NR_STREAMS - 1);
+}
+
+static struct ppa __new_page(struct demand_shard *shard, uint32_t sid) 
 {
     struct ssdparams *spp;
     struct ppa p;
 
     spp = &shard->ssd->sp;
 again:
-    p = get_new_page(shard, USER_IO);
+    p = get_new_page(shard, STREAM_IO(sid));
 
     NVMEV_DEBUG("New page!\n");
 
-    advance_write_pointer(shard, USER_IO);
+    advance_write_pointer(shard, STREAM_IO(sid));
     mark_page_valid(shard, &p);
 
     uint64_t pgidx = ppa2pgidx(shard, &p);
@@ -5037,19 +6055,21 @@ again:
         goto again;
     }
 
-    shard->offset = ((uint64_t) ppa2pgidx(shard, &p)) * spp->pgsz;
+    shard->streams[sid].offset = ((uint64_t) ppa2pgidx(shard, &p)) * spp->pgsz;
+    shard->stats.stream_w[sid] += spp->pgsz;
 
     return p;
 }
 
-static uint32_t __get_append_buf(char* key, uint8_t klen, bool* need_new)
+static uint32_t __get_append_buf(struct demand_shard *shard, char* key, uint8_t klen, 
+                                 bool* need_new)
 {
     for(int i = 0; i < NUM_APPEND_BUFS; i++) {
-        if(append_klens[i] == klen && !memcmp(key, append_keys[i], klen)) {
+        if(shard->append_klens[i] == klen && !memcmp(key, shard->append_keys[i], klen)) {
             NVMEV_DEBUG("Already had append buf %d for key %s klen %u\n",
                         i, (char*) key, klen);
             return i;
-        } else if(append_klens[i] == 0) {
+        } else if(shard->append_klens[i] == 0) {
             //NVMEV_DEBUG("Klen for buffer %d is 0.\n", i);
             *need_new = false;
         }
@@ -5060,16 +6080,16 @@ static uint32_t __get_append_buf(char* key, uint8_t klen, bool* need_new)
     return UINT_MAX;
 } 
 
-static uint32_t __assign_buf(char* key, uint8_t klen) 
+static uint32_t __assign_buf(struct demand_shard *shard, char* key, uint8_t klen) 
 {
     for(int i = 0; i < NUM_APPEND_BUFS; i++) {
-        if(append_klens[i] == 0) {
+        if(shard->append_klens[i] == 0) {
             NVMEV_DEBUG("Assigning buffer %d to key %s\n", i, key);
-            NVMEV_ASSERT(wb_idxs[i] == 0);
-            memcpy(append_keys[i], key, klen);
-            append_klens[i] = klen;
-			append_lrus[i].id = i;
-            lru_cache_set(&buf_lru, &append_lrus[i]);
+            NVMEV_ASSERT(shard->wb_idxs[i] == 0);
+            memcpy(shard->append_keys[i], key, klen);
+            shard->append_klens[i] = klen;
+			shard->append_lrus[i].id = i;
+            lru_cache_set(&shard->buf_lru, &shard->append_lrus[i]);
             return i;
         }
     }
@@ -5077,22 +6097,37 @@ static uint32_t __assign_buf(char* key, uint8_t klen)
     NVMEV_ASSERT(false);
 }
 
-static void __clear_buf(uint32_t buf)
+static void __clear_buf(struct demand_shard *shard, uint32_t buf)
 {
     NVMEV_DEBUG("Clearing buf %u\n", buf);
-    append_klens[buf] = 0;
-    wb_idxs[buf] = 0;
-    inv_cnts[buf] = 0;
-	append_lrus[buf].id = UINT_MAX;
+    shard->append_klens[buf] = 0;
+    shard->wb_idxs[buf] = 0;
+    shard->inv_cnts[buf] = 0;
+    shard->append_hidx[buf] = UINT_MAX;
+	shard->append_lrus[buf].id = UINT_MAX;
+}
+
+/*
+ * Whether lpa is held for the key of an append buffer other than own.
+ */
+static bool __slot_reserved(struct demand_shard *shard, lpa_t lpa, uint32_t own)
+{
+    for(int i = 0; i < NUM_APPEND_BUFS; i++) {
+        if(i != own && shard->append_klens[i] && shard->append_hidx[i] == lpa) {
+            return true;
+        }
+    }
+
+    return false;
 }
 
 uint32_t last_evicted = 0;
-static uint32_t __smallest_buf(void)
+static uint32_t __smallest_buf(struct demand_shard *shard)
 {
-	struct item* oldest = lru_cache_get_oldest(&buf_lru);
+	struct item* oldest = lru_cache_get_oldest(&shard->buf_lru);
     uint32_t buf = oldest->id;
     //kfree(oldest);
-    NVMEV_DEBUG("Returning oldest buf %u size %u\n", buf, wb_idxs[buf]);
+    NVMEV_DEBUG("Returning oldest buf %u size %u\n", buf, shard->wb_idxs[buf]);
     return buf;
 
     //uint32_t smallest = UINT_MAX;
@@ -5103,22 +6138,22 @@ static uint32_t __smallest_buf(void)
     //    wrap = i % NUM_APPEND_BUFS;
 
     //    //NVMEV_INFO("Checking buf %u key %llu size %u\n", 
-    //    //            wrap, *(uint64_t*) append_keys[wrap], wb_idxs[wrap]);
-    //    if(wb_idxs[wrap] < smallest) {
+    //    //            wrap, *(uint64_t*) shard->append_keys[wrap], shard->wb_idxs[wrap]);
+    //    if(shard->wb_idxs[wrap] < smallest) {
     //        idx = wrap;
-    //        smallest = wb_idxs[wrap];
+    //        smallest = shard->wb_idxs[wrap];
     //    }
     //}
 
     //last_evicted = idx;
-    //NVMEV_INFO("Returning oldest buf %u size %u\n", idx, wb_idxs[idx]);
+    //NVMEV_INFO("Returning oldest buf %u size %u\n", idx, shard->wb_idxs[idx]);
     //return idx;
 }
 
-static bool __need_buf(void)
+static bool __need_buf(struct demand_shard *shard)
 {
     for(int i = 0; i < NUM_APPEND_BUFS; i++) {
-        if(append_klens[i] == 0) {
+        if(shard->append_klens[i] == 0) {
             return false;
         }
     }
@@ -5126,123 +6161,392 @@ static bool __need_buf(void)
 }
 
 uint32_t cnt = 0;
-static bool __store(struct nvmev_ns *ns, struct nvmev_request *req, 
-                    struct nvmev_result *ret, bool internal,
-                    bool append) 
-{
-    struct demand_shard *demand_shards = (struct demand_shard *)ns->ftls;
-    struct nvme_kv_command *cmd = (struct nvme_kv_command*) req->cmd;
-
-    uint64_t nsecs_latest = 0, nsecs_completed = 0, nsecs_xfer_completed = 0;
-    uint64_t credits = 0;
-    uint32_t allocated_buf_size;
 
-    uint8_t klen = cmd_key_length(cmd);
-    uint32_t vlen = cmd_value_length(cmd);
+/*
+ * Gives a section that was never written its first mapping page. The
+ * section is held, and __get_one(first) sets up its entries after this.
+ */
+static void __new_section(struct demand_shard *shard, struct ht_section *ht)
+{
+skip:
+    spin_lock(&shard->ev_spin);
+    struct ppa p = get_new_page(shard, MAP_IO);
+    ppa_t ppa = ppa2pgidx(shard, &p);
 
-    uint32_t append_buf_klen;
+    advance_write_pointer(shard, MAP_IO);
 
-    if(!append) {
-        /*
-         * The length of the key.
-         */
-        vlen += sizeof(uint8_t);
+    mark_page_valid(shard, &p);
+    spin_unlock(&shard->ev_spin);
 
-        /*
-         * The actual key.
-         */
-        vlen += klen;
+    mark_grain_valid(shard, PPA_TO_PGA(ppa, 0), GRAIN_PER_PAGE);
 
-        /*
-         * Real value length.
-         * We only write it on the flush of an appended-to buffer in the future
-         * when it's flushed.
-         */
-        vlen += VLEN_MARKER_SZ;
+    if(ppa == 0) {
+        mark_grain_invalid(shard, PPA_TO_PGA(ppa, 0), GRAIN_PER_PAGE);
+        goto skip;
     }
 
-    uint64_t glen;
-    uint64_t grain;
-    uint64_t page, start_page;
-    uint64_t g_off, start_g_off;
-    uint32_t status = 0;
+    atomic_set(&ht->t_ppa, ppa);
 
-    uint64_t start, end;
+    ht->mappings = NULL;
 
     /*
-     * Not using sharding right now.
+     * Despite the new scheme only using as many mapping entries as needed,
+     * instead of a full page each time, we still set the length to the
+     * size of a page here for the first ever access. We do this because
+     * if we were to set the length on disk to the actual amount of mappings
+     * the entry holds initially (1), we would need to add some logic to
+     * pack this mapping table entry into an existing page with other
+     * mapping table entries that are less than the size of a page right now.
+     *
+     * That's already being done in the eviction logic later, so we just
+     * set its length to the size of a page for now and waste some space
+     * until its evicted.
      */
-    struct demand_shard *shard = &demand_shards[0];
-    struct ssdparams *spp = &shard->ssd->sp;
-    struct buffer *wbuf = shard->ssd->write_buffer;
-
-    if(!shard->fastmode) {
-        nsecs_xfer_completed = ssd_advance_write_buffer(shard->ssd, req->nsecs_start, 
-                                                        vlen);
-        nsecs_latest = nsecs_xfer_completed;
-    }
 
-    bool flushing_prev = false;
-    bool checking_len = false;
+#ifdef ORIGINAL
+    __oob_set_pair(shard, ppa, 0, (ht->idx * EPP), GRAIN_PER_PAGE);
 
-    /*
-     * Space in memory for the pair. Not necessarily linked to the PPA.
-     */
-    char* pair_mem;
+    __oob_fill(shard, ppa, 1, UINT_MAX);
 
-    start = ktime_get();
+    ht->len_on_disk = GRAIN_PER_PAGE;
+#else
+    uint64_t glen = ORIG_GLEN;
+    __oob_set_pair(shard, ppa, 0, (ht->idx * EPP), glen);
 
-    uint32_t buf = UINT_MAX;
-    bool need_new = true;
-append:
-    pair_mem = NULL;
+    __oob_fill(shard, ppa, 1, UINT_MAX);
 
-    if(append && !checking_len && buf == UINT_MAX) {
-        need_new = true;
-        buf = __get_append_buf(cmd->kv_store.key, klen, &need_new);
+    if(!shard->fastmode) {
+        if(ORIG_GLEN < GRAIN_PER_PAGE) {
+            mark_grain_invalid(shard, PPA_TO_PGA(ppa, ORIG_GLEN), 
+                    GRAIN_PER_PAGE - ORIG_GLEN);
+        }
 
-        //if(need_new) {
-        //    NVMEV_DEBUG("We need a new buffer!\n");
-        //}
+        ht->len_on_disk = ORIG_GLEN;
+    } else {
+        ht->len_on_disk = 1;
+        ht->g_off = 0;
 
-        if(buf != UINT_MAX) {
-            cur_append_key = append_keys[buf];
-            cur_append_klen = append_klens[buf];
-            cur_append_buf = append_bufs[buf];
-            wb_idx = wb_idxs[buf];
-            need_new = false;
-            checking_len = false;
-            lru_cache_get(&buf_lru, buf);
-        } else {
-            cur_append_klen = 0;
-            cur_append_key = NULL;
-            cur_append_buf = NULL;
-            wb_idx = 0;
+        for(int i = 0; i < EPP; i++) {
+            ht->mappings[i].hidx = UINT_MAX;
+            atomic_set(&ht->mappings[i].ppa, UINT_MAX);
+        }
+    }
+#endif
+
+#ifndef ORIGINAL
+    ht->cached_cnt = 0;
+#endif
+    /*
+     * Marked dirty once __update_map() puts its first entry in.
+     */
+
+    ht->state = CLEAN;
+}
+
+/*
+ * Moves the pair in slot off of src to the same slot of dst, which keeps
+ * it in the same place of its window. Both sections are held.
+ */
+static void __lh_move(struct demand_shard *shard, struct ht_section *src,
+                      struct ht_section *dst, uint32_t off, void *mem,
+                      char *key, uint8_t klen, uint64_t hash)
+{
+    lpa_t from = IDX2LPA(src->idx) + off;
+    lpa_t to = IDX2LPA(dst->idx) + off;
+    struct h_to_g_mapping pte;
+    uint32_t pos = UINT_MAX;
+    uint32_t grain;
+
+#ifndef ORIGINAL
+    if(shard->fastmode) {
+        /*
+         * Nothing is mapped yet, only the slots say where pairs are.
+         */
+        struct cache *cache = &shard->cache;
+        struct ht_slot *s = ht_slot_find(src, off);
+        struct ht_slot *d = ht_slot_get(cache, dst, off);
+
+        d->pair_mem = s->pair_mem;
+        d->key = s->key;
+        d->fm_grain = grain = s->fm_grain;
+        ht_set_fp(d, ht_fp(hash));
+
+        s->key = NULL;
+        ht_slot_drop(cache, src, off);
+        xa_store(&shard->lh_moved, grain, xa_mk_value(to), GFP_KERNEL);
+        return;
+    }
+#endif
+
+    pte = cache_hidx_to_grain(src, from, &pos);
+    grain = atomic_read(&pte.ppa);
+    NVMEV_ASSERT(grain != UINT_MAX);
+
+    atomic_set(&pte.ppa, UINT_MAX);
+    __update_map(shard, src, from, NULL, pte, pos, NULL, 0, 0, NULL, false);
+
+#ifndef ORIGINAL
+    pte.hidx = to;
+#endif
+    atomic_set(&pte.ppa, grain);
+    __update_map(shard, dst, to, mem, pte, UINT_MAX, key, klen, hash, NULL, false);
+
+    xa_store(&shard->lh_moved, grain, xa_mk_value(to), GFP_KERNEL);
+}
+
+/*
+ * Whether the key with this hash at slot off of section from belongs to
+ * section from + n once from is split. The key is there through whichever
+ * of its choices has a window over off. Go by the first if both do, as
+ * that's always probed.
+ */
+static bool __lh_goes_to_new(uint32_t n, uint32_t from, uint32_t off, uint64_t hash)
+{
+    struct hash_params h;
+    uint32_t choice, ch = 0, start;
+
+    h.hash = hash;
+    for(choice = 0; choice < 2; choice++) {
+        ch = __probe_hash(&h, choice);
+        start = 1 + reciprocal_scale(ch, EPP - HASH_PROBE_WIN);
+
+        if((ch & (n - 1)) == from && 
+           off >= start && off < start + HASH_PROBE_WIN) {
+            break;
+        }
+    }
+
+    NVMEV_ASSERT(choice < 2);
+    return (ch & ((n << 1) - 1)) == from + n;
+}
+
+/*
+ * Splits section lh_split into itself and lh_split + (lh_base << lh_level).
+ * A key's section comes from the low bits of its hash, so the new section
+ * takes the keys whose next bit up is set. Each is moved to the same slot
+ * of the new section, so no key is ever looked for outside its current two
+ * windows. The pairs themselves stay where they are on flash.
+ *
+ * Called before a store holds any section, as this may evict.
+ */
+static uint64_t __lh_split(struct demand_shard *shard, struct nvmev_request *req,
+                           uint64_t stime)
+{
+    struct cache *cache = &shard->cache;
+    uint32_t n = cache->lh_base << cache->lh_level;
+    uint32_t from = cache->lh_split;
+    uint32_t to = from + n;
+    struct ht_section *src, *dst = NULL;
+    uint64_t nsecs_latest = stime, nsecs_completed;
+    uint64_t credits = 0;
+    uint64_t hash;
+    bool missed = false;
+
+    while(cache_full(cache)) {
+        nsecs_completed = __evict_one(shard, req, nsecs_latest, &credits);
+        nsecs_latest = max(nsecs_latest, nsecs_completed);
+    }
+
+    src = cache_get_ht(cache, IDX2LPA(from + 1));
+    if(!shard->fastmode && atomic_read(&src->t_ppa) != UINT_MAX && !cache_hit(src)) {
+        nsecs_completed = __get_one(shard, src, false, nsecs_latest, &missed);
+        nsecs_latest = max(nsecs_latest, nsecs_completed);
+    }
+
+    if(++cache->lh_split == n) {
+        cache->lh_level++;
+        cache->lh_split = 0;
+        NVMEV_ASSERT(cache->lh_level <= LH_LEVELS);
+    }
+
+    /*
+     * A key that spilled out of the old section may have its first choice
+     * in either half now.
+     */
+    cache->ht[to + 1]->spills = src->spills;
+
+    for(uint32_t off = 1; off < EPP; off++) {
+        uint8_t *mem = ht_pair_mem(src, off);
+        uint8_t klen;
+
+        if(!mem) {
+            continue;
+        }
+
+        klen = __klen_from_value(mem);
+        hash = CityHash64((char*) mem + sizeof(klen), klen);
+
+        if(!__lh_goes_to_new(n, from, off, hash)) {
+            continue;
+        }
+
+        if(!dst) {
+            bool first = false;
+
+            dst = cache_get_ht(cache, IDX2LPA(to + 1));
+            if(!shard->fastmode && atomic_read(&dst->t_ppa) == UINT_MAX) {
+                __new_section(shard, dst);
+                first = true;
+            }
+
+            if(!shard->fastmode && !cache_hit(dst)) {
+                nsecs_completed = __get_one(shard, dst, first, nsecs_latest, &missed);
+                nsecs_latest = max(nsecs_latest, nsecs_completed);
+            }
+        }
+
+        __lh_move(shard, src, dst, off, mem, (char*) mem + sizeof(klen), klen, hash);
+        shard->stats.hash_moved++;
+    }
+
+    /*
+     * Slots held for append buffers follow their keys the same way.
+     */
+    for(int i = 0; i < NUM_APPEND_BUFS; i++) {
+        lpa_t r = shard->append_hidx[i];
+
+        if(!shard->append_klens[i] || r == UINT_MAX || IDX(r) != src->idx) {
+            continue;
+        }
+
+        hash = CityHash64(shard->append_keys[i], shard->append_klens[i]);
+        if(__lh_goes_to_new(n, from, OFFSET(r), hash)) {
+            shard->append_hidx[i] = IDX2LPA(to + 1) + OFFSET(r);
+        }
+    }
+
+    if(dst) {
+        atomic_set(&dst->outgoing, 0);
+    }
+    atomic_set(&src->outgoing, 0);
+
+    if(credits) {
+        shard->leftover_credits += credits;
+    }
+
+    return nsecs_latest;
+}
+
+static bool __store(struct nvmev_ns *ns, struct nvmev_request *req, 
+                    struct nvmev_result *ret, bool internal,
+                    bool append) 
+{
+    struct demand_shard *demand_shards = (struct demand_shard *)ns->ftls;
+    struct nvme_kv_command *cmd = (struct nvme_kv_command*) req->cmd;
+
+    uint64_t nsecs_latest = 0, nsecs_completed = 0, nsecs_xfer_completed = 0;
+    uint64_t credits = 0;
+    uint32_t allocated_buf_size;
+
+    uint8_t klen = cmd_key_length(cmd);
+    uint32_t vlen = cmd_value_length(cmd);
+
+    uint32_t append_buf_klen;
+
+    if(!append) {
+        /*
+         * The length of the key.
+         */
+        vlen += sizeof(uint8_t);
+
+        /*
+         * The actual key.
+         */
+        vlen += klen;
+
+        /*
+         * Real value length.
+         * We only write it on the flush of an appended-to buffer in the future
+         * when it's flushed.
+         */
+        vlen += VLEN_MARKER_SZ;
+    }
+
+    uint64_t glen;
+    uint64_t grain;
+    uint64_t page, start_page;
+    uint64_t g_off, start_g_off;
+    uint32_t status = 0;
+
+    uint64_t start, end;
+
+    /*
+     * Append buffers are per-shard, so a flush of a previous append buffer
+     * below always writes a key that belongs to this same shard.
+     */
+    struct demand_shard *shard = 
+        &demand_shards[SHARD_OF(CityHash64(cmd->kv_store.key, klen))];
+    struct ssdparams *spp = &shard->ssd->sp;
+    struct buffer *wbuf = shard->ssd->write_buffer;
+
+    if(!shard->fastmode) {
+        nsecs_xfer_completed = ssd_advance_write_buffer(shard->ssd, req->nsecs_start, 
+                                                        vlen);
+        nsecs_latest = nsecs_xfer_completed;
+    }
+
+    bool flushing_prev = false;
+    bool checking_len = false;
+    bool charged = false; /* this write's credits were consumed */
+
+    /*
+     * Space in memory for the pair. Not necessarily linked to the PPA.
+     */
+    char* pair_mem;
+
+    start = ktime_get();
+
+    uint32_t buf = UINT_MAX;
+    bool need_new = true;
+append:
+    pair_mem = NULL;
+
+    if(append && !checking_len && buf == UINT_MAX) {
+        need_new = true;
+        buf = __get_append_buf(shard, cmd->kv_store.key, klen, &need_new);
+
+        //if(need_new) {
+        //    NVMEV_DEBUG("We need a new buffer!\n");
+        //}
+
+        if(buf != UINT_MAX) {
+            shard->cur_append_key = shard->append_keys[buf];
+            shard->cur_append_klen = shard->append_klens[buf];
+            shard->cur_append_buf = shard->append_bufs[buf];
+            shard->wb_idx = shard->wb_idxs[buf];
+            need_new = false;
+            checking_len = false;
+            lru_cache_get(&shard->buf_lru, buf);
+        } else {
+            shard->cur_append_klen = 0;
+            shard->cur_append_key = NULL;
+            shard->cur_append_buf = NULL;
+            shard->wb_idx = 0;
         }
     }
 
     if(!append) {
-  //if(!append && cur_append_key && !memcmp(cur_append_key, cmd->kv_store.key, klen)) {
-        buf = __get_append_buf(cmd->kv_store.key, klen, &need_new);
+  //if(!append && shard->cur_append_key && !memcmp(shard->cur_append_key, cmd->kv_store.key, klen)) {
+        buf = __get_append_buf(shard, cmd->kv_store.key, klen, &need_new);
 
         if(buf != UINT_MAX) {
-            lru_cache_remove(&buf_lru, buf);
-            __clear_buf(buf);
+            lru_cache_remove(&shard->buf_lru, buf);
+            __clear_buf(shard, buf);
             buf = UINT_MAX;
-            wb_idx = 0;
-            cur_append_key = NULL;
-            cur_append_klen = 0;
+            shard->wb_idx = 0;
+            shard->cur_append_key = NULL;
+            shard->cur_append_klen = 0;
         }
-        //NVMEV_ERROR("if(!append && !memcmp(cur_append_key, cmd->kv_store.key, klen)) {\n");
+        //NVMEV_ERROR("if(!append && !memcmp(shard->cur_append_key, cmd->kv_store.key, klen)) {\n");
         //NVMEV_ASSERT(false);
         ///*
         // * The value of a store is the new value of the KV pair, overwriting
         // * everything else. If this key is the current append buffer, we need
         // * to clear it.
         // */
-        //cur_append_klen = 0;
-        //wb_idx = 0;
-        ////memset(cur_append_buf, 0x0, WB_SIZE + sizeof(uint8_t) + MAX_KLEN + 
+        //shard->cur_append_klen = 0;
+        //shard->wb_idx = 0;
+        ////memset(shard->cur_append_buf, 0x0, WB_SIZE + sizeof(uint8_t) + MAX_KLEN + 
         ////       sizeof(uint32_t));
 
         ///*
@@ -5259,29 +6563,29 @@ append:
         } else if(buf == UINT_MAX && need_new) {
             //if(need_new) {
             NVMEV_DEBUG("We need space for another append buffer. Flushing one.\n");
-            buf = __smallest_buf();
-            //if(cur_append_klen > 0) {
+            buf = __smallest_buf(shard);
+            //if(shard->cur_append_klen > 0) {
             //    NVMEV_DEBUG("Key %llu was different from current key %llu\n",
-            //                *(uint64_t*) cmd->kv_append.key, *(uint64_t*) cur_append_key);
+            //                *(uint64_t*) cmd->kv_append.key, *(uint64_t*) shard->cur_append_key);
             //} else {
             //    NVMEV_DEBUG("Had no append key. New key is %llu\n",
             //                *(uint64_t*) cmd->kv_append.key);
             //}
 
-            cur_append_key = append_keys[buf];
-            cur_append_klen = append_klens[buf];
-            cur_append_buf = append_bufs[buf];
-            wb_idx = wb_idxs[buf];
+            shard->cur_append_key = shard->append_keys[buf];
+            shard->cur_append_klen = shard->append_klens[buf];
+            shard->cur_append_buf = shard->append_bufs[buf];
+            shard->wb_idx = shard->wb_idxs[buf];
 
-            uint32_t meta_sz = sizeof(cur_append_klen) + cur_append_klen + sizeof(wb_idx);
-            NVMEV_ASSERT(inv_cnts[buf] <= (wb_idx - meta_sz));
+            uint32_t meta_sz = sizeof(shard->cur_append_klen) + shard->cur_append_klen + sizeof(shard->wb_idx);
+            NVMEV_ASSERT(shard->inv_cnts[buf] <= (shard->wb_idx - meta_sz));
 
             /*
              * Appending to a key different from the current append buffer.
              * We will continue downwards to flush the current buffer,
              * then come back up to append: to append to the new buffer.
              */
-            if(inv_cnts[buf] == (wb_idx - meta_sz)) {
+            if(shard->inv_cnts[buf] == (shard->wb_idx - meta_sz)) {
                 NVMEV_DEBUG("Buffer %u had no valid data left. Resuming "
                             "original append\n", buf);
                 /*
@@ -5289,17 +6593,17 @@ append:
                  * to go down to check if this key has an existing value
                  * that we will append to.
                  */
-                __clear_buf(buf);
+                __clear_buf(shard, buf);
 
                 buf = UINT_MAX;
-                wb_idx = 0;
+                shard->wb_idx = 0;
 
-                //buf = __assign_buf(cmd->kv_append.key, klen);
-                //cur_append_key = append_keys[buf];
-                //cur_append_klen = append_klens[buf];
-                //cur_append_buf = append_bufs[buf];
-                //wb_idx = wb_idxs[buf];
-                //NVMEV_ASSERT(wb_idx == 0);
+                //buf = __assign_buf(shard, cmd->kv_append.key, klen);
+                //shard->cur_append_key = shard->append_keys[buf];
+                //shard->cur_append_klen = shard->append_klens[buf];
+                //shard->cur_append_buf = shard->append_bufs[buf];
+                //shard->wb_idx = shard->wb_idxs[buf];
+                //NVMEV_ASSERT(shard->wb_idx == 0);
 
                 need_new = false;
                 flushing_prev = false;
@@ -5313,11 +6617,11 @@ append:
             //    checking_len = true;
             //}
 
-            //if(wb_idx == 0) {
-            //    //memcpy(cur_append_key, cmd->kv_append.key, klen);
-            //    //cur_append_klen = klen;
+            //if(shard->wb_idx == 0) {
+            //    //memcpy(shard->cur_append_key, cmd->kv_append.key, klen);
+            //    //shard->cur_append_klen = klen;
             //}
-        } else if(wb_idx + vlen >= WB_SIZE) {
+        } else if(shard->wb_idx + vlen >= WB_SIZE) {
             NVMEV_DEBUG("Tried to append to buf %u but value is full.\n",
                          buf);
             /*
@@ -5335,50 +6639,50 @@ append:
 
             NVMEV_ASSERT(!need_new);
             if(buf == UINT_MAX) {
-                buf = __assign_buf(cmd->kv_append.key, klen);
-                cur_append_key = append_keys[buf];
-                cur_append_klen = append_klens[buf];
-                cur_append_buf = append_bufs[buf];
-                wb_idx = wb_idxs[buf];
-                NVMEV_ASSERT(wb_idx == 0);
+                buf = __assign_buf(shard, cmd->kv_append.key, klen);
+                shard->cur_append_key = shard->append_keys[buf];
+                shard->cur_append_klen = shard->append_klens[buf];
+                shard->cur_append_buf = shard->append_bufs[buf];
+                shard->wb_idx = shard->wb_idxs[buf];
+                NVMEV_ASSERT(shard->wb_idx == 0);
             }
 
-            __wait_buf(buf);
+            __wait_buf(shard, buf);
 
-            meta_sz = sizeof(cur_append_klen) + cur_append_klen + sizeof(wb_idx);
-            if(wb_idx == 0) {
-                memcpy(cur_append_buf, &cur_append_klen, sizeof(cur_append_klen));
-                memcpy(cur_append_buf + sizeof(cur_append_klen), cur_append_key, 
-                        cur_append_klen);
-                memcpy(cur_append_buf + sizeof(cur_append_klen) + cur_append_klen,
-                        &wb_idx, sizeof(wb_idx));
-                wb_idx += meta_sz;
+            meta_sz = sizeof(shard->cur_append_klen) + shard->cur_append_klen + sizeof(shard->wb_idx);
+            if(shard->wb_idx == 0) {
+                memcpy(shard->cur_append_buf, &shard->cur_append_klen, sizeof(shard->cur_append_klen));
+                memcpy(shard->cur_append_buf + sizeof(shard->cur_append_klen), shard->cur_append_key, 
+                        shard->cur_append_klen);
+                memcpy(shard->cur_append_buf + sizeof(shard->cur_append_klen) + shard->cur_append_klen,
+                        &shard->wb_idx, sizeof(shard->wb_idx));
+                shard->wb_idx += meta_sz;
             }
 
             end = ktime_get();
             NVMEV_DEBUG("Copying key %llu len %u to pos %u in "
                         "append buffer %u took %lluus. Klen is %u\n",
-                        *(uint64_t*) cmd->kv_store.key, vlen, wb_idx, buf,
+                        *(uint64_t*) cmd->kv_store.key, vlen, shard->wb_idx, buf,
                         ktime_to_us(end) - ktime_to_us(start),
-                        *(uint8_t*) cur_append_buf);
+                        *(uint8_t*) shard->cur_append_buf);
 
-            cmd->kv_append.offset = wb_idx;
-            cmd->kv_append.rsvd = ((uint64_t) cur_append_buf) + 
-                                   (uint64_t) wb_idx;
+            cmd->kv_append.offset = shard->wb_idx;
+            cmd->kv_append.rsvd = ((uint64_t) shard->cur_append_buf) + 
+                                   (uint64_t) shard->wb_idx;
 
             ret->status = 0;
-            wb_idx += vlen;
+            shard->wb_idx += vlen;
 
-            atomic_inc(&buf_lock[buf]);
+            atomic_inc(&shard->buf_lock[buf]);
 
             ret->cb = __release_buf;
-            ret->args = &buf_lock[buf];
+            ret->args = &shard->buf_lock[buf];
             ret->nsecs_target = nsecs_latest;
 
-            wb_idxs[buf] = wb_idx;
+            shard->wb_idxs[buf] = shard->wb_idx;
 
-            //if(wb_idx % GRAINED_UNIT) {
-            //    wb_idx += GRAINED_UNIT - (wb_idx % GRAINED_UNIT);
+            //if(shard->wb_idx % GRAINED_UNIT) {
+            //    shard->wb_idx += GRAINED_UNIT - (shard->wb_idx % GRAINED_UNIT);
             //}
             return nsecs_latest;
         }
@@ -5387,12 +6691,13 @@ append:
     uint64_t hash;
 
     if(flushing_prev) {
-        hash = CityHash64(cur_append_key, cur_append_klen);
+        hash = CityHash64(shard->cur_append_key, shard->cur_append_klen);
     } else {
         hash = CityHash64(cmd->kv_store.key, klen);
     }
 
-    uint64_t **oob = shard->oob;
+    NVMEV_ASSERT(shard == &demand_shards[SHARD_OF(hash)]);
+
     uint64_t min_pgs_req;
 
     NVMEV_ASSERT(klen <= 16);
@@ -5401,6 +6706,20 @@ append:
     h.hash = hash;
     h.cnt = 0;
     h.lpa = 0;
+    h.probes = 0;
+    h.gap = false;
+    h.spill = false;
+
+    /*
+     * ins_cnt is the free slot picked for a new key, placing is set once
+     * we're headed back to it, and fresh once a new key went in.
+     */
+    int ins_cnt = -1;
+    bool placing = false;
+    bool fresh = false;
+
+    uint32_t sid = __pick_stream(shard, hash);
+    struct user_stream *stream = &shard->streams[sid];
 
     uint32_t pos = UINT_MAX;
     bool missed = false;
@@ -5409,11 +6728,11 @@ append:
 
     uint32_t rem;
     if(flushing_prev) {
-        wb_idx -= inv_cnts[buf];
-        NVMEV_DEBUG("Took %u away from buffer length.\n", inv_cnts[buf]);
-        rem = wb_idx;
-        glen = wb_idx / GRAINED_UNIT;
-        if(wb_idx & (GRAINED_UNIT - 1)) {
+        shard->wb_idx -= shard->inv_cnts[buf];
+        NVMEV_DEBUG("Took %u away from buffer length.\n", shard->inv_cnts[buf]);
+        rem = shard->wb_idx;
+        glen = shard->wb_idx / GRAINED_UNIT;
+        if(shard->wb_idx & (GRAINED_UNIT - 1)) {
             glen++;
         }
     } else {
@@ -5424,13 +6743,58 @@ append:
         }
     }
 
-    credits += glen + leftover_credits;
-    leftover_credits = 0;
+    credits += glen + shard->leftover_credits;
+    shard->leftover_credits = 0;
+    charged = false;
+
+    /*
+     * Split before probing, while we hold no section, so the probes below
+     * only ever see the current layout.
+     */
+    while(__lh_split_due(&shard->cache)) {
+        nsecs_completed = __lh_split(shard, req, nsecs_latest);
+        nsecs_latest = max(nsecs_latest, nsecs_completed);
+    }
 
 lpa:;
     lpa_t lpa = get_hash_idx(&shard->cache, &h);
     h.lpa = lpa;
 
+    if(lpa == UINT_MAX && ins_cnt >= 0) {
+        /*
+         * No older copy of the key anywhere. Go back to the free slot.
+         */
+        h.cnt = ins_cnt;
+        placing = true;
+        goto lpa;
+    } else if(lpa == UINT_MAX) {
+        /*
+         * Every slot in both of this key's windows belongs to another key.
+         * Nothing was written, so this write's credits go away, and any
+         * others that weren't consumed yet are kept for the next command.
+         */
+        if(!charged) {
+            credits -= glen;
+        }
+        shard->leftover_credits += credits;
+        credits = 0;
+        shard->stats.hash_full++;
+
+        /*
+         * An append buffer's slot is held for it from when the buffer is
+         * made, so only the append that would have made it can end up
+         * here, never the flush.
+         */
+        NVMEV_ASSERT(!flushing_prev);
+
+        NVMEV_ERROR("No free hash index for key %llu after %u probes.\n",
+                    *(uint64_t*) cmd->kv_store.key, h.cnt);
+        cmd->kv_store.rsvd = U64_MAX;
+        ret->status = KV_ERR_HASH_FULL;
+        ret->nsecs_target = nsecs_latest;
+        return true;
+    }
+
 #ifndef ORIGINAL
     new_pte.hidx = lpa;
 #endif
@@ -5448,126 +6812,122 @@ lpa:;
     nsecs_latest = max(nsecs_latest, nsecs_completed);
 
     credits = 0;
+    charged = true;
 
     struct ht_section *ht = cache_get_ht(cache, lpa);
     uint32_t t_ppa = atomic_read(&ht->t_ppa);
+    __probe_note(&h, ht);
+
+    if(__slot_reserved(shard, lpa, flushing_prev ? buf : UINT_MAX)) {
+        /*
+         * Another append buffer's key goes here when it's flushed. Same
+         * as a slot that's in use.
+         */
+        h.cnt++;
+        atomic_set(&ht->outgoing, 0);
+        goto lpa;
+    }
 
     uint32_t sz, gsz;
-    int rem_in_page = spp->pgsz - (shard->offset % spp->pgsz);
+    int rem_in_page = spp->pgsz - (stream->offset % spp->pgsz);
 
     if(shard->fastmode) {
-        if(ht->pair_mem[OFFSET(lpa)]) {
+        if(ht_pair_mem(ht, OFFSET(lpa))) {
             h.cnt++;
             shard->max_try = (h.cnt > shard->max_try) ? h.cnt : 
                                    shard->max_try;
             atomic_dec(&ht->outgoing);
             goto lpa;
         } else {
+            fresh = true;
             goto fm_two;
         }
     }
 
-    if(t_ppa == UINT_MAX) {
-        /*
-         * Previously unused cached mapping table entry.
-         */
-skip:
-        spin_lock(&ev_spin);
-        struct ppa p = get_new_page(shard, MAP_IO);
-        ppa_t ppa = ppa2pgidx(shard, &p);
-
-        advance_write_pointer(shard, MAP_IO);
-
-        mark_page_valid(shard, &p);
-        spin_unlock(&ev_spin);
-
-        mark_grain_valid(shard, PPA_TO_PGA(ppa, 0), GRAIN_PER_PAGE);
-
-        if(ppa == 0) {
-            mark_grain_invalid(shard, PPA_TO_PGA(ppa, 0), GRAIN_PER_PAGE);
-            goto skip;
-        }
-
-        atomic_set(&ht->t_ppa, ppa);
-        t_ppa = ppa;
-
-        ht->mappings = NULL;
-
+    if(t_ppa == UINT_MAX && !placing) {
         /*
-         * Despite the new scheme only using as many mapping entries as needed,
-         * instead of a full page each time, we still set the length to the
-         * size of a page here for the first ever access. We do this because
-         * if we were to set the length on disk to the actual amount of mappings
-         * the entry holds initially (1), we would need to add some logic to
-         * pack this mapping table entry into an existing page with other
-         * mapping table entries that are less than the size of a page right now.
-         *
-         * That's already being done in the eviction logic later, so we just
-         * set its length to the size of a page for now and waste some space
-         * until its evicted.
+         * The whole section is free. Same as a free slot below.
          */
+        int here = h.cnt;
 
-#ifdef ORIGINAL
-        oob[ppa][0] = ((uint64_t) GRAIN_PER_PAGE << 32) | (ht->idx * EPP);
-
-        for(int i = 1; i < GRAIN_PER_PAGE; i++) {
-            oob[ppa][i] = UINT_MAX;
-        }
-
-        ht->len_on_disk = GRAIN_PER_PAGE;
-#else
-        uint64_t glen = ORIG_GLEN;
-        oob[ppa][0] = (glen << 32) | (ht->idx * EPP);
-
-        for(int i = 1; i < GRAIN_PER_PAGE; i++) {
-            oob[ppa][i] = UINT_MAX;
+        if(__store_free_slot(cache, &h, &ins_cnt, true)) {
+            atomic_set(&ht->outgoing, 0);
+            goto lpa;
         }
 
-        if(!shard->fastmode) {
-            if(ORIG_GLEN < GRAIN_PER_PAGE) {
-                mark_grain_invalid(shard, PPA_TO_PGA(ppa, ORIG_GLEN), 
-                        GRAIN_PER_PAGE - ORIG_GLEN);
-            }
-
-            ht->len_on_disk = ORIG_GLEN;
-        } else {
-            ht->len_on_disk = 1;
-            ht->g_off = 0;
+        placing = true;
 
-            for(int i = 0; i < EPP; i++) {
-                ht->mappings[i].hidx = UINT_MAX;
-                atomic_set(&ht->mappings[i].ppa, UINT_MAX);
-            }
+        if(h.cnt != here) {
+            atomic_set(&ht->outgoing, 0);
+            goto lpa;
         }
-#endif
+    }
 
-#ifndef ORIGINAL
-        ht->cached_cnt = 0;
-#endif
+    if(t_ppa == UINT_MAX) {
         /*
-         * Will be marked dirty below in update().
+         * Previously unused cached mapping table entry.
          */
-
-        ht->state = CLEAN;
+        __new_section(shard, ht);
+        t_ppa = atomic_read(&ht->t_ppa);
         first = true;
     }
 
     NVMEV_DEBUG("Got LPA %u for key %llu when %s\n", 
-                 lpa, flushing_prev ? *(uint64_t*) cur_append_key : 
+                 lpa, flushing_prev ? *(uint64_t*) shard->cur_append_key : 
                  *(uint64_t*) (cmd->kv_store.key), append ? "appending." :
                  "storing.");
 
 cache:
     if(cache_hit(ht)) {
+        if(!missed) {
+            cache_access(cache, ht);
+        }
+
         struct h_to_g_mapping pte = cache_hidx_to_grain(ht, lpa, &pos);
         uint32_t meta_sz = sizeof(uint8_t) + klen + sizeof(uint32_t);
         uint32_t sans_mark = vlen - sizeof(uint32_t) - klen - sizeof(uint8_t);
         uint32_t g_from_pte = atomic_read(&pte.ppa);
         char* old_mem;
 
+        if(!IS_INITIAL_PPA(pte.ppa) && !ht_fp_match(ht, OFFSET(lpa), ht_fp(hash))) {
+            /*
+             * Same as in __retrieve, someone else's pair is here.
+             */
+            shard->stats.fp_skip_w++;
+            h.cnt++;
+            missed = true;
+            pos = UINT_MAX;
+            atomic_set(&ht->outgoing, 0);
+            goto lpa;
+        }
+
+        if(IS_INITIAL_PPA(pte.ppa) && !placing) {
+            /*
+             * Before a new key takes a free slot, make sure there's no
+             * copy of it past a hole further along.
+             */
+            int here = h.cnt;
+
+            if(__store_free_slot(cache, &h, &ins_cnt, false)) {
+                missed = true;
+                pos = UINT_MAX;
+                atomic_set(&ht->outgoing, 0);
+                goto lpa;
+            }
+
+            placing = true;
+
+            if(h.cnt != here) {
+                missed = true;
+                pos = UINT_MAX;
+                atomic_set(&ht->outgoing, 0);
+                goto lpa;
+            }
+        }
+
         if(!IS_INITIAL_PPA(pte.ppa)) {
             shard->stats.d_read_on_write += spp->pgsz;
-            old_mem = ht->pair_mem[OFFSET(lpa)];
+            old_mem = ht_pair_mem(ht, OFFSET(lpa));
 
             if(!old_mem) {
                 NVMEV_INFO("NO MEM LPA %u pos %u!!!\n", lpa, pos);
@@ -5578,12 +6938,12 @@ cache:
                          flushing_prev ? "when flushing prev " : "", lpa, 
                          g_from_pte, old_g_off, old_mem, *(uint8_t*) (old_mem),
                          *(uint64_t*) (old_mem + 1));
-            uint32_t len = __glen_from_oob(oob[G_IDX(g_from_pte)][old_g_off]);
+            uint32_t len = __oob_glen(shard, G_IDX(g_from_pte), old_g_off);
 
             if(__retrieve_and_compare(shard, g_from_pte, old_mem, &h, 
-                                  flushing_prev ? cur_append_key : 
+                                  flushing_prev ? shard->cur_append_key : 
                                   cmd->kv_store.key, 
-                                  flushing_prev ? cur_append_klen : klen, 
+                                  flushing_prev ? shard->cur_append_klen : klen, 
                                   nsecs_latest, &nsecs_completed,
                                   len, vlen, 0, false, NULL)) {
                 nsecs_latest = max(nsecs_latest, nsecs_completed);
@@ -5598,7 +6958,7 @@ cache:
                     NVMEV_DEBUG("Can't do this append, existing pair is too big!\n");
                     cmd->kv_store.rsvd = U64_MAX;
                     ret->status = KV_ERR_BUFFER_SMALL;
-                    cur_append_klen = 0;
+                    shard->cur_append_klen = 0;
                     atomic_set(&ht->outgoing, 0);
                     return nsecs_latest;
                 } else if(checking_len) {
@@ -5607,35 +6967,36 @@ cache:
 
                     NVMEV_DEBUG("Len %u klen %u is fine LPA %u key %llu %s. Old mem %p. Going back up to append.\n",
                                 real_vlen, prev_klen, lpa,                 
-                                flushing_prev ? *(uint64_t*) cur_append_key : 
+                                flushing_prev ? *(uint64_t*) shard->cur_append_key : 
                                 *(uint64_t*) cmd->kv_store.key, 
-                                flushing_prev ? cur_append_key : cmd->kv_store.key,
+                                flushing_prev ? shard->cur_append_key : cmd->kv_store.key,
                                 old_mem);
 
                     //buf = UINT_MAX;
-                    buf = __assign_buf(cmd->kv_append.key, klen);
-                    cur_append_key = append_keys[buf];
-                    cur_append_klen = append_klens[buf];
-                    cur_append_buf = append_bufs[buf];
-                    wb_idx = wb_idxs[buf];
-                    NVMEV_ASSERT(wb_idx == 0);
+                    buf = __assign_buf(shard, cmd->kv_append.key, klen);
+                    shard->append_hidx[buf] = lpa;
+                    shard->cur_append_key = shard->append_keys[buf];
+                    shard->cur_append_klen = shard->append_klens[buf];
+                    shard->cur_append_buf = shard->append_bufs[buf];
+                    shard->wb_idx = shard->wb_idxs[buf];
+                    NVMEV_ASSERT(shard->wb_idx == 0);
 
-                    __wait_buf(buf);
+                    __wait_buf(shard, buf);
 
-                    wb_idx = wb_idxs[buf] = real_vlen + sizeof(uint8_t) + prev_klen + sizeof(uint32_t);
-                    memcpy(cur_append_buf, old_mem, wb_idx);
+                    shard->wb_idx = shard->wb_idxs[buf] = real_vlen + sizeof(uint8_t) + prev_klen + sizeof(uint32_t);
+                    memcpy(shard->cur_append_buf, old_mem, shard->wb_idx);
 
-                    NVMEV_DEBUG("Set wb_idx to %u in length check.\n", wb_idx);
+                    NVMEV_DEBUG("Set shard->wb_idx to %u in length check.\n", shard->wb_idx);
 
                     atomic_dec(&ht->outgoing);
                     checking_len = false;
                     goto append;
                 } else if(flushing_prev) {
-                    kfree(old_mem);
-                    pair_mem = kzalloc(glen * GRAINED_UNIT, GFP_KERNEL);
+                    pair_free(old_mem);
+                    pair_mem = pair_alloc(glen, GFP_KERNEL | __GFP_ZERO);
                     NVMEV_ASSERT(pair_mem);
-                    __wait_buf(buf);
-                    memcpy(pair_mem, cur_append_buf, wb_idx);
+                    __wait_buf(shard, buf);
+                    memcpy(pair_mem, shard->cur_append_buf, shard->wb_idx);
                 } else {
                     NVMEV_ASSERT(false);
                 }
@@ -5652,8 +7013,8 @@ cache:
                     memset(old_mem, 0x0, len * GRAINED_UNIT);
                     pair_mem = old_mem;
                 } else {
-                    kfree(old_mem);
-                    pair_mem = kzalloc(glen * GRAINED_UNIT, GFP_KERNEL);
+                    pair_free(old_mem);
+                    pair_mem = pair_alloc(glen, GFP_KERNEL | __GFP_ZERO);
                     NVMEV_DEBUG("Alloced some new memory.\n");
                     NVMEV_ASSERT(pair_mem);
                 }
@@ -5675,16 +7036,20 @@ cache:
         } else if(checking_len) {
             NVMEV_DEBUG("Had no previous pair when checking len.\n");
 
-            buf = __assign_buf(cmd->kv_append.key, klen);
-            cur_append_key = append_keys[buf];
-            cur_append_klen = append_klens[buf];
-            cur_append_buf = append_bufs[buf];
-            wb_idx = wb_idxs[buf];
-            NVMEV_ASSERT(wb_idx == 0);
+            /*
+             * Hold on to this slot until the buffer is flushed.
+             */
+            buf = __assign_buf(shard, cmd->kv_append.key, klen);
+            shard->append_hidx[buf] = lpa;
+            shard->cur_append_key = shard->append_keys[buf];
+            shard->cur_append_klen = shard->append_klens[buf];
+            shard->cur_append_buf = shard->append_bufs[buf];
+            shard->wb_idx = shard->wb_idxs[buf];
+            NVMEV_ASSERT(shard->wb_idx == 0);
 
             //buf = UINT_MAX;
             checking_len = false;
-            wb_idx = 0;
+            shard->wb_idx = 0;
             atomic_set(&ht->outgoing, 0);
             goto append;
         } else {
@@ -5692,16 +7057,17 @@ cache:
             char* key;
             uint8_t klen;
 
-            pair_mem = kmalloc(glen * GRAINED_UNIT, GFP_KERNEL);
+            fresh = true;
+            pair_mem = pair_alloc(glen, GFP_KERNEL);
             NVMEV_ASSERT(pair_mem);
             if(flushing_prev) {
                 /*
                  * Flushing the previous append buffer.
                  */
                 NVMEV_DEBUG("Copying %u bytes in prev flush. Klen %u\n", 
-                             wb_idx, *(uint8_t*) cur_append_buf);
-                __wait_buf(buf);
-                memcpy(pair_mem, cur_append_buf, wb_idx);
+                             shard->wb_idx, *(uint8_t*) shard->cur_append_buf);
+                __wait_buf(shard, buf);
+                memcpy(pair_mem, shard->cur_append_buf, shard->wb_idx);
                 NVMEV_ASSERT(*(uint8_t*) pair_mem > 0);
             } else {
                 key = cmd->kv_store.key;
@@ -5736,41 +7102,44 @@ cache:
     }
 
 fm_two:
-    grain = shard->offset / GRAINED_UNIT;
+    grain = stream->offset / GRAINED_UNIT;
     page = start_page = G_IDX(grain);
     g_off = start_g_off = G_OFFSET(grain);
 
     start = ktime_get();
 
-    if(!enough_space_in_line(shard, cur_page, g_off, glen, NULL)) {
+    if(!enough_space_in_line(shard, stream->cur_page, g_off, glen, NULL)) {
         NVMEV_ASSERT(rem_in_page % GRAINED_UNIT == 0);
-        clear_rest_of_line(shard, cur_page, g_off, rem_in_page / GRAINED_UNIT,
-                           &credits, false);
+        clear_rest_of_line(shard, stream->cur_page, g_off, rem_in_page / GRAINED_UNIT,
+                           &credits, STREAM_IO(sid));
+        __wbuf_drop(shard, stream);
 
-        cur_page = __new_page(shard);
-        grain = shard->offset / GRAINED_UNIT;
+        stream->cur_page = __new_page(shard, sid);
+        grain = stream->offset / GRAINED_UNIT;
 
         //NVMEV_DEBUG("Got page %u. Grain is set to %llu\n", 
-        //        ppa2pgidx(shard, &cur_page), grain);
+        //        ppa2pgidx(shard, &stream->cur_page), grain);
 
         page = start_page = G_IDX(grain);
         g_off = start_g_off = 0;
         rem_in_page = spp->pgsz;
 
         if(credits) {
-            leftover_credits += credits;
+            shard->leftover_credits += credits;
+            credits = 0;
         }
 
         //NVMEV_DEBUG("Done clearing line.\n");
-        //shard->offset = 0;
+        //stream->offset = 0;
     }
 
-    if(shard->offset == 0) { // || (shard->offset % spp->pgsz == 0)) {
-        cur_page = __new_page(shard);
-        grain = shard->offset / GRAINED_UNIT;
+    if(stream->offset == 0) { // || (stream->offset % spp->pgsz == 0)) {
+        __wbuf_drop(shard, stream);
+        stream->cur_page = __new_page(shard, sid);
+        grain = stream->offset / GRAINED_UNIT;
 
         //NVMEV_DEBUG("Got page %u. Grain is set to %llu\n", 
-        //        ppa2pgidx(shard, &cur_page), grain);
+        //        ppa2pgidx(shard, &stream->cur_page), grain);
 
         page = start_page = G_IDX(grain);
         g_off = start_g_off = 0;
@@ -5778,7 +7147,7 @@ fm_two:
     }
 
     //NVMEV_DEBUG("Initially had offset %llu rem_in_page %d page %llu g_off %llu vlen %u\n", 
-    //             shard->offset, rem_in_page, page, g_off, vlen);
+    //             stream->offset, rem_in_page, page, g_off, vlen);
     NVMEV_ASSERT(rem_in_page > 0);
     atomic_set(&new_pte.ppa, grain);
 
@@ -5793,49 +7162,73 @@ fm_two:
         mark_grain_valid(shard, PPA_TO_PGA(page, g_off), gsz);
         //NVMEV_DEBUG("Taking sz %u bytes of the page.\n", sz);
 
-        shard->offset += gsz * GRAINED_UNIT;
+        /*
+         * Admit a page worth at a time, so a large value can wait for
+         * programs it's filling itself to free up room.
+         */
+        if(!shard->fastmode) {
+            nsecs_xfer_completed = __wbuf_admit(shard, stream, gsz * GRAINED_UNIT,
+                                                nsecs_xfer_completed);
+            nsecs_latest = max(nsecs_latest, nsecs_xfer_completed);
+        }
+
+        stream->offset += gsz * GRAINED_UNIT;
 
         rem -= sz;
-        if(!rem && shard->offset % spp->pgsz) {
+        if(!rem && stream->offset % spp->pgsz) {
             //NVMEV_DEBUG("Breaking because nothing remaining off %llu.\n",
-            //             shard->offset);
+            //             stream->offset);
             break;
         }
 
-        NVMEV_ASSERT(shard->offset % spp->pgsz == 0);
+        NVMEV_ASSERT(stream->offset % spp->pgsz == 0);
 
-        if (last_pg_in_wordline(shard, &cur_page)) {
+        if (last_pg_in_wordline(shard, &stream->cur_page)) {
             struct nand_cmd swr = {
                 .type = USER_IO,
                 .cmd = NAND_WRITE,
                 .interleave_pci_dma = false,
-                .xfer_size = spp->pgsz * spp->pgs_per_oneshotpg,
+                .xfer_size = spp->pgsz * spp->pgs_per_prog,
             };
 
             swr.stime = __stime_or_clock(nsecs_latest);
-            swr.ppa = &cur_page;
+            swr.ppa = &stream->cur_page;
 
             nsecs_completed = ssd_advance_nand(shard->ssd, &swr);
             nsecs_latest = max(nsecs_latest, nsecs_completed);
 
-            shard->stats.d_write_on_write += spp->pgsz * spp->pgs_per_oneshotpg;
-            shard->stats.data_w += spp->pgsz * spp->pgs_per_oneshotpg;
-            schedule_internal_operation(req->sq_id, nsecs_completed, wbuf,
-                    spp->pgs_per_oneshotpg * spp->pgsz);
+            shard->stats.d_write_on_write += spp->pgsz * spp->pgs_per_prog;
+            shard->stats.data_w += spp->pgsz * spp->pgs_per_prog;
+
+            /*
+             * The buffered bytes of this program unit go back to the
+             * write buffer once it's on flash.
+             */
+            if(stream->wbuf_pending) {
+                /*
+                 * No IO work entry free to retire it later. Hand the
+                 * space back now rather than leak it for good.
+                 */
+                if(!schedule_internal_operation(req->sq_id, nsecs_completed, wbuf,
+                                                stream->wbuf_pending)) {
+                    buffer_release(wbuf, stream->wbuf_pending);
+                }
+                stream->wbuf_pending = 0;
+            }
         }
 
-        cur_page = __new_page(shard);
+        stream->cur_page = __new_page(shard, sid);
         //NVMEV_DEBUG("2 Got page %u. Grain is %llu\n", 
-        //        ppa2pgidx(shard, &cur_page), grain);
+        //        ppa2pgidx(shard, &stream->cur_page), grain);
 
-        page = ppa2pgidx(shard, &cur_page);
+        page = ppa2pgidx(shard, &stream->cur_page);
         g_off = 0;
         rem_in_page = spp->pgsz;
     }
     end = ktime_get();
 
     NVMEV_DEBUG("Setting OOB PPA %llu g_off %llu\n", start_page, start_g_off);
-    oob[start_page][start_g_off] = ((uint64_t) glen << 32) | lpa;
+    __oob_set_pair(shard, start_page, start_g_off, lpa, glen);
 
     if(start_g_off + glen > GRAIN_PER_PAGE) {
         //NVMEV_DEBUG("We are spilling over a page.\n");
@@ -5859,10 +7252,10 @@ fm_two:
                          rem, pgidx, sz);
 
             if(sz == 1) {
-                oob[pgidx][0] = UINT_MAX - 11;
+                __oob_set(shard, pgidx, 0, UINT_MAX - 11);
             } else {
-                oob[pgidx][0] = UINT_MAX - 10;
-                oob[pgidx][1] = sz;
+                __oob_set(shard, pgidx, 0, UINT_MAX - 10);
+                __oob_set(shard, pgidx, 1, sz);
             }
 
             rem -= sz;
@@ -5878,23 +7271,33 @@ fm_two:
     }
 
     shard->max_try = (h.cnt > shard->max_try) ? h.cnt : shard->max_try;
+    shard->stats.w_hash_collision_cnt[min(h.probes - 1, MAX_HASH_COLLISION - 1)]++;
+
+    if(fresh) {
+        if(PROBE_CHOICE(h.cnt)) {
+            cache->ht[__lh_section(cache, __probe_hash(&h, 0)) + 1]->spills++;
+        }
+
+        atomic64_inc(&cache->lh_used);
+    }
 
     if(shard->fastmode) {
         goto fm_out;
     }
 
     __update_map(shard, ht, lpa, pair_mem, new_pte, pos, 
-                 flushing_prev ? cur_append_key : cmd->kv_store.key, 
-                 flushing_prev ? cur_append_klen : klen, &credits, true);
+                 flushing_prev ? shard->cur_append_key : cmd->kv_store.key, 
+                 flushing_prev ? shard->cur_append_klen : klen, hash, &credits, true);
 
     if(credits) {
-        leftover_credits += credits;
+        shard->leftover_credits += credits;
+        credits = 0;
     }
 
     //NVMEV_DEBUG("Set mem %p for LPA %u key %llu %s in %s.\n", 
     //            pair_mem, lpa, 
-    //            flushing_prev ? *(uint64_t*) cur_append_key : *(uint64_t*) cmd->kv_store.key, 
-    //            flushing_prev ? cur_append_key : cmd->kv_store.key,
+    //            flushing_prev ? *(uint64_t*) shard->cur_append_key : *(uint64_t*) cmd->kv_store.key, 
+    //            flushing_prev ? shard->cur_append_key : cmd->kv_store.key,
     //            append ? "append" : "write");
 
     shard->stats.write_req_cnt++;
@@ -5902,7 +7305,7 @@ fm_two:
     if(flushing_prev) {
         //NVMEV_INFO("Flushing previous append buffer for key %llu klen %u "
         //            "vlen %u grain %llu PPA %llu LPA %u\n",
-        //            *(uint64_t*) cur_append_key, cur_append_klen, wb_idx, 
+        //            *(uint64_t*) shard->cur_append_key, shard->cur_append_klen, shard->wb_idx, 
         //            start_g_off, page, lpa);
         /*
         // * Why do these copies here instead of in io.c?
@@ -5928,32 +7331,32 @@ fm_two:
         // * complications. We only enter this path every append buffer flush,
         // * which will usually be a rare operation.
         // */
-        memcpy(pair_mem, &cur_append_klen, sizeof(cur_append_klen));
-        memcpy(pair_mem + sizeof(cur_append_klen), cur_append_key, 
-               cur_append_klen);
+        memcpy(pair_mem, &shard->cur_append_klen, sizeof(shard->cur_append_klen));
+        memcpy(pair_mem + sizeof(shard->cur_append_klen), shard->cur_append_key, 
+               shard->cur_append_klen);
  
-        wb_idx -= ((sizeof(uint8_t) + cur_append_klen + sizeof(uint32_t)));
-        memcpy(pair_mem + sizeof(cur_append_klen) + cur_append_klen,
-               &wb_idx, sizeof(wb_idx));
+        shard->wb_idx -= ((sizeof(uint8_t) + shard->cur_append_klen + sizeof(uint32_t)));
+        memcpy(pair_mem + sizeof(shard->cur_append_klen) + shard->cur_append_klen,
+               &shard->wb_idx, sizeof(shard->wb_idx));
         NVMEV_DEBUG("Wrote real vlen of %u buf %u klen %u LPA %u key %llu to %p\n", 
-                     wb_idx, buf, *(uint8_t*) pair_mem, 
-                     lpa, *(uint64_t*) cur_append_key, pair_mem);
+                     shard->wb_idx, buf, *(uint8_t*) pair_mem, 
+                     lpa, *(uint64_t*) shard->cur_append_key, pair_mem);
 
         /*
          * Not we get a new append buffer for the current key.
          */
-        //cur_append_buf = kmalloc(WB_SIZE + sizeof(uint8_t) + MAX_KLEN + sizeof(uint32_t), 
+        //shard->cur_append_buf = kmalloc(WB_SIZE + sizeof(uint8_t) + MAX_KLEN + sizeof(uint32_t), 
         //                         GFP_KERNEL);
-        //NVMEV_ASSERT(cur_append_buf);
-        //NVMEV_DEBUG("New cur_append_buf is %p\n", cur_append_buf);
+        //NVMEV_ASSERT(shard->cur_append_buf);
+        //NVMEV_DEBUG("New shard->cur_append_buf is %p\n", shard->cur_append_buf);
 
         //NVMEV_INFO("Realloc took %lluus\n", ktime_to_us(end) - ktime_to_us(start));
 
-        __clear_buf(buf);
+        __clear_buf(shard, buf);
         buf = UINT_MAX;
-        wb_idx = 0;
-        //memcpy(cur_append_key, cmd->kv_store.key, klen);
-        //cur_append_klen = klen;
+        shard->wb_idx = 0;
+        //memcpy(shard->cur_append_key, cmd->kv_store.key, klen);
+        //shard->cur_append_klen = klen;
 
         flushing_prev = false;
         checking_len = true;
@@ -5976,25 +7379,37 @@ fm_two:
     if(!shard->fastmode) {
         ret->cb = __release_map;
         ret->args = &ht->outgoing;
-        ret->nsecs_target = nsecs_latest;
+
+        /*
+         * With early completion the store is done once it's in the
+         * write buffer, and the program finishes in the background.
+         */
+        if(spp->write_early_completion) {
+            ret->nsecs_target = nsecs_xfer_completed;
+        } else {
+            ret->nsecs_target = nsecs_latest;
+        }
     } else {
 fm_out:;
         void* to;
         void* from = (void*) cmd->kv_store.dptr.prp1;
         uint32_t sans_mark = vlen - sizeof(uint32_t) - klen - sizeof(uint8_t);
 
-        oob[start_page][start_g_off] = ((uint64_t) glen << 32) | lpa;
+        __oob_set_pair(shard, start_page, start_g_off, lpa, glen);
 
-        to = kzalloc_node(glen * GRAINED_UNIT, GFP_KERNEL, numa_node_id());
+        to = pair_alloc(glen, GFP_KERNEL | __GFP_ZERO);
         memcpy(to + sizeof(klen) + klen + sizeof(vlen), from, sans_mark);
 
         memcpy(to, &klen, sizeof(klen));
         memcpy(to + sizeof(klen), cmd->kv_store.key, klen);
         memcpy(to + sizeof(klen) + klen, &sans_mark, sizeof(vlen));
 
-        ht->pair_mem[OFFSET(lpa)] = to;
+        struct ht_slot *s = ht_slot_get(&shard->cache, ht, OFFSET(lpa));
+
+        s->pair_mem = to;
+        ht_set_fp(s, ht_fp(hash));
 #ifndef ORIGINAL
-        ht->fm_grains[OFFSET(lpa)] = PPA_TO_PGA(start_page, start_g_off);
+        s->fm_grain = PPA_TO_PGA(start_page, start_g_off);
 #endif
         atomic_dec(&ht->outgoing);
     }
@@ -6125,7 +7540,7 @@ static bool conv_batch(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
 
         schedule_internal_operation_cb(req->sq_id, 0, NULL, 0, 0, __release_map,
                                        ret->args, false, NULL);
-        //multi_ht[multi_idx++] = ret->args;
+        //shard->multi_ht[shard->multi_idx++] = ret->args;
         //NVMEV_INFO("Adding %p to multi HT.\n", ret->args);
 
         if(ret->nsecs_target > slowest) {
@@ -6149,57 +7564,6 @@ static bool conv_batch(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
 
 #ifndef ORIGINAL
 #define REAP 4096
-static void __reclaim_completed_reqs(void)
-{
-    unsigned int turn;
-
-    for (turn = 0; turn < nvmev_vdev->config.nr_io_workers; turn++) {
-        struct nvmev_io_worker *worker;
-        struct nvmev_io_work *w;
-
-        unsigned int first_entry = -1;
-        unsigned int last_entry = -1;
-        unsigned int curr;
-        int nr_reclaimed = 0;
-
-        worker = &nvmev_vdev->io_workers[turn];
-
-        first_entry = worker->io_seq;
-        curr = first_entry;
-
-        while (curr != -1) {
-            w = &worker->work_queue[curr];
-            if (w->is_completed == true && w->is_copied == true &&
-                w->nsecs_target <= worker->latest_nsecs) {
-                last_entry = curr;
-                curr = w->next;
-                nr_reclaimed++;
-            } else {
-                break;
-            }
-        }
-
-        if (last_entry != -1) {
-            w = &worker->work_queue[last_entry];
-            worker->io_seq = w->next;
-            if (w->next != -1) {
-                worker->work_queue[w->next].prev = -1;
-            }
-            w->next = -1;
-
-            w = &worker->work_queue[first_entry];
-            w->prev = worker->free_seq_end;
-
-            w = &worker->work_queue[worker->free_seq_end];
-            w->next = first_entry;
-
-            worker->free_seq_end = last_entry;
-            NVMEV_DEBUG_VERBOSE("%s: %u -- %u, %d\n", __func__,
-                    first_entry, last_entry, nr_reclaimed);
-        }
-    }
-}
-
 struct leaf_e e[EPP];
 void **bufs = NULL;
 
@@ -6210,99 +7574,14 @@ struct fast_fill_args {
     uint32_t pairs;
 };
 
-struct task_struct *ff_ts;
-int fast_fill_t(void *data) {
-    struct fast_fill_args *args;
-    struct demand_shard *shard;
-    struct cache* cache;
-    struct ssdparams *spp;
-    struct nvmev_ns *ns;
-    uint64_t size;
-    uint32_t vlen;
-    uint32_t pairs;
-
-    args = (struct fast_fill_args*) data;
-    shard = __fast_fill_shard;
-    cache = &shard->cache;
-    spp = &shard->ssd->sp;
-    ns = args->ns;
-    size = args->size;
-    vlen = args->vlen;
-    pairs = args->pairs;
-
-    shard->fastmode = true;
-
-    uint64_t **oob = shard->oob;
-    uint8_t klen = 8;
-    uint32_t g_len = vlen / GRAINED_UNIT;
-
-    if(vlen % GRAINED_UNIT) {
-        g_len++;
-    }
-
-    if(GRAIN_PER_PAGE % g_len) {
-        NVMEV_INFO("Fastmode failed!\n");
-        return 0; 
-    }
-
-    NVMEV_INFO("Starting fastmode vlen %u pairs %u.\n", vlen, pairs);
-
-    bufs = kzalloc_node(sizeof(char*) * REAP, GFP_KERNEL, numa_node_id());
-    for(int i = 0; i < REAP; i++) {
-        bufs[i] = kzalloc_node(vlen, GFP_KERNEL, numa_node_id());
-    } 
-
-    ktime_t tstart, tend; 
-    tstart = ktime_get();
-
-    for(uint64_t i = 1; i < pairs; i++) {
-        struct nvme_kv_command cmd;
-        memset(&cmd, 0, sizeof (struct nvme_kv_command));
-        cmd.common.opcode = nvme_cmd_kv_store;
-
-        NVMEV_ASSERT(klen == sizeof(i));
-        memcpy(cmd.kv_store.key, &i, sizeof(i));
-        cmd.kv_store.key_len = klen - 1;
-
-        cmd.kv_store.dptr.prp1 = (__u64) bufs[i % REAP];
-        cmd.kv_store.value_len = vlen >> 2;
-        cmd.kv_store.invalid_byte = 0;
-
-        struct nvmev_request req = {
-            .cmd = (struct nvme_command*) &cmd,
-            .sq_id = 0,
-            .nsecs_start = 0,
-        };
-        struct nvmev_result ret = {
-            .nsecs_target = 0,
-            .status = NVME_SC_SUCCESS,
-            .cb = NULL,
-            .args = NULL,
-        };
-
-        __store(ns, &req, &ret, false, false);
-
-        if(i % REAP == 0) {
-            __reclaim_completed_reqs();
-        }
-
-        if(i > 0 && ((i & 1048575) == 0)) {
-            tend = ktime_get();
-            uint64_t elapsed = ktime_to_ns(ktime_sub(tend, tstart)) / 1000000000;
-
-            if(elapsed > 0) {
-                uint64_t ops_s = i / elapsed;
-                NVMEV_INFO("%llu fastmode writes done. %llu elapsed. %llu ops/s\n", 
-                             i, elapsed, ops_s);
-            }
-
-            cond_resched();
-        }
-    }
-
-    NVMEV_INFO("Before map.\n");
+/*
+ * Builds the on-disk mapping pages for every section a fast fill touched
+ * in this shard.
+ */
+static void __fast_fill_maps(struct demand_shard *shard) {
+    struct cache *cache = &shard->cache;
+    struct ssdparams *spp = &shard->ssd->sp;
 
-    uint64_t collision = 0;
     for(uint64_t i = 1; i < cache->nr_valid_tpages; i++) {
         struct ht_section *ht = cache->ht[i];
 
@@ -6323,7 +7602,7 @@ int fast_fill_t(void *data) {
         uint32_t cnt_bytes;
 
         for(int i = 0; i < EPP; i++) {
-            if(ht->pair_mem[i]) {
+            if(ht_pair_mem(ht, i)) {
                 cnt++;
             }
         }
@@ -6358,10 +7637,8 @@ skip:;
 
             atomic_set(&ht->t_ppa, ppa);
 
-            oob[ppa][0] = (glen << 32) | (ht->idx * EPP);
-            for(int i = 1; i < GRAIN_PER_PAGE; i++) {
-                oob[ppa][i] = UINT_MAX;
-            }
+            __oob_set_pair(shard, ppa, 0, (ht->idx * EPP), glen);
+            __oob_fill(shard, ppa, 1, UINT_MAX);
 
             ht->mappings = kzalloc_node(spp->pgsz, GFP_KERNEL, numa_node_id());
             ht->mem = ht->mappings;
@@ -6389,10 +7666,10 @@ skip:;
         uint32_t leaf_e_idx = 0;
 
         for(int i = 0; i < EPP; i++) {
-            if(ht->pair_mem[i]) {
+            if(ht_pair_mem(ht, i)) {
                 lpa_t lpa = (ht->idx * EPP) + i;
                 e[leaf_e_idx].hidx = lpa;
-                e[leaf_e_idx].ppa = ht->fm_grains[OFFSET(lpa)];
+                e[leaf_e_idx].ppa = ht_fm_grain(ht, i);
                 leaf_e_idx++;
             }
         }
@@ -6402,8 +7679,106 @@ skip:;
         ht->state = DIRTY;
         ht->mappings = NULL;
     }
+}
+
+struct task_struct *ff_ts;
+int fast_fill_t(void *data) {
+    struct fast_fill_args *args;
+    struct demand_shard *shards;
+    struct nvmev_ns *ns;
+    uint64_t size;
+    uint32_t vlen;
+    uint32_t pairs;
+
+    args = (struct fast_fill_args*) data;
+    ns = args->ns;
+    shards = (struct demand_shard*) ns->ftls;
+    size = args->size;
+    vlen = args->vlen;
+    pairs = args->pairs;
+
+    for(int s = 0; s < ns->nr_parts; s++) {
+        shards[s].fastmode = true;
+    }
+
+    uint8_t klen = 8;
+    uint32_t g_len = vlen / GRAINED_UNIT;
+
+    if(vlen % GRAINED_UNIT) {
+        g_len++;
+    }
+
+    if(GRAIN_PER_PAGE % g_len) {
+        NVMEV_INFO("Fastmode failed!\n");
+        return 0; 
+    }
+
+    NVMEV_INFO("Starting fastmode vlen %u pairs %u.\n", vlen, pairs);
+
+    bufs = kzalloc_node(sizeof(char*) * REAP, GFP_KERNEL, numa_node_id());
+    for(int i = 0; i < REAP; i++) {
+        bufs[i] = kzalloc_node(vlen, GFP_KERNEL, numa_node_id());
+    } 
+
+    ktime_t tstart, tend; 
+    tstart = ktime_get();
+
+    for(uint64_t i = 1; i < pairs; i++) {
+        struct nvme_kv_command cmd;
+        memset(&cmd, 0, sizeof (struct nvme_kv_command));
+        cmd.common.opcode = nvme_cmd_kv_store;
+
+        NVMEV_ASSERT(klen == sizeof(i));
+        memcpy(cmd.kv_store.key, &i, sizeof(i));
+        cmd.kv_store.key_len = klen - 1;
+
+        cmd.kv_store.dptr.prp1 = (__u64) bufs[i % REAP];
+        cmd.kv_store.value_len = vlen >> 2;
+        cmd.kv_store.invalid_byte = 0;
+
+        struct nvmev_request req = {
+            .cmd = (struct nvme_command*) &cmd,
+            .sq_id = 0,
+            .nsecs_start = 0,
+        };
+        struct nvmev_result ret = {
+            .nsecs_target = 0,
+            .status = NVME_SC_SUCCESS,
+            .cb = NULL,
+            .args = NULL,
+        };
+
+        __store(ns, &req, &ret, false, false);
+
+        if(i % REAP == 0) {
+            __reclaim_completed_reqs();
+        }
+
+        if(i > 0 && ((i & 1048575) == 0)) {
+            tend = ktime_get();
+            uint64_t elapsed = ktime_to_ns(ktime_sub(tend, tstart)) / 1000000000;
+
+            if(elapsed > 0) {
+                uint64_t ops_s = i / elapsed;
+                NVMEV_INFO("%llu fastmode writes done. %llu elapsed. %llu ops/s\n", 
+                             i, elapsed, ops_s);
+            }
+
+            cond_resched();
+        }
+    }
+
+    NVMEV_INFO("Before map.\n");
+
+    uint64_t collision = 0;
+    for(int s = 0; s < ns->nr_parts; s++) {
+        __fast_fill_maps(&shards[s]);
+    }
+
+    for(int s = 0; s < ns->nr_parts; s++) {
+        shards[s].fastmode = false;
+    }
 
-    shard->fastmode = false;
     NVMEV_ERROR("Fast fill done. %llu collisions\n", collision);
 
     kfree(args);
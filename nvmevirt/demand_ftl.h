@@ -5,13 +5,17 @@
 
 #include <linux/hashtable.h> 
 #include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/slub_def.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/wait.h>
 #include <linux/xarray.h>
 
 #include "cache.h"
+#include "lru.h"
 #include "pqueue/pqueue.h"
 #include "ssd_config.h"
 #include "ssd.h"
@@ -41,7 +45,8 @@ typedef enum {
 	// generic command status
 	KV_SUCCESS = 0, // success
 	KV_ERR_KEY_NOT_EXIST = 0x310,
-    KV_ERR_BUFFER_SMALL=0x301
+    KV_ERR_BUFFER_SMALL=0x301,
+    KV_ERR_HASH_FULL = 0x312
 } kvs_result;
 
 struct convparams {
@@ -57,6 +62,35 @@ struct convparams {
     uint64_t real_num_segments;
 };
 
+/*
+ * GC victim selection. GC_GREEDY pops the line with the fewest valid
+ * grains off victim_line_pq. The other policies score lines by age too,
+ * which changes as other lines fill, so they scan the queue instead.
+ *
+ * GC_WINDOWED is greedy over the GC_WINDOW oldest victim lines only.
+ */
+enum gc_policy {
+    GC_GREEDY,
+    GC_COST_BENEFIT,
+    GC_WINDOWED,
+    NR_GC_POLICIES,
+};
+
+#define GC_WINDOW (16)
+
+/*
+ * User stores are spread over NR_STREAMS write streams by how often
+ * their key is rewritten, and each stream fills its own line. That
+ * keeps frequently overwritten pairs from sharing lines with pairs that
+ * stay put, so victim lines are either mostly invalid or mostly cold.
+ *
+ * Stream 0 is the coldest and keeps USER_IO; stream s > 0 allocates
+ * pages with STREAM_IO(s). GC copies already go to gc_wp, which acts as
+ * the coldest stream of all.
+ */
+#define NR_STREAMS (4)
+#define STREAM_IO(s) ((s) == 0 ? USER_IO : GC_MAP_IO + (s))
+
 struct line {
 	int id; /* line id, the same as corresponding block id */
 	int ipc; /* invalid page count in this line */
@@ -68,7 +102,7 @@ struct line {
 	struct list_head entry;
 	/* position in the priority queue for victim lines */
 	size_t pos;
-    size_t pos_b;
+    uint64_t age; /* lm->seal_seq when this line was filled */
     bool map;
 };
 
@@ -82,15 +116,42 @@ struct write_pointer {
 	uint32_t pl;
 };
 
+struct user_stream {
+    struct write_pointer wp;
+    struct ppa cur_page; /* page stores in this stream are filling */
+    uint64_t offset; /* current offset on disk */
+    uint64_t wbuf_pending; /* bytes in the write buffer not yet programmed */
+};
+
+/*
+ * Count-min sketch of how many times each key hash has been stored.
+ * Counters are halved every HEAT_DECAY updates so old popularity fades.
+ */
+#define HEAT_ROWS (4)
+#define HEAT_BITS (12)
+#define HEAT_WIDTH (1 << HEAT_BITS)
+#define HEAT_DECAY (HEAT_WIDTH * 8)
+
+struct heat_sketch {
+    uint8_t cnt[HEAT_ROWS][HEAT_WIDTH];
+    uint32_t updates;
+};
+
 struct line_mgmt {
 	struct line *lines;
 
 	/* free line list, we only need to maintain a list of blk numbers */
 	struct list_head free_line_list;
 	pqueue_t *victim_line_pq;
-    pqueue_t *victim_line_bq;
 	struct list_head full_line_list;
 
+    /*
+     * Number of lines filled so far. It's the clock line->age is
+     * measured against, so age is in lines written rather than time.
+     */
+    uint64_t seal_seq;
+    unsigned int policy; /* enum gc_policy */
+
 	uint32_t tt_lines;
 	uint32_t free_line_cnt;
 	uint32_t victim_line_cnt;
@@ -122,6 +183,83 @@ struct gc_data {
     bool map;
     struct xarray inv_mapping_xa;
     struct xarray off_dels;
+
+    /*
+     * Progress through the line being collected. GC copies gc_slice
+     * flash pages at a time and lets stores run in between, so a
+     * victim can stay half collected across calls to __gc_step.
+     */
+    struct line *victim; /* NULL when no GC is in progress */
+    uint32_t cursor; /* next flash page, ch and lun vary fastest */
+    uint32_t refilled; /* write credits handed back so far */
+    bool bg;
+    ktime_t start;
+    uint64_t map_us, clean_us;
+    uint64_t nsecs_latest;
+};
+
+/*
+ * Background GC workers, one per CPU in gccpus=. Shard i is always
+ * collected by worker i % nr_gc_workers, so workers clean disjoint
+ * lines and never share a shard's write pointers, cache or gc_data.
+ *
+ * Everything below lock is scratch space that do_gc only needs for the
+ * duration of one collection. It used to be global, which is why only
+ * one shard could be collected at a time.
+ */
+#define GC_SHIFTS (1024)
+
+struct demand_shard;
+struct gc_worker {
+    unsigned int id;
+    struct task_struct *task;
+    wait_queue_head_t wq; /* woken when one of our shards needs GC */
+    struct demand_shard *shards;
+    uint32_t nr_parts;
+
+    /*
+     * The shard whose line we are part way through. The scratch space
+     * below can only hold one line's state, so we finish it before
+     * starting on another shard, and pick that one round-robin from next.
+     */
+    struct demand_shard *active;
+    uint32_t next;
+
+    struct mutex lock; /* held across each GC slice */
+
+    /*
+     * Plus's transient GC hash tables, containing invalid hash index
+     * to grain mappings and offset deletes for the line being collected.
+     */
+    DECLARE_HASHTABLE(inv_m_hash, 17);
+    DECLARE_HASHTABLE(off_del_hash, 17);
+
+    /* hash table sections read in during GC, see clean_one_flashpg */
+    uint32_t shadow_idx[GRAIN_PER_PAGE * FLASH_PAGE_SIZE];
+    uint32_t shadow_idx_idx;
+
+    /* offset delete shifts of the pair being copied */
+    uint64_t existing_shifts[GC_SHIFTS];
+    uint64_t shifts_pre[GC_SHIFTS];
+    uint64_t shifts_post[GC_SHIFTS];
+    uint64_t combined[GC_SHIFTS];
+    uint32_t existing_idx;
+    uint32_t shift_pre_idx;
+    uint32_t shift_post_idx;
+    uint32_t combined_idx;
+
+    /* page counts and timings of the current collection */
+    uint64_t user_pgs_this_gc;
+    uint64_t gc_pgs_this_gc;
+    uint64_t map_pgs_this_gc;
+    uint64_t map_gc_pgs_this_gc;
+    uint64_t clean_first_half;
+    uint64_t clean_second_half;
+    uint64_t clean_third_half;
+    uint64_t mapping_searches;
+    uint64_t clearing;
+    uint64_t clear_count;
+    uint64_t copying;
 };
 
 #define MAX_HASH_COLLISION 1024
@@ -168,20 +306,70 @@ struct stats {
     uint64_t gc_invm_copy;
     uint64_t gc_cmt_copy;
 
+    /* valid grains and age of the lines GC picked, for averages */
+    uint64_t gc_victim_vgc;
+    uint64_t gc_victim_age;
+
+    /* writers stalled in forground_gc, and for how long in total */
+    uint64_t fg_gc_stalls;
+    uint64_t fg_gc_stall_us;
+
+    /* stores that waited for room in the write buffer, and for how long */
+    uint64_t wbuf_stalls;
+    uint64_t wbuf_stall_us;
+
+    /* pages allocated by each user write stream */
+    uint64_t stream_w[NR_STREAMS];
+
 	uint64_t w_hash_collision_cnt[MAX_HASH_COLLISION];
 	uint64_t r_hash_collision_cnt[MAX_HASH_COLLISION];
+	/* stores that found no free slot within HASH_MAX_PROBES */
+	uint64_t hash_full;
+	/* keys moved to the new section when theirs was split */
+	uint64_t hash_moved;
 
 	uint64_t fp_match_r;
 	uint64_t fp_match_w;
 	uint64_t fp_collision_r;
 	uint64_t fp_collision_w;
 
+	/* probes that skipped a flash read on a fingerprint mismatch */
+	uint64_t fp_skip_r;
+	uint64_t fp_skip_w;
+
 	uint64_t cache_hit;
 	uint64_t cache_miss;
 	uint64_t clean_evict;
 	uint64_t dirty_evict;
 };
 
+/*
+ * This isn't stricly necessary, but is here to try to avoid
+ * a situation where the exact same page is read repeatedly
+ * and the channel runs out of space for requests.
+ *
+ */
+#define NUM_APPEND_BUFS 4
+
+/*
+ * The background GC and eviction threads sleep until a watermark is
+ * crossed instead of spinning on their own core. Writers that have to
+ * wait on them spin for at most BG_SPIN_NS before going to sleep, so a
+ * short stall costs no more than it used to. BG_POLL_MS bounds how long
+ * any sleeper can miss a wakeup for.
+ */
+#define BG_SPIN_NS (20000)
+#define BG_POLL_MS (10)
+
+/*
+ * Past gc_thres_lines_high, writers may still use credits GC has handed
+ * back while more than this many lines are free. The rest are kept for
+ * the GC and map write pointers so a half collected line can finish.
+ */
+#define GC_RESERVE_LINES (2)
+
+#define IN_TXN 32
+
 struct demand_shard {
     uint64_t id;
 
@@ -195,7 +383,7 @@ struct demand_shard {
 	struct convparams cp;
 	struct ppa *maptbl; /* page level mapping table */
 	uint64_t *rmap; /* reverse mapptbl, assume it's stored in OOB */
-	struct write_pointer wp;
+    struct user_stream streams[NR_STREAMS];
     struct write_pointer map_wp;
 	struct write_pointer gc_wp;
     struct write_pointer map_gc_wp;
@@ -203,30 +391,101 @@ struct demand_shard {
 	struct write_flow_control wfc;
     struct gc_data gcd;
 
-    uint64_t offset; /* current offset on disk */
+    struct heat_sketch heat;
 
-    uint64_t **oob;
-    uint64_t *oob_mem;
-    bool *grain_bitmap;
+    uint32_t *oob; /* per grain LPA or marker, see __oob */
+    uint16_t *oob_glen; /* per grain pair length, where a pair starts */
+    struct xarray lh_moved; /* grain -> hash index, see __lh_hidx */
+    unsigned long *grain_bitmap; /* one bit per grain, see __grain_valid */
 
     uint32_t max_try;
 
     uint64_t dram; /* in bytes */
     bool fastmode; /* skip timings and build map later */
 
-    struct task_struct *bg_gc_t;
+    struct gc_worker *gcw; /* the GC worker that owns this shard */
     struct task_struct *bg_ev_t;
 
     atomic_t candidates;
     atomic_t have_victims;
 
+    /*
+     * gcw->wq wakes our GC worker once free lines drop to gc_thres_lines,
+     * and gc_done_wq wakes writers stalled in forground_gc after a round.
+     * ev_wq wakes bg_ev_t once the cache passes ev_wmark entries, and
+     * ev_done_wq wakes writers in __evict_one once victims are ready.
+     */
+    wait_queue_head_t gc_done_wq;
+    wait_queue_head_t ev_wq;
+    wait_queue_head_t ev_done_wq;
+    uint32_t ev_wmark;
+
+    /*
+     * Everything below used to be a global in demand_ftl.c. Each shard
+     * owns its own lines, cache and write pointers, so the locks that
+     * protect them are per-shard too.
+     */
+    spinlock_t entry_spin;
+    spinlock_t ev_spin;
+    spinlock_t wfc_spin;
+    spinlock_t v_spin;
+    spinlock_t inv_spin;
+    spinlock_t lm_spin;
+    spinlock_t inv_m_spin;
+    spinlock_t map_spin;
+
+    uint32_t leftover_credits;
+
+#ifndef ORIGINAL
+    /*
+     * Plus's per-page invalid count.
+     */
+    uint8_t *pg_inv_cnt;
+
+    /*
+     * Plus's in-memory per-superblock invalid mapping buffers, and the
+     * current offset in each.
+     */
+    char **inv_mapping_bufs;
+    uint64_t *inv_mapping_offs;
+#endif
+
+    /*
+     * Append buffers. A key always lands on the same shard, so keeping
+     * these per-shard means only the thread running this shard touches them.
+     */
+    struct item append_lrus[NUM_APPEND_BUFS];
+    struct lru_cache buf_lru;
+    char *cur_append_key;
+    uint8_t cur_append_klen;
+    uint8_t append_klens[NUM_APPEND_BUFS];
+    char* append_keys[NUM_APPEND_BUFS];
+    char* append_bufs[NUM_APPEND_BUFS];
+    uint32_t wb_idxs[NUM_APPEND_BUFS];
+    uint32_t inv_cnts[NUM_APPEND_BUFS];
+    /*
+     * Slot each buffer's key is flushed to, held from when the buffer is
+     * made so the flush always has somewhere to go.
+     */
+    lpa_t append_hidx[NUM_APPEND_BUFS];
+    uint32_t wb_idx;
+    char* cur_append_buf;
+    atomic_t buf_lock[NUM_APPEND_BUFS];
+
+    /*
+     * Sections pinned by the pairs of one batch, released together once
+     * the batch completes.
+     */
+    atomic_t *multi_ht[IN_TXN];
+    uint32_t multi_idx;
+
     struct stats stats;
     struct proc_dir_entry *proc_stats;
     struct proc_dir_entry *proc_gc;
 };
 
-void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr,
-			 uint32_t cpu_nr_dispatcher);
+int conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr,
+			uint32_t cpu_nr_dispatcher);
 void conv_remove_namespace(struct nvmev_ns *ns);
 bool conv_proc_nvme_io_cmd(struct nvmev_ns *ns, struct nvmev_request *req,
 			   struct nvmev_result *ret);
@@ -238,48 +497,61 @@ void mark_grain_invalid(struct demand_shard *shard, uint64_t grain, uint32_t len
 void mark_page_valid(struct demand_shard *demand_shard, struct ppa *ppa);
 void mark_grain_valid(struct demand_shard *shard, uint64_t grain, uint32_t len);
 
-void gc(void);
-char* get_demand_stat(void);
-void clear_demand_stat(void);
+void gc(struct nvmev_ns *ns);
+int gc_policy_parse(const char *name);
+const char *gc_policy_name(unsigned int policy);
+char* get_demand_stat(struct nvmev_ns *ns);
+void clear_demand_stat(struct nvmev_ns *ns);
 
 #ifndef ORIGINAL
 #define INV_PAGE_SZ PAGESIZE
 #define INV_ENTRY_SZ (sizeof(lpa_t) + sizeof(ppa_t))
-
-extern uint8_t *pg_inv_cnt;
-extern char** inv_mapping_bufs;
-extern uint64_t* inv_mapping_offs;
 #endif
 
-extern uint64_t user_pgs_this_gc;
-extern uint64_t gc_pgs_this_gc;
-extern uint64_t map_pgs_this_gc;
-extern uint64_t map_gc_pgs_this_gc;
-
 struct hash_params {
-	uint32_t hash;
+	uint64_t hash;
 	int cnt;
 	int find;
 	uint32_t lpa;
+	int probes; /* slots looked at so far */
+	bool gap; /* passed a free slot */
+	bool spill; /* the key may be in its second choice */
 };
 
 #define MAX_KLEN 16
 
-#define QUADRATIC_PROBING(h,c) ((h)+(c)+(c)*(c))
-#define LINEAR_PROBING(h,c) (h+c)
+/*
+ * A key lives in one of two windows of HASH_PROBE_WIN consecutive hash
+ * index slots. Each window sits inside a single mapping page, and the two
+ * pages are picked from different bits of the key's hash. So finding a
+ * key, or a slot for it, looks at no more than HASH_MAX_PROBES slots in
+ * at most two mapping pages.
+ *
+ * The index also grows by linear hashing (see struct cache). Splitting a
+ * section moves the keys that now belong to the new section there (see
+ * __lh_split), so there are no older windows to look in.
+ *
+ * Deletes and splits leave holes, so a window is looked at up to its end
+ * even after a free slot. The probe count h.cnt encodes the position:
+ * choice * HASH_PROBE_WIN + slot.
+ */
+#define HASH_PROBE_WIN 32
+#define HASH_MAX_PROBES (2 * HASH_PROBE_WIN)
 
-#define PROBING_FUNC(h,c) QUADRATIC_PROBING(h,c)
+#define PROBE_CHOICE(cnt) ((cnt) / HASH_PROBE_WIN)
 
 #define IS_INITIAL_PPA(x) ((atomic_read(&x)) == UINT_MAX)
 
+/*
+ * Which shard owns a key. The low bits of the hash pick the hash index
+ * inside the shard, so use the high bits here to keep the two independent.
+ */
+#define SHARD_OF(h) (((h) >> 32) % SSD_PARTITIONS)
+
 #define IDX2LPA(x) ((x) * EPP)
 #define IDX(x) ((x) / EPP)
 
-#ifdef ORIGINAL
-#define OFFSET(x) ((x) & (EPP - 1))
-#else
 #define OFFSET(x) ((x) % EPP)
-#endif
 
 #define PPA_TO_PGA(_ppa_, _offset_) ( ((_ppa_) * GRAIN_PER_PAGE) + (_offset_) )
 #define G_IDX(x) ((x) / GRAIN_PER_PAGE)
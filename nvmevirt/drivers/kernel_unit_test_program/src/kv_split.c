@@ -0,0 +1,181 @@
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include "linux_nvme_ioctl.h"
+#include "kv_nvme.h"
+
+/*
+ * Stores enough keys to make the hash table split its sections, and keeps
+ * reading back the keys stored first. Those were placed before any split,
+ * so they are the ones that break if a split loses track of old keys.
+ */
+
+void usage(void)
+{
+    printf("[Usage] kv_split -d device_path [-n number_of_kvpairs -s value_size -c check_every -z space_id]\n");
+}
+
+#define DEFAULT_NR_KEYS         (1000000)
+#define DEFAULT_VALUE_SIZE      (128)
+#define DEFAULT_CHECK_EVERY     (50000)
+#define NR_CHECK_KEYS           (1024)
+#define KEY_LEN                 (16)
+
+static void make_key(char *key, int i)
+{
+    memset(key, 0, KEY_LEN);
+    snprintf(key, KEY_LEN, "split#%d", i);
+}
+
+static void make_value(char *buf, int value_len, const char *key, int i)
+{
+    u_int8_t klen = KEY_LEN;
+
+    for (int k = 0; k < value_len; k++) {
+        buf[k] = 'a' + (i + k) % 26;
+    }
+
+    memcpy(buf, &klen, sizeof(u_int8_t));
+    memcpy(buf + sizeof(u_int8_t), key, KEY_LEN);
+}
+
+static int check_keys(int space_id, int fd, unsigned int nsid, int nr_keys,
+                      char *buf, char *expect, int value_len)
+{
+    char key[KEY_LEN];
+    int fails = 0;
+    int len;
+
+    for (int i = 0; i < nr_keys; i++) {
+        make_key(key, i);
+        make_value(expect, value_len, key, i);
+
+        len = value_len;
+        memset(buf, 0, value_len);
+        if (nvme_kv_retrieve(space_id, fd, nsid, key, KEY_LEN, buf, &len, 0,
+                             RETRIEVE_OPTION_NOTHING)) {
+            printf("fail to retrieve key %s\n", key);
+            fails++;
+        } else if (len != value_len || memcmp(buf, expect, value_len)) {
+            printf("value of key %s doesn't match value written (len %d)\n",
+                   key, len);
+            fails++;
+        }
+    }
+
+    return fails;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = 0;
+    int fd = -1;
+    int opt = 0;
+    char *dev = NULL;
+    char key[KEY_LEN];
+    long tmp = 0;
+    int nr_keys = DEFAULT_NR_KEYS;
+    int value_len = DEFAULT_VALUE_SIZE;
+    int check_every = DEFAULT_CHECK_EVERY;
+    int nr_check = 0;
+    int fails = 0;
+    unsigned int nsid = 0;
+    char *buf = NULL, *expect = NULL;
+    int space_id = 0;
+    while((opt = getopt(argc, argv, "d:n:s:c:z:")) != -1) {
+        switch(opt) {
+            case 'd':
+                dev = optarg;
+            break;
+            case 'n':
+            case 's':
+            case 'c':
+            case 'z':
+                tmp = strtol(optarg, NULL, 10);
+                if (tmp == LONG_MIN || tmp == LONG_MAX || tmp > INT_MAX || tmp <= 0) {
+                    printf("invalid -%c %ld\n", opt, tmp);
+                    ret = -EINVAL;
+                    goto exit;
+                }
+                if (opt == 'n') nr_keys = tmp;
+                else if (opt == 's') value_len = tmp;
+                else if (opt == 'c') check_every = tmp;
+                else space_id = tmp;
+            break;
+            case '?':
+            default:
+                usage();
+                ret = -EINVAL;
+                goto exit;
+            break;
+        }
+    }
+
+    if (!dev || value_len % 4 || value_len < KEY_LEN + 1) {
+        usage();
+        ret = -EINVAL;
+        goto exit;
+    }
+
+    posix_memalign((void **)&buf, 4096, value_len);
+    posix_memalign((void **)&expect, 4096, value_len);
+    if (!buf || !expect) {
+        printf("fail to alloc buf size %d\n", value_len);
+        ret = -ENOMEM;
+        goto exit;
+    }
+
+    fd = open(dev, O_RDWR);
+    if (fd < 0) {
+        printf("fail to open device %s\n", dev);
+        goto exit;
+    }
+
+    nsid = ioctl(fd, NVME_IOCTL_ID);
+    if (nsid == (unsigned) -1) {
+        printf("fail to get nsid for %s\n", dev);
+        goto exit;
+    }
+
+    nr_check = (nr_keys < NR_CHECK_KEYS) ? nr_keys : NR_CHECK_KEYS;
+    for (int i = 0; i < nr_keys; i++) {
+        make_key(key, i);
+        make_value(buf, value_len, key, i);
+
+        ret = nvme_kv_store(space_id, fd, nsid, key, KEY_LEN, buf, value_len, 0,
+                            STORE_OPTION_NOTHING);
+        if (ret) {
+            printf("fail to store key %s after %d keys\n", key, i);
+            goto exit;
+        }
+
+        if ((i + 1) % check_every == 0) {
+            fails += check_keys(space_id, fd, nsid, nr_check, buf, expect,
+                                value_len);
+            printf("stored %d keys, %d failed reads so far\n", i + 1, fails);
+        }
+    }
+
+    fails += check_keys(space_id, fd, nsid, nr_check, buf, expect, value_len);
+    if (fails) {
+        printf("%d reads of keys stored before splitting failed\n", fails);
+        ret = 1;
+    } else {
+        printf("success\n");
+    }
+exit:
+    if (buf) free(buf);
+    if (expect) free(expect);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ret;
+}
@@ -2,123 +2,52 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
-#include <linux/slab.h>
 
-#define RING_BUFFER_SIZE 600000 // Define your required size
-
-struct ring_buffer {
-    struct cmt_struct* buffer[RING_BUFFER_SIZE];
-    int head;
-    int tail;
-    spinlock_t lock;
-};
-
-static struct ring_buffer rb;
-
-void rb_init(struct ring_buffer *rb) {
-    rb->head = 0;
-    rb->tail = 0;
-    spin_lock_init(&rb->lock);
-}
-
-int rb_is_full(struct ring_buffer *rb) {
-    return ((rb->head + 1) % RING_BUFFER_SIZE) == rb->tail;
-}
-
-int rb_is_empty(struct ring_buffer *rb) {
-    return rb->head == rb->tail;
+void fifo_init(struct fifo *queue) {
+    INIT_LIST_HEAD(&queue->head);
+    queue->len = 0;
 }
 
-int rb_push(struct ring_buffer *rb, struct cmt_struct *data) {
-    unsigned long flags;
-
-    //spin_lock_irqsave(&rb->lock, flags);
-
-    if (rb_is_full(rb)) {
-        //spin_unlock_irqrestore(&rb->lock, flags);
-        return -1; // Buffer is full
+bool fifo_enqueue(struct fifo *queue, struct list_head *node) {
+    if(!list_empty(node)) {
+        return false;
     }
 
-    //NVMEV_ERROR("Placing CMT IDX %u at %d\n", data->idx, rb->head);
-
-    rb->buffer[rb->head] = data;
-    rb->head = (rb->head + 1) % RING_BUFFER_SIZE;
-
-    //spin_unlock_irqrestore(&rb->lock, flags);
-    return 0; // Success
+    list_add_tail(node, &queue->head);
+    queue->len++;
+    return true;
 }
 
-struct cmt_struct *rb_pop(struct ring_buffer *rb) {
-    void* ret;
-    unsigned long flags;
-
-    //spin_lock_irqsave(&rb->lock, flags);
+struct list_head *fifo_dequeue(struct fifo *queue) {
+    struct list_head *node;
 
-    if (rb_is_empty(rb)) {
-        //spin_unlock_irqrestore(&rb->lock, flags);
-        return NULL; // Buffer is empty
+    if(list_empty(&queue->head)) {
+        return NULL;
     }
 
-    ret = rb->buffer[rb->tail];
-    rb->tail = (rb->tail + 1) % RING_BUFFER_SIZE;
-
-    //NVMEV_ERROR("Popping CMT IDX %u from %d\n", 
-                 //((struct cmt_struct*) ret)->idx, rb->tail);
-
-    //spin_unlock_irqrestore(&rb->lock, flags);
-    return ret; // Success
-}
-
-void rb_free(struct ring_buffer *rb) {
-    // If your cmt_struct contains dynamically allocated memory, free it here
-}
-
-spinlock_t fifo_spin;
-void fifo_init(struct fifo **queue) {
-    rb_init(&rb);	
-    //*queue = kzalloc(sizeof(struct fifo), GFP_KERNEL);
-    //INIT_LIST_HEAD(&((*queue)->head));
-}
-
-void* fifo_enqueue(struct fifo *queue, void *data) {
-    spin_lock(&fifo_spin);
-    rb_push(&rb, (struct cmt_struct*) data);
-    spin_unlock(&fifo_spin);
-    //struct q_entry *new_node = kmalloc(sizeof(*new_node), GFP_KERNEL);
-    //new_node->data = data;
-    //list_add_tail(&new_node->list, &queue->head);
-    return (void*) 0xA;
+    node = queue->head.next;
+    list_del_init(node);
+    queue->len--;
+    return node;
 }
 
-void *fifo_dequeue(struct fifo *queue) {
-    void *ret;
-    spin_lock(&fifo_spin);
-    if(rb_is_empty(&rb)) {
-        spin_unlock(&fifo_spin);
-        return NULL;
+void fifo_remove(struct fifo *queue, struct list_head *node) {
+    if(list_empty(node)) {
+        return;
     }
 
-    ret = rb_pop(&rb);
-    spin_unlock(&fifo_spin);
-    return ret;
-    //if (list_empty(&queue->head)) {
-    //    spin_unlock(&fifo_spin);
-    //    return NULL;
-    //}
-
-    //struct q_entry *node = list_first_entry(&queue->head, struct q_entry, list);
-    //void *data = node->data;
-    //list_del(&node->list);
-    //kfree(node);
-    //spin_unlock(&fifo_spin);
-    //return data;
+    list_del_init(node);
+    queue->len--;
 }
 
 void fifo_destroy(struct fifo *queue) {
-    return;
-    struct q_entry *cur, *temp;
-    list_for_each_entry_safe(cur, temp, &queue->head, list) {
-        list_del(&cur->list);
-        kfree(cur);
+    struct list_head *cur, *tmp;
+
+    /*
+     * Nodes belong to their containers, so just unlink them.
+     */
+    list_for_each_safe(cur, tmp, &queue->head) {
+        list_del_init(cur);
     }
+    queue->len = 0;
 }
@@ -1,21 +1,25 @@
 #ifndef _NVMEVIRT_FIFO_H
 #define _NVMEVIRT_FIFO_H
 
-#include <linux/kfifo.h>
-#include <linux/slab.h>
-
-struct q_entry {
-    void *data;
-    struct list_head list;
-};
+#include <linux/list.h>
 
+/*
+ * Intrusive FIFO. Items embed a struct list_head and are linked in
+ * directly, so queueing never allocates. A node that is not queued is kept
+ * list_empty(), which is how fifo_enqueue() refuses double insertion.
+ *
+ * There is no locking in here. The owner (e.g. a cache's eviction policy)
+ * serializes access, since it usually has to update several queues at once.
+ */
 struct fifo {
     struct list_head head;
+    uint32_t len;
 };
 
-void fifo_init(struct fifo **queue);
-void* fifo_enqueue(struct fifo *queue, void *data);
-void *fifo_dequeue(struct fifo *queue);
+void fifo_init(struct fifo *queue);
+bool fifo_enqueue(struct fifo *queue, struct list_head *node);
+struct list_head *fifo_dequeue(struct fifo *queue);
+void fifo_remove(struct fifo *queue, struct list_head *node);
 void fifo_destroy(struct fifo *queue);
 
 #endif
@@ -9,6 +9,7 @@
 #include "nvmev.h"
 #include "nvme_kv.h"
 #include "dma.h"
+#include "pqueue/pqueue.h"
 
 #if (SUPPORTED_SSD_TYPE(CONV) || SUPPORTED_SSD_TYPE(ZNS))
 #include "ssd.h"
@@ -79,10 +80,8 @@ static unsigned int cmd_key_length(struct nvme_kv_command *cmd)
     }
 }
 
-static unsigned int __do_perform_io_kv(int sqid, int sq_entry)
+static unsigned int __do_perform_io_kv(struct nvme_command *b_cmd)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	struct nvme_command *b_cmd = &sq_entry(sq_entry);
     struct nvme_kv_command *cmd = (struct nvme_kv_command*) b_cmd;
 
 	size_t offset;
@@ -416,10 +415,9 @@ static unsigned int __do_perform_io_kv(int sqid, int sq_entry)
 }
 #endif
 
-static unsigned int __do_perform_io(int sqid, int sq_entry)
+static unsigned int __do_perform_io(struct nvme_command *b_cmd)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-    struct nvme_rw_command *cmd = &sq_entry(sq_entry).rw;
+    struct nvme_rw_command *cmd = &b_cmd->rw;
 	size_t offset;
 	size_t length, remaining;
 	int prp_offs = 0;
@@ -485,10 +483,9 @@ static unsigned int __do_perform_io(int sqid, int sq_entry)
 static u64 paddr_list[513] = {
 	0,
 }; // Not using index 0 to make max index == num_prp
-static unsigned int __do_perform_io_using_dma(int sqid, int sq_entry)
+static unsigned int __do_perform_io_using_dma(struct nvme_command *b_cmd)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	struct nvme_rw_command *cmd = &sq_entry(sq_entry).rw;
+	struct nvme_rw_command *cmd = &b_cmd->rw;
 	size_t offset;
 	size_t length, remaining;
 	int prp_offs = 0;
@@ -581,99 +578,141 @@ static unsigned int __do_perform_io_using_dma(int sqid, int sq_entry)
 	return length;
 }
 
-static void __insert_req_sorted(unsigned int entry, struct nvmev_io_worker *worker,
-				                unsigned long nsecs_target)
+/*
+ * Each IO worker keeps the work it has picked up in a min-heap keyed by
+ * nsecs_target, so finding what is due is O(1) and completing it O(log n).
+ * Producers never touch the heap: they push onto the lock-free @incoming
+ * list and the worker moves entries into the heap itself.
+ */
+static inline int io_work_cmp_pri(pqueue_pri_t next, pqueue_pri_t curr)
 {
-	/**
-	 * Requests are placed in @work_queue sorted by their target time.
-	 * @work_queue is statically allocated and the ordered list is
-	 * implemented by chaining the indexes of entries with @prev and @next.
-	 * This implementation is nasty but we do this way over dynamically
-	 * allocated linked list to minimize the influence of dynamic memory allocation.
-	 * Also, this O(n) implementation can be improved to O(logn) scheme with
-	 * e.g., red-black tree but....
-	 */
-	if (worker->io_seq == -1) {
-		worker->io_seq = entry;
-		worker->io_seq_end = entry;
-	} else {
-		unsigned int curr = worker->io_seq_end;
+	return (next > curr);
+}
 
-		while (curr != -1) {
-			if (worker->work_queue[curr].nsecs_target <= worker->latest_nsecs)
-				break;
+static inline pqueue_pri_t io_work_get_pri(void *a)
+{
+	return ((struct nvmev_io_work *)a)->nsecs_target;
+}
 
-			if (worker->work_queue[curr].nsecs_target <= nsecs_target)
-				break;
+static inline void io_work_set_pri(void *a, pqueue_pri_t pri)
+{
+	((struct nvmev_io_work *)a)->nsecs_target = pri;
+}
 
-			curr = worker->work_queue[curr].prev;
-		}
+static inline size_t io_work_get_pos(void *a)
+{
+	return ((struct nvmev_io_work *)a)->pos;
+}
 
-		if (curr == -1) { /* Head inserted */
-			worker->work_queue[worker->io_seq].prev = entry;
-			worker->work_queue[entry].next = worker->io_seq;
-			worker->io_seq = entry;
-		} else if (worker->work_queue[curr].next == -1) { /* Tail */
-			worker->work_queue[entry].prev = curr;
-			worker->io_seq_end = entry;
-			worker->work_queue[curr].next = entry;
-		} else { /* In between */
-			worker->work_queue[entry].prev = curr;
-			worker->work_queue[entry].next = worker->work_queue[curr].next;
-
-			worker->work_queue[worker->work_queue[entry].next].prev = entry;
-			worker->work_queue[curr].next = entry;
-		}
+static inline void io_work_set_pos(void *a, size_t pos)
+{
+	((struct nvmev_io_work *)a)->pos = pos;
+}
+
+static void __queue_io_work(unsigned int entry, struct nvmev_io_worker *worker)
+{
+	struct nvmev_io_work *w = worker->work_queue + entry;
+
+	w->pos = 0;
+	llist_add(&w->llnode, &worker->incoming);
+}
+
+static inline bool __io_work_on(struct nvmev_io_worker *worker, struct nvmev_io_work *w)
+{
+	return w >= worker->work_queue && w < worker->work_queue + NR_MAX_PARALLEL_IO;
+}
+
+static struct nvmev_io_worker *__io_work_owner(struct nvmev_io_work *w)
+{
+	unsigned int i;
+
+	for (i = 0; i < nvmev_vdev->config.nr_io_workers; i++) {
+		if (__io_work_on(&nvmev_vdev->io_workers[i], w))
+			return &nvmev_vdev->io_workers[i];
 	}
+
+	return NULL;
 }
 
-static struct nvmev_io_worker *__allocate_work_queue_entry(int sqid, unsigned int *entry)
+/*
+ * Move @w to a new target time. Only the worker that owns @w may do this,
+ * since its heap is private to that worker. If @w isn't in the heap yet,
+ * it is filed with the new target when the worker picks it up.
+ */
+static void __retarget_io_work(struct nvmev_io_worker *worker, struct nvmev_io_work *w,
+			       unsigned long long nsecs_target)
+{
+	NVMEV_ASSERT(__io_work_on(worker, w));
+
+	if (w->pos != 0 && !w->is_completed)
+		pqueue_change_priority(worker->pq, nsecs_target, w);
+	else
+		w->nsecs_target = nsecs_target;
+}
+
+/*
+ * Take a free entry on @owner, or on the next worker in turn for @sqid if
+ * @owner is NULL.
+ */
+static struct nvmev_io_worker *__allocate_work_queue_entry(int sqid, unsigned int *entry,
+							   struct nvmev_io_worker *owner)
 {
 	unsigned int io_worker_turn = __get_io_worker(sqid);
-	struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[io_worker_turn];
-	unsigned int e = worker->free_seq;
-	struct nvmev_io_work *w = worker->work_queue + e;
+	struct nvmev_io_worker *worker = owner ? owner : &nvmev_vdev->io_workers[io_worker_turn];
+	unsigned int e;
+	struct nvmev_io_work *w;
+
+	spin_lock(&worker->lock);
+
+	e = worker->free_seq;
+	w = worker->work_queue + e;
 
 	if (w->next >= NR_MAX_PARALLEL_IO) {
+		spin_unlock(&worker->lock);
 		WARN_ON_ONCE("IO queue is almost full");
 		return NULL;
 	}
 
-	if (++io_worker_turn == nvmev_vdev->config.nr_io_workers)
-		io_worker_turn = 0;
-	nvmev_vdev->io_worker_turn = io_worker_turn;
+	if (!owner) {
+		if (++io_worker_turn == nvmev_vdev->config.nr_io_workers)
+			io_worker_turn = 0;
+		nvmev_vdev->io_worker_turn = io_worker_turn;
+	}
 
 	worker->free_seq = w->next;
 	BUG_ON(worker->free_seq >= NR_MAX_PARALLEL_IO);
 	*entry = e;
 
+	spin_unlock(&worker->lock);
+
 	return worker;
 }
 
 static struct nvmev_io_work* __enqueue_io_req(int sqid, int cqid, int sq_entry, 
+                                              struct nvme_command *cmd,
                                               unsigned long long nsecs_start,
                                               struct nvmev_result *ret)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
 	struct nvmev_io_worker *worker;
 	struct nvmev_io_work *w;
 	unsigned int entry;
 
-	worker = __allocate_work_queue_entry(sqid, &entry);
+	worker = __allocate_work_queue_entry(sqid, &entry, NULL);
 	if (!worker)
 		return NULL;
 
 	w = worker->work_queue + entry;
 
 	NVMEV_DEBUG_VERBOSE("%s/%u[%d], sq %d cq %d, entry %d, %llu + %llu\n", worker->thread_name, entry,
-		    sq_entry(sq_entry).rw.opcode, sqid, cqid, sq_entry, nsecs_start,
+		    cmd->rw.opcode, sqid, cqid, sq_entry, nsecs_start,
 		    ret->nsecs_target - nsecs_start);
 
 	/////////////////////////////////
 	w->sqid = sqid;
 	w->cqid = cqid;
 	w->sq_entry = sq_entry;
-	w->command_id = sq_entry(sq_entry).common.command_id;
+	w->command_id = cmd->common.command_id;
+	w->cmd = *cmd;
 	w->nsecs_start = nsecs_start;
 	w->nsecs_enqueue = local_clock();
 	w->nsecs_target = ret->nsecs_target;
@@ -686,13 +725,15 @@ static struct nvmev_io_work* __enqueue_io_req(int sqid, int cqid, int sq_entry,
     w->args = ret->args;
 
 	w->is_internal = false;
-	mb(); /* IO worker shall see the updated w at once */
-
-	__insert_req_sorted(entry, worker, ret->nsecs_target);
+	__queue_io_work(entry, worker);
     return w;
 }
 
-void schedule_internal_operation(int sqid, unsigned long long nsecs_target,
+/*
+ * Returns false if no work entry was free, in which case nothing will
+ * release buffs_to_release and the caller has to.
+ */
+bool schedule_internal_operation(int sqid, unsigned long long nsecs_target,
 				 struct buffer *write_buffer, size_t buffs_to_release)
 {
 	struct nvmev_io_worker *worker;
@@ -705,9 +746,9 @@ void schedule_internal_operation(int sqid, unsigned long long nsecs_target,
 		sqid = sqid_r % nvmev_vdev->config.nr_io_workers;
 	}
 
-	worker = __allocate_work_queue_entry(sqid, &entry);
+	worker = __allocate_work_queue_entry(sqid, &entry, NULL);
 	if (!worker)
-		return;
+		return false;
 
 	w = worker->work_queue + entry;
 
@@ -726,9 +767,8 @@ void schedule_internal_operation(int sqid, unsigned long long nsecs_target,
 	w->is_internal = true;
 	w->write_buffer = write_buffer;
 	w->buffs_to_release = buffs_to_release;
-	mb(); /* IO worker shall see the updated w at once */
-
-	__insert_req_sorted(entry, worker, nsecs_target);
+	__queue_io_work(entry, worker);
+	return true;
 }
 
 void schedule_internal_operation_cb(int sqid, unsigned long long nsecs_start,
@@ -747,7 +787,11 @@ void schedule_internal_operation_cb(int sqid, unsigned long long nsecs_start,
         sqid = sqid_r % nvmev_vdev->config.nr_io_workers;
     }
 
-	worker = __allocate_work_queue_entry(sqid, &entry);
+	/*
+	 * The callback retargets cb_w from inside the worker loop, so it has
+	 * to run on the worker whose heap holds cb_w.
+	 */
+	worker = __allocate_work_queue_entry(sqid, &entry, cb_w ? __io_work_owner(cb_w) : NULL);
     BUG_ON(!worker);
 	if (!worker)
 		return;
@@ -777,18 +821,17 @@ void schedule_internal_operation_cb(int sqid, unsigned long long nsecs_start,
 	w->is_internal = true;
 	w->write_buffer = NULL;
 	w->buffs_to_release = 0;
-	mb(); /* IO worker shall see the updated w at once */
-
-	__insert_req_sorted(entry, worker, w->nsecs_target);
+	__queue_io_work(entry, worker);
 }
 
-static void __reclaim_completed_reqs(void)
+void __reclaim_completed_reqs(void)
 {
 	unsigned int turn;
 
 	for (turn = 0; turn < nvmev_vdev->config.nr_io_workers; turn++) {
 		struct nvmev_io_worker *worker;
 		struct nvmev_io_work *w;
+		struct llist_node *done;
 
 		unsigned int first_entry = -1;
 		unsigned int last_entry = -1;
@@ -797,53 +840,63 @@ static void __reclaim_completed_reqs(void)
 
 		worker = &nvmev_vdev->io_workers[turn];
 
-		first_entry = worker->io_seq;
-		curr = first_entry;
+		done = llist_del_all(&worker->completed);
+		if (!done)
+			continue;
 
-		while (curr != -1) {
-			w = &worker->work_queue[curr];
-			if (w->is_completed == true && w->is_copied == true &&
-			    w->nsecs_target <= worker->latest_nsecs) {
-				last_entry = curr;
-				curr = w->next;
-				nr_reclaimed++;
-			} else {
-				break;
-			}
+		/* Chain what the worker completed, then hang it off the free list. */
+		llist_for_each_entry(w, done, llnode) {
+			curr = w - worker->work_queue;
+			if (first_entry == -1)
+				first_entry = curr;
+			else
+				worker->work_queue[last_entry].next = curr;
+			w->prev = last_entry;
+			last_entry = curr;
+			nr_reclaimed++;
 		}
+		worker->work_queue[last_entry].next = -1;
 
-		if (last_entry != -1) {
-			w = &worker->work_queue[last_entry];
-			worker->io_seq = w->next;
-			if (w->next != -1) {
-				worker->work_queue[w->next].prev = -1;
-			}
-			w->next = -1;
+		spin_lock(&worker->lock);
 
-			w = &worker->work_queue[first_entry];
-			w->prev = worker->free_seq_end;
+		w = &worker->work_queue[first_entry];
+		w->prev = worker->free_seq_end;
 
-			w = &worker->work_queue[worker->free_seq_end];
-			w->next = first_entry;
+		w = &worker->work_queue[worker->free_seq_end];
+		w->next = first_entry;
 
-			worker->free_seq_end = last_entry;
-			NVMEV_DEBUG_VERBOSE("%s: %u -- %u, %d\n", __func__,
-					first_entry, last_entry, nr_reclaimed);
-		}
+		worker->free_seq_end = last_entry;
+
+		spin_unlock(&worker->lock);
+
+		NVMEV_DEBUG_VERBOSE("%s: %u -- %u, %d\n", __func__,
+				first_entry, last_entry, nr_reclaimed);
 	}
 }
 
-static size_t __nvmev_proc_io(int sqid, int sq_entry, size_t *io_size)
+static inline struct nvmev_ns *__cmd_ns(struct nvme_command *cmd)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	unsigned long long nsecs_start = __get_wallclock();
-	struct nvme_command *cmd = &sq_entry(sq_entry);
 #if (BASE_SSD == KV_PROTOTYPE) || (BASE_SSD == SAMSUNG_970PRO_HASH_DFTL)
 	uint32_t nsid = 0; // Some KVSSD programs give 0 as nsid for KV IO
 #else
 	uint32_t nsid = cmd->common.nsid - 1;
 #endif
-	struct nvmev_ns *ns = &nvmev_vdev->ns[nsid];
+	return &nvmev_vdev->ns[nsid];
+}
+
+/*
+ * Runs the FTL for one command and queues its completion. Called on the
+ * dispatcher, or on an FTL worker when ftlcpus is given.
+ *
+ * cmd is a private copy of the SQ entry. The host may reuse the slot as
+ * soon as any later command completes, and the FTL writes its results for
+ * the copy stage into the command, so nothing past here reads the slot.
+ */
+static bool __nvmev_do_proc_io(int sqid, int sq_entry, struct nvme_command *cmd,
+			       unsigned long long nsecs_start)
+{
+	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
+	struct nvmev_ns *ns = __cmd_ns(cmd);
 
 	struct nvmev_request req = {
 		.cmd = cmd,
@@ -870,13 +923,12 @@ static size_t __nvmev_proc_io(int sqid, int sq_entry, size_t *io_size)
 
 	if (!ns->proc_io_cmd(ns, &req, &ret))
 		return false;
-	*io_size = (cmd->rw.length + 1) << 9;
 
 #ifdef PERF_DEBUG
 	prev_clock2 = local_clock();
 #endif
 
-    __enqueue_io_req(sqid, sq->cqid, sq_entry, nsecs_start, &ret);
+    __enqueue_io_req(sqid, sq->cqid, sq_entry, cmd, nsecs_start, &ret);
 
 #ifdef PERF_DEBUG
 	prev_clock3 = local_clock();
@@ -904,6 +956,82 @@ static size_t __nvmev_proc_io(int sqid, int sq_entry, size_t *io_size)
 	return true;
 }
 
+static inline bool __ftl_worker_idle(struct nvmev_ftl_worker *worker)
+{
+	return smp_load_acquire(&worker->tail) == worker->head;
+}
+
+/*
+ * Wait until every FTL worker has finished everything handed to it.
+ */
+static void __quiesce_ftl_workers(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nvmev_vdev->config.nr_ftl_workers; i++) {
+		while (!__ftl_worker_idle(&nvmev_vdev->ftl_workers[i]))
+			cpu_relax();
+	}
+}
+
+static bool __dispatch_ftl_req(struct nvmev_ftl_worker *worker, int sqid, int sq_entry,
+			       struct nvme_command *cmd, unsigned long long nsecs_start)
+{
+	unsigned int head = worker->head;
+	struct nvmev_ftl_req *r;
+
+	if (head - smp_load_acquire(&worker->tail) >= FTL_QUEUE_SIZE)
+		return false; /* Full, the dispatcher retries on its next pass */
+
+	r = &worker->queue[head & (FTL_QUEUE_SIZE - 1)];
+	r->sqid = sqid;
+	r->sq_entry = sq_entry;
+	r->cmd = *cmd;
+	r->nsecs_start = nsecs_start;
+
+	smp_store_release(&worker->head, head + 1);
+
+	if (wq_has_sleeper(&worker->wq))
+		wake_up(&worker->wq);
+	return true;
+}
+
+static size_t __nvmev_proc_io(int sqid, int sq_entry, size_t *io_size)
+{
+	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
+	unsigned long long nsecs_start = __get_wallclock();
+	struct nvme_command cmd_copy = sq_entry(sq_entry);
+	struct nvme_command *cmd = &cmd_copy;
+	struct nvmev_ns *ns = __cmd_ns(cmd);
+	unsigned int nr_ftl_workers = nvmev_vdev->config.nr_ftl_workers;
+	int part;
+
+	if (nr_ftl_workers == 0 || !ns->io_cmd_part) {
+		if (!__nvmev_do_proc_io(sqid, sq_entry, cmd, nsecs_start))
+			return false;
+	} else {
+		/*
+		 * Every command for a given partition goes to the same worker,
+		 * so commands on the same key stay in submission order.
+		 * Commands that may touch several partitions run here, once
+		 * the workers have drained.
+		 */
+		part = ns->io_cmd_part(ns, cmd);
+		if (part >= 0) {
+			if (!__dispatch_ftl_req(&nvmev_vdev->ftl_workers[part % nr_ftl_workers],
+						sqid, sq_entry, cmd, nsecs_start))
+				return false;
+		} else {
+			__quiesce_ftl_workers();
+			if (!__nvmev_do_proc_io(sqid, sq_entry, cmd, nsecs_start))
+				return false;
+		}
+	}
+
+	*io_size = (cmd->rw.length + 1) << 9;
+	return true;
+}
+
 int nvmev_proc_io_sq(int sqid, int new_db, int old_db)
 {
 	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
@@ -975,9 +1103,6 @@ static void __fill_cq_result(struct nvmev_io_work *w)
 
 	spin_lock(&cq->entry_lock);
 
-    struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-    struct nvme_command *cmd = &sq_entry(sq_entry);
-
 	cqe->command_id = command_id;
 	cqe->sq_id = sqid;
 	cqe->sq_head = sq_entry;
@@ -1015,18 +1140,19 @@ static int nvmev_io_worker(void *data)
 		unsigned long long curr_nsecs_local = local_clock();
 		long long delta = curr_nsecs_wall - curr_nsecs_local;
 
-		volatile unsigned int curr = worker->io_seq;
+		struct llist_node *incoming;
+		struct nvmev_io_work *w, *tmp;
+		unsigned long long curr_nsecs;
+		unsigned int curr;
 		int qidx;
 
-		while (curr != -1) {
-			struct nvmev_io_work *w = &worker->work_queue[curr];
-			unsigned long long curr_nsecs = local_clock() + delta;
-			worker->latest_nsecs = curr_nsecs;
-
-			if (w->is_completed == true) {
-				curr = w->next;
-				continue;
-			}
+		/*
+		 * Pick up newly queued work in arrival order, do its copy, and
+		 * file it by target time.
+		 */
+		incoming = llist_reverse_order(llist_del_all(&worker->incoming));
+		llist_for_each_entry_safe(w, tmp, incoming, llnode) {
+			curr = w - worker->work_queue;
 
 			if (w->is_copied == false) {
                 NVMEV_DEBUG_VERBOSE("%s: picked up %u, %d %d %d\n", worker->thread_name, curr,
@@ -1048,38 +1174,34 @@ static int nvmev_io_worker(void *data)
                         if(w->cb_w) {
                             w->cb_w->result0 = w->cb_w->result1 = result;
                             w->cb_w->status = status;
-                            w->cb_w->nsecs_target = target;
+                            __retarget_io_work(worker, w->cb_w, target);
                         }
                     }
 #endif
 				} else if (io_using_dma) {
-					__do_perform_io_using_dma(w->sqid, w->sq_entry);
+					__do_perform_io_using_dma(&w->cmd);
 				} else {
 #if (BASE_SSD == KV_PROTOTYPE)
-					struct nvmev_submission_queue *sq =
-						nvmev_vdev->sqes[w->sqid];
 					ns = &nvmev_vdev->ns[0];
-					if (ns->identify_io_cmd(ns, sq_entry(w->sq_entry))) {
+					if (ns->identify_io_cmd(ns, w->cmd)) {
 						w->result0 = ns->perform_io_cmd(
-							ns, &sq_entry(w->sq_entry), &(w->status));
+							ns, &w->cmd, &(w->status));
 					} else {
-						__do_perform_io(w->sqid, w->sq_entry);
+						__do_perform_io(&w->cmd);
 					}
 #endif
 #if (BASE_SSD == SAMSUNG_970PRO_HASH_DFTL)
-					struct nvmev_submission_queue *sq =
-						nvmev_vdev->sqes[w->sqid];
 					ns = &nvmev_vdev->ns[0];
-                    if (ns->identify_io_cmd(ns, sq_entry(w->sq_entry))) {
-                        w->result0 = w->result1 = __do_perform_io_kv(w->sqid, w->sq_entry);
+                    if (ns->identify_io_cmd(ns, w->cmd)) {
+                        w->result0 = w->result1 = __do_perform_io_kv(&w->cmd);
                         if(w->cb) {
                             w->cb(w->args, 0, 0);
                         }
                     } else {
-                        __do_perform_io(w->sqid, w->sq_entry);
+                        __do_perform_io(&w->cmd);
                     }
 #else
-					__do_perform_io(w->sqid, w->sq_entry);
+					__do_perform_io(&w->cmd);
 #endif
 				}
 
@@ -1092,35 +1214,48 @@ static int nvmev_io_worker(void *data)
 					    w->sqid, w->cqid, w->sq_entry);
 			}
 
-			if (w->nsecs_target <= curr_nsecs) {
-				if (w->is_internal) {
+			pqueue_insert(worker->pq, w);
+		}
+
+		/*
+		 * Complete everything that is due. The heap gives us the earliest
+		 * target first, so we stop at the first one still in the future.
+		 */
+		curr_nsecs = local_clock() + delta;
+		worker->latest_nsecs = curr_nsecs;
+
+		while ((w = pqueue_peek(worker->pq)) != NULL) {
+			if (w->nsecs_target > curr_nsecs)
+				break;
+
+			pqueue_pop(worker->pq);
+			curr = w - worker->work_queue;
+
+			if (w->is_internal) {
 #if (SUPPORTED_SSD_TYPE(CONV) || SUPPORTED_SSD_TYPE(ZNS))
-                    if(w->write_buffer) {
-                        buffer_release((struct buffer *)w->write_buffer,
-                                w->buffs_to_release);
-                    }
+                if(w->write_buffer) {
+                    buffer_release((struct buffer *)w->write_buffer,
+                            w->buffs_to_release);
+                }
 #endif
-				} else {
-                    __fill_cq_result(w);
-				}
+			} else {
+                __fill_cq_result(w);
+			}
 
-				NVMEV_DEBUG_VERBOSE("%s: completed %u, %d %d %d\n", worker->thread_name, curr,
-					    w->sqid, w->cqid, w->sq_entry);
+			NVMEV_DEBUG_VERBOSE("%s: completed %u, %d %d %d\n", worker->thread_name, curr,
+				    w->sqid, w->cqid, w->sq_entry);
 
 #ifdef PERF_DEBUG
-				w->nsecs_cq_filled = local_clock() + delta;
-				trace_printk("%llu %llu %llu %llu %llu %llu\n", w->nsecs_start,
-					     w->nsecs_enqueue - w->nsecs_start,
-					     w->nsecs_copy_start - w->nsecs_start,
-					     w->nsecs_copy_done - w->nsecs_start,
-					     w->nsecs_cq_filled - w->nsecs_start,
-					     w->nsecs_target - w->nsecs_start);
+			w->nsecs_cq_filled = local_clock() + delta;
+			trace_printk("%llu %llu %llu %llu %llu %llu\n", w->nsecs_start,
+				     w->nsecs_enqueue - w->nsecs_start,
+				     w->nsecs_copy_start - w->nsecs_start,
+				     w->nsecs_copy_done - w->nsecs_start,
+				     w->nsecs_cq_filled - w->nsecs_start,
+				     w->nsecs_target - w->nsecs_start);
 #endif
-				mb(); /* Reclaimer shall see after here */
-				w->is_completed = true;
-			}
-
-			curr = w->next;
+			w->is_completed = true;
+			llist_add(&w->llnode, &worker->completed);
 		}
 
 		for (qidx = 1; qidx <= nvmev_vdev->nr_cq; qidx++) {
@@ -1183,8 +1318,11 @@ void NVMEV_IO_WORKER_INIT(struct nvmev_dev *nvmev_vdev)
 		worker->id = worker_id;
 		worker->free_seq = 0;
 		worker->free_seq_end = NR_MAX_PARALLEL_IO - 1;
-		worker->io_seq = -1;
-		worker->io_seq_end = -1;
+		spin_lock_init(&worker->lock);
+		init_llist_head(&worker->incoming);
+		init_llist_head(&worker->completed);
+		worker->pq = pqueue_init(NR_MAX_PARALLEL_IO, io_work_cmp_pri, io_work_get_pri,
+					 io_work_set_pri, io_work_get_pos, io_work_set_pos);
 
 		snprintf(worker->thread_name, sizeof(worker->thread_name), "nvmev_io_worker_%d", worker_id);
 
@@ -1195,6 +1333,132 @@ void NVMEV_IO_WORKER_INIT(struct nvmev_dev *nvmev_vdev)
 	}
 }
 
+static int nvmev_ftl_worker(void *data)
+{
+	struct nvmev_ftl_worker *worker = (struct nvmev_ftl_worker *)data;
+	unsigned long long idle_since = 0;
+
+	NVMEV_INFO("%s started on cpu %d (node %d)\n", worker->thread_name, smp_processor_id(),
+		   cpu_to_node(smp_processor_id()));
+
+	while (!kthread_should_stop()) {
+		unsigned int tail = worker->tail;
+		struct nvmev_ftl_req *r;
+
+		if (tail == smp_load_acquire(&worker->head)) {
+			/*
+			 * Poll for a short while so back-to-back commands don't
+			 * pay for a wakeup, then sleep until the dispatcher
+			 * hands us something.
+			 */
+			if (idle_since == 0)
+				idle_since = local_clock();
+
+			if (local_clock() - idle_since < FTL_SPIN_NS) {
+				cpu_relax();
+				continue;
+			}
+
+			wait_event_interruptible_timeout(worker->wq,
+					!__ftl_worker_idle(worker) || kthread_should_stop(),
+					msecs_to_jiffies(FTL_POLL_MS));
+			continue;
+		}
+
+		idle_since = 0;
+
+		r = &worker->queue[tail & (FTL_QUEUE_SIZE - 1)];
+
+		/*
+		 * KV commands never fail here. If that changes this needs a way
+		 * to push the command back to the dispatcher.
+		 */
+		if (!__nvmev_do_proc_io(r->sqid, r->sq_entry, &r->cmd, r->nsecs_start))
+			NVMEV_ERROR("%s: dropped sq %d entry %d\n", worker->thread_name, r->sqid,
+				    r->sq_entry);
+
+		/* Advance only once done, so idle means drained. */
+		smp_store_release(&worker->tail, tail + 1);
+	}
+
+	return 0;
+}
+
+void NVMEV_FTL_WORKER_INIT(struct nvmev_dev *nvmev_vdev)
+{
+	unsigned int worker_id;
+
+	if (nvmev_vdev->config.nr_ftl_workers == 0)
+		return;
+
+	nvmev_vdev->ftl_workers =
+		kcalloc(sizeof(struct nvmev_ftl_worker), nvmev_vdev->config.nr_ftl_workers, GFP_KERNEL);
+	if (!nvmev_vdev->ftl_workers)
+		goto err;
+
+	for (worker_id = 0; worker_id < nvmev_vdev->config.nr_ftl_workers; worker_id++) {
+		struct nvmev_ftl_worker *worker = &nvmev_vdev->ftl_workers[worker_id];
+
+		worker->queue = kcalloc(sizeof(struct nvmev_ftl_req), FTL_QUEUE_SIZE, GFP_KERNEL);
+		if (!worker->queue)
+			goto err;
+	}
+
+	for (worker_id = 0; worker_id < nvmev_vdev->config.nr_ftl_workers; worker_id++) {
+		struct nvmev_ftl_worker *worker = &nvmev_vdev->ftl_workers[worker_id];
+
+		worker->head = 0;
+		worker->tail = 0;
+		worker->id = worker_id;
+		init_waitqueue_head(&worker->wq);
+
+		snprintf(worker->thread_name, sizeof(worker->thread_name), "nvmev_ftl_worker_%d", worker_id);
+
+		worker->task_struct = kthread_create(nvmev_ftl_worker, worker, "%s", worker->thread_name);
+
+		kthread_bind(worker->task_struct, nvmev_vdev->config.cpu_nr_ftl_workers[worker_id]);
+		wake_up_process(worker->task_struct);
+	}
+	return;
+
+err:
+	/*
+	 * No thread has started yet. Fall back to running the FTL on the
+	 * dispatcher, as without ftlcpus=.
+	 */
+	NVMEV_ERROR("Failed to allocate %u FTL workers, running the FTL on the dispatcher\n",
+		    nvmev_vdev->config.nr_ftl_workers);
+
+	if (nvmev_vdev->ftl_workers) {
+		for (worker_id = 0; worker_id < nvmev_vdev->config.nr_ftl_workers; worker_id++)
+			kfree(nvmev_vdev->ftl_workers[worker_id].queue);
+	}
+
+	kfree(nvmev_vdev->ftl_workers);
+	nvmev_vdev->ftl_workers = NULL;
+	nvmev_vdev->config.nr_ftl_workers = 0;
+}
+
+void NVMEV_FTL_WORKER_FINAL(struct nvmev_dev *nvmev_vdev)
+{
+	unsigned int i;
+
+	if (nvmev_vdev->config.nr_ftl_workers == 0)
+		return;
+
+	for (i = 0; i < nvmev_vdev->config.nr_ftl_workers; i++) {
+		struct nvmev_ftl_worker *worker = &nvmev_vdev->ftl_workers[i];
+
+		if (!IS_ERR_OR_NULL(worker->task_struct)) {
+			kthread_stop(worker->task_struct);
+		}
+
+		kfree(worker->queue);
+	}
+
+	kfree(nvmev_vdev->ftl_workers);
+}
+
 void NVMEV_IO_WORKER_FINAL(struct nvmev_dev *nvmev_vdev)
 {
 	unsigned int i;
@@ -1206,6 +1470,7 @@ void NVMEV_IO_WORKER_FINAL(struct nvmev_dev *nvmev_vdev)
 			kthread_stop(worker->task_struct);
 		}
 
+		pqueue_free(worker->pq);
 		kfree(worker->work_queue);
 	}
 
@@ -1,3 +1,6 @@
+#ifndef _NVMEVIRT_LRU_H
+#define _NVMEVIRT_LRU_H
+
 #define MAX_CAPACITY 128
 
 struct item {
@@ -19,3 +22,5 @@ struct item *lru_cache_get(struct lru_cache *cache, uint32_t id);
 void lru_cache_set(struct lru_cache *cache, struct item *item);
 void lru_cache_remove(struct lru_cache *cache, uint32_t id);
 struct item *lru_cache_get_oldest(struct lru_cache *cache);
+
+#endif
@@ -19,6 +19,8 @@
 #include "nvmev.h"
 #include "demand_ftl.h"
 #include "dma.h"
+#include "channel_model.h"
+#include "twolevel.h"
 
 /****************************************************************
  * Memory Layout
@@ -68,10 +70,14 @@ static unsigned int nr_io_units = 8;
 static unsigned int io_unit_shift = 12;
 
 static unsigned int cache_dram_mb = 1;
+static char *cache_policy = "fifo";
+static char *gc_policy = "greedy";
+static unsigned int gc_slice = 8;
 
 static char *cpus;
-static char *gccpu;
+static char *gccpus;
 static char *evictcpu;
+static char *ftlcpus;
 static unsigned int debug = 0;
 
 int io_using_dma = false;
@@ -110,13 +116,21 @@ module_param(io_unit_shift, uint, 0444);
 MODULE_PARM_DESC(io_unit_shift, "Size of each I/O unit (2^)");
 module_param(cpus, charp, 0444);
 MODULE_PARM_DESC(cpus, "CPU list for process, completion(int.) threads, Seperated by Comma(,)");
-module_param(gccpu, charp, 0444);
-MODULE_PARM_DESC(gccpu, "Which CPU to place DFTLKV's background GC thread on.");
+module_param(gccpus, charp, 0444);
+MODULE_PARM_DESC(gccpus, "CPU list for DFTLKV's background GC workers, Seperated by Comma(,).");
 module_param(evictcpu, charp, 0444);
 MODULE_PARM_DESC(evictcpu, "Which CPU to place DFTLKV's background evict thread on.");
+module_param(ftlcpus, charp, 0444);
+MODULE_PARM_DESC(ftlcpus, "CPU list for FTL worker threads, Seperated by Comma(,). Runs the FTL on the dispatcher if not given.");
 module_param(debug, uint, 0644);
 module_param(cache_dram_mb, uint, 0644);
 MODULE_PARM_DESC(cache_dram_mb, "How much DRAM to use for the DFTLKV mapping cache.");
+module_param(cache_policy, charp, 0444);
+MODULE_PARM_DESC(cache_policy, "DFTLKV mapping cache eviction policy: fifo, clock, s3fifo or lru2.");
+module_param(gc_policy, charp, 0444);
+MODULE_PARM_DESC(gc_policy, "DFTLKV GC victim policy: greedy, cb (cost-benefit) or window (windowed greedy).");
+module_param(gc_slice, uint, 0444);
+MODULE_PARM_DESC(gc_slice, "Flash pages DFTLKV's background GC copies before yielding to stores. 0 collects a whole line at once.");
 
 static void nvmev_proc_dbs(void)
 {
@@ -293,6 +307,14 @@ static int __get_nr_entries(int dbs_idx, int queue_size)
 	return diff;
 }
 
+/* Result of the last channel model benchmark run through /proc/nvmev/chbench */
+static struct chmodel_bench_result chbench_result;
+
+#ifndef ORIGINAL
+/* Result of the last mapping leaf insert benchmark run through /proc/nvmev/tlbench */
+static struct twolevel_bench_result tlbench_result;
+#endif
+
 static int __proc_file_read(struct seq_file *m, void *data)
 {
 	const char *filename = m->private;
@@ -336,6 +358,33 @@ static int __proc_file_read(struct seq_file *m, void *data)
 		/* Left for later use */
 	} else if(strcmp(filename, "space") == 0) {
         seq_printf(m, "Space used in bytes: %llu\n", nvmev_vdev->space_used);
+    } else if(strcmp(filename, "chbench") == 0) {
+        struct chmodel_bench_result *r = &chbench_result;
+
+        if (r->nr_reqs == 0) {
+            seq_printf(m, "echo \"<nr_reqs> [load %%]\" > chbench to run\n");
+        } else {
+            seq_printf(m, "reqs %u load %u%%: array %llu ns/req sparse %llu ns/req "
+                          "max_runs %u merged_runs %u mismatches %u\n",
+                       r->nr_reqs, r->load, r->array_ns / r->nr_reqs,
+                       r->sparse_ns / r->nr_reqs, r->max_runs, r->merged_runs,
+                       r->mismatches);
+        }
+#ifndef ORIGINAL
+    } else if(strcmp(filename, "tlbench") == 0) {
+        struct twolevel_bench_result *r = &tlbench_result;
+
+        if (r->nr_inserts == 0) {
+            seq_printf(m, "echo \"<nr_inserts>\" > tlbench to run\n");
+        } else {
+            seq_printf(m, "inserts %u: reload %llu ns/insert (%u reloads) "
+                          "local %llu ns/insert (%u borrows %u shifts over %llu leaves "
+                          "%u splits %u reloads) mismatches %u\n",
+                       r->nr_inserts, r->reload_ns / r->nr_inserts, r->full_reloads,
+                       r->borrow_ns / r->nr_inserts, r->borrows, r->shifts,
+                       r->shift_leaves, r->splits, r->reloads, r->mismatches);
+        }
+#endif
     } else if(strcmp(filename, "cleardstat") == 0) {
         //clear_demand_stat();
         //for(int i = 0; i < SSD_PARTITIONS; i++) {
@@ -396,6 +445,24 @@ static ssize_t __proc_file_write(struct file *file, const char __user *buf, size
 		ret = sscanf(input, "%u %u", &vlen, &pairs);
         printk("Trying vlen %u num %u\n", vlen, pairs);
         fast_fill(&nvmev_vdev->ns[0], nvmev_vdev->ns[0].size, vlen, pairs);
+    } else if(strcmp(filename, "chbench") == 0) {
+        uint32_t nr_reqs, load = 50;
+        ret = sscanf(input, "%u %u", &nr_reqs, &load);
+        if (ret < 1)
+            goto out;
+
+        if (chmodel_bench(nr_reqs, load, &chbench_result))
+            NVMEV_ERROR("chbench with %u reqs at %u%% load failed\n", nr_reqs, load);
+#ifndef ORIGINAL
+    } else if(strcmp(filename, "tlbench") == 0) {
+        uint32_t nr_inserts;
+        ret = sscanf(input, "%u", &nr_inserts);
+        if (ret < 1)
+            goto out;
+
+        if (twolevel_bench(nr_inserts, &tlbench_result))
+            NVMEV_ERROR("tlbench with %u inserts failed\n", nr_inserts);
+#endif
     }
 
 out:
@@ -455,6 +522,10 @@ void NVMEV_STORAGE_INIT(struct nvmev_dev *nvmev_vdev)
     nvmev_vdev->proc_space = proc_create("dstat", 0444, nvmev_vdev->proc_root, &proc_file_fops);
     nvmev_vdev->proc_space = proc_create("cleardstat", 0664, nvmev_vdev->proc_root, &proc_file_fops);
     nvmev_vdev->proc_space = proc_create("fastfill", 0444, nvmev_vdev->proc_root, &proc_file_fops);
+    nvmev_vdev->proc_space = proc_create("chbench", 0664, nvmev_vdev->proc_root, &proc_file_fops);
+#ifndef ORIGINAL
+    nvmev_vdev->proc_space = proc_create("tlbench", 0664, nvmev_vdev->proc_root, &proc_file_fops);
+#endif
 }
 
 void NVMEV_STORAGE_FINAL(struct nvmev_dev *nvmev_vdev)
@@ -468,6 +539,10 @@ void NVMEV_STORAGE_FINAL(struct nvmev_dev *nvmev_vdev)
     remove_proc_entry("dstat", nvmev_vdev->proc_root);
     remove_proc_entry("cleardstat", nvmev_vdev->proc_root);
     remove_proc_entry("fastfill", nvmev_vdev->proc_root);
+    remove_proc_entry("chbench", nvmev_vdev->proc_root);
+#ifndef ORIGINAL
+    remove_proc_entry("tlbench", nvmev_vdev->proc_root);
+#endif
 
 	remove_proc_entry("nvmev", NULL);
 
@@ -483,6 +558,7 @@ static bool __load_configs(struct nvmev_config *config)
 	bool first = true;
 	unsigned int cpu_nr;
 	char *cpu;
+	int ret;
 
 	if (__validate_configs() < 0) {
 		return false;
@@ -512,10 +588,24 @@ static bool __load_configs(struct nvmev_config *config)
      */
     config->cache_dram_mb = cache_dram_mb;
 
+    ret = cache_policy_parse(cache_policy);
+    if (ret < 0) {
+        NVMEV_ERROR("Unknown cache_policy %s\n", cache_policy);
+        return false;
+    }
+    config->cache_policy = ret;
+
+    ret = gc_policy_parse(gc_policy);
+    if (ret < 0) {
+        NVMEV_ERROR("Unknown gc_policy %s\n", gc_policy);
+        return false;
+    }
+    config->gc_policy = ret;
+    config->gc_slice = gc_slice;
+
 	config->nr_io_workers = 0;
 	config->cpu_nr_dispatcher = -1;
 	config->cpu_nr_copier = -1;
-    config->cpu_nr_bg_gc = -1;
     config->cpu_nr_ev_t = -1;
 
 	while ((cpu = strsep(&cpus, ",")) != NULL) {
@@ -529,18 +619,46 @@ static bool __load_configs(struct nvmev_config *config)
 		first = false;
 	}
 
+	config->nr_ftl_workers = 0;
+	while ((cpu = strsep(&ftlcpus, ",")) != NULL) {
+		if (config->nr_ftl_workers == NR_MAX_FTL_WORKERS) {
+			NVMEV_ERROR("At most %d FTL workers are supported.\n", NR_MAX_FTL_WORKERS);
+			return false;
+		}
+
+		cpu_nr = (unsigned int)simple_strtol(cpu, NULL, 10);
+		config->cpu_nr_ftl_workers[config->nr_ftl_workers] = cpu_nr;
+		config->nr_ftl_workers++;
+	}
+
+	if (config->nr_ftl_workers > SSD_PARTITIONS) {
+		NVMEV_INFO("%u FTL workers but only %d partitions, some workers will sit idle.\n",
+			   config->nr_ftl_workers, SSD_PARTITIONS);
+	}
+
 #if (BASE_SSD == SAMSUNG_970PRO_HASH_DFTL)
-    cpu_nr = UINT_MAX;
-	while ((cpu = strsep(&gccpu, ",")) != NULL) {
+	config->nr_gc_workers = 0;
+	while ((cpu = strsep(&gccpus, ",")) != NULL) {
+		if (config->nr_gc_workers == NR_MAX_GC_WORKERS) {
+			NVMEV_ERROR("At most %d GC workers are supported.\n", NR_MAX_GC_WORKERS);
+			return false;
+		}
+
 		cpu_nr = (unsigned int)simple_strtol(cpu, NULL, 10);
-        config->cpu_nr_bg_gc = cpu_nr;
+		config->cpu_nr_gc_workers[config->nr_gc_workers] = cpu_nr;
+		config->nr_gc_workers++;
 	}
 
-    if(cpu_nr == UINT_MAX) {
-        NVMEV_ERROR("Please provide gccpu when using DFTLKV.\n");
+    if(config->nr_gc_workers == 0) {
+        NVMEV_ERROR("Please provide gccpus when using DFTLKV.\n");
         return false;
     }
 
+	if (config->nr_gc_workers > SSD_PARTITIONS) {
+		NVMEV_INFO("%u GC workers but only %d partitions, only the first %d will be used.\n",
+			   config->nr_gc_workers, SSD_PARTITIONS, SSD_PARTITIONS);
+	}
+
     cpu_nr = UINT_MAX;
 	while ((cpu = strsep(&evictcpu, ",")) != NULL) {
 		cpu_nr = (unsigned int)simple_strtol(cpu, NULL, 10);
@@ -556,7 +674,7 @@ static bool __load_configs(struct nvmev_config *config)
 	return true;
 }
 
-void NVMEV_NAMESPACE_INIT(struct nvmev_dev *nvmev_vdev)
+bool NVMEV_NAMESPACE_INIT(struct nvmev_dev *nvmev_vdev)
 {
 	unsigned long long remaining_capacity = nvmev_vdev->config.storage_size;
 	void *ns_addr = nvmev_vdev->storage_mapped;
@@ -567,16 +685,21 @@ void NVMEV_NAMESPACE_INIT(struct nvmev_dev *nvmev_vdev)
 
 	struct nvmev_ns *ns = kmalloc(sizeof(struct nvmev_ns) * nr_ns, GFP_KERNEL);
 
+	if (!ns)
+		return false;
+
 	for (i = 0; i < nr_ns; i++) {
 		if (NS_CAPACITY(i) == 0)
 			size = remaining_capacity;
 		else
 			size = min(NS_CAPACITY(i), remaining_capacity);
 
-		if (NS_SSD_TYPE(i) == SSD_TYPE_CONV)
-			conv_init_namespace(&ns[i], i, size, ns_addr, disp_no);
-		else
+		if (NS_SSD_TYPE(i) == SSD_TYPE_CONV) {
+			if (conv_init_namespace(&ns[i], i, size, ns_addr, disp_no))
+				goto err;
+		} else {
 			BUG_ON(1);
+		}
 
 		remaining_capacity -= size;
 		ns_addr += size;
@@ -586,6 +709,13 @@ void NVMEV_NAMESPACE_INIT(struct nvmev_dev *nvmev_vdev)
 	nvmev_vdev->ns = ns;
 	nvmev_vdev->nr_ns = nr_ns;
 	nvmev_vdev->mdts = MDTS;
+	return true;
+
+err:
+	while (--i >= 0)
+		conv_remove_namespace(&ns[i]);
+	kfree(ns);
+	return false;
 }
 
 void NVMEV_NAMESPACE_FINAL(struct nvmev_dev *nvmev_vdev)
@@ -653,7 +783,10 @@ static int NVMeV_init(void)
 
 	NVMEV_STORAGE_INIT(nvmev_vdev);
 
-	NVMEV_NAMESPACE_INIT(nvmev_vdev);
+	if (!NVMEV_NAMESPACE_INIT(nvmev_vdev)) {
+		NVMEV_STORAGE_FINAL(nvmev_vdev);
+		goto ret_err;
+	}
 
 	if (io_using_dma) {
 		if (ioat_dma_chan_set("dma7chan0") != 0) {
@@ -669,6 +802,7 @@ static int NVMeV_init(void)
 	__print_perf_configs();
 
 	NVMEV_IO_WORKER_INIT(nvmev_vdev);
+	NVMEV_FTL_WORKER_INIT(nvmev_vdev);
 	NVMEV_DISPATCHER_INIT(nvmev_vdev);
 
 	pci_bus_add_devices(nvmev_vdev->virt_bus);
@@ -692,6 +826,7 @@ static void NVMeV_exit(void)
 	}
 
 	NVMEV_DISPATCHER_FINAL(nvmev_vdev);
+	NVMEV_FTL_WORKER_FINAL(nvmev_vdev);
 	NVMEV_IO_WORKER_FINAL(nvmev_vdev);
 
 	NVMEV_NAMESPACE_FINAL(nvmev_vdev);
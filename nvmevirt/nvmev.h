@@ -3,11 +3,13 @@
 #ifndef _LIB_NVMEV_H
 #define _LIB_NVMEV_H
 
+#include <linux/llist.h>
 #include <linux/pci.h>
 #include <linux/proc_fs.h>
 #include <linux/msi.h>
 #include <linux/seq_file.h>
 #include <linux/version.h>
+#include <linux/wait.h>
 #include <asm/apic.h>
 #include <asm/msr.h>
 
@@ -46,6 +48,11 @@
 
 #define NR_MAX_IO_QUEUE 72
 #define NR_MAX_PARALLEL_IO 16384
+#define NR_MAX_FTL_WORKERS 32
+#define NR_MAX_GC_WORKERS 32
+#define FTL_QUEUE_SIZE 4096 /* must be a power of 2 */
+#define FTL_SPIN_NS 20000 /* an idle FTL worker polls this long before sleeping */
+#define FTL_POLL_MS 10
 
 #define NVMEV_INTX_IRQ 15
 
@@ -160,6 +167,10 @@ struct nvmev_config {
 
 	unsigned int cpu_nr_copier;
 
+	/* 0 runs the FTL inline on the dispatcher */
+	unsigned int nr_ftl_workers;
+	unsigned int cpu_nr_ftl_workers[NR_MAX_FTL_WORKERS];
+
 	/* TODO Refactoring storage configurations */
 	unsigned int nr_io_units;
 	unsigned int io_unit_shift; // 2^
@@ -172,8 +183,12 @@ struct nvmev_config {
 	unsigned int write_trailing; // ns
 
     unsigned int cache_dram_mb; // mb
+    unsigned int cache_policy; // enum cache_policy
+    unsigned int gc_policy; // enum gc_policy
+    unsigned int gc_slice; // flash pages per GC slice, 0 for whole lines
 
-    unsigned int cpu_nr_bg_gc;
+    unsigned int nr_gc_workers;
+    unsigned int cpu_nr_gc_workers[NR_MAX_GC_WORKERS];
     unsigned int cpu_nr_ev_t;
 };
 
@@ -183,6 +198,7 @@ struct nvmev_io_work {
 
 	int sq_entry;
 	unsigned int command_id;
+	struct nvme_command cmd; /* copy the FTL ran on, read again by the copy stage */
 
 	unsigned long long nsecs_start;
 	unsigned long long nsecs_target;
@@ -203,7 +219,10 @@ struct nvmev_io_work {
 	void *write_buffer;
 	size_t buffs_to_release;
 
-	unsigned int next, prev;
+	unsigned int next, prev; /* free list links */
+
+	struct llist_node llnode; /* on the worker's incoming or completed list */
+	size_t pos; /* position in the worker's heap, 0 if not in it */
 
     /* Internal copy parameters */
 
@@ -228,16 +247,52 @@ struct nvmev_io_work {
     struct nvmev_io_work *cb_w;
 };
 
+struct pqueue_t;
+
 struct nvmev_io_worker {
 	struct nvmev_io_work *work_queue;
 
 	unsigned int free_seq; /* free io req head index */
 	unsigned int free_seq_end; /* free io req tail index */
-	unsigned int io_seq; /* io req head index */
-	unsigned int io_seq_end; /* io req tail index */
+
+	struct llist_head incoming; /* queued by producers, not yet picked up */
+	struct pqueue_t *pq; /* picked up, ordered by nsecs_target */
+	struct llist_head completed; /* done, waiting to be reclaimed */
 
 	unsigned long long latest_nsecs;
 
+	/*
+	 * Serializes the producers (dispatcher, FTL workers, FTL background
+	 * threads) on the free list. The worker itself never takes it.
+	 */
+	spinlock_t lock;
+
+	unsigned int id;
+	struct task_struct *task_struct;
+	char thread_name[32];
+};
+
+/*
+ * A command the dispatcher has pulled off a submission queue but whose FTL
+ * work hasn't run yet.
+ */
+struct nvmev_ftl_req {
+	int sqid;
+	int sq_entry;
+	struct nvme_command cmd; /* copied at dispatch, the slot may be reused */
+	unsigned long long nsecs_start;
+};
+
+struct nvmev_ftl_worker {
+	/*
+	 * Single-producer single-consumer ring. Only the dispatcher moves
+	 * @head and only this worker moves @tail, so no lock is needed.
+	 */
+	struct nvmev_ftl_req *queue;
+	unsigned int head ____cacheline_aligned_in_smp;
+	unsigned int tail ____cacheline_aligned_in_smp;
+	wait_queue_head_t wq; /* the worker sleeps here once idle for FTL_SPIN_NS */
+
 	unsigned int id;
 	struct task_struct *task_struct;
 	char thread_name[32];
@@ -262,6 +317,8 @@ struct nvmev_dev {
 	struct nvmev_io_worker *io_workers;
 	unsigned int io_worker_turn;
 
+	struct nvmev_ftl_worker *ftl_workers;
+
 	void __iomem *msix_table;
 
 	bool intx_disabled;
@@ -328,6 +385,8 @@ struct nvmev_ns {
 
 	/*specific CSS io command identifier*/
 	bool (*identify_io_cmd)(struct nvmev_ns *ns, struct nvme_command cmd);
+	/*partition an io command touches, -1 if it may touch several*/
+	int (*io_cmd_part)(struct nvmev_ns *ns, struct nvme_command *cmd);
 	/*specific CSS io command processor*/
 	unsigned int (*perform_io_cmd)(struct nvmev_ns *ns, struct nvme_command *cmd,
 				       uint32_t *status);
@@ -350,7 +409,10 @@ void nvmev_proc_admin_cq(int new_db, int old_db);
 // OPS I/O QUEUE
 void NVMEV_IO_WORKER_INIT(struct nvmev_dev *nvmev_vdev);
 void NVMEV_IO_WORKER_FINAL(struct nvmev_dev *nvmev_vdev);
+void NVMEV_FTL_WORKER_INIT(struct nvmev_dev *nvmev_vdev);
+void NVMEV_FTL_WORKER_FINAL(struct nvmev_dev *nvmev_vdev);
 int nvmev_proc_io_sq(int qid, int new_db, int old_db);
+void __reclaim_completed_reqs(void);
 void nvmev_proc_io_cq(int qid, int new_db, int old_db);
 
 // CALLBACKS
@@ -14,6 +14,7 @@ static inline uint64_t __get_ioclock(struct ssd *ssd)
 void buffer_init(struct buffer *buf, size_t size)
 {
 	spin_lock_init(&buf->lock);
+	init_waitqueue_head(&buf->wq);
 	buf->size = size;
 	buf->remaining = size;
 }
@@ -41,6 +42,9 @@ bool buffer_release(struct buffer *buf, size_t size)
 	buf->remaining += size;
 	spin_unlock(&buf->lock);
 
+	if (wq_has_sleeper(&buf->wq))
+		wake_up_all(&buf->wq);
+
 	return true;
 }
 
@@ -105,6 +109,7 @@ void ssd_init_params(struct ssdparams *spp, uint64_t capacity, uint32_t nparts)
     spp->flashpgs_per_blk = (ONESHOT_PAGE_SIZE / FLASH_PAGE_SIZE) * spp->oneshotpgs_per_blk;
 
     spp->pgs_per_blk = spp->pgs_per_oneshotpg * spp->oneshotpgs_per_blk;
+    spp->pgs_per_prog = spp->pgs_per_oneshotpg * spp->pls_per_lun;
 
 	spp->write_unit_size = WRITE_UNIT_SIZE;
 
@@ -116,6 +121,11 @@ void ssd_init_params(struct ssdparams *spp, uint64_t capacity, uint32_t nparts)
 	spp->pg_rd_lat[CELL_TYPE_CSB] = NAND_READ_LATENCY_CSB;
 	spp->pg_wr_lat = NAND_PROG_LATENCY;
 	spp->blk_er_lat = NAND_ERASE_LATENCY;
+	spp->rd_prio = NAND_READ_PRIORITY;
+	spp->pe_suspend = NAND_PE_SUSPEND;
+	spp->suspend_lat = NAND_SUSPEND_LATENCY;
+	spp->resume_lat = NAND_RESUME_LATENCY;
+	spp->cache_ops = NAND_CACHE_OPS;
 	spp->max_ch_xfer_size = MAX_CH_XFER_SIZE;
 
 	spp->fw_4kb_rd_lat = FW_4KB_READ_LATENCY;
@@ -151,13 +161,15 @@ void ssd_init_params(struct ssdparams *spp, uint64_t capacity, uint32_t nparts)
 
 	spp->tt_luns = spp->luns_per_ch * spp->nchs;
 
-	/* line is special, put it at the end */
-	spp->blks_per_line = spp->tt_luns; /* TODO: to fix under multiplanes */
+	/*
+	 * line is special, put it at the end. A line is the same block on
+	 * every plane of every LUN, so there are blks_per_pl of them.
+	 */
+	spp->blks_per_line = spp->tt_luns * spp->pls_per_lun;
 	spp->pgs_per_line = spp->blks_per_line * spp->pgs_per_blk;
     spp->flashpgs_per_line = spp->pgs_per_line / spp->pgs_per_flashpg;
 	spp->secs_per_line = spp->pgs_per_line * spp->secs_per_pg;
-	spp->tt_lines = spp->blks_per_lun;
-	/* TODO: to fix under multiplanes */ // lun size is super-block(line) size
+	spp->tt_lines = spp->blks_per_pl;
 
 	check_params(spp);
 
@@ -247,6 +259,15 @@ static void ssd_init_nand_lun(struct nand_lun *lun, struct ssdparams *spp)
 	}
 	lun->next_lun_avail_time = 0;
 	lun->busy = false;
+	spin_lock_init(&lun->lock);
+
+	lun->cache_avail_time = 0;
+	lun->cache_cmd = NAND_NOP;
+
+	lun->fg_avail_time = 0;
+	memset(lun->bg_ops, 0x0, sizeof(lun->bg_ops));
+	lun->bg_head = 0;
+	lun->nr_suspends = 0;
 }
 
 static void ssd_remove_nand_lun(struct nand_lun *lun)
@@ -341,36 +362,18 @@ void ssd_remove(struct ssd *ssd)
 	kfree(ssd->ch);
 }
 
-#if (BASE_SSD == SAMSUNG_970PRO_HASH_DFTL)
 /*
- * In the DFTLKV FTL, frontend key-value work (mapping, write buffer copies, 
+ * In the DFTLKV FTL, frontend key-value work (mapping, write buffer copies,
  * etc) is done in the worker threads, not in the dispatcher thread like in
- * the conventional FTL. This means that there will be multiple threads
- * accessing the single PCIe channel at the same time. We protect the channel
- * with a spinlock, as to not introduce races.
- *
- * This gets us around 500K IOPS at most in the case of continually writing
- * to the write buffer with no other background FTL work, but will likely 
- * need re-doing for better concurrency when we want to test faster KVSSDs.
+ * the conventional FTL, so several threads hit the PCIe link at once. The
+ * link is still a single shared timeline, but the channel model now locks
+ * itself for the duration of the credit walk instead of callers spinning on
+ * one global lock around it.
  */
-spinlock_t spin;
-#endif
 uint64_t ssd_advance_pcie(struct ssd *ssd, uint64_t request_time, uint64_t length)
 {
 	struct channel_model *perf_model = ssd->pcie->perf_model;
 
-#if (BASE_SSD == SAMSUNG_970PRO_HASH_DFTL)
-    while (!spin_trylock(&spin)) {
-		cpu_relax();
-	}
-#endif
-
-    uint64_t ret = chmodel_request(perf_model, request_time, length);
-
-#if (BASE_SSD == SAMSUNG_970PRO_HASH_DFTL)
-    spin_unlock(&spin);
-#endif
-    return ret;
 	return chmodel_request(perf_model, request_time, length);
 }
 
@@ -394,25 +397,128 @@ uint64_t ssd_advance_write_buffer(struct ssd *ssd, uint64_t request_time, uint64
 	return nsecs_latest;
 }
 
-spinlock_t adv_spin;
+static inline bool __is_host_read(struct nand_cmd *ncmd)
+{
+	/* mapping reads are on a host request's critical path too */
+	return ncmd->cmd == NAND_READ && (ncmd->type == USER_IO || ncmd->type == MAP_IO);
+}
+
+static void __lun_record_bg(struct nand_lun *lun, int cmd, uint64_t stime, uint64_t etime)
+{
+	struct lun_op *op = &lun->bg_ops[lun->bg_head];
+
+	op->stime = stime;
+	op->etime = etime;
+	op->cmd = cmd;
+	op->nr_suspends = 0;
+	lun->bg_head = (lun->bg_head + 1) % LUN_BG_OPS;
+}
+
+/*
+ * When a host read arriving at stime can start. It waits for earlier host
+ * reads, then for the background command running at that point, unless
+ * that's a program or erase we can suspend. Commands queued behind it are
+ * overtaken.
+ */
+static uint64_t __host_read_stime(struct ssdparams *spp, struct nand_lun *lun, uint64_t stime,
+				  bool *suspend)
+{
+	uint64_t start = max(stime, lun->fg_avail_time);
+	uint32_t i;
+
+	*suspend = false;
+	if (start >= lun->next_lun_avail_time)
+		return start;
+
+	for (i = 0; i < LUN_BG_OPS; i++) {
+		struct lun_op *op = &lun->bg_ops[(lun->bg_head + i) % LUN_BG_OPS];
+
+		if (op->etime <= start)
+			continue;
+
+		if (op->stime > start) {
+			/*
+			 * Either the die is idle until op starts, or it's running a
+			 * command older than bg_ops. If nothing older was seen assume
+			 * the latter, which ends by op->stime at the latest.
+			 */
+			return (i == 0) ? op->stime : start;
+		}
+
+		if (spp->pe_suspend && (op->cmd == NAND_WRITE || op->cmd == NAND_ERASE) &&
+		    op->nr_suspends < LUN_MAX_SUSPENDS &&
+		    op->etime - start > spp->suspend_lat + spp->resume_lat) {
+			op->nr_suspends++;
+			*suspend = true;
+			return start + spp->suspend_lat;
+		}
+
+		return op->etime;
+	}
+
+	return start;
+}
+
+/*
+ * A host read held the die from busy_s to busy_e. Push back the background
+ * commands it overlapped, and everything queued after them.
+ */
+static void __lun_push_bg(struct nand_lun *lun, uint64_t busy_s, uint64_t busy_e)
+{
+	uint64_t delta = 0;
+	bool found = false;
+	uint32_t i;
+
+	for (i = 0; i < LUN_BG_OPS; i++) {
+		struct lun_op *op = &lun->bg_ops[(lun->bg_head + i) % LUN_BG_OPS];
+
+		if (op->etime <= busy_s)
+			continue;
+
+		if (!found) {
+			uint64_t from = max(busy_s, op->stime);
+
+			delta = (busy_e > from) ? busy_e - from : 0;
+			found = true;
+		}
+
+		if (op->stime >= busy_s)
+			op->stime += delta;
+		op->etime += delta;
+	}
+
+	lun->next_lun_avail_time = max(lun->next_lun_avail_time + delta, busy_e);
+}
+
+/*
+ * Only the target LUN is locked for the whole operation. Channel and PCIe
+ * transfers are serialized by their own channel model locks, which nest
+ * inside the LUN lock (LUN -> channel, LUN -> PCIe), so operations on
+ * different LUNs proceed in parallel.
+ *
+ * A command may cover the same page on several planes of a LUN, e.g. a
+ * multi-plane program of pgs_per_prog pages. It costs one array time
+ * (tR, tPROG or tBERS) however many planes it spans, while the channel
+ * transfer scales with xfer_size.
+ */
 uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 {
 	int c = ncmd->cmd;
 	uint64_t nand_stime, nand_etime;
 	uint64_t chnl_stime, chnl_etime;
 	uint64_t remaining, xfer_size, completed_time;
+	uint64_t cmd_stime, xfer_stime, array_etime;
 	struct ssdparams *spp;
 	struct nand_lun *lun;
 	struct ssd_channel *ch;
 	struct ppa *ppa = ncmd->ppa;
 	uint32_t cell;
+	bool host_read, suspend = false;
 	NVMEV_DEBUG_VERBOSE(
 		"SSD: %p, Enter stime: %lld, ch %d lun %d blk %d page %d command %d ppa 0x%llx\n",
 		ssd, ncmd->stime, ppa->g.ch, ppa->g.lun, ppa->g.blk, ppa->g.pg, c, ppa->ppa);
 
-
-    spin_lock(&adv_spin);
-    uint64_t cmd_stime = (ncmd->stime == 0) ? __get_ioclock(ssd) : ncmd->stime;
+	cmd_stime = (ncmd->stime == 0) ? __get_ioclock(ssd) : ncmd->stime;
 
 	if (ppa->ppa == UNMAPPED_PPA) {
 		NVMEV_ERROR("Error ppa 0x%llx\n", ppa->ppa);
@@ -424,11 +530,18 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 	ch = get_ch(ssd, ppa);
 	cell = get_cell(ssd, ppa);
 	remaining = ncmd->xfer_size;
+	host_read = spp->rd_prio && __is_host_read(ncmd);
+
+	spin_lock(&lun->lock);
 
 	switch (c) {
 	case NAND_READ:
 		/* read: perform NAND cmd first */
-        nand_stime = max(lun->next_lun_avail_time, cmd_stime);
+		if (host_read) {
+			nand_stime = __host_read_stime(spp, lun, cmd_stime, &suspend);
+		} else {
+			nand_stime = max(lun->next_lun_avail_time, cmd_stime);
+		}
 
 		if (ncmd->xfer_size == 4096) {
 			nand_etime = nand_stime + spp->pg_4kb_rd_lat[cell];
@@ -439,6 +552,16 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 		/* read: then data transfer through channel */
 		chnl_stime = nand_etime;
 
+		/*
+		 * Cache read: the page can't move to the cache register until the
+		 * previous page has been clocked out of it. A cache register still
+		 * holding data for a program we overtook is left alone, and we
+		 * transfer straight from the page register.
+		 */
+		if (spp->cache_ops && lun->cache_cmd == NAND_READ)
+			chnl_stime = max(chnl_stime, lun->cache_avail_time);
+		xfer_stime = chnl_stime;
+
 		while (remaining) {
 			xfer_size = min(remaining, (uint64_t)spp->max_ch_xfer_size);
 			chnl_etime = chmodel_request(ch->perf_model, chnl_stime, xfer_size);
@@ -453,18 +576,58 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 			chnl_stime = chnl_etime;
 		}
 
-		lun->next_lun_avail_time = chnl_etime;
+		/*
+		 * With a cache register the array is free for the next tR once
+		 * our page is out of the page register.
+		 */
+		if (spp->cache_ops) {
+			array_etime = xfer_stime;
+			lun->cache_avail_time = chnl_etime;
+			lun->cache_cmd = NAND_READ;
+		} else {
+			array_etime = chnl_etime;
+		}
+
+		if (host_read) {
+			lun->fg_avail_time = array_etime;
+			if (suspend) {
+				lun->nr_suspends++;
+				__lun_push_bg(lun, nand_stime - spp->suspend_lat,
+					      array_etime + spp->resume_lat);
+			} else {
+				__lun_push_bg(lun, nand_stime, array_etime);
+			}
+			break;
+		}
+
+		if (spp->rd_prio)
+			__lun_record_bg(lun, c, nand_stime, array_etime);
+		lun->next_lun_avail_time = array_etime;
 		break;
 
 	case NAND_WRITE:
-		/* write: transfer data through channel first */
-		chnl_stime = max(lun->next_lun_avail_time, cmd_stime);
+		/*
+		 * write: transfer data through channel first. With cache program
+		 * that only needs the cache register, so it can overlap the
+		 * array's previous tPROG.
+		 */
+		if (spp->cache_ops) {
+			chnl_stime = max(lun->cache_avail_time, cmd_stime);
+		} else {
+			chnl_stime = max(lun->next_lun_avail_time, cmd_stime);
+		}
 
 		chnl_etime = chmodel_request(ch->perf_model, chnl_stime, ncmd->xfer_size);
 
 		/* write: then do NAND program */
-		nand_stime = chnl_etime;
+		nand_stime = max(chnl_etime, lun->next_lun_avail_time);
 		nand_etime = nand_stime + spp->pg_wr_lat;
+		if (spp->cache_ops) {
+			lun->cache_avail_time = nand_stime;
+			lun->cache_cmd = NAND_WRITE;
+		}
+		if (spp->rd_prio)
+			__lun_record_bg(lun, c, nand_stime, nand_etime);
 		lun->next_lun_avail_time = nand_etime;
 		completed_time = nand_etime;
 		break;
@@ -473,6 +636,8 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 		/* erase: only need to advance NAND status */
 		nand_stime = max(lun->next_lun_avail_time, cmd_stime);
 		nand_etime = nand_stime + spp->blk_er_lat;
+		if (spp->rd_prio)
+			__lun_record_bg(lun, c, nand_stime, nand_etime);
 		lun->next_lun_avail_time = nand_etime;
 		completed_time = nand_etime;
 		break;
@@ -486,10 +651,11 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 
 	default:
 		NVMEV_ERROR("Unsupported NAND command: 0x%x\n", c);
-		return 0;
+		completed_time = 0;
+		break;
 	}
 
-    spin_unlock(&adv_spin);
+	spin_unlock(&lun->lock);
 	return completed_time;
 }
 
@@ -504,13 +670,28 @@ uint64_t ssd_next_idle_time(struct ssd *ssd)
 
 		for (j = 0; j < spp->luns_per_ch; j++) {
 			struct nand_lun *lun = &ch->lun[j];
-			latest = max(latest, lun->next_lun_avail_time);
+			latest = max(latest, READ_ONCE(lun->next_lun_avail_time));
+			latest = max(latest, READ_ONCE(lun->cache_avail_time));
 		}
 	}
 
 	return latest;
 }
 
+uint64_t ssd_nr_suspends(struct ssd *ssd)
+{
+	struct ssdparams *spp = &ssd->sp;
+	uint64_t nr = 0;
+	uint32_t i, j;
+
+	for (i = 0; i < spp->nchs; i++) {
+		for (j = 0; j < spp->luns_per_ch; j++)
+			nr += READ_ONCE(ssd->ch[i].lun[j].nr_suspends);
+	}
+
+	return nr;
+}
+
 void adjust_ftl_latency(int target, int lat)
 {
 /* TODO ..*/
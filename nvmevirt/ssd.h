@@ -4,6 +4,7 @@
 #define _NVMEVIRT_SSD_H
 
 #include <linux/types.h>
+#include <linux/wait.h>
 #include "pqueue/pqueue.h"
 #include "ssd_config.h"
 #include "channel_model.h"
@@ -107,12 +108,41 @@ struct nand_plane {
 	int nblks;
 };
 
+/*
+ * The last few non host read commands scheduled on a LUN, oldest at
+ * bg_head. With NAND_READ_PRIORITY, host reads look here to find what the
+ * die is doing when they arrive, and push back whatever they overtake.
+ */
+#define LUN_BG_OPS (8)
+#define LUN_MAX_SUSPENDS (4) /* per command, so reads can't starve programs */
+
+struct lun_op {
+	uint64_t stime;
+	uint64_t etime;
+	int cmd;
+	int nr_suspends;
+};
+
 struct nand_lun {
 	struct nand_plane *pl;
 	int npls;
 	uint64_t next_lun_avail_time;
 	bool busy;
 	uint64_t gc_endtime;
+	spinlock_t lock; /* serializes next_lun_avail_time updates */
+
+	/*
+	 * With cache ops, next_lun_avail_time is when the array is free, and
+	 * cache_avail_time is when the cache register is, after cache_cmd's
+	 * data has moved in or out of it.
+	 */
+	uint64_t cache_avail_time;
+	int cache_cmd;
+
+	uint64_t fg_avail_time; /* when host reads queued here are done */
+	struct lun_op bg_ops[LUN_BG_OPS];
+	uint32_t bg_head;
+	uint64_t nr_suspends;
 };
 
 struct ssd_channel {
@@ -140,6 +170,7 @@ struct buffer {
 	size_t size;
 	size_t remaining;
 	spinlock_t lock;
+	wait_queue_head_t wq; /* writers waiting for space, woken by buffer_release */
 };
 
 /*
@@ -157,6 +188,7 @@ struct ssdparams {
 	int pgs_per_flashpg; /* # of pgs per flash page */
 	int flashpgs_per_blk; /* # of flash pages per block */
 	int pgs_per_oneshotpg; /* # of pgs per oneshot page */
+	int pgs_per_prog; /* # of pgs one multi-plane program writes, a oneshot page per plane */
 	int oneshotpgs_per_blk; /* # of oneshot pages per block */
 	int pgs_per_blk; /* # of pages per block */
 	int blks_per_pl; /* # of blocks per plane */
@@ -175,6 +207,11 @@ struct ssdparams {
 	int pg_rd_lat[MAX_CELL_TYPES]; /* NAND page read latency in nanoseconds. sensing time (tR) */
 	int pg_wr_lat; /* NAND page program latency in nanoseconds. pgm time (tPROG)*/
 	int blk_er_lat; /* NAND block erase latency in nanoseconds. erase time (tERASE) */
+	bool rd_prio; /* host reads overtake queued background commands */
+	bool pe_suspend; /* host reads suspend running programs and erases */
+	int suspend_lat; /* Program/erase suspend latency in nanoseconds */
+	int resume_lat; /* Program/erase resume latency in nanoseconds */
+	bool cache_ops; /* overlap channel transfers with tR/tPROG via the cache register */
 	int max_ch_xfer_size;
 
 	int fw_4kb_rd_lat; /* Firmware overhead of 4KB read of read in nanoseconds */
@@ -277,6 +314,7 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd);
 uint64_t ssd_advance_pcie(struct ssd *ssd, uint64_t request_time, uint64_t length);
 uint64_t ssd_advance_write_buffer(struct ssd *ssd, uint64_t request_time, uint64_t length);
 uint64_t ssd_next_idle_time(struct ssd *ssd);
+uint64_t ssd_nr_suspends(struct ssd *ssd);
 
 void buffer_init(struct buffer *buf, size_t size);
 uint32_t buffer_allocate(struct buffer *buf, size_t size);
@@ -278,7 +278,7 @@ static_assert((WB_SIZE % GRAINED_UNIT) == 0);
 #define SSD_PARTITIONS (1)
 #define NAND_CHANNELS (8)
 #define LUNS_PER_NAND_CH (8)
-#define PLNS_PER_LUN (1)
+#define PLNS_PER_LUN (1) /* > 1 stripes writes across planes, programmed together */
 #define FLASH_PAGE_SIZE KB(32)
 #define ONESHOT_PAGE_SIZE (FLASH_PAGE_SIZE * 1)
 #define BLKS_PER_PLN (0)
@@ -316,12 +316,55 @@ static_assert((ONESHOT_PAGE_SIZE % FLASH_PAGE_SIZE) == 0);
 #define FW_CH_XFER_LATENCY (0)
 #define OP_AREA_PERCENT (0.07)
 
-#define GLOBAL_WB_SIZE (NAND_CHANNELS * LUNS_PER_NAND_CH * ONESHOT_PAGE_SIZE * 2)
+/*
+ * Host reads go ahead of GC, mapping and program traffic queued on their
+ * LUN. With NAND_PE_SUSPEND they also suspend a program or erase that's
+ * already running, paying NAND_SUSPEND_LATENCY before the read and
+ * NAND_RESUME_LATENCY on the suspended command after it.
+ */
+#define NAND_READ_PRIORITY (1)
+#define NAND_PE_SUSPEND (1)
+#define NAND_SUSPEND_LATENCY (20000) //ns
+#define NAND_RESUME_LATENCY (10000) //ns
+
+/*
+ * Cache read and cache program. Each LUN has a cache register in front
+ * of its page register, so one page can move over the channel while the
+ * array senses or programs the next.
+ */
+#define NAND_CACHE_OPS (1)
+
+/*
+ * Bits of key fingerprint kept with every hash index entry. A probe only
+ * goes to flash to compare keys when the fingerprint matches. 0 turns
+ * fingerprints off, and at most 32 bits are used.
+ */
+#define FP_BITS (8)
+
+#define GLOBAL_WB_SIZE (NAND_CHANNELS * LUNS_PER_NAND_CH * PLNS_PER_LUN * ONESHOT_PAGE_SIZE * 2)
 #define WRITE_EARLY_COMPLETION 1
 
 #endif
 ///////////////////////////////////////////////////////////////////////////
 
+/* Other devices schedule every LUN command in arrival order */
+#ifndef NAND_READ_PRIORITY
+#define NAND_READ_PRIORITY (0)
+#define NAND_PE_SUSPEND (0)
+#define NAND_SUSPEND_LATENCY (0)
+#define NAND_RESUME_LATENCY (0)
+#endif
+
+#ifndef NAND_CACHE_OPS
+#define NAND_CACHE_OPS (0)
+#endif
+
+#ifndef FP_BITS
+#define FP_BITS (0)
+#endif
+static_assert(FP_BITS <= 32);
+///////////////////////////////////////////////////////////////////////////
+
 static const uint32_t ns_ssd_type[] = { NS_SSD_TYPE_0, NS_SSD_TYPE_1 };
 static const uint64_t ns_capacity[] = { NS_CAPACITY_0, NS_CAPACITY_1 };
 
@@ -1,9 +1,13 @@
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+
 #include "nvmev.h"
 #include "ssd_config.h"
 
 #ifndef ORIGINAL
 #include "twolevel.h"
-int reloading = 0;
 
 static inline uint64_t __cycles(void)
 {
@@ -51,8 +55,31 @@ static int cmp_hidx(const void *a, const void *b)
 }
 
 struct root tmp_root;
-struct leaf_e tmp_leaves[IN_ROOT * IN_LEAF];
-uint32_t tmp_leaf_idx = 0;
+
+/*
+ * Scratch space for twolevel_reload. Shards insert concurrently, so it's
+ * only used under tl_reload_lock. twolevel_bench brings its own.
+ */
+static struct leaf_e tmp_leaves[IN_ROOT * IN_LEAF];
+static DEFINE_SPINLOCK(tl_reload_lock);
+
+/*
+ * How __twolevel_insert handles a full leaf. Without borrow it reloads
+ * the whole section on every overflow, the old behaviour kept for
+ * twolevel_bench. While reloading, a full leaf is a bug. A reload uses
+ * scratch, or tmp_leaves if that's NULL. touched gets the number of
+ * leaves a shift went through.
+ */
+struct tl_ctx {
+    bool borrow;
+    bool reloading;
+    struct leaf_e *scratch;
+    uint32_t touched;
+};
+
+static int __twolevel_insert(struct ht_section *ht, struct root *root, 
+                             uint32_t hidx, uint32_t ppa, uint32_t pos,
+                             struct tl_ctx *ctx);
 
 uint32_t __new_roots(uint32_t *root_keys, struct leaf_e* leaves, 
 					 uint32_t key_cnt, uint32_t num_leaves) {
@@ -134,21 +161,21 @@ void twolevel_bulk_insert(struct root* root, struct leaf_e *e, uint32_t cnt) {
     return;
 }
 
-void twolevel_reload(struct ht_section *ht, struct root* root, 
-                  uint32_t hidx, uint32_t ppa) {
+static void __twolevel_reload(struct ht_section *ht, struct root* root, 
+                              uint32_t hidx, uint32_t ppa, 
+                              struct leaf_e *scratch) {
+    struct tl_ctx ctx = { .reloading = true };
     uint32_t new_root_cnt = 0, before;
     uint32_t new_root_keys[IN_ROOT];
+    uint32_t tmp_leaf_idx = 0;
     struct leaf *tmp_leaf;
     char* ptr;
     int i;
 
     before = ht->cached_cnt;
-    tmp_leaf_idx = 0;
     ptr = (char*) root;
     i = 0;
 
-    reloading = 1;
-
     for(i = 0; i < root->cnt; i++) {
         tmp_leaf = (struct leaf*) (ptr + sizeof(struct root) + (sizeof(struct leaf) * i));
         for(int j = 0; j < IN_LEAF; j++) {
@@ -156,8 +183,8 @@ void twolevel_reload(struct ht_section *ht, struct root* root,
                 break;
             }
 
-            tmp_leaves[tmp_leaf_idx].hidx = tmp_leaf->hidx[j];
-            tmp_leaves[tmp_leaf_idx].ppa = tmp_leaf->ppa[j];
+            scratch[tmp_leaf_idx].hidx = tmp_leaf->hidx[j];
+            scratch[tmp_leaf_idx].ppa = tmp_leaf->ppa[j];
 
             tmp_leaf->hidx[j] = UINT_MAX;
             tmp_leaf->ppa[j] = UINT_MAX;
@@ -167,18 +194,18 @@ void twolevel_reload(struct ht_section *ht, struct root* root,
     }
 
     if(hidx != UINT_MAX) {
-        tmp_leaves[tmp_leaf_idx].hidx = hidx;
-        tmp_leaves[tmp_leaf_idx].ppa = ppa;
+        scratch[tmp_leaf_idx].hidx = hidx;
+        scratch[tmp_leaf_idx].ppa = ppa;
         tmp_leaf_idx++;
     }
 
-    sort(tmp_leaves, tmp_leaf_idx, sizeof(struct leaf_e), cmp_hidx, NULL);
+    sort(scratch, tmp_leaf_idx, sizeof(struct leaf_e), cmp_hidx, NULL);
     ht->cached_cnt -= tmp_leaf_idx;
 
     /*
      * Get the new set of root keys.
      */
-    __new_roots(new_root_keys, tmp_leaves, tmp_leaf_idx, root->cnt);
+    __new_roots(new_root_keys, scratch, tmp_leaf_idx, root->cnt);
 
     /*
      * Copy them to the root.
@@ -191,25 +218,316 @@ void twolevel_reload(struct ht_section *ht, struct root* root,
      * Reinsert. Includes original to-be-inserted pair.
      */
     for(int i = 0; i < tmp_leaf_idx; i++) {
-        twolevel_insert(ht, root, tmp_leaves[i].hidx, tmp_leaves[i].ppa, UINT_MAX);
+        __twolevel_insert(ht, root, scratch[i].hidx, scratch[i].ppa, 
+                          UINT_MAX, &ctx);
     }
 
-    reloading = 0;
     NVMEV_ASSERT(ht->cached_cnt == before);
     return;
 }
 
+void twolevel_reload(struct ht_section *ht, struct root* root, 
+                  uint32_t hidx, uint32_t ppa) {
+    spin_lock(&tl_reload_lock);
+    __twolevel_reload(ht, root, hidx, ppa, tmp_leaves);
+    spin_unlock(&tl_reload_lock);
+}
+
+/*
+ * First root entry >= hidx, or root->cnt if there's none. Branchless, so
+ * the loop runs log2(cnt) times with no mispredicts on random hidxs.
+ */
 int __lower_bound(struct root *root, uint32_t hidx) {
-	int left = 0, right = root->cnt - 1, mid;
-	while (left <= right) {
-		mid = left + (right - left) / 2;
-		if (root->entries[mid] < hidx) {
-			left = mid + 1;
-		} else {
-			right = mid - 1;
-		}
-	}
-	return left;
+    const uint32_t *base = root->entries;
+    uint32_t n = root->cnt, half;
+
+    while(n > 1) {
+        half = n / 2;
+        base = (base[half] < hidx) ? base + half : base;
+        n -= half;
+    }
+
+    return (base - root->entries) + (*base < hidx);
+}
+
+#define LANES_LO 0x0000000100000001ULL
+#define LANES_HI 0x8000000080000000ULL
+
+static_assert(IN_LEAF % 2 == 0);
+
+/*
+ * First slot in leaf->hidx equal to val, or IN_LEAF. Compares two slots
+ * per 64-bit word: a slot that matches is zero after the xor, and
+ * subtracting one sets its top bit. A borrow out of a zero slot can only
+ * fake a match in the slot above it, so the lowest match is exact.
+ * Assumes little endian, like the rest of this file.
+ */
+static inline uint32_t __leaf_scan(struct leaf *leaf, uint32_t val) {
+    const uint64_t *w = (const uint64_t*) leaf->hidx;
+    uint64_t rep = (uint64_t) val * LANES_LO;
+    uint64_t x, hit;
+
+    for(int i = 0; i < IN_LEAF / 2; i++) {
+        x = w[i] ^ rep;
+        hit = (x - LANES_LO) & ~x & LANES_HI;
+
+        if(hit) {
+            return (i * 2) + (__ffs64(hit) >> 5);
+        }
+    }
+
+    return IN_LEAF;
+}
+
+static inline struct leaf *__leaf(struct root *root, uint32_t i) {
+    return (struct leaf*) ((char*) root + sizeof(struct root) + 
+                           (sizeof(struct leaf) * i));
+}
+
+/*
+ * A full leaf's entries plus hidx, sorted into e.
+ */
+static void __leaf_sorted(struct leaf *leaf, uint32_t hidx, uint32_t ppa, 
+                          struct leaf_e *e) {
+    struct leaf_e tmp;
+    uint32_t j;
+    int l;
+
+    for(j = 0; j < IN_LEAF; j++) {
+        e[j].hidx = leaf->hidx[j];
+        e[j].ppa = leaf->ppa[j];
+    }
+    e[IN_LEAF].hidx = hidx;
+    e[IN_LEAF].ppa = ppa;
+
+    for(j = 1; j < IN_LEAF + 1; j++) {
+        tmp = e[j];
+        for(l = j - 1; l >= 0 && e[l].hidx > tmp.hidx; l--) {
+            e[l + 1] = e[l];
+        }
+        e[l + 1] = tmp;
+    }
+}
+
+/*
+ * Leaf i is full and hidx belongs in it. Sort its entries plus the new
+ * one, and hand the largest of them to leaf i + 1 or the smallest to
+ * leaf i - 1, whichever has more room, so both end up about equally full.
+ * Only the separator between the two leaves moves, plus the neighbour's
+ * own separator if it was an unused leaf. Returns false if both
+ * neighbours are full too.
+ */
+static bool __leaf_borrow(struct root *root, uint32_t i, 
+                          uint32_t hidx, uint32_t ppa) {
+    struct leaf *leaf = __leaf(root, i), *nb;
+    struct leaf_e e[IN_LEAF + 1];
+    uint32_t prev_cnt = IN_LEAF, next_cnt = IN_LEAF;
+    uint32_t k, keep, first, j;
+
+    if(i > 0) {
+        prev_cnt = __leaf_scan(__leaf(root, i - 1), UINT_MAX);
+    }
+
+    if(i < root->cnt - 1) {
+        next_cnt = __leaf_scan(__leaf(root, i + 1), UINT_MAX);
+    }
+
+    if(prev_cnt == IN_LEAF && next_cnt == IN_LEAF) {
+        return false;
+    }
+
+    __leaf_sorted(leaf, hidx, ppa, e);
+
+    if(next_cnt <= prev_cnt) {
+        k = (IN_LEAF + 1 - next_cnt) / 2;
+        keep = IN_LEAF + 1 - k;
+        first = 0;
+        nb = __leaf(root, i + 1);
+
+        for(j = 0; j < k; j++) {
+            nb->hidx[next_cnt + j] = e[keep + j].hidx;
+            nb->ppa[next_cnt + j] = e[keep + j].ppa;
+        }
+
+        /*
+         * An unused leaf before the last one has no separator yet, and
+         * the first insert into it would set one below what we moved.
+         */
+        if(i + 1 != root->cnt - 1 && root->entries[i + 1] == UINT_MAX) {
+            root->entries[i + 1] = e[IN_LEAF].hidx;
+        }
+        root->entries[i] = e[keep - 1].hidx;
+    } else {
+        k = (IN_LEAF + 1 - prev_cnt) / 2;
+        keep = IN_LEAF + 1 - k;
+        first = k;
+        nb = __leaf(root, i - 1);
+
+        for(j = 0; j < k; j++) {
+            nb->hidx[prev_cnt + j] = e[j].hidx;
+            nb->ppa[prev_cnt + j] = e[j].ppa;
+        }
+
+        root->entries[i - 1] = e[k - 1].hidx;
+    }
+
+    for(j = 0; j < IN_LEAF; j++) {
+        if(j < keep) {
+            leaf->hidx[j] = e[first + j].hidx;
+            leaf->ppa[j] = e[first + j].ppa;
+        } else {
+            leaf->hidx[j] = UINT_MAX;
+            leaf->ppa[j] = UINT_MAX;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Swap hidx into a full leaf in place of its largest (or smallest)
+ * entry, and return what was swapped out, which is hidx itself if it's
+ * already the extreme.
+ */
+static struct leaf_e __leaf_swap_out(struct leaf *leaf, uint32_t hidx, 
+                                     uint32_t ppa, bool largest) {
+    struct leaf_e out = { .hidx = hidx, .ppa = ppa };
+    uint32_t j, e = IN_LEAF;
+
+    for(j = 0; j < IN_LEAF; j++) {
+        if(largest ? leaf->hidx[j] > out.hidx : leaf->hidx[j] < out.hidx) {
+            out.hidx = leaf->hidx[j];
+            e = j;
+        }
+    }
+
+    if(e < IN_LEAF) {
+        out.ppa = leaf->ppa[e];
+        leaf->hidx[e] = hidx;
+        leaf->ppa[e] = ppa;
+    }
+
+    return out;
+}
+
+static uint32_t __leaf_max(struct leaf *leaf) {
+    uint32_t max = 0;
+
+    for(int j = 0; j < IN_LEAF; j++) {
+        max = leaf->hidx[j] > max ? leaf->hidx[j] : max;
+    }
+
+    return max;
+}
+
+/*
+ * Farthest a full leaf's insert is shifted, in leaves, so a shift
+ * touches at most three. Past that the leaf is split instead, see
+ * twolevel_split.
+ */
+#define TL_SHIFT_MAX 2
+
+/*
+ * Leaf i and both its neighbours are full. Walk to the nearest leaf with
+ * a free slot, at most TL_SHIFT_MAX away, and pass one entry across
+ * every separator on the way: each full leaf takes the entry coming in
+ * and gives up its largest (smallest, going left), and the separator in
+ * between follows. No sort and no reinsert, just one scan per leaf.
+ * Returns the number of leaves touched, or 0 if none is close enough.
+ */
+static uint32_t __leaf_shift(struct root *root, uint32_t i, 
+                             uint32_t hidx, uint32_t ppa) {
+    struct leaf_e e = { .hidx = hidx, .ppa = ppa };
+    struct leaf *leaf;
+    uint32_t d, t, x, j;
+    bool right = false, found = false;
+
+    for(d = 2; d <= TL_SHIFT_MAX && d < root->cnt; d++) {
+        if(i + d < root->cnt && __leaf(root, i + d)->hidx[IN_LEAF - 1] == UINT_MAX) {
+            right = found = true;
+            break;
+        }
+        if(i >= d && __leaf(root, i - d)->hidx[IN_LEAF - 1] == UINT_MAX) {
+            found = true;
+            break;
+        }
+    }
+
+    if(!found) {
+        return 0;
+    }
+
+    if(right) {
+        t = i + d;
+        for(x = i; x < t; x++) {
+            leaf = __leaf(root, x);
+            e = __leaf_swap_out(leaf, e.hidx, e.ppa, true);
+            root->entries[x] = __leaf_max(leaf);
+        }
+
+        if(t != root->cnt - 1 && root->entries[t] == UINT_MAX) {
+            root->entries[t] = e.hidx;
+        }
+    } else {
+        t = i - d;
+        for(x = i; x > t; x--) {
+            e = __leaf_swap_out(__leaf(root, x), e.hidx, e.ppa, false);
+            root->entries[x - 1] = e.hidx;
+        }
+    }
+
+    leaf = __leaf(root, t);
+    j = __leaf_scan(leaf, UINT_MAX);
+    leaf->hidx[j] = e.hidx;
+    leaf->ppa[j] = e.ppa;
+
+    return d + 1;
+}
+
+/*
+ * hidx's leaf is full and there's no room within TL_SHIFT_MAX leaves of
+ * it. Add a leaf with twolevel_expand, move the leaves after hidx's leaf
+ * and their separators up by one, and split the full leaf's entries plus
+ * hidx between it and the new leaf. Only those two leaves have entries
+ * looked at; the ones after are moved with a single memmove, as the
+ * leaves must stay in key order in the page. The caller has grown the
+ * section by a grain for the new leaf, like it does before any
+ * twolevel_expand.
+ */
+void twolevel_split(struct ht_section *ht, struct root *root, 
+                    uint32_t hidx, uint32_t ppa) {
+    struct leaf_e e[IN_LEAF + 1];
+    struct leaf *leaf, *next;
+    uint32_t i, j, keep = (IN_LEAF + 2) / 2;
+
+    NVMEV_ASSERT(root->cnt < IN_ROOT);
+
+    i = __lower_bound(root, hidx);
+    leaf = __leaf(root, i);
+    NVMEV_ASSERT(leaf->hidx[IN_LEAF - 1] != UINT_MAX);
+
+    __leaf_sorted(leaf, hidx, ppa, e);
+
+    twolevel_expand(root);
+    memmove(__leaf(root, i + 2), __leaf(root, i + 1), 
+            sizeof(struct leaf) * (root->cnt - 2 - i));
+    memmove(&root->entries[i + 2], &root->entries[i + 1], 
+            sizeof(uint32_t) * (root->cnt - 2 - i));
+
+    next = __leaf(root, i + 1);
+    for(j = 0; j < IN_LEAF; j++) {
+        leaf->hidx[j] = j < keep ? e[j].hidx : UINT_MAX;
+        leaf->ppa[j] = j < keep ? e[j].ppa : UINT_MAX;
+        next->hidx[j] = keep + j < IN_LEAF + 1 ? e[keep + j].hidx : UINT_MAX;
+        next->ppa[j] = keep + j < IN_LEAF + 1 ? e[keep + j].ppa : UINT_MAX;
+    }
+
+    /*
+     * The new leaf takes over leaf i's old bound, UINT_MAX if i was last.
+     */
+    root->entries[i + 1] = root->entries[i];
+    root->entries[i] = e[keep - 1].hidx;
+    ht->cached_cnt++;
 }
 
 void twolevel_direct_read(struct root *root, uint32_t pos, 
@@ -219,9 +537,18 @@ void twolevel_direct_read(struct root *root, uint32_t pos,
     memcpy(out, ptr + pos, len);
 }
 
-void twolevel_insert(struct ht_section *ht, struct root *root, 
-                  uint32_t hidx, uint32_t ppa, uint32_t pos) {
+#define TL_INSERTED 0
+#define TL_BORROWED 1
+#define TL_SHIFTED 2
+#define TL_RELOADED 3
+#define TL_NEED_SPLIT 4
+
+static int __twolevel_insert(struct ht_section *ht, struct root *root, 
+                             uint32_t hidx, uint32_t ppa, uint32_t pos,
+                             struct tl_ctx *ctx) {
+    uint32_t shifted;
     int i = 0;
+    uint32_t j;
     struct leaf *leaf;
     char* ptr;
     uint32_t max;
@@ -236,7 +563,8 @@ void twolevel_insert(struct ht_section *ht, struct root *root,
             uint32_t my_leaf_idx = (pos / GRAINED_UNIT) - ROOT_G;
             uint32_t my_leaf_bytes = sizeof(struct root) + 
                                      (sizeof(struct leaf) * my_leaf_idx);
-            uint32_t my_in_leaf = ((pos - my_leaf_bytes) - 32) / sizeof(uint32_t);
+            uint32_t my_in_leaf = ((pos - my_leaf_bytes) - offsetof(struct leaf, ppa)) / 
+                                  sizeof(uint32_t);
             struct leaf *my_leaf = (struct leaf*) ((char*) root + my_leaf_bytes);
 
             for(int i = my_in_leaf; i < IN_LEAF - 1; i++) {
@@ -247,10 +575,10 @@ void twolevel_insert(struct ht_section *ht, struct root *root,
             my_leaf->hidx[IN_LEAF - 1] = UINT_MAX;
             my_leaf->ppa[IN_LEAF - 1] = UINT_MAX;
 
-            return;
+            return TL_INSERTED;
         }
         memcpy(ptr + pos, &ppa, sizeof(ppa));
-        return;
+        return TL_INSERTED;
     }
 
     ht->cached_cnt++;
@@ -258,14 +586,40 @@ void twolevel_insert(struct ht_section *ht, struct root *root,
 
     leaf = (struct leaf*) (ptr + sizeof(struct root) + (sizeof(struct leaf) * i));
     if(leaf->hidx[IN_LEAF - 1] != UINT_MAX) {
-        if(reloading) {
+        if(ctx->reloading) {
             NVMEV_ERROR("Full while reloading. root->cnt %u max %u cached_cnt %u\n", 
                          root->cnt, max, ht->cached_cnt);
         }
 
-        NVMEV_ASSERT(!reloading);
-        twolevel_reload(ht, root, hidx, ppa);
-        return;
+        NVMEV_ASSERT(!ctx->reloading);
+
+        /*
+         * Rebalance with a neighbour, or shift towards a free slot a few
+         * leaves away. Failing that the caller grows the section by a
+         * leaf and splits into it. Only a section that already has all
+         * IN_ROOT leaves is reloaded.
+         */
+        if(ctx->borrow && __leaf_borrow(root, i, hidx, ppa)) {
+            return TL_BORROWED;
+        }
+
+        shifted = ctx->borrow ? __leaf_shift(root, i, hidx, ppa) : 0;
+        if(shifted) {
+            ctx->touched = shifted;
+            return TL_SHIFTED;
+        }
+
+        if(ctx->borrow && root->cnt < IN_ROOT) {
+            ht->cached_cnt--;
+            return TL_NEED_SPLIT;
+        }
+
+        if(ctx->scratch) {
+            __twolevel_reload(ht, root, hidx, ppa, ctx->scratch);
+        } else {
+            twolevel_reload(ht, root, hidx, ppa);
+        }
+        return TL_RELOADED;
     }
 
     if((i != root->cnt - 1) && 
@@ -273,17 +627,29 @@ void twolevel_insert(struct ht_section *ht, struct root *root,
         root->entries[i] = hidx;
     }
 
-    for(int j = 0; j < IN_LEAF; j++) {
-        if(leaf->hidx[j] == UINT_MAX) {
-            leaf->hidx[j] = hidx;
-            leaf->ppa[j] = ppa;
-            break;
-        }
+    j = __leaf_scan(leaf, UINT_MAX);
+    if(j < IN_LEAF) {
+        leaf->hidx[j] = hidx;
+        leaf->ppa[j] = ppa;
     }
+
+    return TL_INSERTED;
+}
+
+/*
+ * Returns false if hidx wasn't inserted because its leaf has to be
+ * split, see twolevel_split.
+ */
+bool twolevel_insert(struct ht_section *ht, struct root *root, 
+                     uint32_t hidx, uint32_t ppa, uint32_t pos) {
+    struct tl_ctx ctx = { .borrow = true };
+
+    return __twolevel_insert(ht, root, hidx, ppa, pos, &ctx) != TL_NEED_SPLIT;
 }
 
 uint32_t twolevel_find(struct root *root, uint32_t hidx, uint32_t *pos) {
-    int i, j;
+    int i;
+    uint32_t j;
     struct leaf *leaf;
     uint32_t ret;
     char* ptr;
@@ -300,22 +666,145 @@ uint32_t twolevel_find(struct root *root, uint32_t hidx, uint32_t *pos) {
         goto out;
     }
 
+    /*
+     * Slots after the first UINT_MAX are all UINT_MAX, which is never a
+     * valid hidx, so no need to stop there.
+     */
     leaf = (struct leaf*) (ptr + sizeof(struct root) + (sizeof(struct leaf) * i));
-    for(j = 0; j < IN_LEAF; j++) {
-        if(leaf->hidx[j] == hidx) {
-            if(pos) {
-                *pos = sizeof(struct root) + (sizeof(struct leaf) * i) + 
-                       (sizeof(uint32_t) * IN_LEAF) + 
-                       (j * sizeof(uint32_t));
+    j = __leaf_scan(leaf, hidx);
+
+    if(j < IN_LEAF) {
+        if(pos) {
+            *pos = sizeof(struct root) + (sizeof(struct leaf) * i) + 
+                   (sizeof(uint32_t) * IN_LEAF) + 
+                   (j * sizeof(uint32_t));
+        }
+
+        return leaf->ppa[j];
+    }
+
+out:
+    return ret;
+}
+
+/*
+ * Fill sections the way __update_map does, from two leaves up to
+ * IN_ROOT, then start over with a fresh one. Without borrow a full
+ * section grows by a leaf and reloads, as it used to, and with it full
+ * leaves are split. Only the inserts, reloads and splits are timed.
+ * Every key is looked up again at the end of each section, and the ppa
+ * stored for a key is ~key, so a duplicate key can't show up as a
+ * mismatch.
+ */
+static uint64_t __twolevel_bench_run(struct ht_section *ht, struct root *root, 
+                                     uint32_t *keys, uint32_t nr_inserts, 
+                                     bool borrow, struct leaf_e *scratch,
+                                     struct twolevel_bench_result *res) {
+    struct tl_ctx ctx = { .borrow = borrow, .scratch = scratch };
+    uint64_t ns = 0, t0;
+    uint32_t start = 0, i, j;
+    int ret;
+
+    while(start < nr_inserts) {
+        cond_resched();
+
+        twolevel_init(root);
+        ht->cached_cnt = 0;
+
+        t0 = ktime_get_ns();
+        for(i = start; i < nr_inserts; i++) {
+            if(ht->cached_cnt == root->cnt * IN_LEAF) {
+                if(root->cnt == IN_ROOT) {
+                    break;
+                }
+
+                if(!borrow) {
+                    twolevel_expand(root);
+                    __twolevel_reload(ht, root, UINT_MAX, UINT_MAX, scratch);
+                }
             }
 
-            return leaf->ppa[j];
-        } else if(leaf->hidx[j] == UINT_MAX) {
-            break;
+            ret = __twolevel_insert(ht, root, keys[i], ~keys[i], UINT_MAX, &ctx);
+            if(ret == TL_NEED_SPLIT) {
+                twolevel_split(ht, root, keys[i], ~keys[i]);
+                res->splits++;
+            } else if(!borrow && ret == TL_RELOADED) {
+                res->full_reloads++;
+            } else if(ret == TL_RELOADED) {
+                res->reloads++;
+            } else if(ret == TL_BORROWED) {
+                res->borrows++;
+            } else if(ret == TL_SHIFTED) {
+                res->shifts++;
+                res->shift_leaves += ctx.touched;
+            }
+        }
+        ns += ktime_get_ns() - t0;
+
+        for(j = start; j < i; j++) {
+            if(twolevel_find(root, keys[j], NULL) != ~keys[j]) {
+                res->mismatches++;
+            }
+        }
+
+        start = i;
+    }
+
+    return ns;
+}
+
+/*
+ * Insert nr_inserts random hash indexes into scratch sections, first
+ * reloading the whole section on every leaf overflow as before, then with
+ * local rebalancing. Reloads here use the bench's own scratch, not
+ * tmp_leaves, so it can run next to live stores.
+ */
+int twolevel_bench(uint32_t nr_inserts, struct twolevel_bench_result *res) {
+    struct ht_section *ht;
+    struct root *root;
+    struct leaf_e *scratch;
+    uint32_t *keys;
+    uint32_t seed = 0x9e3779b9;
+    int ret = -ENOMEM;
+
+    if(nr_inserts == 0) {
+        return -EINVAL;
+    }
+
+    ht = kzalloc(sizeof(*ht), GFP_KERNEL);
+    root = kzalloc(PAGESIZE, GFP_KERNEL);
+    keys = vmalloc(sizeof(uint32_t) * nr_inserts);
+    scratch = vmalloc(sizeof(struct leaf_e) * IN_ROOT * IN_LEAF);
+    if(!ht || !root || !keys || !scratch) {
+        goto out;
+    }
+
+    /*
+     * 0 is never a valid hidx and UINT_MAX marks a free slot.
+     */
+    for(uint32_t i = 0; i < nr_inserts; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+
+        keys[i] = seed | 1;
+        if(keys[i] == UINT_MAX) {
+            keys[i]--;
         }
     }
 
+    memset(res, 0, sizeof(*res));
+    res->reload_ns = __twolevel_bench_run(ht, root, keys, nr_inserts, false, 
+                                          scratch, res);
+    res->borrow_ns = __twolevel_bench_run(ht, root, keys, nr_inserts, true, 
+                                          scratch, res);
+    res->nr_inserts = nr_inserts;
+    ret = 0;
 out:
+    vfree(scratch);
+    vfree(keys);
+    kfree(root);
+    kfree(ht);
     return ret;
 }
 
@@ -11,6 +11,12 @@
 struct root {
     uint32_t cnt;
     uint32_t entries[IN_ROOT];
+
+    /*
+     * Pad the root out to its ROOT_G grains, so the leaves after it start
+     * on a cache line and each leaf (one grain) sits in a single line.
+     */
+    uint8_t pad[ROOT_G_BYTES - (sizeof(uint32_t) * (IN_ROOT + 1))];
 };
 
 struct leaf {
@@ -18,14 +24,21 @@ struct leaf {
     uint32_t ppa[IN_LEAF];
 };
 
+static_assert(sizeof(struct root) == ROOT_G_BYTES);
+static_assert(sizeof(struct leaf) == GRAINED_UNIT);
+static_assert(sizeof(struct root) + (IN_ROOT * sizeof(struct leaf)) + 
+              (EPP * FP_SIZE) <= PAGESIZE);
+
 struct leaf_e {
     uint32_t hidx;
     uint32_t ppa;
 };
 
 void twolevel_init(struct root *root);
-void twolevel_insert(struct ht_section *ht, struct root *root, 
-                  uint32_t hidx, uint32_t ppa, uint32_t pos);
+bool twolevel_insert(struct ht_section *ht, struct root *root, 
+                     uint32_t hidx, uint32_t ppa, uint32_t pos);
+void twolevel_split(struct ht_section *ht, struct root *root, 
+                    uint32_t hidx, uint32_t ppa);
 uint32_t twolevel_find(struct root *root, uint32_t hidx, uint32_t *pos);
 void twolevel_expand(struct root *root);
 void twolevel_reload(struct ht_section *ht, struct root *root, 
@@ -34,6 +47,20 @@ void twolevel_direct_read(struct root *root, uint32_t pos,
                        void* out, uint32_t len);
 void twolevel_bulk_insert(struct root* root, struct leaf_e *e, uint32_t cnt);
 
+struct twolevel_bench_result {
+    uint32_t nr_inserts;
+    uint64_t reload_ns; /* total insert time when every overflow reloads */
+    uint64_t borrow_ns; /* total insert time with local rebalancing */
+    uint32_t full_reloads; /* overflows, all of which reload without rebalancing */
+    uint32_t borrows; /* overflows absorbed by a neighbour */
+    uint32_t shifts; /* overflows shifted towards a farther free slot */
+    uint64_t shift_leaves; /* leaves touched by those shifts */
+    uint32_t splits; /* overflows split into a new leaf */
+    uint32_t reloads; /* overflows that still reloaded */
+    uint32_t mismatches; /* keys that didn't find their ppa after a run */
+};
+int twolevel_bench(uint32_t nr_inserts, struct twolevel_bench_result *res);
+
 #endif
 
 #endif